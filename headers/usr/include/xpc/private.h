@@ -1,6 +1,7 @@
 #ifndef XPC_PRIVATE_H_
 #define XPC_PRIVATE_H_
 
+#include <stdio.h>
 #include <uuid/uuid.h>
 #include <xpc/xpc.h>
 
@@ -22,6 +23,30 @@ xpc_object_t xpc_create_with_format(const char * format, ...);
 
 xpc_object_t xpc_create_from_plist(void *data, size_t size);
 
+// Like xpc_array_create(NULL, 0), with room for capacity elements.
+xpc_object_t xpc_array_create_with_capacity(size_t capacity);
+
+// Statistics of one size class of the object allocator.  Allocations and
+// frees are folded in whenever a thread exchanges objects with the shared
+// depot, so they trail the real numbers by a thread cache's worth.
+struct xpc_slab_stats {
+	size_t		xss_size;	// object size of the class
+	size_t		xss_slabs;	// slabs carved for the class
+	size_t		xss_depot;	// free objects in the shared depot
+	uint64_t	xss_allocs;
+	uint64_t	xss_frees;
+};
+
+// Fills in up to count classes and returns the number of classes.
+size_t xpc_slab_get_stats(struct xpc_slab_stats *stats, size_t count);
+
+// Streams what xpc_copy_description() returns to writer, in chunks of a
+// few kilobytes, instead of building it up in one string.
+typedef void (^xpc_description_writer_t)(const char *buf, size_t len);
+
+void xpc_write_description(xpc_object_t object, xpc_description_writer_t writer);
+void xpc_fwrite_description(xpc_object_t object, FILE *fp);
+
 void xpc_dictionary_get_audit_token(xpc_object_t, audit_token_t *);
 int xpc_pipe_routine_reply(xpc_object_t);
 int xpc_pipe_routine(xpc_object_t pipe, void *payload,xpc_object_t *reply);
@@ -1,115 +1,290 @@
 #include <sys/types.h>
+#include <sys/sbuf.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 
-struct sbuf {
-	char	*s_buf;		/* storage buffer */
-	void	*s_unused;	/* binary compatibility, unused */
-	int		 s_size;	/* size of storage buffer */
-	int		 s_len;		/* current length of string */
-	int		 s_flags;	/* flags, unused */
-};
-
-struct sbuf *sbuf_new_auto(void) {
-	struct sbuf *sb = calloc(1, sizeof(*sb));
-	sb->s_buf = malloc(1024);
-	sb->s_size = 1024;
-	sb->s_len = 0;
-	return sb;
+/*
+ * Auto-extending buffers start at SBUF_MINSIZE bytes and double until an
+ * append fits, so a long run of appends only reallocates a logarithmic
+ * number of times.  One byte past s_len is always kept free for the
+ * terminating NUL.
+ */
+#define	SBUF_MINSIZE	1024
+
+#define	SBUF_ISDYNAMIC(s)	((s)->s_flags & SBUF_DYNAMIC)
+#define	SBUF_ISDYNSTRUCT(s)	((s)->s_flags & SBUF_DYNSTRUCT)
+#define	SBUF_CANEXTEND(s)	((s)->s_flags & SBUF_AUTOEXTEND)
+#define	SBUF_HASOVERFLOWED(s)	((s)->s_flags & SBUF_OVERFLOWED)
+#define	SBUF_FREESPACE(s)	((s)->s_size - (s)->s_len - 1)
+
+/*
+ * Make room for at least addlen more bytes.  Fails, and marks the buffer
+ * as overflowed, if it can't be extended or the size would overflow.
+ */
+static int
+sbuf_extend(struct sbuf *sb, size_t addlen)
+{
+	size_t needed, newsize;
+	char *newbuf;
+
+	if (SBUF_HASOVERFLOWED(sb))
+		return (-1);
+	if (addlen <= (size_t)SBUF_FREESPACE(sb))
+		return (0);
+	if (!SBUF_CANEXTEND(sb))
+		goto overflow;
+
+	needed = (size_t)sb->s_len + addlen + 1;
+	if (needed > INT_MAX)
+		goto overflow;
+	newsize = sb->s_size < SBUF_MINSIZE ? SBUF_MINSIZE : sb->s_size;
+	while (newsize < needed)
+		newsize *= 2;
+	if (newsize > INT_MAX)
+		newsize = INT_MAX;
+
+	if (SBUF_ISDYNAMIC(sb))
+		newbuf = realloc(sb->s_buf, newsize);
+	else {
+		newbuf = malloc(newsize);
+		if (newbuf != NULL)
+			memcpy(newbuf, sb->s_buf, sb->s_len);
+	}
+	if (newbuf == NULL)
+		goto overflow;
+	sb->s_buf = newbuf;
+	sb->s_size = (int)newsize;
+	sb->s_flags |= SBUF_DYNAMIC;
+	return (0);
+
+overflow:
+	sb->s_flags |= SBUF_OVERFLOWED;
+	return (-1);
+}
+
+struct sbuf *
+sbuf_new(struct sbuf *s, char *buf, int length, int flags)
+{
+	struct sbuf *sb;
+
+	flags &= SBUF_USRFLAGMSK;
+	if (length < 0 || (length == 0 && (buf != NULL ||
+	    !(flags & SBUF_AUTOEXTEND))))
+		return (NULL);
+
+	if (s == NULL) {
+		sb = calloc(1, sizeof(*sb));
+		if (sb == NULL)
+			return (NULL);
+		flags |= SBUF_DYNSTRUCT;
+	} else {
+		sb = s;
+		memset(sb, 0, sizeof(*sb));
+	}
+	sb->s_flags = flags;
+
+	if (buf != NULL) {
+		sb->s_buf = buf;
+		sb->s_size = length;
+		return (sb);
+	}
+
+	sb->s_size = length < SBUF_MINSIZE ? SBUF_MINSIZE : length;
+	sb->s_buf = malloc(sb->s_size);
+	if (sb->s_buf == NULL) {
+		if (SBUF_ISDYNSTRUCT(sb))
+			free(sb);
+		return (NULL);
+	}
+	sb->s_flags |= SBUF_DYNAMIC;
+	return (sb);
 }
 
-void sbuf_clear(struct sbuf *sb) {
-	free(sb->s_buf);
-	sb->s_buf = malloc(1024);
-	sb->s_size = 1024;
+struct sbuf *
+sbuf_new_auto(void)
+{
+
+	return (sbuf_new(NULL, NULL, 0, SBUF_AUTOEXTEND));
+}
+
+/*
+ * Empty the buffer but keep its storage for reuse.
+ */
+void
+sbuf_clear(struct sbuf *sb)
+{
+
 	sb->s_len = 0;
+	sb->s_flags &= ~(SBUF_FINISHED | SBUF_OVERFLOWED);
 }
 
-int	sbuf_setpos(struct sbuf *sb, int pos) {
-	// Unimplemented.
-	return sb->s_len;
+int
+sbuf_setpos(struct sbuf *sb, int pos)
+{
+
+	if (pos < 0 || pos > sb->s_len)
+		return (-1);
+	sb->s_len = pos;
+	return (0);
 }
 
-int	sbuf_bcat(struct sbuf *sb, const void *ptr, size_t len) {
-	if ((sb->s_len + len) > sb->s_size) {
-		sb->s_size *= 2;
-		sb->s_buf = realloc(sb->s_buf, sb->s_size);
-	}
+int
+sbuf_bcat(struct sbuf *sb, const void *ptr, size_t len)
+{
 
+	if (sbuf_extend(sb, len) != 0)
+		return (-1);
 	memcpy(sb->s_buf + sb->s_len, ptr, len);
-	sb->s_len += len;
-	return sb->s_len;
+	sb->s_len += (int)len;
+	return (0);
 }
 
-int sbuf_bcpy(struct sbuf *sb, const void *ptr, size_t len) {
-	if (len > sb->s_size) {
-		sb->s_size *= 2;
-		sb->s_buf = realloc(sb->s_buf, sb->s_size);
-	}
+int
+sbuf_bcpy(struct sbuf *sb, const void *ptr, size_t len)
+{
 
-	memcpy(sb->s_buf, ptr, len);
-	sb->s_len = (int)len;
-	return sb->s_len;
+	sbuf_clear(sb);
+	return (sbuf_bcat(sb, ptr, len));
 }
 
-int sbuf_cat(struct sbuf *sb, const char *str) {
-	return sbuf_bcat(sb, str, (int)strlen(str) * sizeof(char));
+int
+sbuf_cat(struct sbuf *sb, const char *str)
+{
+
+	return (sbuf_bcat(sb, str, strlen(str)));
 }
 
-int sbuf_cpy(struct sbuf *sb, const char *str) {
-	return sbuf_bcpy(sb, str, (int)strlen(str) * sizeof(char));
+int
+sbuf_cpy(struct sbuf *sb, const char *str)
+{
+
+	sbuf_clear(sb);
+	return (sbuf_cat(sb, str));
 }
 
-int sbuf_vprintf(struct sbuf *sb, const char *fmt, va_list ap) {
-	char *str; vasprintf(&str, fmt, ap);
-	int ret = sbuf_cat(sb, str);
-	free(str);
-	return ret;
+/*
+ * Format straight into the free space, and only when that turns out to be
+ * too small extend the buffer and format again.
+ */
+int
+sbuf_vprintf(struct sbuf *sb, const char *fmt, va_list ap)
+{
+	va_list ap_copy;
+	int len;
+
+	if (SBUF_HASOVERFLOWED(sb))
+		return (-1);
+
+	va_copy(ap_copy, ap);
+	len = vsnprintf(sb->s_buf + sb->s_len, SBUF_FREESPACE(sb) + 1, fmt,
+	    ap_copy);
+	va_end(ap_copy);
+	if (len < 0) {
+		sb->s_flags |= SBUF_OVERFLOWED;
+		return (-1);
+	}
+
+	if (len > SBUF_FREESPACE(sb)) {
+		if (sbuf_extend(sb, len) != 0)
+			return (-1);
+		va_copy(ap_copy, ap);
+		vsnprintf(sb->s_buf + sb->s_len, SBUF_FREESPACE(sb) + 1, fmt,
+		    ap_copy);
+		va_end(ap_copy);
+	}
+
+	sb->s_len += len;
+	return (0);
 }
 
-int sbuf_printf(struct sbuf *sb, const char *fmt, ...) {
+int
+sbuf_printf(struct sbuf *sb, const char *fmt, ...)
+{
 	va_list ap;
+	int ret;
+
 	va_start(ap, fmt);
-	int ret = sbuf_vprintf(sb, fmt, ap);
+	ret = sbuf_vprintf(sb, fmt, ap);
 	va_end(ap);
-	return ret;
+	return (ret);
 }
 
-int sbuf_putc(struct sbuf *sb, int c) {
-	return sbuf_bcat(sb, &c, sizeof(int));
+int
+sbuf_putc(struct sbuf *sb, int c)
+{
+	char ch;
+
+	ch = (char)c;
+	return (sbuf_bcat(sb, &ch, 1));
 }
 
-int sbuf_trim(struct sbuf *sb) {
-	// Don't know what this does.
-	return 0;
+/*
+ * Strip trailing whitespace.
+ */
+int
+sbuf_trim(struct sbuf *sb)
+{
+
+	if (SBUF_HASOVERFLOWED(sb))
+		return (-1);
+	while (sb->s_len > 0 && (sb->s_buf[sb->s_len - 1] == ' ' ||
+	    sb->s_buf[sb->s_len - 1] == '\t' ||
+	    sb->s_buf[sb->s_len - 1] == '\n'))
+		sb->s_len--;
+	return (0);
 }
 
-int	sbuf_overflowed(struct sbuf *sb) {
-	// Don't know what this does.
-	return 0;
+int
+sbuf_overflowed(struct sbuf *sb)
+{
+
+	return (SBUF_HASOVERFLOWED(sb) != 0);
 }
 
-void sbuf_finish(struct sbuf *sb) {
-	// Don't know what this does.
+void
+sbuf_finish(struct sbuf *sb)
+{
+
+	sb->s_buf[sb->s_len] = '\0';
+	sb->s_flags |= SBUF_FINISHED;
 }
 
-char *sbuf_data(struct sbuf *sb) {
-	bzero(sb->s_buf + sb->s_len, sb->s_size - sb->s_len);
-	return sb->s_buf;
+char *
+sbuf_data(struct sbuf *sb)
+{
+
+	sb->s_buf[sb->s_len] = '\0';
+	return (sb->s_buf);
 }
 
-int	sbuf_len(struct sbuf *sb) {
-	return sb->s_len;
+int
+sbuf_len(struct sbuf *sb)
+{
+
+	if (SBUF_HASOVERFLOWED(sb))
+		return (-1);
+	return (sb->s_len);
 }
 
-int sbuf_done(struct sbuf *sb) {
-	// Don't know what this does.
-	return 0;
+int
+sbuf_done(struct sbuf *sb)
+{
+
+	return ((sb->s_flags & SBUF_FINISHED) != 0);
 }
 
-void sbuf_delete(struct sbuf *sb) {
-	free(sb->s_buf);
-	free(sb);
+void
+sbuf_delete(struct sbuf *sb)
+{
+	int isdyn;
+
+	if (SBUF_ISDYNAMIC(sb))
+		free(sb->s_buf);
+	isdyn = SBUF_ISDYNSTRUCT(sb);
+	memset(sb, 0, sizeof(*sb));
+	if (isdyn)
+		free(sb);
 }
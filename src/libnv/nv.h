@@ -42,6 +42,8 @@
 
 
 
+struct iovec;
+
 #ifndef	_NVLIST_T_DECLARED
 #define	_NVLIST_T_DECLARED
 struct nvlist;
@@ -49,6 +51,54 @@ struct nvlist;
 typedef struct nvlist nvlist_t;
 #endif
 
+/*
+ * Called when a pair added with nvlist_add_binary_external() lets go of the
+ * caller's memory.
+ */
+typedef void (*nv_destructor_t)(void *ctx, const void *value, size_t size);
+
+struct nvlist_parser;
+
+typedef struct nvlist_parser nvlist_parser_t;
+
+/*
+ * A read-only view of a packed nvlist.  nvlist_view_init() validates the
+ * whole buffer once; iteration, lookups and nested views then read straight
+ * from the buffer without allocating anything.  Strings, binary values and
+ * nested views point into the buffer, so it must outlive the view.
+ * The fields are private to libnv.
+ */
+typedef struct nvlist_view {
+	const unsigned char	*nvv_ptr;	/* First pair. */
+	size_t			 nvv_size;	/* Size of all pairs. */
+	int			 nvv_type;
+	int			 nvv_flags;
+} nvlist_view_t;
+
+/*
+ * A single pair of a view, as returned by nvlist_view_next() and
+ * nvlist_view_find().  Use the nvpair_view_get functions to read its value.
+ */
+typedef struct nvpair_view {
+	const char		*nvpv_name;
+	int			 nvpv_type;
+	int			 nvpv_flags;
+	const unsigned char	*nvpv_data;
+	size_t			 nvpv_datasize;
+} nvpair_view_t;
+
+/*
+ * An encoder writes a list in the version 0 format without building it
+ * first, for callers that hold the data in a representation of their own.
+ * The fields are private to libnv.
+ */
+typedef struct nvlist_encoder {
+	unsigned char		*nve_ptr;	/* Next byte to write. */
+	size_t			 nve_left;
+	unsigned char		*nve_open;	/* Pair of the innermost list. */
+	int			 nve_error;
+} nvlist_encoder_t;
+
 #define	NV_NAME_MAX	2048
 
 #define	NV_TYPE_NONE			0
@@ -71,6 +121,14 @@ typedef struct nvlist nvlist_t;
 #define	NV_TYPE_NVLIST_ARRAY		14
 #define	NV_TYPE_NVLIST_DICTIONARY	15
 
+/*
+ * Typed arrays pack all their items into a single value instead of one
+ * pair per element.
+ */
+#define	NV_TYPE_BOOL_ARRAY		16
+#define	NV_TYPE_INT64_ARRAY		17
+#define	NV_TYPE_UINT64_ARRAY		18
+#define	NV_TYPE_STRING_ARRAY		19
 
 /*
  * Perform case-insensitive lookups of provided names.
@@ -81,6 +139,27 @@ typedef struct nvlist nvlist_t;
  */
 #define	NV_FLAG_NO_UNIQUE		0x02
 
+/*
+ * Flags for nvlist_unpack_flags().
+ *
+ * NV_UNPACK_TRUSTED skips the duplicate name check for every element, for
+ * buffers that were produced by nvlist_pack() and so are known to hold
+ * unique names.  Never use it on data received from another process.
+ */
+#define	NV_UNPACK_TRUSTED		0x01
+
+/*
+ * Flags for nvlist_pack_flags().
+ *
+ * NV_PACK_COMPACT selects the version 1 encoding, which stores every name
+ * once in a table at the front and refers to it by index, uses varints for
+ * all lengths, and leaves out the names of array elements; those are
+ * numbered from 0 again on unpack.  nvlist_unpack() takes either version.
+ * Views, nvlist_pack_iov() and the parser only handle version 0, and
+ * compact lists cannot carry descriptors.
+ */
+#define	NV_PACK_COMPACT			0x01
+
 #if defined(_KERNEL) && defined(MALLOC_DECLARE)
 MALLOC_DECLARE(M_NVLIST);
 #endif
@@ -90,6 +169,21 @@ __BEGIN_DECLS
 nvlist_t	*nvlist_create(int flags);
 nvlist_t	*nvlist_create_array(int flags);
 nvlist_t	*nvlist_create_dictionary(int flags);
+
+/*
+ * nvlist_create_arena() creates a list whose nodes, names and payloads are
+ * carved out of one bump allocator, released all at once when the list is
+ * destroyed.  nvlist_create_in() creates further lists in the arena of
+ * owner (or on the heap if owner has none), to be nested into the tree with
+ * the nvlist_move functions.  The plain nvlist_add and nvlist_move
+ * functions allocate from the arena; the formatted variants and
+ * nvlist_add_nvlist() fall back to the heap, which still works but gives
+ * up the cheap teardown.  Lists taken out of an arena tree remain valid
+ * only as long as its root.
+ */
+nvlist_t	*nvlist_create_arena(int type, int flags);
+nvlist_t	*nvlist_create_in(nvlist_t *owner, int type, int flags);
+
 void		 nvlist_destroy(nvlist_t *nvl);
 int		 nvlist_error(const nvlist_t *nvl);
 bool		 nvlist_empty(const nvlist_t *nvl);
@@ -98,6 +192,21 @@ void		 nvlist_set_error(nvlist_t *nvl, int error);
 
 nvlist_t *nvlist_clone(const nvlist_t *nvl);
 
+/*
+ * nvlist_freeze() makes a list and everything nested in it immutable and
+ * reference counted, so it can be cached and read by several threads at
+ * once without locking.  A frozen list is never copied: nvlist_add_nvlist()
+ * and nvpair cloning take a reference with nvlist_retain() and nest the
+ * same list into the new parent, and nvlist_destroy() drops a reference.
+ * Changing a frozen list is a programming error.  nvlist_get_parent() of a
+ * frozen list returns NULL, as it may have many parents.  Freezing fails
+ * with the error of the list if it has one, or with ELOOP if frozen lists
+ * are nested into each other too deeply.
+ */
+bool		 nvlist_freeze(nvlist_t *nvl);
+bool		 nvlist_frozen(const nvlist_t *nvl);
+nvlist_t	*nvlist_retain(const nvlist_t *nvl);
+
 #ifndef _KERNEL
 void nvlist_dump(const nvlist_t *nvl, int fd);
 void nvlist_fdump(const nvlist_t *nvl, FILE *fp);
@@ -107,7 +216,50 @@ int nvlist_type(const nvlist_t *nvl);
 size_t		 nvlist_size(const nvlist_t *nvl);
 void		*nvlist_pack(const nvlist_t *nvl, size_t *sizep);
 void		*nvlist_pack_buffer(const nvlist_t *nvl, void *buf, size_t *sizep);
+void		*nvlist_pack_flags(const nvlist_t *nvl, size_t *sizep, int flags);
+#ifndef _KERNEL
+struct iovec	*nvlist_pack_iov(const nvlist_t *nvl, size_t *iovcntp, size_t *sizep);
+#endif
 nvlist_t	*nvlist_unpack(const void *buf, size_t size);
+nvlist_t	*nvlist_unpack_flags(const void *buf, size_t size, int flags);
+
+/*
+ * To encode a list, add up nvlist_encode_nvlist_size(NULL), then
+ * nvlist_encode_size() with the size of the value for every pair, and
+ * nvlist_encode_nvlist_size() for every nested list on top of the pairs it
+ * holds.  Hand a buffer of exactly that size to nvlist_encode_init() and
+ * emit the pairs in order, wrapping the pairs of nested lists in
+ * nvlist_encode_begin() and nvlist_encode_end().  Values are written as
+ * nvlist_pack() writes them, in host byte order; nvlist_encode_pair()
+ * returns the space for a value to fill in, or NULL after an error.
+ * nvlist_encode_finish() returns the first error, such as ENAMETOOLONG,
+ * and the buffer then holds the same bytes nvlist_pack() makes of the
+ * same list.
+ */
+size_t		 nvlist_encode_size(const char *name, size_t datasize);
+size_t		 nvlist_encode_nvlist_size(const char *name);
+void		 nvlist_encode_init(nvlist_encoder_t *nve, int type, void *buf, size_t size);
+void		 nvlist_encode_begin(nvlist_encoder_t *nve, int type, const char *name, int nvltype);
+void		 nvlist_encode_end(nvlist_encoder_t *nve);
+void		*nvlist_encode_pair(nvlist_encoder_t *nve, int type, const char *name, size_t datasize);
+void		 nvlist_encode_bool(nvlist_encoder_t *nve, const char *name, bool value);
+void		 nvlist_encode_number(nvlist_encoder_t *nve, int type, const char *name, uint64_t value);
+void		 nvlist_encode_string(nvlist_encoder_t *nve, const char *name, const char *value);
+void		 nvlist_encode_binary(nvlist_encoder_t *nve, int type, const char *name, const void *value, size_t size);
+int		 nvlist_encode_finish(nvlist_encoder_t *nve);
+
+/*
+ * An nvlist_parser unpacks a list that arrives in pieces, such as over a
+ * stream socket.  Each nvlist_parser_feed() consumes as much of the data
+ * as belongs to the current list; once it is complete nvlist_parser_take()
+ * hands it over and the parser moves on to the next one.  Flags are those
+ * of nvlist_unpack_flags().  Descriptors are not supported.
+ */
+nvlist_parser_t	*nvlist_parser_create(int flags);
+void		 nvlist_parser_destroy(nvlist_parser_t *parser);
+int		 nvlist_parser_error(const nvlist_parser_t *parser);
+size_t		 nvlist_parser_feed(nvlist_parser_t *parser, const void *buf, size_t size);
+nvlist_t	*nvlist_parser_take(nvlist_parser_t *parser);
 
 int nvlist_send(int sock, const nvlist_t *nvl);
 nvlist_t *nvlist_recv(int sock);
@@ -117,6 +269,47 @@ const char *nvlist_next(const nvlist_t *nvl, int *typep, void **cookiep);
 
 const nvlist_t *nvlist_get_parent(const nvlist_t *nvl, void **cookiep);
 
+/*
+ * The nvlist_view functions operate on packed nvlists in place.
+ * nvlist_view_init() returns false and sets errno if the buffer is malformed
+ * or carries descriptors, which views cannot hold.
+ */
+
+bool		 nvlist_view_init(nvlist_view_t *view, const void *buf, size_t size);
+int		 nvlist_view_type(const nvlist_view_t *view);
+int		 nvlist_view_flags(const nvlist_view_t *view);
+bool		 nvlist_view_empty(const nvlist_view_t *view);
+bool		 nvlist_view_next(const nvlist_view_t *view, nvpair_view_t *nvpv, void **cookiep);
+bool		 nvlist_view_find(const nvlist_view_t *view, const char *name, int type, nvpair_view_t *nvpv);
+bool		 nvlist_view_exists(const nvlist_view_t *view, const char *name);
+bool		 nvlist_view_exists_type(const nvlist_view_t *view, const char *name, int type);
+
+bool		 nvlist_view_get_bool(const nvlist_view_t *view, const char *name);
+uint64_t	 nvlist_view_get_number(const nvlist_view_t *view, const char *name);
+int64_t		 nvlist_view_get_int64(const nvlist_view_t *view, const char *name);
+uint64_t	 nvlist_view_get_uint64(const nvlist_view_t *view, const char *name);
+const char	*nvlist_view_get_string(const nvlist_view_t *view, const char *name);
+const void	*nvlist_view_get_binary(const nvlist_view_t *view, const char *name, size_t *sizep);
+const uuid_t	*nvlist_view_get_uuid(const nvlist_view_t *view, const char *name);
+void		 nvlist_view_get_nvlist(const nvlist_view_t *view, const char *name, nvlist_view_t *child);
+
+bool		 nvpair_view_get_bool(const nvpair_view_t *nvpv);
+uint64_t	 nvpair_view_get_number(const nvpair_view_t *nvpv);
+const char	*nvpair_view_get_string(const nvpair_view_t *nvpv);
+const void	*nvpair_view_get_binary(const nvpair_view_t *nvpv, size_t *sizep);
+const uuid_t	*nvpair_view_get_uuid(const nvpair_view_t *nvpv);
+void		 nvpair_view_get_nvlist(const nvpair_view_t *nvpv, nvlist_view_t *child);
+
+/*
+ * Typed arrays are copied out of a view into caller supplied storage of
+ * nvpair_view_get_nitems() items.  The strings of a string array still
+ * point into the buffer.
+ */
+size_t		 nvpair_view_get_nitems(const nvpair_view_t *nvpv);
+void		 nvpair_view_get_bool_array(const nvpair_view_t *nvpv, bool *values);
+void		 nvpair_view_get_number_array(const nvpair_view_t *nvpv, uint64_t *values);
+void		 nvpair_view_get_string_array(const nvpair_view_t *nvpv, const char **values);
+
 /*
  * The nvlist_exists functions check if the given name (optionally of the given
  * type) exists on nvlist.
@@ -142,6 +335,10 @@ bool nvlist_exists_descriptor(const nvlist_t *nvl, const char *name);
 #endif
 bool nvlist_exists_binary(const nvlist_t *nvl, const char *name);
 bool nvlist_exists_uuid(const nvlist_t *nvl, const char *name);
+bool nvlist_exists_bool_array(const nvlist_t *nvl, const char *name);
+bool nvlist_exists_int64_array(const nvlist_t *nvl, const char *name);
+bool nvlist_exists_uint64_array(const nvlist_t *nvl, const char *name);
+bool nvlist_exists_string_array(const nvlist_t *nvl, const char *name);
 
 /*
  * The nvlist_add functions add the given name/value pair.
@@ -170,6 +367,10 @@ void nvlist_add_descriptor(nvlist_t *nvl, const char *name, int value);
 #endif
 void nvlist_add_binary(nvlist_t *nvl, const char *name, const void *value, size_t size);
 void nvlist_add_uuid(nvlist_t *nvl, const char *name, const uuid_t *value);
+void nvlist_add_bool_array(nvlist_t *nvl, const char *name, const bool *value, size_t nitems);
+void nvlist_add_int64_array(nvlist_t *nvl, const char *name, const int64_t *value, size_t nitems);
+void nvlist_add_uint64_array(nvlist_t *nvl, const char *name, const uint64_t *value, size_t nitems);
+void nvlist_add_string_array(nvlist_t *nvl, const char *name, const char * const *value, size_t nitems);
 
 /*
  * The nvlist_move functions add the given name/value pair.
@@ -186,6 +387,16 @@ void nvlist_move_descriptor(nvlist_t *nvl, const char *name, int value);
 void nvlist_move_binary(nvlist_t *nvl, const char *name, void *value, size_t size);
 void nvlist_move_uuid(nvlist_t *nvl, const char *name, uuid_t *value);
 
+/*
+ * nvlist_add_binary_external() adds a binary value without copying it; the
+ * memory (an mmap'd file, an out-of-line message region, ...) must stay
+ * valid until destructor, if not NULL, is called with ctx when the pair is
+ * freed.  The value is consumed even if the function fails.  Taking the
+ * value with nvlist_take_binary() returns a copy.
+ */
+
+void nvlist_add_binary_external(nvlist_t *nvl, const char *name, const void *value, size_t size, nv_destructor_t destructor, void *ctx);
+
 /*
  * The nvlist_get functions returns value associated with the given name.
  * If it returns a pointer, the pointer represents internal buffer and should
@@ -209,6 +420,10 @@ int		 nvlist_get_descriptor(const nvlist_t *nvl, const char *name);
 #endif
 const void	*nvlist_get_binary(const nvlist_t *nvl, const char *name, size_t *sizep);
 const uuid_t	*nvlist_get_uuid(const nvlist_t *nvl, const char *name);
+const bool	*nvlist_get_bool_array(const nvlist_t *nvl, const char *name, size_t *nitemsp);
+const int64_t	*nvlist_get_int64_array(const nvlist_t *nvl, const char *name, size_t *nitemsp);
+const uint64_t	*nvlist_get_uint64_array(const nvlist_t *nvl, const char *name, size_t *nitemsp);
+const char * const *nvlist_get_string_array(const nvlist_t *nvl, const char *name, size_t *nitemsp);
 bool	nvlist_contains_key(const nvlist_t *nvl, const char *name);
 
 /*
@@ -261,6 +476,10 @@ void nvlist_free_descriptor(nvlist_t *nvl, const char *name);
 #endif
 void nvlist_free_binary(nvlist_t *nvl, const char *name);
 void nvlist_free_uuid(nvlist_t *nvl, const char *name);
+void nvlist_free_bool_array(nvlist_t *nvl, const char *name);
+void nvlist_free_int64_array(nvlist_t *nvl, const char *name);
+void nvlist_free_uint64_array(nvlist_t *nvl, const char *name);
+void nvlist_free_string_array(nvlist_t *nvl, const char *name);
 
 /*
  * Below are the same functions, but which operate on format strings and
@@ -42,10 +42,10 @@ typedef struct nvpair nvpair_t;
 #define	NV_TYPE_NVLIST_UP		255
 
 #define	NV_TYPE_FIRST		NV_TYPE_NULL
-#define	NV_TYPE_LAST		NV_TYPE_NVLIST_DICTIONARY
+#define	NV_TYPE_LAST		NV_TYPE_STRING_ARRAY
 
 #define NV_TYPE_NUMBER_MIN NV_TYPE_NUMBER
-#define NV_TYPE_NUMBER_MAX NV_TYPE_ENDPOINT
+#define NV_TYPE_NUMBER_MAX NV_TYPE_DATE
 #define NV_TYPE_NVLIST_MIN NV_TYPE_NVLIST
 #define NV_TYPE_NVLIST_MAX NV_TYPE_NVLIST_DICTIONARY
 
@@ -120,7 +120,11 @@ nvpair_t *nvpair_create_stringv(const char *name, const char *valuefmt, va_list
 nvpair_t *nvpair_create_nvlist_type(const char *name, const nvlist_t *value, int type);
 nvpair_t *nvpair_create_descriptor(const char *name, int value);
 nvpair_t *nvpair_create_binary(const char *name, const void *value, size_t size);
+nvpair_t *nvpair_create_binary_external(const char *name, const void *value, size_t size, nv_destructor_t destructor, void *ctx);
 nvpair_t *nvpair_create_uuid(const char *name, const uuid_t *value);
+nvpair_t *nvpair_create_bool_array(const char *name, const bool *value, size_t nitems);
+nvpair_t *nvpair_create_number_array_type(const char *name, const uint64_t *value, size_t nitems, int type);
+nvpair_t *nvpair_create_string_array(const char *name, const char * const *value, size_t nitems);
 
 nvpair_t *nvpair_move_string(const char *name, char *value);
 nvpair_t *nvpair_move_nvlist(const char *name, nvlist_t *value);
@@ -136,6 +140,9 @@ const nvlist_t	*nvpair_get_nvlist(const nvpair_t *nvp);
 int		 nvpair_get_descriptor(const nvpair_t *nvp);
 const void	*nvpair_get_binary(const nvpair_t *nvp, size_t *sizep);
 const uuid_t	*nvpair_get_uuid(const nvpair_t *nvp);
+const bool	*nvpair_get_bool_array(const nvpair_t *nvp, size_t *nitemsp);
+const uint64_t	*nvpair_get_number_array(const nvpair_t *nvp, size_t *nitemsp);
+const char * const *nvpair_get_string_array(const nvpair_t *nvp, size_t *nitemsp);
 
 void nvpair_free(nvpair_t *nvp);
 
@@ -46,6 +46,7 @@ __FBSDID("$FreeBSD$");
 
 #else
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <errno.h>
 #include <stdarg.h>
@@ -88,6 +89,11 @@ __FBSDID("$FreeBSD$");
 #define	NV_FLAG_PRIVATE_MASK	(NV_FLAG_BIG_ENDIAN)
 #define	NV_FLAG_PUBLIC_MASK	(NV_FLAG_IGNORE_CASE)
 #define	NV_FLAG_ALL_MASK	(NV_FLAG_PRIVATE_MASK | NV_FLAG_PUBLIC_MASK)
+#if BYTE_ORDER == BIG_ENDIAN
+#define	NV_FLAG_HOST_ORDER	NV_FLAG_BIG_ENDIAN
+#else
+#define	NV_FLAG_HOST_ORDER	0
+#endif
 
 #define	NVLIST_MAGIC	0x6e766c	/* "nvl" */
 struct nvlist {
@@ -97,6 +103,91 @@ struct nvlist {
 	int		 nvl_type;
 	nvpair_t	*nvl_parent;
 	struct nvl_head	 nvl_head;
+	size_t		 nvl_count;
+	bool		 nvl_dirty;
+	size_t		 nvl_size;
+	size_t		 nvl_ndescs;
+	struct nvlist_hslot *nvl_hash;
+	size_t		 nvl_hashsize;
+	size_t		 nvl_hashused;
+	struct nvlist_arena *nvl_arena;
+	bool		 nvl_frozen;
+	unsigned int	 nvl_refcnt;
+	unsigned int	 nvl_shared;
+};
+
+/*
+ * A frozen list may be nested into any number of parents at once, so its
+ * nvl_parent stays NULL and walks that climb back up remember the pair they
+ * entered it through.  nvl_shared is the largest number of frozen lists a
+ * walk from the top of a frozen tree can pass through, which nvlist_freeze()
+ * keeps below NVLIST_SHARED_MAX so the stack of a walk can be fixed in size.
+ */
+#define	NVLIST_SHARED_MAX	32
+
+struct nvlist_walk {
+	const nvlist_t	*nvw_root;
+	size_t		 nvw_depth;
+	nvpair_t	*nvw_entry[NVLIST_SHARED_MAX];
+};
+
+/*
+ * Lists holding more than NVLIST_HASH_THRESHOLD elements get a name index,
+ * so that lookups don't have to walk and compare every name.  The index is
+ * an open addressing table keyed by a case-folded hash of the name, which
+ * lets one hash serve both case-sensitive and NV_FLAG_IGNORE_CASE lists.
+ */
+struct nvlist_hslot {
+	uint32_t	 nvh_hash;
+	nvpair_t	*nvh_nvp;
+};
+
+#define	NVLIST_HSLOT_DELETED	((nvpair_t *)(uintptr_t)-1)
+
+#ifdef NVLIST_TESTING
+static size_t nvlist_hash_threshold = NVLIST_HASH_THRESHOLD;
+
+/*
+ * Change the threshold for every list and return the previous one, so that
+ * benchmarks can compare lists with and without an index.  Only built with
+ * NVLIST_TESTING, as it is not synchronized.
+ */
+size_t
+nvlist_set_hash_threshold(size_t threshold)
+{
+	size_t old;
+
+	old = nvlist_hash_threshold;
+	nvlist_hash_threshold = threshold;
+	return (old);
+}
+#else
+#define	nvlist_hash_threshold	NVLIST_HASH_THRESHOLD
+#endif
+
+/*
+ * Lists created by nvlist_create_arena() and nvlist_create_in() take their
+ * nodes, names and payloads from a bump allocator owned by the root list,
+ * so destroying the root only has to release the chunks.  Whatever still
+ * needs to be torn down on its own (descriptors, heap pairs or lists moved
+ * into the tree) is counted in nva_external; while that count is zero
+ * nvlist_destroy() doesn't walk the tree at all.
+ */
+#define	NVLIST_ARENA_CHUNK_MIN	4096
+#define	NVLIST_ARENA_CHUNK_MAX	65536
+#define	NVLIST_ARENA_ALIGN	sizeof(uint64_t)
+
+struct nvlist_arena_chunk {
+	struct nvlist_arena_chunk *nvac_next;
+	size_t		 nvac_size;
+	size_t		 nvac_used;
+};
+
+struct nvlist_arena {
+	struct nvlist_arena_chunk *nva_chunk;
+	size_t		 nva_nextsize;
+	size_t		 nva_external;
+	nvlist_t	*nva_owner;
 };
 
 #define	NVLIST_ASSERT(nvl)	do {					\
@@ -112,6 +203,7 @@ MALLOC_DEFINE(M_NVLIST, "nvlist", "kernel nvlist");
 
 #define	NVLIST_HEADER_MAGIC	0x6c
 #define	NVLIST_HEADER_VERSION	0x00
+#define	NVLIST_HEADER_VERSION_COMPACT	0x01
 struct nvlist_header {
 	uint8_t		nvlh_magic;
 	uint8_t		nvlh_version;
@@ -121,6 +213,29 @@ struct nvlist_header {
 	uint64_t	nvlh_size;
 } __attribute__((packed));
 
+static void
+nvlist_init(nvlist_t *nvl, int type, int flags)
+{
+
+	nvl->nvl_error = 0;
+	nvl->nvl_flags = flags;
+	nvl->nvl_parent = NULL;
+	nvl->nvl_count = 0;
+	nvl->nvl_dirty = true;
+	nvl->nvl_size = 0;
+	nvl->nvl_ndescs = 0;
+	nvl->nvl_hash = NULL;
+	nvl->nvl_hashsize = 0;
+	nvl->nvl_hashused = 0;
+	nvl->nvl_arena = NULL;
+	nvl->nvl_frozen = false;
+	nvl->nvl_refcnt = 0;
+	nvl->nvl_shared = 0;
+	nvl->nvl_type = type;
+	TAILQ_INIT(&nvl->nvl_head);
+	nvl->nvl_magic = NVLIST_MAGIC;
+}
+
 nvlist_t *
 nvlist_create(int flags)
 {
@@ -129,12 +244,8 @@ nvlist_create(int flags)
 	PJDLOG_ASSERT((flags & ~(NV_FLAG_PUBLIC_MASK)) == 0);
 
 	nvl = nv_malloc(sizeof(*nvl));
-	nvl->nvl_error = 0;
-	nvl->nvl_flags = flags;
-	nvl->nvl_parent = NULL;
-	nvl->nvl_type = NV_TYPE_NVLIST;
-	TAILQ_INIT(&nvl->nvl_head);
-	nvl->nvl_magic = NVLIST_MAGIC;
+	if (nvl != NULL)
+		nvlist_init(nvl, NV_TYPE_NVLIST, flags);
 
 	return (nvl);
 }
@@ -147,12 +258,8 @@ nvlist_create_array(int flags)
 	PJDLOG_ASSERT((flags & ~(NV_FLAG_PUBLIC_MASK)) == 0);
 
 	nvl = nv_malloc(sizeof(*nvl));
-	nvl->nvl_error = 0;
-	nvl->nvl_flags = flags;
-	nvl->nvl_parent = NULL;
-	nvl->nvl_type = NV_TYPE_NVLIST_ARRAY;
-	TAILQ_INIT(&nvl->nvl_head);
-	nvl->nvl_magic = NVLIST_MAGIC;
+	if (nvl != NULL)
+		nvlist_init(nvl, NV_TYPE_NVLIST_ARRAY, flags);
 
 	return (nvl);
 }
@@ -165,20 +272,173 @@ nvlist_create_dictionary(int flags)
 	PJDLOG_ASSERT((flags & ~(NV_FLAG_PUBLIC_MASK)) == 0);
 
 	nvl = nv_malloc(sizeof(*nvl));
-	nvl->nvl_error = 0;
-	nvl->nvl_flags = flags;
-	nvl->nvl_parent = NULL;
-	nvl->nvl_type = NV_TYPE_NVLIST_DICTIONARY;
-	TAILQ_INIT(&nvl->nvl_head);
-	nvl->nvl_magic = NVLIST_MAGIC;
+	if (nvl != NULL)
+		nvlist_init(nvl, NV_TYPE_NVLIST_DICTIONARY, flags);
+
+	return (nvl);
+}
+
+void *
+nvlist_arena_alloc(struct nvlist_arena *arena, size_t size)
+{
+	struct nvlist_arena_chunk *chunk;
+	size_t chunksize;
+	void *ptr;
+
+	size = roundup(size, NVLIST_ARENA_ALIGN);
+	chunk = arena->nva_chunk;
+	if (chunk->nvac_size - chunk->nvac_used >= size) {
+		ptr = (char *)(chunk + 1) + chunk->nvac_used;
+		chunk->nvac_used += size;
+		return (ptr);
+	}
+
+	chunksize = arena->nva_nextsize;
+	if (size > chunksize / 4) {
+		/*
+		 * Large payloads get a chunk of their own, linked in behind
+		 * the current one so its free space isn't lost.
+		 */
+		chunk = nv_malloc(sizeof(*chunk) + size);
+		if (chunk == NULL)
+			return (NULL);
+		chunk->nvac_size = chunk->nvac_used = size;
+		chunk->nvac_next = arena->nva_chunk->nvac_next;
+		arena->nva_chunk->nvac_next = chunk;
+		return (chunk + 1);
+	}
+
+	chunk = nv_malloc(sizeof(*chunk) + chunksize);
+	if (chunk == NULL)
+		return (NULL);
+	chunk->nvac_size = chunksize;
+	chunk->nvac_used = size;
+	chunk->nvac_next = arena->nva_chunk;
+	arena->nva_chunk = chunk;
+	if (chunksize < NVLIST_ARENA_CHUNK_MAX)
+		arena->nva_nextsize = chunksize * 2;
+
+	return (chunk + 1);
+}
+
+static void
+nvlist_arena_release(struct nvlist_arena *arena)
+{
+	struct nvlist_arena_chunk *chunk, *next;
+
+	/* The arena itself lives in the first chunk, don't touch it below. */
+	for (chunk = arena->nva_chunk; chunk != NULL; chunk = next) {
+		next = chunk->nvac_next;
+		nv_free(chunk);
+	}
+}
+
+nvlist_t *
+nvlist_create_arena(int type, int flags)
+{
+	struct nvlist_arena_chunk *chunk;
+	struct nvlist_arena *arena;
+	nvlist_t *nvl;
+
+	PJDLOG_ASSERT((flags & ~(NV_FLAG_PUBLIC_MASK)) == 0);
+	PJDLOG_ASSERT(type == NV_TYPE_NVLIST ||
+	    type == NV_TYPE_NVLIST_ARRAY ||
+	    type == NV_TYPE_NVLIST_DICTIONARY);
+
+	chunk = nv_malloc(sizeof(*chunk) + NVLIST_ARENA_CHUNK_MIN);
+	if (chunk == NULL)
+		return (NULL);
+	chunk->nvac_next = NULL;
+	chunk->nvac_size = NVLIST_ARENA_CHUNK_MIN;
+	chunk->nvac_used = roundup(sizeof(*arena), NVLIST_ARENA_ALIGN);
+
+	arena = (struct nvlist_arena *)(chunk + 1);
+	arena->nva_chunk = chunk;
+	arena->nva_nextsize = NVLIST_ARENA_CHUNK_MIN * 2;
+	arena->nva_external = 0;
+
+	/* Always fits in the first chunk. */
+	nvl = nvlist_arena_alloc(arena, sizeof(*nvl));
+	nvlist_init(nvl, type, flags);
+	nvl->nvl_arena = arena;
+	arena->nva_owner = nvl;
+
+	return (nvl);
+}
+
+nvlist_t *
+nvlist_create_in(nvlist_t *owner, int type, int flags)
+{
+	nvlist_t *nvl;
+
+	NVLIST_ASSERT(owner);
+	PJDLOG_ASSERT((flags & ~(NV_FLAG_PUBLIC_MASK)) == 0);
+
+	switch (type) {
+	case NV_TYPE_NVLIST:
+	case NV_TYPE_NVLIST_ARRAY:
+	case NV_TYPE_NVLIST_DICTIONARY:
+		break;
+	default:
+		PJDLOG_ABORT("Invalid nvlist type (%d).", type);
+	}
+
+	if (owner->nvl_arena == NULL)
+		nvl = nv_malloc(sizeof(*nvl));
+	else
+		nvl = nvlist_arena_alloc(owner->nvl_arena, sizeof(*nvl));
+	if (nvl == NULL)
+		return (NULL);
+	nvlist_init(nvl, type, flags);
+	nvl->nvl_arena = owner->nvl_arena;
 
-	printf("1 nvl = %p\n", nvl);
 	return (nvl);
 }
 
+struct nvlist_arena *
+nvlist_arena(const nvlist_t *nvl)
+{
+
+	NVLIST_ASSERT(nvl);
+
+	return (nvl->nvl_arena);
+}
+
+/*
+ * Keep count of the elements of arena lists that destroying the arena
+ * wouldn't release by itself.
+ */
+void
+nvlist_arena_track(nvlist_t *nvl, const nvpair_t *nvp, int delta)
+{
+	struct nvlist_arena *arena;
+	bool external;
+
+	arena = nvl->nvl_arena;
+	if (arena == NULL)
+		return;
+
+	switch (nvpair_type(nvp)) {
+	case NV_TYPE_DESCRIPTOR:
+		external = true;
+		break;
+	case NV_TYPE_NVLIST:
+	case NV_TYPE_NVLIST_ARRAY:
+	case NV_TYPE_NVLIST_DICTIONARY:
+		external = nvpair_arena(nvp) != arena ||
+		    nvpair_get_nvlist(nvp)->nvl_arena != arena;
+		break;
+	default:
+		external = nvpair_arena(nvp) != arena;
+	}
+	if (external)
+		arena->nva_external += delta;
+}
+
 void
 nvlist_destroy(nvlist_t *nvl)
 {
+	struct nvlist_arena *arena;
 	nvpair_t *nvp;
 	int serrno;
 
@@ -189,12 +449,46 @@ nvlist_destroy(nvlist_t *nvl)
 
 	NVLIST_ASSERT(nvl);
 
+	if (nvl->nvl_frozen) {
+		if (__atomic_sub_fetch(&nvl->nvl_refcnt, 1,
+		    __ATOMIC_ACQ_REL) != 0) {
+			RESTORE_ERRNO(serrno);
+			return;
+		}
+		/*
+		 * That was the last reference, the tree is ours again.  A
+		 * nested list still points at the pair it was removed from.
+		 */
+		nvl->nvl_frozen = false;
+		nvl->nvl_parent = NULL;
+	}
+
+	arena = nvl->nvl_arena;
+	if (arena != NULL && arena->nva_owner == nvl &&
+	    arena->nva_external == 0) {
+		nvlist_arena_release(arena);
+		RESTORE_ERRNO(serrno);
+		return;
+	}
+
+	/* No point in keeping the index up to date while tearing down. */
+	if (arena == NULL)
+		nv_free(nvl->nvl_hash);
+	nvl->nvl_hash = NULL;
+
 	while ((nvp = nvlist_first_nvpair(nvl)) != NULL) {
 		nvlist_remove_nvpair(nvl, nvp);
 		nvpair_free(nvp);
 	}
 	nvl->nvl_magic = 0;
-	nv_free(nvl);
+	/*
+	 * Lists in an arena other than its root stay allocated until the
+	 * root is destroyed.
+	 */
+	if (arena == NULL)
+		nv_free(nvl);
+	else if (arena->nva_owner == nvl)
+		nvlist_arena_release(arena);
 
 	RESTORE_ERRNO(serrno);
 }
@@ -204,6 +498,7 @@ nvlist_set_error(nvlist_t *nvl, int error)
 {
 
 	PJDLOG_ASSERT(error != 0);
+	PJDLOG_ASSERT(nvl == NULL || !nvl->nvl_frozen);
 
 	/*
 	 * Check for error != 0 so that we don't do the wrong thing if somebody
@@ -259,6 +554,63 @@ nvlist_set_parent(nvlist_t *nvl, nvpair_t *parent)
 	nvl->nvl_parent = parent;
 }
 
+/*
+ * Mark the cached packed size and descriptor count of the list and all of
+ * its ancestors as stale.  A clean list never has a dirty descendant, so
+ * the walk can stop at the first list that is already dirty.
+ */
+void
+nvlist_invalidate(nvlist_t *nvl)
+{
+	nvpair_t *nvp;
+
+	while (nvl != NULL && !nvl->nvl_dirty) {
+		NVLIST_ASSERT(nvl);
+		nvl->nvl_dirty = true;
+		nvp = nvl->nvl_parent;
+		nvl = (nvp != NULL) ? nvpair_nvlist(nvp) : NULL;
+	}
+}
+
+static void
+nvlist_walk_init(struct nvlist_walk *walk, const nvlist_t *root)
+{
+
+	walk->nvw_root = root;
+	walk->nvw_depth = 0;
+}
+
+/*
+ * Note that a walk descends through nvp into nvl, the list nvp holds.
+ */
+static void
+nvlist_walk_enter(struct nvlist_walk *walk, nvpair_t *nvp,
+    const nvlist_t *nvl)
+{
+
+	if (nvl->nvl_parent != NULL)
+		return;
+	PJDLOG_ASSERT(nvl->nvl_frozen);
+	PJDLOG_ASSERT(walk->nvw_depth < NVLIST_SHARED_MAX);
+	walk->nvw_entry[walk->nvw_depth++] = nvp;
+}
+
+/*
+ * Return the pair through which a walk entered nvl, or NULL once it is
+ * back at its root.
+ */
+static nvpair_t *
+nvlist_walk_leave(struct nvlist_walk *walk, const nvlist_t *nvl)
+{
+
+	if (nvl == walk->nvw_root)
+		return (NULL);
+	if (nvl->nvl_parent != NULL)
+		return (nvl->nvl_parent);
+	PJDLOG_ASSERT(walk->nvw_depth > 0);
+	return (walk->nvw_entry[--walk->nvw_depth]);
+}
+
 bool
 nvlist_empty(const nvlist_t *nvl)
 {
@@ -287,6 +639,159 @@ nvlist_report_missing(int type, const char *name)
 	    name, nvpair_type_string(type));
 }
 
+static uint32_t
+nvlist_hash_name(const char *name)
+{
+	uint32_t hash;
+	unsigned char ch;
+
+	/* FNV-1a over the name folded to lower case. */
+	hash = 2166136261U;
+	while ((ch = (unsigned char)*name++) != '\0') {
+		if (ch >= 'A' && ch <= 'Z')
+			ch += 'a' - 'A';
+		hash ^= ch;
+		hash *= 16777619U;
+	}
+
+	return (hash);
+}
+
+static bool
+nvlist_name_equal(const nvlist_t *nvl, const char *name1, const char *name2)
+{
+
+	if ((nvl->nvl_flags & NV_FLAG_IGNORE_CASE) != 0)
+		return (strcasecmp(name1, name2) == 0);
+	return (strcmp(name1, name2) == 0);
+}
+
+static void
+nvlist_hash_link(nvlist_t *nvl, nvpair_t *nvp, uint32_t hash)
+{
+	struct nvlist_hslot *slot;
+	size_t idx, mask;
+
+	mask = nvl->nvl_hashsize - 1;
+	for (idx = hash & mask;; idx = (idx + 1) & mask) {
+		slot = &nvl->nvl_hash[idx];
+		if (slot->nvh_nvp == NULL) {
+			nvl->nvl_hashused++;
+			break;
+		}
+		if (slot->nvh_nvp == NVLIST_HSLOT_DELETED)
+			break;
+	}
+	slot->nvh_hash = hash;
+	slot->nvh_nvp = nvp;
+}
+
+/*
+ * (Re)build the index so that it holds at most half as many used slots as
+ * it has.  On allocation failure the list simply stays unindexed and
+ * lookups fall back to the linear walk.
+ */
+static void
+nvlist_hash_rebuild(nvlist_t *nvl)
+{
+	nvpair_t *nvp;
+	size_t size;
+
+	size = 16;
+	while (size < nvl->nvl_count * 3)
+		size <<= 1;
+
+	if (nvl->nvl_arena == NULL) {
+		nv_free(nvl->nvl_hash);
+		nvl->nvl_hash = nv_calloc(size, sizeof(nvl->nvl_hash[0]));
+	} else {
+		/* The old table is reclaimed along with the arena. */
+		nvl->nvl_hash = nvlist_arena_alloc(nvl->nvl_arena,
+		    size * sizeof(nvl->nvl_hash[0]));
+		if (nvl->nvl_hash != NULL)
+			memset(nvl->nvl_hash, 0, size * sizeof(nvl->nvl_hash[0]));
+	}
+	nvl->nvl_hashused = 0;
+	if (nvl->nvl_hash == NULL) {
+		nvl->nvl_hashsize = 0;
+		return;
+	}
+	nvl->nvl_hashsize = size;
+
+	for (nvp = nvlist_first_nvpair(nvl); nvp != NULL;
+	    nvp = nvlist_next_nvpair(nvl, nvp)) {
+		nvlist_hash_link(nvl, nvp, nvlist_hash_name(nvpair_name(nvp)));
+	}
+}
+
+static nvpair_t *
+nvlist_hash_lookup(const nvlist_t *nvl, const char *name)
+{
+	const struct nvlist_hslot *slot;
+	size_t idx, mask;
+	uint32_t hash;
+
+	hash = nvlist_hash_name(name);
+	mask = nvl->nvl_hashsize - 1;
+	for (idx = hash & mask;; idx = (idx + 1) & mask) {
+		slot = &nvl->nvl_hash[idx];
+		if (slot->nvh_nvp == NULL)
+			return (NULL);
+		if (slot->nvh_nvp != NVLIST_HSLOT_DELETED &&
+		    slot->nvh_hash == hash &&
+		    nvlist_name_equal(nvl, nvpair_name(slot->nvh_nvp), name)) {
+			return (slot->nvh_nvp);
+		}
+	}
+}
+
+void
+nvlist_hash_insert(nvlist_t *nvl, nvpair_t *nvp)
+{
+
+	NVLIST_ASSERT(nvl);
+	PJDLOG_ASSERT(!nvl->nvl_frozen);
+
+	nvl->nvl_count++;
+	if (nvl->nvl_hash == NULL) {
+		if (nvl->nvl_count > nvlist_hash_threshold)
+			nvlist_hash_rebuild(nvl);
+		return;
+	}
+	if ((nvl->nvl_hashused + 1) * 2 > nvl->nvl_hashsize) {
+		nvlist_hash_rebuild(nvl);
+		return;
+	}
+	nvlist_hash_link(nvl, nvp, nvlist_hash_name(nvpair_name(nvp)));
+}
+
+void
+nvlist_hash_remove(nvlist_t *nvl, nvpair_t *nvp)
+{
+	struct nvlist_hslot *slot;
+	size_t idx, mask;
+	uint32_t hash;
+
+	NVLIST_ASSERT(nvl);
+	PJDLOG_ASSERT(!nvl->nvl_frozen);
+	PJDLOG_ASSERT(nvl->nvl_count > 0);
+
+	nvl->nvl_count--;
+	if (nvl->nvl_hash == NULL)
+		return;
+
+	hash = nvlist_hash_name(nvpair_name(nvp));
+	mask = nvl->nvl_hashsize - 1;
+	for (idx = hash & mask;; idx = (idx + 1) & mask) {
+		slot = &nvl->nvl_hash[idx];
+		PJDLOG_ASSERT(slot->nvh_nvp != NULL);
+		if (slot->nvh_nvp == nvp) {
+			slot->nvh_nvp = NVLIST_HSLOT_DELETED;
+			break;
+		}
+	}
+}
+
 static nvpair_t *
 nvlist_find(const nvlist_t *nvl, int type, const char *name)
 {
@@ -297,6 +802,17 @@ nvlist_find(const nvlist_t *nvl, int type, const char *name)
 	PJDLOG_ASSERT(type == NV_TYPE_NONE ||
 	    (type >= NV_TYPE_FIRST && type <= NV_TYPE_LAST));
 
+	if (nvl->nvl_hash != NULL) {
+		/* Names are unique, so a type mismatch means no match. */
+		nvp = nvlist_hash_lookup(nvl, name);
+		if (nvp != NULL && type != NV_TYPE_NONE &&
+		    nvpair_type(nvp) != type)
+			nvp = NULL;
+		if (nvp == NULL)
+			RESTORE_ERRNO(ENOENT);
+		return (nvp);
+	}
+
 	for (nvp = nvlist_first_nvpair(nvl); nvp != NULL;
 	    nvp = nvlist_next_nvpair(nvl, nvp)) {
 		if (type != NV_TYPE_NONE && nvpair_type(nvp) != type)
@@ -450,15 +966,16 @@ nvlist_dump_error_check(const nvlist_t *nvl, int fd, int level)
 void
 nvlist_dump(const nvlist_t *nvl, int fd)
 {
+	struct nvlist_walk walk;
 	const nvlist_t *tmpnvl;
 	nvpair_t *nvp, *tmpnvp;
-	void *cookie;
 	int level;
 
 	level = 0;
 	if (nvlist_dump_error_check(nvl, fd, level))
 		return;
 
+	nvlist_walk_init(&walk, nvl);
 	nvp = nvlist_first_nvpair(nvl);
 	while (nvp != NULL) {
 		dprintf(fd, "%*s%s (%s):", level * 4, "", nvpair_name(nvp),
@@ -494,6 +1011,7 @@ nvlist_dump(const nvlist_t *nvl, int fd)
 				break;
 			tmpnvp = nvlist_first_nvpair(tmpnvl);
 			if (tmpnvp != NULL) {
+				nvlist_walk_enter(&walk, nvp, tmpnvl);
 				nvl = tmpnvl;
 				nvp = tmpnvp;
 				level++;
@@ -524,20 +1042,55 @@ nvlist_dump(const nvlist_t *nvl, int fd)
 		    	uuid = nvpair_get_uuid(nvp);
 				uuid_unparse_upper(*uuid, str);
 	    		dprintf(fd, " [%s]\n", str);
-
-		    	free(str);
 		    	break;
 		    }
+		case NV_TYPE_BOOL_ARRAY:
+		    {
+			const bool *bools;
+			size_t ii, nitems;
+
+			bools = nvpair_get_bool_array(nvp, &nitems);
+			for (ii = 0; ii < nitems; ii++)
+				dprintf(fd, " %s", bools[ii] ? "TRUE" : "FALSE");
+			dprintf(fd, "\n");
+			break;
+		    }
+		case NV_TYPE_INT64_ARRAY:
+		case NV_TYPE_UINT64_ARRAY:
+		    {
+			const uint64_t *numbers;
+			size_t ii, nitems;
+
+			numbers = nvpair_get_number_array(nvp, &nitems);
+			for (ii = 0; ii < nitems; ii++) {
+				if (nvpair_type(nvp) == NV_TYPE_INT64_ARRAY)
+					dprintf(fd, " %jd", (intmax_t)numbers[ii]);
+				else
+					dprintf(fd, " %ju", (uintmax_t)numbers[ii]);
+			}
+			dprintf(fd, "\n");
+			break;
+		    }
+		case NV_TYPE_STRING_ARRAY:
+		    {
+			const char * const *strs;
+			size_t ii, nitems;
+
+			strs = nvpair_get_string_array(nvp, &nitems);
+			for (ii = 0; ii < nitems; ii++)
+				dprintf(fd, " [%s]", strs[ii]);
+			dprintf(fd, "\n");
+			break;
+		    }
 		default:
 			PJDLOG_ABORT("Unknown type: %d.", nvpair_type(nvp));
 		}
 
 		while ((nvp = nvlist_next_nvpair(nvl, nvp)) == NULL) {
-			cookie = NULL;
-			nvl = nvlist_get_parent(nvl, &cookie);
-			if (nvl == NULL)
+			nvp = nvlist_walk_leave(&walk, nvl);
+			if (nvp == NULL)
 				return;
-			nvp = cookie;
+			nvl = nvpair_nvlist(nvp);
 			level--;
 		}
 	}
@@ -553,52 +1106,169 @@ nvlist_fdump(const nvlist_t *nvl, FILE *fp)
 #endif
 
 /*
- * The function obtains size of the nvlist after nvlist_pack().
+ * Recompute the cached packed size and descriptor count of a dirty list,
+ * descending only into nested lists that are dirty themselves, so that
+ * sizing a whole tree is a single linear pass.
  */
-size_t
-nvlist_size(const nvlist_t *nvl)
+static void
+nvlist_update_size(const nvlist_t *nvl)
 {
 	const nvlist_t *tmpnvl;
-	const nvpair_t *nvp, *tmpnvp;
-	void *cookie;
-	size_t size;
+	const nvpair_t *nvp;
+	nvlist_t *mnvl;
+	size_t size, ndescs;
 
 	NVLIST_ASSERT(nvl);
 	PJDLOG_ASSERT(nvl->nvl_error == 0);
 
+	if (!nvl->nvl_dirty)
+		return;
+
 	size = sizeof(struct nvlist_header);
-	nvp = nvlist_first_nvpair(nvl);
-	while (nvp != NULL) {
+	ndescs = 0;
+	for (nvp = nvlist_first_nvpair(nvl); nvp != NULL;
+	    nvp = nvlist_next_nvpair(nvl, nvp)) {
 		size += nvpair_header_size();
 		size += strlen(nvpair_name(nvp)) + 1;
-		if (nvpair_type(nvp) == NV_TYPE_NVLIST_ARRAY ||
-			nvpair_type(nvp) == NV_TYPE_NVLIST_DICTIONARY ||
-			nvpair_type(nvp) == NV_TYPE_NVLIST) {
-			size += sizeof(struct nvlist_header);
-			size += nvpair_header_size() + 1;
-			tmpnvl = nvpair_get_nvlist(nvp);
+		switch (nvpair_type(nvp)) {
+		case NV_TYPE_NVLIST:
+		case NV_TYPE_NVLIST_ARRAY:
+		case NV_TYPE_NVLIST_DICTIONARY:
+			tmpnvl = nvpair_get_nvlist(nvp);
 			PJDLOG_ASSERT(tmpnvl->nvl_error == 0);
-			tmpnvp = nvlist_first_nvpair(tmpnvl);
-			if (tmpnvp != NULL) {
-				nvl = tmpnvl;
-				nvp = tmpnvp;
-				continue;
-			}
-		} else {
+			nvlist_update_size(tmpnvl);
+			size += tmpnvl->nvl_size;
+			size += nvpair_header_size() + 1;
+			ndescs += tmpnvl->nvl_ndescs;
+			break;
+#ifndef _KERNEL
+		case NV_TYPE_DESCRIPTOR:
+			ndescs++;
+			size += nvpair_size(nvp);
+			break;
+#endif
+		default:
 			size += nvpair_size(nvp);
+			break;
 		}
+	}
 
-		while ((nvp = nvlist_next_nvpair(nvl, nvp)) == NULL) {
-			cookie = NULL;
-			nvl = nvlist_get_parent(nvl, &cookie);
-			if (nvl == NULL)
-				goto out;
-			nvp = cookie;
+	/* XXX: The cache is not part of the list's logical contents. */
+	mnvl = __DECONST(nvlist_t *, nvl);
+	mnvl->nvl_size = size;
+	mnvl->nvl_ndescs = ndescs;
+	mnvl->nvl_dirty = false;
+}
+
+/*
+ * The function obtains size of the nvlist after nvlist_pack().
+ */
+size_t
+nvlist_size(const nvlist_t *nvl)
+{
+
+	NVLIST_ASSERT(nvl);
+	PJDLOG_ASSERT(nvl->nvl_error == 0);
+
+	nvlist_update_size(nvl);
+	return (nvl->nvl_size);
+}
+
+/*
+ * Return the largest nvl_shared among the frozen lists nested anywhere in
+ * the tree under nvl.  With freeze set, every list of the tree that isn't
+ * already frozen is frozen on the way, with one reference held by the pair
+ * that contains it, and the sizes of nested lists are stored in their pairs
+ * so that packing doesn't have to write to the tree.
+ */
+static unsigned int
+nvlist_freeze_tree(nvlist_t *nvl, bool freeze)
+{
+	nvlist_t *tmpnvl;
+	nvpair_t *nvp;
+	unsigned int shared, tmpshared;
+
+	shared = 0;
+	for (nvp = nvlist_first_nvpair(nvl); nvp != NULL;
+	    nvp = nvlist_next_nvpair(nvl, nvp)) {
+		switch (nvpair_type(nvp)) {
+		case NV_TYPE_NVLIST:
+		case NV_TYPE_NVLIST_ARRAY:
+		case NV_TYPE_NVLIST_DICTIONARY:
+			tmpnvl = __DECONST(nvlist_t *, nvpair_get_nvlist(nvp));
+			if (tmpnvl->nvl_parent == NULL) {
+				PJDLOG_ASSERT(tmpnvl->nvl_frozen);
+				tmpshared = tmpnvl->nvl_shared;
+			} else {
+				tmpshared = nvlist_freeze_tree(tmpnvl, freeze);
+			}
+			if (tmpshared > shared)
+				shared = tmpshared;
+			if (freeze)
+				nvpair_init_datasize(nvp);
+			break;
 		}
 	}
+	if (freeze && !nvl->nvl_frozen) {
+		nvl->nvl_refcnt = 1;
+		nvl->nvl_frozen = true;
+	}
 
-out:
-	return (size);
+	return (shared);
+}
+
+bool
+nvlist_freeze(nvlist_t *nvl)
+{
+	unsigned int shared;
+
+	NVLIST_ASSERT(nvl);
+	PJDLOG_ASSERT(nvl->nvl_parent == NULL);
+	PJDLOG_ASSERT(nvl->nvl_arena == NULL ||
+	    nvl->nvl_arena->nva_owner == nvl);
+
+	if (nvl->nvl_frozen)
+		return (true);
+	if (nvl->nvl_error != 0) {
+		RESTORE_ERRNO(nvl->nvl_error);
+		return (false);
+	}
+
+	shared = nvlist_freeze_tree(nvl, false) + 1;
+	if (shared > NVLIST_SHARED_MAX) {
+		RESTORE_ERRNO(ELOOP);
+		return (false);
+	}
+	nvlist_update_size(nvl);
+	(void)nvlist_freeze_tree(nvl, true);
+	nvl->nvl_shared = shared;
+
+	return (true);
+}
+
+bool
+nvlist_frozen(const nvlist_t *nvl)
+{
+
+	NVLIST_ASSERT(nvl);
+
+	return (nvl->nvl_frozen);
+}
+
+nvlist_t *
+nvlist_retain(const nvlist_t *nvl)
+{
+	nvlist_t *mnvl;
+
+	NVLIST_ASSERT(nvl);
+	PJDLOG_ASSERT(nvl->nvl_frozen);
+	PJDLOG_ASSERT(nvl->nvl_parent == NULL);
+
+	/* XXX: The reference count is not part of the list's contents. */
+	mnvl = __DECONST(nvlist_t *, nvl);
+	__atomic_add_fetch(&mnvl->nvl_refcnt, 1, __ATOMIC_RELAXED);
+
+	return (mnvl);
 }
 
 #ifndef _KERNEL
@@ -651,61 +1321,31 @@ nvlist_descriptors(const nvlist_t *nvl, size_t *nitemsp)
 }
 #endif
 
-static size_t
-nvlist_xndescriptors(const nvlist_t *nvl, int level)
+size_t
+nvlist_ndescriptors(const nvlist_t *nvl)
 {
-#ifndef _KERNEL
-	const nvpair_t *nvp;
-	size_t ndescs;
 
 	NVLIST_ASSERT(nvl);
 	PJDLOG_ASSERT(nvl->nvl_error == 0);
-	PJDLOG_ASSERT(level < 3);
-
-	ndescs = 0;
-	for (nvp = nvlist_first_nvpair(nvl); nvp != NULL;
-	    nvp = nvlist_next_nvpair(nvl, nvp)) {
-		switch (nvpair_type(nvp)) {
-		case NV_TYPE_DESCRIPTOR:
-			ndescs++;
-			break;
-		case NV_TYPE_NVLIST:
-		case NV_TYPE_NVLIST_ARRAY:
-		case NV_TYPE_NVLIST_DICTIONARY:
-			ndescs += nvlist_xndescriptors(nvpair_get_nvlist(nvp),
-			    level + 1);
-			break;
-		}
-	}
-
-	return (ndescs);
-#else
-	return (0);
-#endif
-}
-
-size_t
-nvlist_ndescriptors(const nvlist_t *nvl)
-{
 
-	return (nvlist_xndescriptors(nvl, 0));
+	nvlist_update_size(nvl);
+	return (nvl->nvl_ndescs);
 }
 
 static unsigned char *
-nvlist_pack_header(const nvlist_t *nvl, unsigned char *ptr, size_t *leftp)
+nvlist_pack_raw_header(int type, int flags, size_t ndescs, unsigned char *ptr,
+    size_t *leftp)
 {
 	struct nvlist_header nvlhdr;
 
-	NVLIST_ASSERT(nvl);
-
 	nvlhdr.nvlh_magic = NVLIST_HEADER_MAGIC;
 	nvlhdr.nvlh_version = NVLIST_HEADER_VERSION;
-	nvlhdr.nvlh_flags = nvl->nvl_flags;
-	nvlhdr.nvlh_type = (uint8_t)nvl->nvl_type;
+	nvlhdr.nvlh_flags = flags;
+	nvlhdr.nvlh_type = (uint8_t)type;
 #if BYTE_ORDER == BIG_ENDIAN
 	nvlhdr.nvlh_flags |= NV_FLAG_BIG_ENDIAN;
 #endif
-	nvlhdr.nvlh_descriptors = nvlist_ndescriptors(nvl);
+	nvlhdr.nvlh_descriptors = ndescs;
 	nvlhdr.nvlh_size = *leftp - sizeof(nvlhdr);
 	PJDLOG_ASSERT(*leftp >= sizeof(nvlhdr));
 	memcpy(ptr, &nvlhdr, sizeof(nvlhdr));
@@ -715,14 +1355,90 @@ nvlist_pack_header(const nvlist_t *nvl, unsigned char *ptr, size_t *leftp)
 	return (ptr);
 }
 
+static unsigned char *
+nvlist_pack_header(const nvlist_t *nvl, unsigned char *ptr, size_t *leftp)
+{
+
+	NVLIST_ASSERT(nvl);
+
+	return (nvlist_pack_raw_header(nvl->nvl_type, nvl->nvl_flags,
+	    nvlist_ndescriptors(nvl), ptr, leftp));
+}
+
+/*
+ * Walk to the pair that follows nvp in packing order, climbing out of
+ * finished nested lists but never above the root of the walk.  Every
+ * list left on the way up is reported through nupp so the caller can
+ * emit its terminator.
+ */
+static nvpair_t *
+nvlist_pack_next(struct nvlist_walk *walk, const nvlist_t **nvlp,
+    nvpair_t *nvp, size_t *nupp)
+{
+	const nvlist_t *nvl;
+
+	nvl = *nvlp;
+	*nupp = 0;
+	while ((nvp = nvlist_next_nvpair(nvl, nvp)) == NULL) {
+		nvp = nvlist_walk_leave(walk, nvl);
+		if (nvp == NULL)
+			return (NULL);
+		nvl = nvpair_nvlist(nvp);
+		(*nupp)++;
+	}
+	*nvlp = nvl;
+	return (nvp);
+}
+
+/*
+ * Pack the value of a pair that is not a nested list.
+ */
+static unsigned char *
+nvlist_pack_value(const nvpair_t *nvp, unsigned char *ptr, int64_t *fdidxp,
+    size_t *leftp)
+{
+
+	switch (nvpair_type(nvp)) {
+	case NV_TYPE_NULL:
+		return (nvpair_pack_null(nvp, ptr, leftp));
+	case NV_TYPE_BOOL:
+		return (nvpair_pack_bool(nvp, ptr, leftp));
+	case NV_TYPE_NUMBER:
+	case NV_TYPE_PTR:
+	case NV_TYPE_UINT64:
+	case NV_TYPE_INT64:
+	case NV_TYPE_ENDPOINT:
+	case NV_TYPE_DATE:
+		return (nvpair_pack_number(nvp, ptr, leftp));
+	case NV_TYPE_STRING:
+		return (nvpair_pack_string(nvp, ptr, leftp));
+#ifndef _KERNEL
+	case NV_TYPE_DESCRIPTOR:
+		return (nvpair_pack_descriptor(nvp, ptr, fdidxp, leftp));
+#endif
+	case NV_TYPE_BINARY:
+	case NV_TYPE_UUID:
+		return (nvpair_pack_binary(nvp, ptr, leftp));
+	case NV_TYPE_BOOL_ARRAY:
+	case NV_TYPE_INT64_ARRAY:
+	case NV_TYPE_UINT64_ARRAY:
+	case NV_TYPE_STRING_ARRAY:
+		return (nvpair_pack_array(nvp, ptr, leftp));
+	default:
+		PJDLOG_ABORT("Invalid type (%d).", nvpair_type(nvp));
+	}
+
+	return (NULL);
+}
+
 void *
 nvlist_xpack(const nvlist_t *nvl, void *ubuf, int64_t *fdidxp, size_t *sizep)
 {
+	struct nvlist_walk walk;
 	unsigned char *buf, *ptr;
-	size_t left, size;
+	size_t left, size, nup;
 	const nvlist_t *tmpnvl;
 	nvpair_t *nvp, *tmpnvp;
-	void *cookie;
 
 	NVLIST_ASSERT(nvl);
 
@@ -731,6 +1447,7 @@ nvlist_xpack(const nvlist_t *nvl, void *ubuf, int64_t *fdidxp, size_t *sizep)
 		return (NULL);
 	}
 
+	nvlist_walk_init(&walk, nvl);
 	size = nvlist_size(nvl);
 	if (ubuf) {
 		if (sizep == NULL || *sizep != size)
@@ -758,22 +1475,6 @@ nvlist_xpack(const nvlist_t *nvl, void *ubuf, int64_t *fdidxp, size_t *sizep)
 			return (NULL);
 		}
 		switch (nvpair_type(nvp)) {
-		case NV_TYPE_NULL:
-			ptr = nvpair_pack_null(nvp, ptr, &left);
-			break;
-		case NV_TYPE_BOOL:
-			ptr = nvpair_pack_bool(nvp, ptr, &left);
-			break;
-		case NV_TYPE_NUMBER:
-		case NV_TYPE_PTR:
-		case NV_TYPE_UINT64:
-		case NV_TYPE_INT64:
-		case NV_TYPE_ENDPOINT:
-			ptr = nvpair_pack_number(nvp, ptr, &left);
-			break;
-		case NV_TYPE_STRING:
-			ptr = nvpair_pack_string(nvp, ptr, &left);
-			break;
 		case NV_TYPE_NVLIST:
 		case NV_TYPE_NVLIST_ARRAY:
 		case NV_TYPE_NVLIST_DICTIONARY:
@@ -783,38 +1484,24 @@ nvlist_xpack(const nvlist_t *nvl, void *ubuf, int64_t *fdidxp, size_t *sizep)
 				goto out;
 			tmpnvp = nvlist_first_nvpair(tmpnvl);
 			if (tmpnvp != NULL) {
+				nvlist_walk_enter(&walk, nvp, tmpnvl);
 				nvl = tmpnvl;
 				nvp = tmpnvp;
 				continue;
 			}
 			ptr = nvpair_pack_nvlist_up(ptr, &left);
 			break;
-#ifndef _KERNEL
-		case NV_TYPE_DESCRIPTOR:
-			ptr = nvpair_pack_descriptor(nvp, ptr, fdidxp, &left);
-			break;
-#endif
-		case NV_TYPE_BINARY:
-		case NV_TYPE_UUID:
-			ptr = nvpair_pack_binary(nvp, ptr, &left);
-			break;
 		default:
-			PJDLOG_ABORT("Invalid type (%d).", nvpair_type(nvp));
+			ptr = nvlist_pack_value(nvp, ptr, fdidxp, &left);
+			break;
 		}
 		if (ptr == NULL) {
 			nv_free(buf);
 			return (NULL);
 		}
-		while ((nvp = nvlist_next_nvpair(nvl, nvp)) == NULL) {
-			cookie = NULL;
-			nvl = nvlist_get_parent(nvl, &cookie);
-			if (nvl == NULL)
-				goto out;
-			nvp = cookie;
+		nvp = nvlist_pack_next(&walk, &nvl, nvp, &nup);
+		while (nup-- > 0)
 			ptr = nvpair_pack_nvlist_up(ptr, &left);
-			if (ptr == NULL)
-				goto out;
-		}
 	}
 
 out:
@@ -849,141 +1536,1726 @@ nvlist_pack_buffer(const nvlist_t *nvl, void *ubuf, size_t *sizep)
 	return (nvlist_xpack(nvl, ubuf, NULL, sizep));
 }
 
+/*
+ * The encoder writes what nvlist_pack() makes of a list without flags or
+ * descriptors.  The pair of a nested list goes out before its contents, so
+ * its data size is only known, and patched in, at nvlist_encode_end().
+ * Until then the field holds the address of the pair of the enclosing
+ * list, which is how the encoder finds its way back out without a stack.
+ */
+size_t
+nvlist_encode_size(const char *name, size_t datasize)
+{
+
+	return (nvpair_header_size() + strlen(name) + 1 + datasize);
+}
+
+size_t
+nvlist_encode_nvlist_size(const char *name)
+{
+
+	if (name == NULL)
+		return (sizeof(struct nvlist_header));
+	return (nvlist_encode_size(name, sizeof(struct nvlist_header)) +
+	    nvpair_header_size() + 1);
+}
+
+void
+nvlist_encode_init(nvlist_encoder_t *nve, int type, void *buf, size_t size)
+{
+
+	PJDLOG_ASSERT(type == NV_TYPE_NVLIST ||
+	    type == NV_TYPE_NVLIST_ARRAY || type == NV_TYPE_NVLIST_DICTIONARY);
+
+	nve->nve_left = size;
+	nve->nve_ptr = nvlist_pack_raw_header(type, 0, 0, buf, &nve->nve_left);
+	nve->nve_open = NULL;
+	nve->nve_error = 0;
+}
+
 static bool
-nvlist_check_header(struct nvlist_header *nvlhdrp)
+nvlist_encode_name(nvlist_encoder_t *nve, const char *name, size_t *namesizep)
 {
 
-	if (nvlhdrp->nvlh_magic != NVLIST_HEADER_MAGIC) {
-		RESTORE_ERRNO(EINVAL);
+	if (nve->nve_error != 0)
 		return (false);
-	}
-	if ((nvlhdrp->nvlh_flags & ~NV_FLAG_ALL_MASK) != 0) {
-		RESTORE_ERRNO(EINVAL);
+	*namesizep = strlen(name) + 1;
+	if (*namesizep > NV_NAME_MAX) {
+		nve->nve_error = ENAMETOOLONG;
 		return (false);
 	}
-#if BYTE_ORDER == BIG_ENDIAN
-	if ((nvlhdrp->nvlh_flags & NV_FLAG_BIG_ENDIAN) == 0) {
-		nvlhdrp->nvlh_size = le64toh(nvlhdrp->nvlh_size);
-		nvlhdrp->nvlh_descriptors = le64toh(nvlhdrp->nvlh_descriptors);
-	}
-#else
-	if ((nvlhdrp->nvlh_flags & NV_FLAG_BIG_ENDIAN) != 0) {
-		nvlhdrp->nvlh_size = be64toh(nvlhdrp->nvlh_size);
-		nvlhdrp->nvlh_descriptors = be64toh(nvlhdrp->nvlh_descriptors);
-	}
-#endif
 	return (true);
 }
 
-const unsigned char *
-nvlist_unpack_header(nvlist_t *nvl, const unsigned char *ptr, size_t nfds,
-    bool *isbep, size_t *leftp)
+void
+nvlist_encode_begin(nvlist_encoder_t *nve, int type, const char *name,
+    int nvltype)
 {
-	struct nvlist_header nvlhdr;
+	unsigned char *nvphdr;
+	size_t namesize;
 
-	if (*leftp < sizeof(nvlhdr)) PJDLOG_ABORT("nvlist buffer too small (length=%zu) to contain nvlist_header", *leftp);
+	PJDLOG_ASSERT(type == NV_TYPE_NVLIST ||
+	    type == NV_TYPE_NVLIST_ARRAY || type == NV_TYPE_NVLIST_DICTIONARY);
+	PJDLOG_ASSERT(nvltype == NV_TYPE_NVLIST ||
+	    nvltype == NV_TYPE_NVLIST_ARRAY ||
+	    nvltype == NV_TYPE_NVLIST_DICTIONARY);
 
-	memcpy(&nvlhdr, ptr, sizeof(nvlhdr));
+	if (!nvlist_encode_name(nve, name, &namesize))
+		return;
 
-	if (!nvlist_check_header(&nvlhdr)) PJDLOG_ABORT("%s failed", "nvlist_check_header");
+	nvphdr = nve->nve_ptr;
+	nve->nve_ptr = nvpair_pack_raw_header(type, name, namesize,
+	    (uint64_t)(uintptr_t)nve->nve_open, nve->nve_ptr, &nve->nve_left);
+	nve->nve_ptr = nvlist_pack_raw_header(nvltype, 0, 0, nve->nve_ptr,
+	    &nve->nve_left);
+	nve->nve_open = nvphdr;
+}
 
-	if (nvlhdr.nvlh_size != *leftp - sizeof(nvlhdr)) PJDLOG_ABORT("nvlhdr.nvlh_size (%llu) different than message size (%lu)", nvlhdr.nvlh_size, *leftp - sizeof(nvlhdr));
+void
+nvlist_encode_end(nvlist_encoder_t *nve)
+{
+	unsigned char *nvphdr;
+	uint64_t link;
+	size_t namesize;
+	int type;
 
-	/*
-	 * nvlh_descriptors might be smaller than nfds in embedded nvlists.
-	 */
-	if (nvlhdr.nvlh_descriptors > nfds) PJDLOG_ABORT("nvlhdr.nvlh_descriptors (%llu) <= nfds (%zu)", nvlhdr.nvlh_descriptors, nfds);
+	if (nve->nve_error != 0)
+		return;
 
-	if ((nvlhdr.nvlh_flags & ~NV_FLAG_ALL_MASK) != 0) PJDLOG_ABORT("Invalid nvlh_flags %d", nvlhdr.nvlh_flags);
+	nvphdr = nve->nve_open;
+	PJDLOG_ASSERT(nvphdr != NULL);
+	nvpair_peek_header(BYTE_ORDER == BIG_ENDIAN, nvphdr, &type, &namesize,
+	    &link);
+	nve->nve_open = (unsigned char *)(uintptr_t)link;
+	nvpair_pack_datasize(nvphdr, nve->nve_ptr -
+	    (nvphdr + nvpair_header_size() + namesize));
+	nve->nve_ptr = nvpair_pack_nvlist_up(nve->nve_ptr, &nve->nve_left);
+}
 
-	nvl->nvl_flags = (nvlhdr.nvlh_flags & NV_FLAG_PUBLIC_MASK);
+void *
+nvlist_encode_pair(nvlist_encoder_t *nve, int type, const char *name,
+    size_t datasize)
+{
+	unsigned char *data;
+	size_t namesize;
 
-	ptr += sizeof(nvlhdr);
-	if (isbep != NULL)
-		*isbep = (((int)nvlhdr.nvlh_flags & NV_FLAG_BIG_ENDIAN) != 0);
-	*leftp -= sizeof(nvlhdr);
+	PJDLOG_ASSERT(type > NV_TYPE_NONE && type <= NV_TYPE_STRING_ARRAY &&
+	    type != NV_TYPE_DESCRIPTOR && type != NV_TYPE_NVLIST &&
+	    type != NV_TYPE_NVLIST_ARRAY && type != NV_TYPE_NVLIST_DICTIONARY);
 
-	nvl->nvl_type = nvlhdr.nvlh_type;
-	return (ptr);
+	if (!nvlist_encode_name(nve, name, &namesize))
+		return (NULL);
+	/* Like nvlist_add, refuse what nvlist_unpack() would refuse. */
+	if (datasize == 0 && (type == NV_TYPE_BINARY ||
+	    type == NV_TYPE_BOOL_ARRAY || type == NV_TYPE_INT64_ARRAY ||
+	    type == NV_TYPE_UINT64_ARRAY || type == NV_TYPE_STRING_ARRAY)) {
+		nve->nve_error = EINVAL;
+		return (NULL);
+	}
+
+	data = nvpair_pack_raw_header(type, name, namesize, datasize,
+	    nve->nve_ptr, &nve->nve_left);
+	PJDLOG_ASSERT(nve->nve_left >= datasize);
+	nve->nve_ptr = data + datasize;
+	nve->nve_left -= datasize;
+
+	return (data);
 }
 
-nvlist_t *
-nvlist_xunpack(const void *buf, size_t size, const int *fds, size_t nfds)
+void
+nvlist_encode_bool(nvlist_encoder_t *nve, const char *name, bool value)
 {
-	const unsigned char *ptr;
-	nvlist_t *nvl, *retnvl, *tmpnvl;
-	nvpair_t *nvp;
-	size_t left;
-	bool isbe;
+	unsigned char *data;
 
-	left = size;
-	ptr = buf;
+	data = nvlist_encode_pair(nve, NV_TYPE_BOOL, name, sizeof(uint8_t));
+	if (data != NULL)
+		*data = value ? 1 : 0;
+}
 
-	tmpnvl = NULL;
-	nvl = retnvl = nvlist_create(0);
-	if (nvl == NULL) PJDLOG_ABORT("nvlist_create returned %s", "NULL");
+void
+nvlist_encode_number(nvlist_encoder_t *nve, int type, const char *name,
+    uint64_t value)
+{
+	unsigned char *data;
 
-	ptr = nvlist_unpack_header(nvl, ptr, nfds, &isbe, &left);
-	if (ptr == NULL) PJDLOG_ABORT("Could not unpack nvlist header: (isbe=%s, left=%zu)", isbe ? "true" : "false", left);
+	data = nvlist_encode_pair(nve, type, name, sizeof(value));
+	if (data != NULL)
+		memcpy(data, &value, sizeof(value));
+}
+
+void
+nvlist_encode_string(nvlist_encoder_t *nve, const char *name,
+    const char *value)
+{
+
+	nvlist_encode_binary(nve, NV_TYPE_STRING, name, value,
+	    strlen(value) + 1);
+}
+
+void
+nvlist_encode_binary(nvlist_encoder_t *nve, int type, const char *name,
+    const void *value, size_t size)
+{
+	unsigned char *data;
+
+	data = nvlist_encode_pair(nve, type, name, size);
+	if (data != NULL)
+		memcpy(data, value, size);
+}
+
+int
+nvlist_encode_finish(nvlist_encoder_t *nve)
+{
+
+	if (nve->nve_error == 0) {
+		PJDLOG_ASSERT(nve->nve_open == NULL);
+		PJDLOG_ASSERT(nve->nve_left == 0);
+	}
+	return (nve->nve_error);
+}
+
+/*
+ * The compact (version 1) encoding.  After the usual header comes a table
+ * of every distinct name in the tree, as a varint count followed by varint
+ * length prefixed, NUL-terminated names.  Then the pairs follow, each one
+ * as its type byte, the varint index of its name (left out for elements of
+ * an array), and its value: nothing for NULL, the version 0 bytes for
+ * fixed size values, a varint length and the version 0 bytes for strings,
+ * binaries and typed arrays, or the flags byte of a nested list followed by
+ * its pairs and an NV_TYPE_NVLIST_UP byte.  Like in version 0, numbers are
+ * in the byte order given by the header.
+ */
+#define	NVLIST_VARINT_MAX	10
+
+static size_t
+nvlist_varint_size(uint64_t value)
+{
+	size_t size;
+
+	for (size = 1; value >= 0x80; size++)
+		value >>= 7;
+	return (size);
+}
+
+static unsigned char *
+nvlist_varint_put(unsigned char *ptr, uint64_t value, size_t *leftp)
+{
+
+	PJDLOG_ASSERT(*leftp >= nvlist_varint_size(value));
+	while (value >= 0x80) {
+		*ptr++ = (unsigned char)(value | 0x80);
+		value >>= 7;
+		(*leftp)--;
+	}
+	*ptr++ = (unsigned char)value;
+	(*leftp)--;
+
+	return (ptr);
+}
+
+static const unsigned char *
+nvlist_varint_get(const unsigned char *ptr, size_t *leftp, uint64_t *valuep)
+{
+	uint64_t value;
+	size_t ii;
+
+	value = 0;
+	for (ii = 0; ii < *leftp && ii < NVLIST_VARINT_MAX; ii++) {
+		value |= (uint64_t)(ptr[ii] & 0x7f) << (7 * ii);
+		if ((ptr[ii] & 0x80) == 0) {
+			/* The last byte only has room for the top bit. */
+			if (ii == NVLIST_VARINT_MAX - 1 && ptr[ii] > 1)
+				break;
+			*leftp -= ii + 1;
+			*valuep = value;
+			return (ptr + ii + 1);
+		}
+	}
+
+	RESTORE_ERRNO(EINVAL);
+	return (NULL);
+}
+
+/*
+ * The name table being built for a compact list: names in order of first
+ * use, indexed by an open addressing table of name indices plus one.
+ */
+struct nvlist_keytab {
+	const char	**nvk_names;
+	size_t		 *nvk_slots;
+	size_t		  nvk_nslots;
+	size_t		  nvk_count;
+	size_t		  nvk_size;	/* Packed size of the table. */
+};
+
+static bool
+nvlist_keytab_grow(struct nvlist_keytab *keytab)
+{
+	const char **names;
+	size_t *slots;
+	size_t ii, idx, mask, nslots;
+
+	nslots = keytab->nvk_nslots == 0 ? 64 : keytab->nvk_nslots * 2;
+	names = nv_realloc(keytab->nvk_names, nslots / 2 * sizeof(names[0]));
+	if (names == NULL)
+		return (false);
+	keytab->nvk_names = names;
+	slots = nv_calloc(nslots, sizeof(slots[0]));
+	if (slots == NULL)
+		return (false);
+
+	mask = nslots - 1;
+	for (ii = 0; ii < keytab->nvk_count; ii++) {
+		idx = nvlist_hash_name(names[ii]) & mask;
+		while (slots[idx] != 0)
+			idx = (idx + 1) & mask;
+		slots[idx] = ii + 1;
+	}
+	nv_free(keytab->nvk_slots);
+	keytab->nvk_slots = slots;
+	keytab->nvk_nslots = nslots;
+
+	return (true);
+}
+
+/*
+ * Return the index of name, adding it to the table if add is set.
+ */
+static size_t
+nvlist_keytab_index(struct nvlist_keytab *keytab, const char *name, bool add)
+{
+	size_t idx, mask, len;
+
+	if (add && (keytab->nvk_count + 1) * 2 > keytab->nvk_nslots) {
+		if (!nvlist_keytab_grow(keytab))
+			return (SIZE_MAX);
+	}
+
+	mask = keytab->nvk_nslots - 1;
+	for (idx = nvlist_hash_name(name) & mask;
+	    keytab->nvk_slots[idx] != 0; idx = (idx + 1) & mask) {
+		if (strcmp(keytab->nvk_names[keytab->nvk_slots[idx] - 1],
+		    name) == 0) {
+			return (keytab->nvk_slots[idx] - 1);
+		}
+	}
+	PJDLOG_ASSERT(add);
+
+	len = strlen(name) + 1;
+	keytab->nvk_size += nvlist_varint_size(len) + len;
+	keytab->nvk_names[keytab->nvk_count] = name;
+	keytab->nvk_slots[idx] = keytab->nvk_count + 1;
+	return (keytab->nvk_count++);
+}
+
+static bool
+nvlist_compact_named(const nvlist_t *nvl)
+{
+
+	return (nvl->nvl_type != NV_TYPE_NVLIST_ARRAY);
+}
+
+/*
+ * Collect the names of the tree into keytab and return the packed size of
+ * the pairs, or 0 if the table could not be allocated.
+ */
+static size_t
+nvlist_compact_size(const nvlist_t *nvl, struct nvlist_keytab *keytab)
+{
+	struct nvlist_walk walk;
+	const nvlist_t *tmpnvl;
+	nvpair_t *nvp, *tmpnvp;
+	size_t idx, nup, size;
+
+	nvlist_walk_init(&walk, nvl);
+	size = 0;
+	nvp = nvlist_first_nvpair(nvl);
+	while (nvp != NULL) {
+		size++;
+		if (nvlist_compact_named(nvl)) {
+			idx = nvlist_keytab_index(keytab, nvpair_name(nvp),
+			    true);
+			if (idx == SIZE_MAX)
+				return (0);
+			size += nvlist_varint_size(idx);
+		}
+		switch (nvpair_type(nvp)) {
+		case NV_TYPE_NVLIST:
+		case NV_TYPE_NVLIST_ARRAY:
+		case NV_TYPE_NVLIST_DICTIONARY:
+			/* The flags byte and the terminator. */
+			size += 2;
+			tmpnvl = nvpair_get_nvlist(nvp);
+			tmpnvp = nvlist_first_nvpair(tmpnvl);
+			if (tmpnvp != NULL) {
+				nvlist_walk_enter(&walk, nvp, tmpnvl);
+				nvl = tmpnvl;
+				nvp = tmpnvp;
+				continue;
+			}
+			break;
+		case NV_TYPE_STRING:
+		case NV_TYPE_BINARY:
+		case NV_TYPE_BOOL_ARRAY:
+		case NV_TYPE_INT64_ARRAY:
+		case NV_TYPE_UINT64_ARRAY:
+		case NV_TYPE_STRING_ARRAY:
+			size += nvlist_varint_size(nvpair_size(nvp));
+			/* FALLTHROUGH */
+		default:
+			size += nvpair_size(nvp);
+			break;
+		}
+		nvp = nvlist_pack_next(&walk, &nvl, nvp, &nup);
+	}
+
+	return (size);
+}
+
+static void *
+nvlist_pack_compact(const nvlist_t *nvl, size_t *sizep)
+{
+	struct nvlist_keytab keytab;
+	struct nvlist_walk walk;
+	const nvlist_t *tmpnvl;
+	unsigned char *buf, *ptr;
+	nvpair_t *nvp, *tmpnvp;
+	size_t ii, len, left, size, nup;
+
+	memset(&keytab, 0, sizeof(keytab));
+	buf = NULL;
+
+	nvlist_walk_init(&walk, nvl);
+	size = nvlist_compact_size(nvl, &keytab);
+	if (size == 0 && !nvlist_empty(nvl))
+		goto out;
+	size += sizeof(struct nvlist_header);
+	size += nvlist_varint_size(keytab.nvk_count) + keytab.nvk_size;
+
+	buf = nv_malloc(size);
+	if (buf == NULL)
+		goto out;
+
+	left = size;
+	ptr = nvlist_pack_header(nvl, buf, &left);
+	((struct nvlist_header *)buf)->nvlh_version =
+	    NVLIST_HEADER_VERSION_COMPACT;
+
+	ptr = nvlist_varint_put(ptr, keytab.nvk_count, &left);
+	for (ii = 0; ii < keytab.nvk_count; ii++) {
+		len = strlen(keytab.nvk_names[ii]) + 1;
+		ptr = nvlist_varint_put(ptr, len, &left);
+		PJDLOG_ASSERT(left >= len);
+		memcpy(ptr, keytab.nvk_names[ii], len);
+		ptr += len;
+		left -= len;
+	}
+
+	nvp = nvlist_first_nvpair(nvl);
+	while (nvp != NULL) {
+		PJDLOG_ASSERT(left > 0);
+		*ptr++ = (unsigned char)nvpair_type(nvp);
+		left--;
+		if (nvlist_compact_named(nvl)) {
+			ptr = nvlist_varint_put(ptr,
+			    nvlist_keytab_index(&keytab, nvpair_name(nvp),
+			    false), &left);
+		}
+		switch (nvpair_type(nvp)) {
+		case NV_TYPE_NVLIST:
+		case NV_TYPE_NVLIST_ARRAY:
+		case NV_TYPE_NVLIST_DICTIONARY:
+			tmpnvl = nvpair_get_nvlist(nvp);
+			PJDLOG_ASSERT(left > 0);
+			*ptr++ = (unsigned char)(tmpnvl->nvl_flags &
+			    NV_FLAG_PUBLIC_MASK);
+			left--;
+			tmpnvp = nvlist_first_nvpair(tmpnvl);
+			if (tmpnvp != NULL) {
+				nvlist_walk_enter(&walk, nvp, tmpnvl);
+				nvl = tmpnvl;
+				nvp = tmpnvp;
+				continue;
+			}
+			PJDLOG_ASSERT(left > 0);
+			*ptr++ = NV_TYPE_NVLIST_UP;
+			left--;
+			break;
+		case NV_TYPE_STRING:
+		case NV_TYPE_BINARY:
+		case NV_TYPE_BOOL_ARRAY:
+		case NV_TYPE_INT64_ARRAY:
+		case NV_TYPE_UINT64_ARRAY:
+		case NV_TYPE_STRING_ARRAY:
+			ptr = nvlist_varint_put(ptr, nvpair_size(nvp), &left);
+			/* FALLTHROUGH */
+		default:
+			ptr = nvlist_pack_value(nvp, ptr, NULL, &left);
+			break;
+		}
+		nvp = nvlist_pack_next(&walk, &nvl, nvp, &nup);
+		for (; nup > 0; nup--) {
+			PJDLOG_ASSERT(left > 0);
+			*ptr++ = NV_TYPE_NVLIST_UP;
+			left--;
+		}
+	}
+	PJDLOG_ASSERT(left == 0);
+
+	if (sizep != NULL)
+		*sizep = size;
+out:
+	nv_free(keytab.nvk_names);
+	nv_free(keytab.nvk_slots);
+	return (buf);
+}
+
+void *
+nvlist_pack_flags(const nvlist_t *nvl, size_t *sizep, int flags)
+{
+
+	NVLIST_ASSERT(nvl);
+	PJDLOG_ASSERT((flags & ~NV_PACK_COMPACT) == 0);
+
+	if ((flags & NV_PACK_COMPACT) == 0)
+		return (nvlist_pack(nvl, sizep));
+
+	if (nvl->nvl_error != 0) {
+		RESTORE_ERRNO(nvl->nvl_error);
+		return (NULL);
+	}
+
+	if (nvlist_ndescriptors(nvl) > 0) {
+		RESTORE_ERRNO(EOPNOTSUPP);
+		return (NULL);
+	}
+
+	return (nvlist_pack_compact(nvl, sizep));
+}
+
+#ifndef _KERNEL
+/*
+ * String and binary payloads of at least this many bytes are referenced in
+ * place by nvlist_pack_iov() instead of being copied into its scratch area.
+ */
+#define	NVLIST_IOV_INLINE_MAX	256
+
+static bool
+nvlist_iov_payload(const nvpair_t *nvp, const void **datap, size_t *sizep)
+{
+
+	switch (nvpair_type(nvp)) {
+	case NV_TYPE_STRING:
+	case NV_TYPE_BINARY:
+	case NV_TYPE_INT64_ARRAY:
+	case NV_TYPE_UINT64_ARRAY:
+	case NV_TYPE_STRING_ARRAY:
+		*datap = nvpair_payload(nvp, sizep);
+		return (*sizep >= NVLIST_IOV_INLINE_MAX);
+	default:
+		return (false);
+	}
+}
+
+/*
+ * Pack nvl in scatter-gather form.  Headers, names and small values are
+ * written to a scratch area; large string and binary payloads are
+ * referenced where they live.  The returned array and the scratch area
+ * share one allocation to be released with free(), and the referenced
+ * payloads belong to nvl, which must not be changed or destroyed until the
+ * vector has been consumed.  The iovecs concatenate to exactly what
+ * nvlist_pack() would return.
+ */
+struct iovec *
+nvlist_pack_iov(const nvlist_t *nvl, size_t *iovcntp, size_t *sizep)
+{
+	struct nvlist_walk walk;
+	const nvlist_t *root, *tmpnvl;
+	struct iovec *iov;
+	unsigned char *ptr, *run;
+	nvpair_t *nvp, *tmpnvp;
+	const void *data;
+	size_t left, size, datasize, nrefs, refsize, niov, nup;
+
+	NVLIST_ASSERT(nvl);
+
+	if (nvl->nvl_error != 0) {
+		RESTORE_ERRNO(nvl->nvl_error);
+		return (NULL);
+	}
+
+	if (nvlist_ndescriptors(nvl) > 0) {
+		RESTORE_ERRNO(EOPNOTSUPP);
+		return (NULL);
+	}
+
+	size = nvlist_size(nvl);
+
+	/*
+	 * Count the payloads to reference first, so the vector and the
+	 * scratch area can be allocated at once.  Every reference may split
+	 * a scratch run, hence two iovecs for each plus one.
+	 */
+	root = nvl;
+	nvlist_walk_init(&walk, root);
+	nrefs = refsize = 0;
+	nvp = nvlist_first_nvpair(nvl);
+	while (nvp != NULL) {
+		if (nvlist_iov_payload(nvp, &data, &datasize)) {
+			nrefs++;
+			refsize += datasize;
+		} else if (nvpair_type(nvp) == NV_TYPE_NVLIST ||
+		    nvpair_type(nvp) == NV_TYPE_NVLIST_ARRAY ||
+		    nvpair_type(nvp) == NV_TYPE_NVLIST_DICTIONARY) {
+			tmpnvl = nvpair_get_nvlist(nvp);
+			tmpnvp = nvlist_first_nvpair(tmpnvl);
+			if (tmpnvp != NULL) {
+				nvlist_walk_enter(&walk, nvp, tmpnvl);
+				nvl = tmpnvl;
+				nvp = tmpnvp;
+				continue;
+			}
+		}
+		nvp = nvlist_pack_next(&walk, &nvl, nvp, &nup);
+	}
+
+	iov = nv_malloc(sizeof(iov[0]) * (2 * nrefs + 1) + (size - refsize));
+	if (iov == NULL)
+		return (NULL);
+
+	niov = 0;
+	run = ptr = (unsigned char *)&iov[2 * nrefs + 1];
+	left = size;
+	nvl = root;
+
+	ptr = nvlist_pack_header(nvl, ptr, &left);
+
+	nvp = nvlist_first_nvpair(nvl);
+	while (nvp != NULL) {
+		NVPAIR_ASSERT(nvp);
+
+		nvpair_init_datasize(nvp);
+		ptr = nvpair_pack_header(nvp, ptr, &left);
+		if (nvlist_iov_payload(nvp, &data, &datasize)) {
+			if (ptr > run) {
+				iov[niov].iov_base = run;
+				iov[niov].iov_len = ptr - run;
+				niov++;
+			}
+			iov[niov].iov_base = __DECONST(void *, data);
+			iov[niov].iov_len = datasize;
+			niov++;
+			PJDLOG_ASSERT(left >= datasize);
+			left -= datasize;
+			run = ptr;
+		} else {
+			switch (nvpair_type(nvp)) {
+			case NV_TYPE_NVLIST:
+			case NV_TYPE_NVLIST_ARRAY:
+			case NV_TYPE_NVLIST_DICTIONARY:
+				tmpnvl = nvpair_get_nvlist(nvp);
+				ptr = nvlist_pack_header(tmpnvl, ptr, &left);
+				tmpnvp = nvlist_first_nvpair(tmpnvl);
+				if (tmpnvp != NULL) {
+					nvlist_walk_enter(&walk, nvp, tmpnvl);
+					nvl = tmpnvl;
+					nvp = tmpnvp;
+					continue;
+				}
+				ptr = nvpair_pack_nvlist_up(ptr, &left);
+				break;
+			default:
+				ptr = nvlist_pack_value(nvp, ptr, NULL, &left);
+				break;
+			}
+		}
+		nvp = nvlist_pack_next(&walk, &nvl, nvp, &nup);
+		while (nup-- > 0)
+			ptr = nvpair_pack_nvlist_up(ptr, &left);
+	}
+	if (ptr > run) {
+		iov[niov].iov_base = run;
+		iov[niov].iov_len = ptr - run;
+		niov++;
+	}
+	PJDLOG_ASSERT(left == 0);
+
+	*iovcntp = niov;
+	if (sizep != NULL)
+		*sizep = size;
+	return (iov);
+}
+#endif
+
+static bool
+nvlist_check_header(struct nvlist_header *nvlhdrp, int version)
+{
+
+	if (nvlhdrp->nvlh_magic != NVLIST_HEADER_MAGIC ||
+	    nvlhdrp->nvlh_version != version) {
+		RESTORE_ERRNO(EINVAL);
+		return (false);
+	}
+	if ((nvlhdrp->nvlh_flags & ~NV_FLAG_ALL_MASK) != 0) {
+		RESTORE_ERRNO(EINVAL);
+		return (false);
+	}
+#if BYTE_ORDER == BIG_ENDIAN
+	if ((nvlhdrp->nvlh_flags & NV_FLAG_BIG_ENDIAN) == 0) {
+		nvlhdrp->nvlh_size = le64toh(nvlhdrp->nvlh_size);
+		nvlhdrp->nvlh_descriptors = le64toh(nvlhdrp->nvlh_descriptors);
+	}
+#else
+	if ((nvlhdrp->nvlh_flags & NV_FLAG_BIG_ENDIAN) != 0) {
+		nvlhdrp->nvlh_size = be64toh(nvlhdrp->nvlh_size);
+		nvlhdrp->nvlh_descriptors = be64toh(nvlhdrp->nvlh_descriptors);
+	}
+#endif
+	return (true);
+}
+
+const unsigned char *
+nvlist_unpack_header(nvlist_t *nvl, const unsigned char *ptr, size_t nfds,
+    bool *isbep, size_t *leftp)
+{
+	struct nvlist_header nvlhdr;
+
+	if (*leftp < sizeof(nvlhdr))
+		goto failed;
+
+	memcpy(&nvlhdr, ptr, sizeof(nvlhdr));
+
+	if (!nvlist_check_header(&nvlhdr, NVLIST_HEADER_VERSION))
+		goto failed;
+
+	if (nvlhdr.nvlh_size != *leftp - sizeof(nvlhdr))
+		goto failed;
+
+	/*
+	 * nvlh_descriptors might be smaller than nfds in embedded nvlists.
+	 */
+	if (nvlhdr.nvlh_descriptors > nfds)
+		goto failed;
+
+	if ((nvlhdr.nvlh_flags & ~NV_FLAG_ALL_MASK) != 0)
+		goto failed;
+
+	nvl->nvl_flags = (nvlhdr.nvlh_flags & NV_FLAG_PUBLIC_MASK);
+
+	ptr += sizeof(nvlhdr);
+	if (isbep != NULL)
+		*isbep = (((int)nvlhdr.nvlh_flags & NV_FLAG_BIG_ENDIAN) != 0);
+	*leftp -= sizeof(nvlhdr);
+
+	nvl->nvl_type = nvlhdr.nvlh_type;
+	return (ptr);
+failed:
+	RESTORE_ERRNO(EINVAL);
+	return (NULL);
+}
+
+/*
+ * Unpack a list in the compact encoding described above nvlist_varint_size().
+ */
+static nvlist_t *
+nvlist_unpack_compact(const void *buf, size_t size, int flags)
+{
+	struct nvlist_header nvlhdr;
+	const unsigned char *ptr;
+	const char **names;
+	nvlist_t *nvl, *retnvl, *tmpnvl;
+	nvpair_t *nvp;
+	uint64_t value, nnames, datasize;
+	size_t ii, left;
+	char key[24];
+	const char *name;
+	bool isbe;
+	int type;
+
+	names = NULL;
+	retnvl = NULL;
+
+	if (size < sizeof(nvlhdr))
+		goto failed;
+	memcpy(&nvlhdr, buf, sizeof(nvlhdr));
+	if (!nvlist_check_header(&nvlhdr, NVLIST_HEADER_VERSION_COMPACT))
+		goto failed;
+	if (nvlhdr.nvlh_size != size - sizeof(nvlhdr) ||
+	    nvlhdr.nvlh_descriptors != 0) {
+		goto failed;
+	}
+	isbe = (nvlhdr.nvlh_flags & NV_FLAG_BIG_ENDIAN) != 0;
+	ptr = (const unsigned char *)buf + sizeof(nvlhdr);
+	left = size - sizeof(nvlhdr);
+
+	ptr = nvlist_varint_get(ptr, &left, &nnames);
+	/* Every name takes at least two bytes. */
+	if (ptr == NULL || nnames > left / 2)
+		goto failed;
+	if (nnames > 0) {
+		names = nv_malloc(nnames * sizeof(names[0]));
+		if (names == NULL)
+			goto failed;
+	}
+	for (ii = 0; ii < nnames; ii++) {
+		ptr = nvlist_varint_get(ptr, &left, &value);
+		if (ptr == NULL || value == 0 || value > NV_NAME_MAX ||
+		    value > left) {
+			goto failed;
+		}
+		if (strnlen((const char *)ptr, value) != value - 1)
+			goto failed;
+		names[ii] = (const char *)ptr;
+		ptr += value;
+		left -= value;
+	}
+
+	nvl = retnvl = nvlist_create(nvlhdr.nvlh_flags & NV_FLAG_PUBLIC_MASK);
+	if (nvl == NULL)
+		goto failed;
+	nvl->nvl_type = nvlhdr.nvlh_type;
+
+	while (left > 0) {
+		type = *ptr++;
+		left--;
+		if (type == NV_TYPE_NVLIST_UP) {
+			if (nvl->nvl_parent == NULL)
+				goto failed;
+			nvl = nvpair_nvlist(nvl->nvl_parent);
+			continue;
+		}
+
+		if (nvlist_compact_named(nvl)) {
+			ptr = nvlist_varint_get(ptr, &left, &value);
+			if (ptr == NULL || value >= nnames)
+				goto failed;
+			name = names[value];
+		} else {
+			snprintf(key, sizeof(key), "%zu", nvl->nvl_count);
+			name = key;
+		}
+
+		tmpnvl = NULL;
+		switch (type) {
+		case NV_TYPE_NVLIST:
+		case NV_TYPE_NVLIST_ARRAY:
+		case NV_TYPE_NVLIST_DICTIONARY:
+			if (left == 0 || (*ptr & ~NV_FLAG_PUBLIC_MASK) != 0)
+				goto failed;
+			tmpnvl = nvlist_create(*ptr);
+			if (tmpnvl == NULL)
+				goto failed;
+			tmpnvl->nvl_type = type;
+			ptr++;
+			left--;
+			nvp = nvpair_move_nvlist_type(name, tmpnvl, type);
+			if (nvp == NULL)
+				goto failed;
+			break;
+		case NV_TYPE_NULL:
+		case NV_TYPE_BOOL:
+		case NV_TYPE_NUMBER:
+		case NV_TYPE_PTR:
+		case NV_TYPE_UINT64:
+		case NV_TYPE_INT64:
+		case NV_TYPE_ENDPOINT:
+		case NV_TYPE_DATE:
+		case NV_TYPE_UUID:
+			nvp = nvpair_unpack_compact(type, name, 0);
+			if (nvp == NULL)
+				goto failed;
+			break;
+		case NV_TYPE_STRING:
+		case NV_TYPE_BINARY:
+		case NV_TYPE_BOOL_ARRAY:
+		case NV_TYPE_INT64_ARRAY:
+		case NV_TYPE_UINT64_ARRAY:
+		case NV_TYPE_STRING_ARRAY:
+			ptr = nvlist_varint_get(ptr, &left, &datasize);
+			if (ptr == NULL || datasize > left)
+				goto failed;
+			nvp = nvpair_unpack_compact(type, name, datasize);
+			if (nvp == NULL)
+				goto failed;
+			break;
+		default:
+			/* Compact lists carry no descriptors. */
+			goto failed;
+		}
+
+		switch (type) {
+		case NV_TYPE_NVLIST:
+		case NV_TYPE_NVLIST_ARRAY:
+		case NV_TYPE_NVLIST_DICTIONARY:
+			break;
+		case NV_TYPE_NULL:
+			ptr = nvpair_unpack_null(isbe, nvp, ptr, &left);
+			break;
+		case NV_TYPE_BOOL:
+			ptr = nvpair_unpack_bool(isbe, nvp, ptr, &left);
+			break;
+		case NV_TYPE_STRING:
+			ptr = nvpair_unpack_string(isbe, nvp, ptr, &left);
+			break;
+		case NV_TYPE_BINARY:
+		case NV_TYPE_UUID:
+			ptr = nvpair_unpack_binary(isbe, nvp, ptr, &left);
+			break;
+		case NV_TYPE_BOOL_ARRAY:
+		case NV_TYPE_INT64_ARRAY:
+		case NV_TYPE_UINT64_ARRAY:
+		case NV_TYPE_STRING_ARRAY:
+			ptr = nvpair_unpack_array(isbe, nvp, ptr, &left);
+			break;
+		default:
+			ptr = nvpair_unpack_number(isbe, nvp, ptr, &left);
+			break;
+		}
+		if (ptr == NULL) {
+			nvpair_free_structure(nvp);
+			goto failed;
+		}
+
+		/* Element names of arrays are unique by construction. */
+		if (!nvlist_compact_named(nvl) ||
+		    (flags & NV_UNPACK_TRUSTED) != 0) {
+			nvpair_insert_unique(&nvl->nvl_head, nvp, nvl);
+		} else {
+			nvlist_move_nvpair(nvl, nvp);
+			if (nvlist_error(nvl) != 0)
+				goto failed;
+		}
+		if (tmpnvl != NULL)
+			nvl = tmpnvl;
+	}
+	if (nvl != retnvl)
+		goto failed;
+
+	nv_free(names);
+	return (retnvl);
+failed:
+	if (retnvl != NULL)
+		nvlist_destroy(retnvl);
+	nv_free(names);
+	RESTORE_ERRNO(EINVAL);
+	return (NULL);
+}
+
+/*
+ * Unpack a descriptor-free list in host byte order, which is what local
+ * IPC always produces.  The whole buffer is validated up front by the same
+ * walk nvlist_view_init() does, after which the pairs are decoded without
+ * re-checking bounds, names or values field by field.
+ */
+static nvlist_t *
+nvlist_unpack_native(const void *buf, size_t size, int flags)
+{
+	const unsigned char *ptr;
+	nvlist_t *nvl, *retnvl, *tmpnvl;
+	nvlist_view_t view;
+	nvpair_t *nvp;
+	size_t left;
+
+	if (!nvlist_view_init(&view, buf, size))
+		return (NULL);
+
+	nvl = retnvl = nvlist_create(view.nvv_flags & NV_FLAG_PUBLIC_MASK);
+	if (nvl == NULL)
+		return (NULL);
+	nvl->nvl_type = view.nvv_type;
+
+	ptr = view.nvv_ptr;
+	left = view.nvv_size;
+	while (left > 0) {
+		tmpnvl = NULL;
+		ptr = nvpair_unpack_native(ptr, &left, &nvp, &tmpnvl);
+		if (ptr == NULL)
+			goto failed;
+		if (nvpair_type(nvp) == NV_TYPE_NVLIST_UP) {
+			nvl = nvpair_nvlist(nvl->nvl_parent);
+			nvpair_free_structure(nvp);
+			continue;
+		}
+		if (tmpnvl != NULL)
+			nvlist_set_parent(tmpnvl, nvp);
+		if ((flags & NV_UNPACK_TRUSTED) != 0) {
+			nvpair_insert_unique(&nvl->nvl_head, nvp, nvl);
+		} else {
+			nvlist_move_nvpair(nvl, nvp);
+			/* A duplicate took any nested list down with it. */
+			if (nvl->nvl_error != 0) {
+				RESTORE_ERRNO(nvl->nvl_error);
+				goto failed;
+			}
+		}
+		if (tmpnvl != NULL)
+			nvl = tmpnvl;
+	}
+
+	return (retnvl);
+failed:
+	nvlist_destroy(retnvl);
+	return (NULL);
+}
+
+nvlist_t *
+nvlist_xunpack(const void *buf, size_t size, const int *fds, size_t nfds,
+    int flags)
+{
+	const unsigned char *ptr;
+	nvlist_t *nvl, *retnvl, *tmpnvl;
+	nvpair_t *nvp;
+	size_t left;
+	bool isbe;
+
+	left = size;
+	ptr = buf;
+
+	if (size >= sizeof(struct nvlist_header) &&
+	    ptr[1] == NVLIST_HEADER_VERSION_COMPACT) {
+		if (nfds > 0) {
+			RESTORE_ERRNO(EINVAL);
+			return (NULL);
+		}
+		return (nvlist_unpack_compact(buf, size, flags));
+	}
+
+	/* The third header byte holds the flags. */
+	if (nfds == 0 && size >= sizeof(struct nvlist_header) &&
+	    (ptr[2] & NV_FLAG_BIG_ENDIAN) == NV_FLAG_HOST_ORDER) {
+		return (nvlist_unpack_native(buf, size, flags));
+	}
+
+	tmpnvl = NULL;
+	nvl = retnvl = nvlist_create(0);
+	if (nvl == NULL) PJDLOG_ABORT("nvlist_create returned %s", "NULL");
+
+	ptr = nvlist_unpack_header(nvl, ptr, nfds, &isbe, &left);
+	if (ptr == NULL) PJDLOG_ABORT("Could not unpack nvlist header: (isbe=%s, left=%zu)", isbe ? "true" : "false", left);
+
+	while (left > 0) {
+		ptr = nvpair_unpack(isbe, ptr, &left, &nvp);
+		if (ptr == NULL) PJDLOG_ABORT("Could not unpack nvlist (left=%zu)", left);
+		switch (nvpair_type(nvp)) {
+		case NV_TYPE_NULL:
+			ptr = nvpair_unpack_null(isbe, nvp, ptr, &left);
+			break;
+		case NV_TYPE_BOOL:
+			ptr = nvpair_unpack_bool(isbe, nvp, ptr, &left);
+			break;
+		case NV_TYPE_NUMBER:
+		case NV_TYPE_PTR:
+		case NV_TYPE_UINT64:
+		case NV_TYPE_INT64:
+		case NV_TYPE_ENDPOINT:
+		case NV_TYPE_DATE:
+			ptr = nvpair_unpack_number(isbe, nvp, ptr, &left);
+			break;
+		case NV_TYPE_STRING:
+			ptr = nvpair_unpack_string(isbe, nvp, ptr, &left);
+			break;
+		case NV_TYPE_NVLIST:
+		case NV_TYPE_NVLIST_ARRAY:
+		case NV_TYPE_NVLIST_DICTIONARY:
+			ptr = nvpair_unpack_nvlist(isbe, nvp, ptr, &left, nfds, &tmpnvl);
+			nvlist_set_parent(tmpnvl, nvp);
+			break;
+#ifndef _KERNEL
+		case NV_TYPE_DESCRIPTOR:
+			ptr = nvpair_unpack_descriptor(isbe, nvp, ptr, &left, fds, nfds);
+			break;
+#endif
+		case NV_TYPE_BINARY:
+		case NV_TYPE_UUID:
+			ptr = nvpair_unpack_binary(isbe, nvp, ptr, &left);
+			break;
+		case NV_TYPE_BOOL_ARRAY:
+		case NV_TYPE_INT64_ARRAY:
+		case NV_TYPE_UINT64_ARRAY:
+		case NV_TYPE_STRING_ARRAY:
+			ptr = nvpair_unpack_array(isbe, nvp, ptr, &left);
+			break;
+		case NV_TYPE_NVLIST_UP:
+			if (nvl->nvl_parent == NULL) PJDLOG_ABORT("nvlist_t %p has no parent", nvl);
+			nvl = nvpair_nvlist(nvl->nvl_parent);
+			nvpair_free_structure(nvp);
+			continue;
+		default:
+			PJDLOG_ABORT("Invalid type (%d).", nvpair_type(nvp));
+		}
+		if (ptr == NULL) PJDLOG_ABORT("ptr == NULL (nvp=%p)", nvp);
+		if ((flags & NV_UNPACK_TRUSTED) != 0)
+			nvpair_insert_unique(&nvl->nvl_head, nvp, nvl);
+		else
+			nvlist_move_nvpair(nvl, nvp);
+		if (tmpnvl != NULL) {
+			nvl = tmpnvl;
+			tmpnvl = NULL;
+		}
+	}
+
+	return (retnvl);
+}
+
+nvlist_t *
+nvlist_unpack(const void *buf, size_t size)
+{
+
+	return (nvlist_xunpack(buf, size, NULL, 0, 0));
+}
+
+nvlist_t *
+nvlist_unpack_flags(const void *buf, size_t size, int flags)
+{
+
+	PJDLOG_ASSERT((flags & ~NV_UNPACK_TRUSTED) == 0);
+
+	return (nvlist_xunpack(buf, size, NULL, 0, flags));
+}
+
+/*
+ * Incremental unpacking.  The parser decodes one element at a time: the
+ * root header, then every pair with its name and value, or with the header
+ * of the list it opens.  Elements that arrive whole are decoded straight
+ * from the caller's buffer; only an element split across two feeds is
+ * collected in the staging buffer first.
+ */
+struct nvlist_parser {
+	int		 nvps_flags;
+	int		 nvps_error;
+	bool		 nvps_isbe;
+	bool		 nvps_done;
+	nvlist_t	*nvps_root;
+	nvlist_t	*nvps_nvl;
+	size_t		 nvps_left;
+	unsigned char	*nvps_stage;
+	size_t		 nvps_stagelen;
+	size_t		 nvps_stagesize;
+};
+
+nvlist_parser_t *
+nvlist_parser_create(int flags)
+{
+	nvlist_parser_t *parser;
+
+	PJDLOG_ASSERT((flags & ~NV_UNPACK_TRUSTED) == 0);
+
+	parser = nv_calloc(1, sizeof(*parser));
+	if (parser == NULL)
+		return (NULL);
+	parser->nvps_flags = flags;
+
+	return (parser);
+}
+
+void
+nvlist_parser_destroy(nvlist_parser_t *parser)
+{
+	int serrno;
+
+	if (parser == NULL)
+		return;
+
+	SAVE_ERRNO(serrno);
+	nvlist_destroy(parser->nvps_root);
+	nv_free(parser->nvps_stage);
+	nv_free(parser);
+	RESTORE_ERRNO(serrno);
+}
+
+int
+nvlist_parser_error(const nvlist_parser_t *parser)
+{
+
+	return (parser->nvps_error);
+}
+
+static void
+nvlist_parser_fail(nvlist_parser_t *parser, int error)
+{
+
+	nvlist_destroy(parser->nvps_root);
+	parser->nvps_root = parser->nvps_nvl = NULL;
+	parser->nvps_stagelen = 0;
+	parser->nvps_error = error;
+	RESTORE_ERRNO(error);
+}
+
+/*
+ * Return the size of the element starting at ptr, given the first len
+ * bytes of it, or 0 if the element can never fit in the message.  While
+ * less than a pair header is available, the header size is returned.
+ */
+static size_t
+nvlist_parser_need(const nvlist_parser_t *parser, const unsigned char *ptr,
+    size_t len)
+{
+	uint64_t datasize;
+	size_t need;
+	int type;
+
+	if (parser->nvps_root == NULL)
+		return (sizeof(struct nvlist_header));
+	if (len < nvpair_header_size())
+		return (nvpair_header_size());
+
+	nvpair_peek_header(parser->nvps_isbe, ptr, &type, &need, &datasize);
+	need += nvpair_header_size();
+	switch (type) {
+	case NV_TYPE_NVLIST:
+	case NV_TYPE_NVLIST_ARRAY:
+	case NV_TYPE_NVLIST_DICTIONARY:
+		need += sizeof(struct nvlist_header);
+		break;
+	default:
+		if (datasize > parser->nvps_left)
+			return (0);
+		need += datasize;
+		break;
+	}
+	if (need > parser->nvps_left)
+		return (0);
+
+	return (need);
+}
+
+static bool
+nvlist_parser_root(nvlist_parser_t *parser, const unsigned char *ptr)
+{
+	struct nvlist_header nvlhdr;
+	nvlist_t *nvl;
+
+	memcpy(&nvlhdr, ptr, sizeof(nvlhdr));
+	if (!nvlist_check_header(&nvlhdr, NVLIST_HEADER_VERSION))
+		return (false);
+	if (nvlhdr.nvlh_descriptors != 0) {
+		RESTORE_ERRNO(EOPNOTSUPP);
+		return (false);
+	}
+
+	nvl = nvlist_create(0);
+	if (nvl == NULL)
+		return (false);
+	nvl->nvl_flags = (nvlhdr.nvlh_flags & NV_FLAG_PUBLIC_MASK);
+	nvl->nvl_type = nvlhdr.nvlh_type;
+
+	parser->nvps_root = parser->nvps_nvl = nvl;
+	parser->nvps_isbe = (nvlhdr.nvlh_flags & NV_FLAG_BIG_ENDIAN) != 0;
+	parser->nvps_left = nvlhdr.nvlh_size;
+	return (true);
+}
+
+static bool
+nvlist_parser_pair(nvlist_parser_t *parser, const unsigned char *ptr)
+{
+	nvlist_t *nvl, *tmpnvl;
+	nvpair_t *nvp;
+	size_t left;
+	bool isbe;
+
+	isbe = parser->nvps_isbe;
+	nvl = parser->nvps_nvl;
+	tmpnvl = NULL;
+	left = parser->nvps_left;
+
+	ptr = nvpair_unpack(isbe, ptr, &left, &nvp);
+	if (ptr == NULL)
+		return (false);
+	switch (nvpair_type(nvp)) {
+	case NV_TYPE_NULL:
+		ptr = nvpair_unpack_null(isbe, nvp, ptr, &left);
+		break;
+	case NV_TYPE_BOOL:
+		ptr = nvpair_unpack_bool(isbe, nvp, ptr, &left);
+		break;
+	case NV_TYPE_NUMBER:
+	case NV_TYPE_PTR:
+	case NV_TYPE_UINT64:
+	case NV_TYPE_INT64:
+	case NV_TYPE_ENDPOINT:
+	case NV_TYPE_DATE:
+		ptr = nvpair_unpack_number(isbe, nvp, ptr, &left);
+		break;
+	case NV_TYPE_STRING:
+		ptr = nvpair_unpack_string(isbe, nvp, ptr, &left);
+		break;
+	case NV_TYPE_NVLIST:
+	case NV_TYPE_NVLIST_ARRAY:
+	case NV_TYPE_NVLIST_DICTIONARY:
+		ptr = nvpair_unpack_nvlist(isbe, nvp, ptr, &left, 0, &tmpnvl);
+		if (ptr != NULL)
+			nvlist_set_parent(tmpnvl, nvp);
+		break;
+	case NV_TYPE_BINARY:
+	case NV_TYPE_UUID:
+		ptr = nvpair_unpack_binary(isbe, nvp, ptr, &left);
+		break;
+	case NV_TYPE_BOOL_ARRAY:
+	case NV_TYPE_INT64_ARRAY:
+	case NV_TYPE_UINT64_ARRAY:
+	case NV_TYPE_STRING_ARRAY:
+		ptr = nvpair_unpack_array(isbe, nvp, ptr, &left);
+		break;
+	case NV_TYPE_NVLIST_UP:
+		nvpair_free_structure(nvp);
+		if (nvl->nvl_parent == NULL) {
+			RESTORE_ERRNO(EINVAL);
+			return (false);
+		}
+		parser->nvps_nvl = nvpair_nvlist(nvl->nvl_parent);
+		parser->nvps_left = left;
+		return (true);
+	default:
+		/* Descriptors cannot be carried by a byte stream. */
+		nvpair_free_structure(nvp);
+		RESTORE_ERRNO(EINVAL);
+		return (false);
+	}
+	if (ptr == NULL) {
+		nvpair_free_structure(nvp);
+		return (false);
+	}
+
+	if ((parser->nvps_flags & NV_UNPACK_TRUSTED) != 0)
+		nvpair_insert_unique(&nvl->nvl_head, nvp, nvl);
+	else {
+		nvlist_move_nvpair(nvl, nvp);
+		if (nvlist_error(nvl) != 0)
+			return (false);
+	}
+	if (tmpnvl != NULL)
+		parser->nvps_nvl = tmpnvl;
+	parser->nvps_left = left;
+	return (true);
+}
+
+static bool
+nvlist_parser_element(nvlist_parser_t *parser, const unsigned char *ptr)
+{
+
+	if (parser->nvps_root == NULL) {
+		if (!nvlist_parser_root(parser, ptr))
+			return (false);
+	} else if (!nvlist_parser_pair(parser, ptr))
+		return (false);
+
+	if (parser->nvps_left == 0) {
+		/* Every nested list must have been closed. */
+		if (parser->nvps_nvl != parser->nvps_root) {
+			RESTORE_ERRNO(EINVAL);
+			return (false);
+		}
+		parser->nvps_done = true;
+	}
+	return (true);
+}
+
+/*
+ * Feed the next size bytes of a packed list to the parser.  Returns the
+ * number of bytes consumed, which is less than size only if the list was
+ * completed (see nvlist_parser_take()) or the data was found to be
+ * invalid, in which case nvlist_parser_error() reports why.
+ */
+size_t
+nvlist_parser_feed(nvlist_parser_t *parser, const void *buf, size_t size)
+{
+	const unsigned char *ptr, *elem;
+	unsigned char *stage;
+	size_t used, avail, need, n, stagesize;
+
+	if (parser->nvps_error != 0) {
+		RESTORE_ERRNO(parser->nvps_error);
+		return (0);
+	}
+
+	ptr = buf;
+	used = 0;
+	while (!parser->nvps_done &&
+	    (used < size || parser->nvps_stagelen > 0)) {
+		if (parser->nvps_stagelen > 0) {
+			elem = parser->nvps_stage;
+			avail = parser->nvps_stagelen;
+		} else {
+			elem = ptr + used;
+			avail = size - used;
+		}
+		need = nvlist_parser_need(parser, elem, avail);
+		if (need == 0) {
+			nvlist_parser_fail(parser, EINVAL);
+			break;
+		}
+
+		if (avail >= need) {
+			if (!nvlist_parser_element(parser, elem)) {
+				nvlist_parser_fail(parser, ERRNO_OR_DEFAULT(EINVAL));
+				break;
+			}
+			if (parser->nvps_stagelen > 0)
+				parser->nvps_stagelen = 0;
+			else
+				used += need;
+			continue;
+		}
+
+		/* The element is split; collect it before decoding it. */
+		if (used == size)
+			break;
+		n = MIN(need - parser->nvps_stagelen, size - used);
+		if (parser->nvps_stagelen + n > parser->nvps_stagesize) {
+			/*
+			 * Grow with the data that actually arrived rather
+			 * than to the size the sender claims.
+			 */
+			stagesize = MAX(parser->nvps_stagesize * 2,
+			    parser->nvps_stagelen + n);
+			stagesize = MIN(stagesize, need);
+			stage = nv_realloc(parser->nvps_stage, stagesize);
+			if (stage == NULL) {
+				nvlist_parser_fail(parser, ERRNO_OR_DEFAULT(ENOMEM));
+				break;
+			}
+			parser->nvps_stage = stage;
+			parser->nvps_stagesize = stagesize;
+		}
+		memcpy(parser->nvps_stage + parser->nvps_stagelen, ptr + used, n);
+		parser->nvps_stagelen += n;
+		used += n;
+	}
+
+	return (used);
+}
+
+/*
+ * Return the list completed by the last feed and reset the parser for the
+ * next one, or NULL if the list is not complete yet.
+ */
+nvlist_t *
+nvlist_parser_take(nvlist_parser_t *parser)
+{
+	nvlist_t *nvl;
+
+	if (!parser->nvps_done)
+		return (NULL);
+
+	nvl = parser->nvps_root;
+	parser->nvps_root = parser->nvps_nvl = NULL;
+	parser->nvps_done = false;
+	return (nvl);
+}
+
+/*
+ * Views validate nested lists recursively, so bound the nesting depth to
+ * keep a hostile buffer from exhausting the stack.
+ */
+#define	NVLIST_VIEW_DEPTH_MAX	256
+
+static bool
+nvlist_view_header(nvlist_view_t *view, const unsigned char *ptr, size_t size,
+    size_t bufleft)
+{
+	struct nvlist_header nvlhdr;
+
+	if (size < sizeof(nvlhdr)) {
+		RESTORE_ERRNO(EINVAL);
+		return (false);
+	}
+
+	memcpy(&nvlhdr, ptr, sizeof(nvlhdr));
+	if (!nvlist_check_header(&nvlhdr, NVLIST_HEADER_VERSION))
+		return (false);
+	if (nvlhdr.nvlh_size != bufleft - sizeof(nvlhdr) ||
+	    nvlhdr.nvlh_descriptors != 0) {
+		RESTORE_ERRNO(EINVAL);
+		return (false);
+	}
+
+	view->nvv_ptr = ptr + sizeof(nvlhdr);
+	view->nvv_size = size - sizeof(nvlhdr);
+	view->nvv_type = nvlhdr.nvlh_type;
+	view->nvv_flags = nvlhdr.nvlh_flags;
+	return (true);
+}
+
+static bool
+nvlist_view_name_equal(const nvlist_view_t *view, const char *name1,
+    const char *name2)
+{
+
+	if ((view->nvv_flags & NV_FLAG_IGNORE_CASE) != 0)
+		return (strcasecmp(name1, name2) == 0);
+	return (strcmp(name1, name2) == 0);
+}
+
+static bool
+nvlist_view_validate(const nvlist_view_t *view, const unsigned char *end,
+    unsigned int depth)
+{
+	const unsigned char *ptr;
+	nvlist_view_t child;
+	nvpair_view_t nvpv;
+	size_t left;
+	bool isbe;
+
+	isbe = (view->nvv_flags & NV_FLAG_BIG_ENDIAN) != 0;
+	ptr = view->nvv_ptr;
+	left = view->nvv_size;
+	while (left > 0) {
+		ptr = nvpair_view_unpack(isbe, ptr, &left, &nvpv);
+		if (ptr == NULL)
+			return (false);
+		switch (nvpv.nvpv_type) {
+		case NV_TYPE_NVLIST:
+		case NV_TYPE_NVLIST_ARRAY:
+		case NV_TYPE_NVLIST_DICTIONARY:
+			if (depth >= NVLIST_VIEW_DEPTH_MAX) {
+				RESTORE_ERRNO(EINVAL);
+				return (false);
+			}
+			if (!nvlist_view_header(&child, nvpv.nvpv_data,
+			    nvpv.nvpv_datasize, end - nvpv.nvpv_data)) {
+				return (false);
+			}
+			if (((child.nvv_flags ^ view->nvv_flags) &
+			    NV_FLAG_BIG_ENDIAN) != 0) {
+				RESTORE_ERRNO(EINVAL);
+				return (false);
+			}
+			if (!nvlist_view_validate(&child, end, depth + 1))
+				return (false);
+			/* Every nested list is followed by an up marker. */
+			ptr = nvpair_view_unpack(isbe, ptr, &left, &nvpv);
+			if (ptr == NULL)
+				return (false);
+			if (nvpv.nvpv_type != NV_TYPE_NVLIST_UP) {
+				RESTORE_ERRNO(EINVAL);
+				return (false);
+			}
+			break;
+		case NV_TYPE_NVLIST_UP:
+			RESTORE_ERRNO(EINVAL);
+			return (false);
+		}
+	}
+
+	return (true);
+}
+
+bool
+nvlist_view_init(nvlist_view_t *view, const void *buf, size_t size)
+{
+
+	if (buf == NULL) {
+		RESTORE_ERRNO(EINVAL);
+		return (false);
+	}
+
+	if (!nvlist_view_header(view, buf, size, size))
+		return (false);
+
+	return (nvlist_view_validate(view, (const unsigned char *)buf + size,
+	    0));
+}
+
+int
+nvlist_view_type(const nvlist_view_t *view)
+{
+
+	return (view->nvv_type);
+}
+
+int
+nvlist_view_flags(const nvlist_view_t *view)
+{
+
+	return (view->nvv_flags & NV_FLAG_PUBLIC_MASK);
+}
+
+bool
+nvlist_view_empty(const nvlist_view_t *view)
+{
+
+	return (view->nvv_size == 0);
+}
+
+bool
+nvlist_view_next(const nvlist_view_t *view, nvpair_view_t *nvpv,
+    void **cookiep)
+{
+	const unsigned char *ptr;
+
+	PJDLOG_ASSERT(cookiep != NULL);
+
+	if (*cookiep == NULL)
+		ptr = view->nvv_ptr;
+	else
+		ptr = *cookiep;
+	if (ptr == view->nvv_ptr + view->nvv_size)
+		return (false);
+
+	ptr = nvpair_view_header((view->nvv_flags & NV_FLAG_BIG_ENDIAN) != 0,
+	    ptr, nvpv);
+	switch (nvpv->nvpv_type) {
+	case NV_TYPE_NVLIST:
+	case NV_TYPE_NVLIST_ARRAY:
+	case NV_TYPE_NVLIST_DICTIONARY:
+		/* Skip the up marker: a header and an empty name. */
+		ptr += nvpair_header_size() + 1;
+		break;
+	}
+	*cookiep = __DECONST(unsigned char *, ptr);
+
+	return (true);
+}
+
+bool
+nvlist_view_find(const nvlist_view_t *view, const char *name, int type,
+    nvpair_view_t *nvpv)
+{
+	void *cookie;
+
+	cookie = NULL;
+	while (nvlist_view_next(view, nvpv, &cookie)) {
+		if (type != NV_TYPE_NONE && nvpv->nvpv_type != type)
+			continue;
+		if (nvlist_view_name_equal(view, nvpv->nvpv_name, name))
+			return (true);
+	}
+
+	RESTORE_ERRNO(ENOENT);
+	return (false);
+}
+
+bool
+nvlist_view_exists(const nvlist_view_t *view, const char *name)
+{
+	nvpair_view_t nvpv;
+
+	return (nvlist_view_find(view, name, NV_TYPE_NONE, &nvpv));
+}
+
+bool
+nvlist_view_exists_type(const nvlist_view_t *view, const char *name,
+    int type)
+{
+	nvpair_view_t nvpv;
+
+	return (nvlist_view_find(view, name, type, &nvpv));
+}
+
+static void
+nvlist_view_get_pair(const nvlist_view_t *view, const char *name, int type,
+    nvpair_view_t *nvpv)
+{
+
+	if (!nvlist_view_find(view, name, type, nvpv))
+		nvlist_report_missing(type, name);
+}
+
+bool
+nvlist_view_get_bool(const nvlist_view_t *view, const char *name)
+{
+	nvpair_view_t nvpv;
+
+	nvlist_view_get_pair(view, name, NV_TYPE_BOOL, &nvpv);
+	return (nvpair_view_get_bool(&nvpv));
+}
+
+uint64_t
+nvlist_view_get_number(const nvlist_view_t *view, const char *name)
+{
+	nvpair_view_t nvpv;
+
+	nvlist_view_get_pair(view, name, NV_TYPE_NUMBER, &nvpv);
+	return (nvpair_view_get_number(&nvpv));
+}
+
+int64_t
+nvlist_view_get_int64(const nvlist_view_t *view, const char *name)
+{
+	nvpair_view_t nvpv;
+
+	nvlist_view_get_pair(view, name, NV_TYPE_INT64, &nvpv);
+	return ((int64_t)nvpair_view_get_number(&nvpv));
+}
+
+uint64_t
+nvlist_view_get_uint64(const nvlist_view_t *view, const char *name)
+{
+	nvpair_view_t nvpv;
+
+	nvlist_view_get_pair(view, name, NV_TYPE_UINT64, &nvpv);
+	return (nvpair_view_get_number(&nvpv));
+}
+
+const char *
+nvlist_view_get_string(const nvlist_view_t *view, const char *name)
+{
+	nvpair_view_t nvpv;
+
+	nvlist_view_get_pair(view, name, NV_TYPE_STRING, &nvpv);
+	return (nvpair_view_get_string(&nvpv));
+}
+
+const void *
+nvlist_view_get_binary(const nvlist_view_t *view, const char *name,
+    size_t *sizep)
+{
+	nvpair_view_t nvpv;
+
+	nvlist_view_get_pair(view, name, NV_TYPE_BINARY, &nvpv);
+	return (nvpair_view_get_binary(&nvpv, sizep));
+}
+
+const uuid_t *
+nvlist_view_get_uuid(const nvlist_view_t *view, const char *name)
+{
+	nvpair_view_t nvpv;
+
+	nvlist_view_get_pair(view, name, NV_TYPE_UUID, &nvpv);
+	return (nvpair_view_get_uuid(&nvpv));
+}
+
+void
+nvlist_view_get_nvlist(const nvlist_view_t *view, const char *name,
+    nvlist_view_t *child)
+{
+	nvpair_view_t nvpv;
+	void *cookie;
 
-	while (left > 0) {
-		ptr = nvpair_unpack(isbe, ptr, &left, &nvp);
-		if (ptr == NULL) PJDLOG_ABORT("Could not unpack nvlist (left=%zu)", left);
-		switch (nvpair_type(nvp)) {
-		case NV_TYPE_NULL:
-			ptr = nvpair_unpack_null(isbe, nvp, ptr, &left);
-			break;
-		case NV_TYPE_BOOL:
-			ptr = nvpair_unpack_bool(isbe, nvp, ptr, &left);
-			break;
-		case NV_TYPE_NUMBER:
-		case NV_TYPE_PTR:
-		case NV_TYPE_UINT64:
-		case NV_TYPE_INT64:
-		case NV_TYPE_ENDPOINT:
-			ptr = nvpair_unpack_number(isbe, nvp, ptr, &left);
-			break;
-		case NV_TYPE_STRING:
-			ptr = nvpair_unpack_string(isbe, nvp, ptr, &left);
-			break;
+	cookie = NULL;
+	while (nvlist_view_next(view, &nvpv, &cookie)) {
+		switch (nvpv.nvpv_type) {
 		case NV_TYPE_NVLIST:
 		case NV_TYPE_NVLIST_ARRAY:
 		case NV_TYPE_NVLIST_DICTIONARY:
-			ptr = nvpair_unpack_nvlist(isbe, nvp, ptr, &left, nfds, &tmpnvl);
-			nvlist_set_parent(tmpnvl, nvp);
-			break;
-#ifndef _KERNEL
-		case NV_TYPE_DESCRIPTOR:
-			ptr = nvpair_unpack_descriptor(isbe, nvp, ptr, &left, fds, nfds);
-			break;
-#endif
-		case NV_TYPE_BINARY:
-		case NV_TYPE_UUID:
-			ptr = nvpair_unpack_binary(isbe, nvp, ptr, &left);
 			break;
-		case NV_TYPE_NVLIST_UP:
-			if (nvl->nvl_parent == NULL) PJDLOG_ABORT("nvlist_t %p has no parent", nvl);
-			nvl = nvpair_nvlist(nvl->nvl_parent);
-			continue;
 		default:
-			PJDLOG_ABORT("Invalid type (%d).", nvpair_type(nvp));
+			continue;
 		}
-		if (ptr == NULL) PJDLOG_ABORT("ptr == NULL (nvp=%p)", nvp);
-		nvlist_move_nvpair(nvl, nvp);
-		if (tmpnvl != NULL) {
-			nvl = tmpnvl;
-			tmpnvl = NULL;
+		if (nvlist_view_name_equal(view, nvpv.nvpv_name, name)) {
+			nvpair_view_get_nvlist(&nvpv, child);
+			return;
 		}
 	}
 
-	return (retnvl);
+	nvlist_report_missing(NV_TYPE_NVLIST, name);
 }
 
-nvlist_t *
-nvlist_unpack(const void *buf, size_t size)
+void
+nvpair_view_get_nvlist(const nvpair_view_t *nvpv, nvlist_view_t *child)
 {
+	struct nvlist_header nvlhdr;
+
+	PJDLOG_ASSERT(nvpv->nvpv_type == NV_TYPE_NVLIST ||
+	    nvpv->nvpv_type == NV_TYPE_NVLIST_ARRAY ||
+	    nvpv->nvpv_type == NV_TYPE_NVLIST_DICTIONARY);
 
-	return (nvlist_xunpack(buf, size, NULL, 0));
+	/* Only the flags and type are needed, both are single bytes. */
+	memcpy(&nvlhdr, nvpv->nvpv_data, sizeof(nvlhdr));
+	child->nvv_ptr = nvpv->nvpv_data + sizeof(nvlhdr);
+	child->nvv_size = nvpv->nvpv_datasize - sizeof(nvlhdr);
+	child->nvv_type = nvlhdr.nvlh_type;
+	child->nvv_flags = nvlhdr.nvlh_flags;
 }
 
 nvpair_t *
@@ -1076,6 +3348,10 @@ NVLIST_EXISTS(descriptor, DESCRIPTOR)
 #endif
 NVLIST_EXISTS(binary, BINARY)
 NVLIST_EXISTS(uuid, UUID)
+NVLIST_EXISTS(bool_array, BOOL_ARRAY)
+NVLIST_EXISTS(int64_array, INT64_ARRAY)
+NVLIST_EXISTS(uint64_array, UINT64_ARRAY)
+NVLIST_EXISTS(string_array, STRING_ARRAY)
 
 #undef	NVLIST_EXISTS
 
@@ -1198,67 +3474,137 @@ nvlist_add_nvpair(nvlist_t *nvl, const nvpair_t *nvp)
 	nvpair_insert(&nvl->nvl_head, newnvp, nvl);
 }
 
+/*
+ * Insert a pair made by one of the nvpair_create_*() or nvpair_move_*()
+ * functions, recording the error if it couldn't be made.  The plain add and
+ * move functions use this so that names which are already strings don't
+ * go through the printf machinery of the f/v variants.
+ */
+static void
+nvlist_insert_created(nvlist_t *nvl, nvpair_t *nvp)
+{
+
+	if (nvp == NULL) {
+		nvl->nvl_error = ERRNO_OR_DEFAULT(ENOMEM);
+		RESTORE_ERRNO(nvl->nvl_error);
+	} else
+		nvlist_move_nvpair(nvl, nvp);
+}
+
 void
 nvlist_add_null(nvlist_t *nvl, const char *name)
 {
 
-	nvlist_addf_null(nvl, "%s", name);
+	if (nvlist_error(nvl) != 0) {
+		RESTORE_ERRNO(nvlist_error(nvl));
+		return;
+	}
+
+	nvlist_insert_created(nvl, nvpair_create_null_in(nvl->nvl_arena, name));
 }
 
 void
 nvlist_add_bool(nvlist_t *nvl, const char *name, bool value)
 {
 
-	nvlist_addf_bool(nvl, value, "%s", name);
+	if (nvlist_error(nvl) != 0) {
+		RESTORE_ERRNO(nvlist_error(nvl));
+		return;
+	}
+
+	nvlist_insert_created(nvl,
+	    nvpair_create_bool_in(nvl->nvl_arena, name, value));
 }
 
 void
 nvlist_add_number(nvlist_t *nvl, const char *name, uint64_t value)
 {
 
-	nvlist_addf_number(nvl, value, "%s", name);
+	if (nvlist_error(nvl) != 0) {
+		RESTORE_ERRNO(nvlist_error(nvl));
+		return;
+	}
+
+	nvlist_insert_created(nvl, nvpair_create_number_type_in(nvl->nvl_arena,
+	    name, value, NV_TYPE_NUMBER));
 }
 
 void
 nvlist_add_ptr(nvlist_t *nvl, const char *name, uintptr_t value)
 {
 
-	nvlist_addf_ptr(nvl, value, "%s", name);
+	if (nvlist_error(nvl) != 0) {
+		RESTORE_ERRNO(nvlist_error(nvl));
+		return;
+	}
+
+	nvlist_insert_created(nvl, nvpair_create_number_type_in(nvl->nvl_arena,
+	    name, value, NV_TYPE_PTR));
 }
 
 void
 nvlist_add_uint64(nvlist_t *nvl, const char *name, uint64_t value)
 {
 
-	nvlist_addf_uint64(nvl, value, "%s", name);
+	if (nvlist_error(nvl) != 0) {
+		RESTORE_ERRNO(nvlist_error(nvl));
+		return;
+	}
+
+	nvlist_insert_created(nvl, nvpair_create_number_type_in(nvl->nvl_arena,
+	    name, value, NV_TYPE_UINT64));
 }
 
 void
 nvlist_add_int64(nvlist_t *nvl, const char *name, int64_t value)
 {
 
-	nvlist_addf_int64(nvl, value, "%s", name);
+	if (nvlist_error(nvl) != 0) {
+		RESTORE_ERRNO(nvlist_error(nvl));
+		return;
+	}
+
+	nvlist_insert_created(nvl, nvpair_create_number_type_in(nvl->nvl_arena,
+	    name, value, NV_TYPE_INT64));
 }
 
 void
 nvlist_add_endpoint(nvlist_t *nvl, const char *name, int value)
 {
 
-	nvlist_addf_endpoint(nvl, value, "%s", name);
+	if (nvlist_error(nvl) != 0) {
+		RESTORE_ERRNO(nvlist_error(nvl));
+		return;
+	}
+
+	nvlist_insert_created(nvl, nvpair_create_number_type_in(nvl->nvl_arena,
+	    name, value, NV_TYPE_ENDPOINT));
 }
 
 void
 nvlist_add_date(nvlist_t *nvl, const char *name, uint64_t value)
 {
 
-	nvlist_addf_date(nvl, value, "%s", name);
+	if (nvlist_error(nvl) != 0) {
+		RESTORE_ERRNO(nvlist_error(nvl));
+		return;
+	}
+
+	nvlist_insert_created(nvl, nvpair_create_number_type_in(nvl->nvl_arena,
+	    name, value, NV_TYPE_DATE));
 }
 
 void
 nvlist_add_string(nvlist_t *nvl, const char *name, const char *value)
 {
 
-	nvlist_addf_string(nvl, value, "%s", name);
+	if (nvlist_error(nvl) != 0) {
+		RESTORE_ERRNO(nvlist_error(nvl));
+		return;
+	}
+
+	nvlist_insert_created(nvl,
+	    nvpair_create_string_in(nvl->nvl_arena, name, value));
 }
 
 void
@@ -1294,21 +3640,39 @@ void
 nvlist_add_nvlist(nvlist_t *nvl, const char *name, const nvlist_t *value)
 {
 
-	nvlist_addf_nvlist(nvl, value, "%s", name);
+	if (nvlist_error(nvl) != 0) {
+		RESTORE_ERRNO(nvlist_error(nvl));
+		return;
+	}
+
+	nvlist_insert_created(nvl,
+	    nvpair_create_nvlist_type(name, value, NV_TYPE_NVLIST));
 }
 
 void
 nvlist_add_nvlist_array(nvlist_t *nvl, const char *name, const nvlist_t *value)
 {
 
-	nvlist_addf_nvlist_array(nvl, value, "%s", name);
+	if (nvlist_error(nvl) != 0) {
+		RESTORE_ERRNO(nvlist_error(nvl));
+		return;
+	}
+
+	nvlist_insert_created(nvl,
+	    nvpair_create_nvlist_type(name, value, NV_TYPE_NVLIST_ARRAY));
 }
 
 void
 nvlist_add_nvlist_dictionary(nvlist_t *nvl, const char *name, const nvlist_t *value)
 {
 
-	nvlist_addf_nvlist_dictionary(nvl, value, "%s", name);
+	if (nvlist_error(nvl) != 0) {
+		RESTORE_ERRNO(nvlist_error(nvl));
+		return;
+	}
+
+	nvlist_insert_created(nvl,
+	    nvpair_create_nvlist_type(name, value, NV_TYPE_NVLIST_DICTIONARY));
 }
 
 #ifndef _KERNEL
@@ -1316,7 +3680,13 @@ void
 nvlist_add_descriptor(nvlist_t *nvl, const char *name, int value)
 {
 
-	nvlist_addf_descriptor(nvl, value, "%s", name);
+	if (nvlist_error(nvl) != 0) {
+		RESTORE_ERRNO(nvlist_error(nvl));
+		return;
+	}
+
+	nvlist_insert_created(nvl,
+	    nvpair_create_descriptor_in(nvl->nvl_arena, name, value));
 }
 #endif
 
@@ -1325,14 +3695,104 @@ nvlist_add_binary(nvlist_t *nvl, const char *name, const void *value,
     size_t size)
 {
 
-	nvlist_addf_binary(nvl, value, size, "%s", name);
+	if (nvlist_error(nvl) != 0) {
+		RESTORE_ERRNO(nvlist_error(nvl));
+		return;
+	}
+
+	nvlist_insert_created(nvl,
+	    nvpair_create_binary_in(nvl->nvl_arena, name, value, size));
+}
+
+void
+nvlist_add_binary_external(nvlist_t *nvl, const char *name, const void *value,
+    size_t size, nv_destructor_t destructor, void *ctx)
+{
+
+	if (nvlist_error(nvl) != 0) {
+		if (destructor != NULL)
+			destructor(ctx, value, size);
+		RESTORE_ERRNO(nvlist_error(nvl));
+		return;
+	}
+
+	/*
+	 * Keep the pair on the heap even in an arena list: arena pairs aren't
+	 * freed one by one, and the destructor has to run.
+	 */
+	nvlist_insert_created(nvl, nvpair_create_binary_external(name, value,
+	    size, destructor, ctx));
 }
 
 void
 nvlist_add_uuid(nvlist_t *nvl, const char *name, const uuid_t *value)
 {
 
-	nvlist_addf_uuid(nvl, value, "%s", name);
+	if (nvlist_error(nvl) != 0) {
+		RESTORE_ERRNO(nvlist_error(nvl));
+		return;
+	}
+
+	nvlist_insert_created(nvl,
+	    nvpair_create_uuid_in(nvl->nvl_arena, name, value));
+}
+
+void
+nvlist_add_bool_array(nvlist_t *nvl, const char *name, const bool *value,
+    size_t nitems)
+{
+
+	if (nvlist_error(nvl) != 0) {
+		RESTORE_ERRNO(nvlist_error(nvl));
+		return;
+	}
+
+	nvlist_insert_created(nvl,
+	    nvpair_create_bool_array_in(nvl->nvl_arena, name, value, nitems));
+}
+
+void
+nvlist_add_int64_array(nvlist_t *nvl, const char *name, const int64_t *value,
+    size_t nitems)
+{
+
+	if (nvlist_error(nvl) != 0) {
+		RESTORE_ERRNO(nvlist_error(nvl));
+		return;
+	}
+
+	nvlist_insert_created(nvl,
+	    nvpair_create_number_array_type_in(nvl->nvl_arena, name,
+	    (const uint64_t *)value, nitems, NV_TYPE_INT64_ARRAY));
+}
+
+void
+nvlist_add_uint64_array(nvlist_t *nvl, const char *name,
+    const uint64_t *value, size_t nitems)
+{
+
+	if (nvlist_error(nvl) != 0) {
+		RESTORE_ERRNO(nvlist_error(nvl));
+		return;
+	}
+
+	nvlist_insert_created(nvl,
+	    nvpair_create_number_array_type_in(nvl->nvl_arena, name, value,
+	    nitems, NV_TYPE_UINT64_ARRAY));
+}
+
+void
+nvlist_add_string_array(nvlist_t *nvl, const char *name,
+    const char * const *value, size_t nitems)
+{
+
+	if (nvlist_error(nvl) != 0) {
+		RESTORE_ERRNO(nvlist_error(nvl));
+		return;
+	}
+
+	nvlist_insert_created(nvl,
+	    nvpair_create_string_array_in(nvl->nvl_arena, name, value, nitems));
 }
 
 void
@@ -1781,6 +4241,7 @@ nvlist_move_nvpair(nvlist_t *nvl, nvpair_t *nvp)
 
 	NVPAIR_ASSERT(nvp);
 	PJDLOG_ASSERT(nvpair_nvlist(nvp) == NULL);
+	PJDLOG_ASSERT(nvl == NULL || !nvl->nvl_frozen);
 
 	if (nvlist_error(nvl) != 0) {
 		nvpair_free(nvp);
@@ -1797,36 +4258,85 @@ nvlist_move_nvpair(nvlist_t *nvl, nvpair_t *nvp)
 	nvpair_insert(&nvl->nvl_head, nvp, nvl);
 }
 
-#define	NVLIST_MOVE(vtype, type)					\
+void
+nvlist_move_string(nvlist_t *nvl, const char *name, char *value)
+{
+
+	if (nvlist_error(nvl) != 0) {
+		nv_free(value);
+		RESTORE_ERRNO(nvlist_error(nvl));
+		return;
+	}
+
+	nvlist_insert_created(nvl,
+	    nvpair_move_string_in(nvl->nvl_arena, name, value));
+}
+
+#define	NVLIST_MOVE(type, TYPE)						\
 void									\
-nvlist_move_##type(nvlist_t *nvl, const char *name, vtype value)	\
+nvlist_move_##type(nvlist_t *nvl, const char *name, nvlist_t *value)	\
 {									\
 									\
-	nvlist_movef_##type(nvl, value, "%s", name);			\
+	if (nvlist_error(nvl) != 0) {					\
+		/* Consume value unless it belongs to another pair. */	\
+		if (value != NULL && nvlist_get_nvpair_parent(value) == NULL) \
+			nvlist_destroy(value);				\
+		RESTORE_ERRNO(nvlist_error(nvl));			\
+		return;							\
+	}								\
+									\
+	nvlist_insert_created(nvl, nvpair_move_nvlist_type_in(nvl->nvl_arena, \
+	    name, value, NV_TYPE_##TYPE));				\
 }
 
-NVLIST_MOVE(char *, string)
-NVLIST_MOVE(nvlist_t *, nvlist)
-NVLIST_MOVE(nvlist_t *, nvlist_array)
-NVLIST_MOVE(nvlist_t *, nvlist_dictionary)
-#ifndef _KERNEL
-NVLIST_MOVE(int, descriptor)
-#endif
+NVLIST_MOVE(nvlist, NVLIST)
+NVLIST_MOVE(nvlist_array, NVLIST_ARRAY)
+NVLIST_MOVE(nvlist_dictionary, NVLIST_DICTIONARY)
 
 #undef	NVLIST_MOVE
 
+#ifndef _KERNEL
+void
+nvlist_move_descriptor(nvlist_t *nvl, const char *name, int value)
+{
+
+	if (nvlist_error(nvl) != 0) {
+		close(value);
+		errno = nvlist_error(nvl);
+		return;
+	}
+
+	nvlist_insert_created(nvl,
+	    nvpair_move_descriptor_in(nvl->nvl_arena, name, value));
+}
+#endif
+
 void
 nvlist_move_binary(nvlist_t *nvl, const char *name, void *value, size_t size)
 {
 
-	nvlist_movef_binary(nvl, value, size, "%s", name);
+	if (nvlist_error(nvl) != 0) {
+		nv_free(value);
+		RESTORE_ERRNO(nvlist_error(nvl));
+		return;
+	}
+
+	nvlist_insert_created(nvl,
+	    nvpair_move_binary_in(nvl->nvl_arena, name, value, size));
 }
 
 void
 nvlist_move_uuid(nvlist_t *nvl, const char *name, uuid_t *value)
 {
 
-	nvlist_movef_binary(nvl, value, sizeof(uuid_t), "%s", name);
+	if (nvlist_error(nvl) != 0) {
+		nv_free(value);
+		RESTORE_ERRNO(nvlist_error(nvl));
+		return;
+	}
+
+	nvlist_insert_created(nvl,
+	    nvpair_move_uuid_in(nvl->nvl_arena, name, value));
 }
 
 #define	NVLIST_MOVEF(vtype, type)					\
@@ -1899,7 +4409,7 @@ nvlist_movev_nvlist(nvlist_t *nvl, nvlist_t *value, const char *namefmt,
 	nvpair_t *nvp;
 
 	if (nvlist_error(nvl) != 0) {
-		if (value != NULL && nvlist_get_nvpair_parent(value) != NULL)
+		if (value != NULL && nvlist_get_nvpair_parent(value) == NULL)
 			nvlist_destroy(value);
 		RESTORE_ERRNO(nvlist_error(nvl));
 		return;
@@ -1920,7 +4430,7 @@ nvlist_movev_nvlist_array(nvlist_t *nvl, nvlist_t *value, const char *namefmt,
 	nvpair_t *nvp;
 
 	if (nvlist_error(nvl) != 0) {
-		if (value != NULL && nvlist_get_nvpair_parent(value) != NULL)
+		if (value != NULL && nvlist_get_nvpair_parent(value) == NULL)
 			nvlist_destroy(value);
 		RESTORE_ERRNO(nvlist_error(nvl));
 		return;
@@ -1941,7 +4451,7 @@ nvlist_movev_nvlist_dictionary(nvlist_t *nvl, nvlist_t *value, const char *namef
 	nvpair_t *nvp;
 
 	if (nvlist_error(nvl) != 0) {
-		if (value != NULL && nvlist_get_nvpair_parent(value) != NULL)
+		if (value != NULL && nvlist_get_nvpair_parent(value) == NULL)
 			nvlist_destroy(value);
 		RESTORE_ERRNO(nvlist_error(nvl));
 		return;
@@ -2071,6 +4581,56 @@ nvlist_get_binary(const nvlist_t *nvl, const char *name, size_t *sizep)
 	return (nvpair_get_binary(nvp, sizep));
 }
 
+const bool *
+nvlist_get_bool_array(const nvlist_t *nvl, const char *name, size_t *nitemsp)
+{
+	nvpair_t *nvp;
+
+	nvp = nvlist_find(nvl, NV_TYPE_BOOL_ARRAY, name);
+	if (nvp == NULL)
+		nvlist_report_missing(NV_TYPE_BOOL_ARRAY, name);
+
+	return (nvpair_get_bool_array(nvp, nitemsp));
+}
+
+const int64_t *
+nvlist_get_int64_array(const nvlist_t *nvl, const char *name, size_t *nitemsp)
+{
+	nvpair_t *nvp;
+
+	nvp = nvlist_find(nvl, NV_TYPE_INT64_ARRAY, name);
+	if (nvp == NULL)
+		nvlist_report_missing(NV_TYPE_INT64_ARRAY, name);
+
+	return ((const int64_t *)nvpair_get_number_array(nvp, nitemsp));
+}
+
+const uint64_t *
+nvlist_get_uint64_array(const nvlist_t *nvl, const char *name,
+    size_t *nitemsp)
+{
+	nvpair_t *nvp;
+
+	nvp = nvlist_find(nvl, NV_TYPE_UINT64_ARRAY, name);
+	if (nvp == NULL)
+		nvlist_report_missing(NV_TYPE_UINT64_ARRAY, name);
+
+	return (nvpair_get_number_array(nvp, nitemsp));
+}
+
+const char * const *
+nvlist_get_string_array(const nvlist_t *nvl, const char *name,
+    size_t *nitemsp)
+{
+	nvpair_t *nvp;
+
+	nvp = nvlist_find(nvl, NV_TYPE_STRING_ARRAY, name);
+	if (nvp == NULL)
+		nvlist_report_missing(NV_TYPE_STRING_ARRAY, name);
+
+	return (nvpair_get_string_array(nvp, nitemsp));
+}
+
 #define	NVLIST_GETF(ftype, type)					\
 ftype									\
 nvlist_getf_##type(const nvlist_t *nvl, const char *namefmt, ...)	\
@@ -2175,6 +4735,7 @@ nvlist_take_##type(nvlist_t *nvl, const char *name)			\
 	nvp = nvlist_find(nvl, NV_TYPE_##TYPE, name);			\
 	if (nvp == NULL)						\
 		nvlist_report_missing(NV_TYPE_##TYPE, name);		\
+	nvpair_detach_payload(nvp);					\
 	value = (ftype)(intptr_t)nvpair_get_##acc_type(nvp);		\
 	nvlist_remove_nvpair(nvl, nvp);					\
 	nvpair_free_structure(nvp);					\
@@ -2209,6 +4770,7 @@ nvlist_take_binary(nvlist_t *nvl, const char *name, size_t *sizep)
 	if (nvp == NULL)
 		nvlist_report_missing(NV_TYPE_BINARY, name);
 
+	nvpair_detach_payload(nvp);
 	value = (void *)(intptr_t)nvpair_get_binary(nvp, sizep);
 	nvlist_remove_nvpair(nvl, nvp);
 	nvpair_free_structure(nvp);
@@ -2314,6 +4876,7 @@ nvlist_remove_nvpair(nvlist_t *nvl, nvpair_t *nvp)
 	NVLIST_ASSERT(nvl);
 	NVPAIR_ASSERT(nvp);
 	PJDLOG_ASSERT(nvpair_nvlist(nvp) == nvl);
+	PJDLOG_ASSERT(!nvl->nvl_frozen);
 
 	nvpair_remove(&nvl->nvl_head, nvp, nvl);
 }
@@ -2350,6 +4913,10 @@ NVLIST_FREE(descriptor, DESCRIPTOR)
 #endif
 NVLIST_FREE(binary, BINARY)
 NVLIST_FREE(uuid, UUID)
+NVLIST_FREE(bool_array, BOOL_ARRAY)
+NVLIST_FREE(int64_array, INT64_ARRAY)
+NVLIST_FREE(uint64_array, UINT64_ARRAY)
+NVLIST_FREE(string_array, STRING_ARRAY)
 
 #undef	NVLIST_FREE
 
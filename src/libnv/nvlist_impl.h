@@ -38,11 +38,27 @@
 
 #include "nv.h"
 
+/*
+ * Number of elements above which a list maintains a name index.  Below
+ * this a linear walk over the names is cheaper than hashing them.
+ */
+#define	NVLIST_HASH_THRESHOLD	8
+
+#ifdef NVLIST_TESTING
+size_t nvlist_set_hash_threshold(size_t threshold);
+#endif
+
 void *nvlist_xpack(const nvlist_t *nvl, void *ubuf, int64_t *fdidxp, size_t *sizep);
 nvlist_t *nvlist_xunpack(const void *buf, size_t size, const int *fds,
-    size_t nfds);
+    size_t nfds, int flags);
 
 nvpair_t *nvlist_get_nvpair_parent(const nvlist_t *nvl);
+void nvlist_hash_insert(nvlist_t *nvl, nvpair_t *nvp);
+void nvlist_hash_remove(nvlist_t *nvl, nvpair_t *nvp);
+void nvlist_invalidate(nvlist_t *nvl);
+struct nvlist_arena *nvlist_arena(const nvlist_t *nvl);
+void *nvlist_arena_alloc(struct nvlist_arena *arena, size_t size);
+void nvlist_arena_track(nvlist_t *nvl, const nvpair_t *nvp, int delta);
 const unsigned char *nvlist_unpack_header(nvlist_t *nvl,
     const unsigned char *ptr, size_t nfds, bool *isbep, size_t *leftp);
 
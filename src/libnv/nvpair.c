@@ -48,12 +48,21 @@ __FBSDID("$FreeBSD$");
 #include <fcntl.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #endif
 
+#if !defined(_KERNEL) && defined(__SSE2__)
+#define	NVPAIR_SSE2
+#include <emmintrin.h>
+#elif !defined(_KERNEL) && defined(__ARM_NEON) && defined(__aarch64__)
+#define	NVPAIR_NEON
+#include <arm_neon.h>
+#endif
+
 #ifdef HAVE_PJDLOG
 #include <pjdlog.h>
 #endif
@@ -83,10 +92,21 @@ struct nvpair {
 	int		 nvp_type;
 	uint64_t	 nvp_data;
 	size_t		 nvp_datasize;
+	size_t		 nvp_nitems;	/* Typed arrays only. */
+	struct nvpair_external *nvp_external;	/* Caller owned binary. */
 	nvlist_t	*nvp_list;
+	struct nvlist_arena *nvp_arena;
 	TAILQ_ENTRY(nvpair) nvp_next;
 };
 
+/*
+ * How to let go of a binary value that lives in the caller's memory.
+ */
+struct nvpair_external {
+	nv_destructor_t	 nve_destructor;
+	void		*nve_ctx;
+};
+
 #define	NVPAIR_ASSERT(nvp)	do {					\
 	PJDLOG_ASSERT((nvp) != NULL);					\
 	PJDLOG_ASSERT((nvp)->nvp_magic == NVPAIR_MAGIC);		\
@@ -99,6 +119,72 @@ struct nvpair_header {
 } __attribute__((packed));
 
 
+/*
+ * Return the offset of the first NUL in the size bytes at ptr, or size if
+ * there is none.  Names and strings are scanned sixteen bytes at a time;
+ * only whole blocks inside the buffer are loaded.
+ */
+static inline size_t
+nvpair_strnlen(const unsigned char *ptr, size_t size)
+{
+	size_t ii;
+
+	ii = 0;
+#if defined(NVPAIR_SSE2)
+	for (; ii + 16 <= size; ii += 16) {
+		unsigned int mask;
+
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+		    _mm_loadu_si128((const __m128i *)(ptr + ii)),
+		    _mm_setzero_si128()));
+		if (mask != 0)
+			return (ii + __builtin_ctz(mask));
+	}
+#elif defined(NVPAIR_NEON)
+	for (; ii + 16 <= size; ii += 16) {
+		uint64_t mask;
+
+		/* Narrow the byte mask to four bits per byte. */
+		mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(
+		    vreinterpretq_u16_u8(vceqzq_u8(vld1q_u8(ptr + ii))), 4)),
+		    0);
+		if (mask != 0)
+			return (ii + (__builtin_ctzll(mask) >> 2));
+	}
+#endif
+	for (; ii < size; ii++) {
+		if (ptr[ii] == '\0')
+			break;
+	}
+	return (ii);
+}
+
+/*
+ * Count the NULs in the size bytes at ptr.
+ */
+static inline size_t
+nvpair_nulcount(const unsigned char *ptr, size_t size)
+{
+	size_t ii, count;
+
+	ii = count = 0;
+#if defined(NVPAIR_SSE2)
+	for (; ii + 16 <= size; ii += 16) {
+		count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(
+		    _mm_loadu_si128((const __m128i *)(ptr + ii)),
+		    _mm_setzero_si128())));
+	}
+#elif defined(NVPAIR_NEON)
+	for (; ii + 16 <= size; ii += 16) {
+		count += vaddvq_u8(vandq_u8(vceqzq_u8(vld1q_u8(ptr + ii)),
+		    vdupq_n_u8(1)));
+	}
+#endif
+	for (; ii < size; ii++)
+		count += (ptr[ii] == '\0');
+	return (count);
+}
+
 void
 nvpair_assert(const nvpair_t *nvp)
 {
@@ -140,11 +226,27 @@ nvpair_insert(struct nvl_head *head, nvpair_t *nvp, nvlist_t *nvl)
 {
 
 	NVPAIR_ASSERT(nvp);
-	PJDLOG_ASSERT(nvp->nvp_list == NULL);
 	PJDLOG_ASSERT(!nvlist_exists(nvl, nvpair_name(nvp)));
 
+	nvpair_insert_unique(head, nvp, nvl);
+}
+
+/*
+ * nvpair_insert() for a pair whose name is known not to be in the list,
+ * such as those of trusted buffers: the name is not looked up at all.
+ */
+void
+nvpair_insert_unique(struct nvl_head *head, nvpair_t *nvp, nvlist_t *nvl)
+{
+
+	NVPAIR_ASSERT(nvp);
+	PJDLOG_ASSERT(nvp->nvp_list == NULL);
+
 	TAILQ_INSERT_TAIL(head, nvp, nvp_next);
 	nvp->nvp_list = nvl;
+	nvlist_hash_insert(nvl, nvp);
+	nvlist_arena_track(nvl, nvp, 1);
+	nvlist_invalidate(nvl);
 }
 
 static void
@@ -155,7 +257,9 @@ nvpair_remove_nvlist(nvpair_t *nvp)
 	/* XXX: DECONST is bad, mkay? */
 	nvl = __DECONST(nvlist_t *, nvpair_get_nvlist(nvp));
 	PJDLOG_ASSERT(nvl != NULL);
-	nvlist_set_parent(nvl, NULL);
+	/* Frozen lists are left alone, others may be reading them. */
+	if (!nvlist_frozen(nvl))
+		nvlist_set_parent(nvl, NULL);
 }
 
 void
@@ -170,6 +274,9 @@ nvpair_remove(struct nvl_head *head, nvpair_t *nvp, const nvlist_t *nvl)
 		nvpair_type(nvp) == NV_TYPE_NVLIST_DICTIONARY)
 		nvpair_remove_nvlist(nvp);
 
+	nvlist_hash_remove(__DECONST(nvlist_t *, nvl), nvp);
+	nvlist_arena_track(__DECONST(nvlist_t *, nvl), nvp, -1);
+	nvlist_invalidate(__DECONST(nvlist_t *, nvl));
 	TAILQ_REMOVE(head, nvp, nvp_next);
 	nvp->nvp_list = NULL;
 }
@@ -180,7 +287,7 @@ nvpair_clone(const nvpair_t *nvp)
 	nvpair_t *newnvp;
 	const char *name;
 	const void *data;
-	size_t datasize;
+	size_t datasize, nitems;
 
 	NVPAIR_ASSERT(nvp);
 
@@ -198,11 +305,26 @@ nvpair_clone(const nvpair_t *nvp)
 	case NV_TYPE_UINT64:
 	case NV_TYPE_INT64:
 	case NV_TYPE_ENDPOINT:
+	case NV_TYPE_DATE:
 		newnvp = nvpair_create_number_type(name, nvpair_get_number(nvp), nvpair_type(nvp));
 		break;
 	case NV_TYPE_STRING:
 		newnvp = nvpair_create_string(name, nvpair_get_string(nvp));
 		break;
+	case NV_TYPE_BOOL_ARRAY:
+		data = nvpair_get_bool_array(nvp, &nitems);
+		newnvp = nvpair_create_bool_array(name, data, nitems);
+		break;
+	case NV_TYPE_INT64_ARRAY:
+	case NV_TYPE_UINT64_ARRAY:
+		data = nvpair_get_number_array(nvp, &nitems);
+		newnvp = nvpair_create_number_array_type(name, data, nitems,
+		    nvpair_type(nvp));
+		break;
+	case NV_TYPE_STRING_ARRAY:
+		data = nvpair_get_string_array(nvp, &nitems);
+		newnvp = nvpair_create_string_array(name, data, nitems);
+		break;
 	case NV_TYPE_NVLIST:
 	case NV_TYPE_NVLIST_ARRAY:
 	case NV_TYPE_NVLIST_DICTIONARY:
@@ -245,32 +367,54 @@ nvpair_size(const nvpair_t *nvp)
 	return (nvp->nvp_datasize);
 }
 
+/*
+ * Write a pair header and its name.  The encoder uses this to emit pairs
+ * that only exist in the caller's own representation.
+ */
 unsigned char *
-nvpair_pack_header(const nvpair_t *nvp, unsigned char *ptr, size_t *leftp)
+nvpair_pack_raw_header(int type, const char *name, size_t namesize,
+    uint64_t datasize, unsigned char *ptr, size_t *leftp)
 {
 	struct nvpair_header nvphdr;
-	size_t namesize;
-
-	NVPAIR_ASSERT(nvp);
 
-	nvphdr.nvph_type = nvp->nvp_type;
-	namesize = strlen(nvp->nvp_name) + 1;
 	PJDLOG_ASSERT(namesize > 0 && namesize <= UINT16_MAX);
+	nvphdr.nvph_type = type;
 	nvphdr.nvph_namesize = namesize;
-	nvphdr.nvph_datasize = nvp->nvp_datasize;
+	nvphdr.nvph_datasize = datasize;
 	PJDLOG_ASSERT(*leftp >= sizeof(nvphdr));
 	memcpy(ptr, &nvphdr, sizeof(nvphdr));
 	ptr += sizeof(nvphdr);
 	*leftp -= sizeof(nvphdr);
 
 	PJDLOG_ASSERT(*leftp >= namesize);
-	memcpy(ptr, nvp->nvp_name, namesize);
+	memcpy(ptr, name, namesize);
 	ptr += namesize;
 	*leftp -= namesize;
 
 	return (ptr);
 }
 
+/*
+ * Overwrite the data size of a pair header written in host byte order.
+ */
+void
+nvpair_pack_datasize(unsigned char *ptr, uint64_t datasize)
+{
+
+	memcpy(ptr + offsetof(struct nvpair_header, nvph_datasize), &datasize,
+	    sizeof(datasize));
+}
+
+unsigned char *
+nvpair_pack_header(const nvpair_t *nvp, unsigned char *ptr, size_t *leftp)
+{
+
+	NVPAIR_ASSERT(nvp);
+
+	return (nvpair_pack_raw_header(nvp->nvp_type, nvp->nvp_name,
+	    strlen(nvp->nvp_name) + 1, nvp->nvp_datasize, ptr, leftp));
+}
+
 unsigned char *
 nvpair_pack_null(const nvpair_t *nvp, unsigned char *ptr,
     size_t *leftp __unused)
@@ -343,25 +487,8 @@ nvpair_pack_string(const nvpair_t *nvp, unsigned char *ptr, size_t *leftp)
 unsigned char *
 nvpair_pack_nvlist_up(unsigned char *ptr, size_t *leftp)
 {
-	struct nvpair_header nvphdr;
-	size_t namesize;
-	const char *name = "";
-
-	namesize = 1;
-	nvphdr.nvph_type = NV_TYPE_NVLIST_UP;
-	nvphdr.nvph_namesize = namesize;
-	nvphdr.nvph_datasize = 0;
-	PJDLOG_ASSERT(*leftp >= sizeof(nvphdr));
-	memcpy(ptr, &nvphdr, sizeof(nvphdr));
-	ptr += sizeof(nvphdr);
-	*leftp -= sizeof(nvphdr);
 
-	PJDLOG_ASSERT(*leftp >= namesize);
-	memcpy(ptr, name, namesize);
-	ptr += namesize;
-	*leftp -= namesize;
-
-	return (ptr);
+	return (nvpair_pack_raw_header(NV_TYPE_NVLIST_UP, "", 1, 0, ptr, leftp));
 }
 
 #ifndef _KERNEL
@@ -401,7 +528,8 @@ nvpair_pack_binary(const nvpair_t *nvp, unsigned char *ptr, size_t *leftp)
 {
 
 	NVPAIR_ASSERT(nvp);
-	PJDLOG_ASSERT(nvp->nvp_type == NV_TYPE_BINARY);
+	PJDLOG_ASSERT(nvp->nvp_type == NV_TYPE_BINARY ||
+	    nvp->nvp_type == NV_TYPE_UUID);
 
 	PJDLOG_ASSERT(*leftp >= nvp->nvp_datasize);
 	memcpy(ptr, (const void *)(intptr_t)nvp->nvp_data, nvp->nvp_datasize);
@@ -411,9 +539,76 @@ nvpair_pack_binary(const nvpair_t *nvp, unsigned char *ptr, size_t *leftp)
 	return (ptr);
 }
 
+/*
+ * Where the packed bytes of an int64, uint64 or string array live: numbers
+ * are kept in host order and the strings of a string array follow its
+ * table of pointers, NUL-terminated and back to back, just as they are
+ * packed.
+ */
+static const void *
+nvpair_array_bytes(const nvpair_t *nvp)
+{
+
+	if (nvp->nvp_type == NV_TYPE_STRING_ARRAY) {
+		return ((const char *)(intptr_t)nvp->nvp_data +
+		    nvp->nvp_nitems * sizeof(char *));
+	}
+	return ((const void *)(intptr_t)nvp->nvp_data);
+}
+
+unsigned char *
+nvpair_pack_array(const nvpair_t *nvp, unsigned char *ptr, size_t *leftp)
+{
+	const bool *bools;
+	size_t ii;
+
+	NVPAIR_ASSERT(nvp);
+	PJDLOG_ASSERT(nvp->nvp_type == NV_TYPE_BOOL_ARRAY ||
+	    nvp->nvp_type == NV_TYPE_INT64_ARRAY ||
+	    nvp->nvp_type == NV_TYPE_UINT64_ARRAY ||
+	    nvp->nvp_type == NV_TYPE_STRING_ARRAY);
+
+	PJDLOG_ASSERT(*leftp >= nvp->nvp_datasize);
+	if (nvp->nvp_type == NV_TYPE_BOOL_ARRAY) {
+		bools = (const bool *)(intptr_t)nvp->nvp_data;
+		for (ii = 0; ii < nvp->nvp_nitems; ii++)
+			ptr[ii] = bools[ii] ? 1 : 0;
+	} else {
+		memcpy(ptr, nvpair_array_bytes(nvp), nvp->nvp_datasize);
+	}
+	ptr += nvp->nvp_datasize;
+	*leftp -= nvp->nvp_datasize;
+
+	return (ptr);
+}
+
+const void *
+nvpair_payload(const nvpair_t *nvp, size_t *sizep)
+{
+
+	NVPAIR_ASSERT(nvp);
+
+	*sizep = nvp->nvp_datasize;
+	switch (nvp->nvp_type) {
+	case NV_TYPE_STRING:
+	case NV_TYPE_BINARY:
+	case NV_TYPE_UUID:
+		return ((const void *)(intptr_t)nvp->nvp_data);
+	case NV_TYPE_INT64_ARRAY:
+	case NV_TYPE_UINT64_ARRAY:
+	case NV_TYPE_STRING_ARRAY:
+		return (nvpair_array_bytes(nvp));
+	default:
+		PJDLOG_ABORT("Invalid type (%d).", nvp->nvp_type);
+	}
+
+	return (NULL);
+}
+
 void
 nvpair_init_datasize(nvpair_t *nvp)
 {
+	size_t size;
 
 	NVPAIR_ASSERT(nvp);
 
@@ -421,11 +616,17 @@ nvpair_init_datasize(nvpair_t *nvp)
 		nvp->nvp_type == NV_TYPE_NVLIST_DICTIONARY ||
 		nvp->nvp_type == NV_TYPE_NVLIST) {
 		if (nvp->nvp_data == 0) {
-			nvp->nvp_datasize = 0;
+			size = 0;
 		} else {
-			nvp->nvp_datasize =
+			size =
 			    nvlist_size((const nvlist_t *)(intptr_t)nvp->nvp_data);
 		}
+		/*
+		 * Pairs of frozen lists are packed concurrently; their size
+		 * was stored when the list was frozen and must not be written.
+		 */
+		if (nvp->nvp_datasize != size)
+			nvp->nvp_datasize = size;
 	}
 }
 
@@ -469,7 +670,7 @@ nvpair_unpack_header(bool isbe, nvpair_t *nvp, const unsigned char *ptr,
 		goto failed;
 	if (nvphdr.nvph_namesize < 1)
 		goto failed;
-	if (strnlen((const char *)ptr, nvphdr.nvph_namesize) !=
+	if (nvpair_strnlen(ptr, nvphdr.nvph_namesize) !=
 	    (size_t)(nvphdr.nvph_namesize - 1)) {
 		goto failed;
 	}
@@ -582,7 +783,7 @@ nvpair_unpack_string(bool isbe __unused, nvpair_t *nvp,
 		return (NULL);
 	}
 
-	if (strnlen((const char *)ptr, nvp->nvp_datasize) !=
+	if (nvpair_strnlen(ptr, nvp->nvp_datasize) !=
 	    nvp->nvp_datasize - 1) {
 		RESTORE_ERRNO(EINVAL);
 		return (NULL);
@@ -628,8 +829,10 @@ nvpair_unpack_nvlist(bool isbe __unused, nvpair_t *nvp,
 		return (NULL);
 
 	ptr = nvlist_unpack_header(value, ptr, nfds, NULL, leftp);
-	if (ptr == NULL)
+	if (ptr == NULL) {
+		nvlist_destroy(value);
 		return (NULL);
+	}
 
 	nvp->nvp_data = (uint64_t)(uintptr_t)value;
 	*child = value;
@@ -685,7 +888,8 @@ nvpair_unpack_binary(bool isbe __unused, nvpair_t *nvp,
 {
 	void *value;
 
-	PJDLOG_ASSERT(nvp->nvp_type == NV_TYPE_BINARY);
+	PJDLOG_ASSERT(nvp->nvp_type == NV_TYPE_BINARY ||
+	    nvp->nvp_type == NV_TYPE_UUID);
 
 	if (*leftp < nvp->nvp_datasize || nvp->nvp_datasize == 0) {
 		RESTORE_ERRNO(EINVAL);
@@ -705,131 +909,791 @@ nvpair_unpack_binary(bool isbe __unused, nvpair_t *nvp,
 	return (ptr);
 }
 
-const unsigned char *
-nvpair_unpack(bool isbe, const unsigned char *ptr, size_t *leftp,
-    nvpair_t **nvpp)
+/*
+ * Check the packed value of a typed array and count its items.
+ */
+static bool
+nvpair_array_check(int type, const unsigned char *ptr, size_t datasize,
+    size_t *nitemsp)
 {
-	nvpair_t *nvp;
+	size_t ii, nitems;
 
-	nvp = nv_calloc(1, sizeof(*nvp) + NV_NAME_MAX);
-	if (nvp == NULL)
-		return (NULL);
-	nvp->nvp_name = (char *)(nvp + 1);
+	if (datasize == 0)
+		return (false);
 
-	ptr = nvpair_unpack_header(isbe, nvp, ptr, leftp);
-	if (ptr == NULL)
-		goto failed;
+	switch (type) {
+	case NV_TYPE_BOOL_ARRAY:
+		for (ii = 0; ii < datasize; ii++) {
+			if (ptr[ii] != 0 && ptr[ii] != 1)
+				return (false);
+		}
+		nitems = datasize;
+		break;
+	case NV_TYPE_INT64_ARRAY:
+	case NV_TYPE_UINT64_ARRAY:
+		if (datasize % sizeof(uint64_t) != 0)
+			return (false);
+		nitems = datasize / sizeof(uint64_t);
+		break;
+	case NV_TYPE_STRING_ARRAY:
+		if (ptr[datasize - 1] != '\0')
+			return (false);
+		/* Every string, the last one included, ends in a NUL. */
+		nitems = nvpair_nulcount(ptr, datasize);
+		break;
+	default:
+		return (false);
+	}
 
-	/* Update nvp_name after realloc(). */
-	nvp->nvp_data = 0x00;
-	nvp->nvp_magic = NVPAIR_MAGIC;
-	*nvpp = nvp;
-	return (ptr);
-failed:
-	nv_free(nvp);
-	return (NULL);
+	*nitemsp = nitems;
+	return (true);
 }
 
-int
-nvpair_type(const nvpair_t *nvp)
+/*
+ * Byte swap an array of 64-bit numbers in place.  The loop has no
+ * dependencies between iterations, so the compiler turns it into vector
+ * shuffles.
+ */
+static void
+nvpair_array_swap(uint64_t *values, size_t nitems)
 {
+	size_t ii;
 
-	NVPAIR_ASSERT(nvp);
-
-	return (nvp->nvp_type);
+	for (ii = 0; ii < nitems; ii++)
+		values[ii] = bswap64(values[ii]);
 }
 
-const char *
-nvpair_name(const nvpair_t *nvp)
+/*
+ * Point the table of a string array at the strings that follow it.
+ */
+static void
+nvpair_array_index(const char **table, size_t nitems)
 {
+	const char *str;
+	size_t ii;
 
-	NVPAIR_ASSERT(nvp);
-
-	return (nvp->nvp_name);
+	str = (const char *)(table + nitems);
+	for (ii = 0; ii < nitems; ii++) {
+		table[ii] = str;
+		str += strlen(str) + 1;
+	}
 }
 
-static nvpair_t *
-nvpair_allocv(int type, uint64_t data, size_t datasize, const char *namefmt,
-    va_list nameap)
+/*
+ * Copy the checked value of a typed array at ptr into nvp.
+ */
+static bool
+nvpair_array_decode(nvpair_t *nvp, const unsigned char *ptr, size_t nitems,
+    bool swap)
 {
-	nvpair_t *nvp;
-	char *name;
-	int namelen;
-
-	PJDLOG_ASSERT(type >= NV_TYPE_FIRST && type <= NV_TYPE_LAST);
-
-	namelen = nv_vasprintf(&name, namefmt, nameap);
-	if (namelen < 0)
-		return (NULL);
-
-	PJDLOG_ASSERT(namelen > 0);
-	if (namelen >= NV_NAME_MAX) {
-		nv_free(name);
-		RESTORE_ERRNO(ENAMETOOLONG);
-		return (NULL);
-	}
+	bool *bools;
+	void *value;
+	size_t ii;
 
-	nvp = nv_calloc(1, sizeof(*nvp) + namelen + 1);
-	if (nvp != NULL) {
-		nvp->nvp_name = (char *)(nvp + 1);
-		memcpy(nvp->nvp_name, name, namelen + 1);
-		nvp->nvp_type = type;
-		nvp->nvp_data = data;
-		nvp->nvp_datasize = datasize;
-		nvp->nvp_magic = NVPAIR_MAGIC;
+	switch (nvp->nvp_type) {
+	case NV_TYPE_BOOL_ARRAY:
+		value = bools = nv_malloc(nitems * sizeof(bool));
+		if (value == NULL)
+			return (false);
+		for (ii = 0; ii < nitems; ii++)
+			bools[ii] = ptr[ii] != 0;
+		break;
+	case NV_TYPE_INT64_ARRAY:
+	case NV_TYPE_UINT64_ARRAY:
+		value = nv_malloc(nvp->nvp_datasize);
+		if (value == NULL)
+			return (false);
+		memcpy(value, ptr, nvp->nvp_datasize);
+		if (swap)
+			nvpair_array_swap(value, nitems);
+		break;
+	case NV_TYPE_STRING_ARRAY:
+		value = nv_malloc(nitems * sizeof(char *) + nvp->nvp_datasize);
+		if (value == NULL)
+			return (false);
+		memcpy((char **)value + nitems, ptr, nvp->nvp_datasize);
+		nvpair_array_index(value, nitems);
+		break;
+	default:
+		PJDLOG_ABORT("Invalid type (%d).", nvp->nvp_type);
 	}
-	nv_free(name);
-
-	return (nvp);
-};
 
-nvpair_t *
-nvpair_create_null(const char *name)
-{
-
-	return (nvpair_createf_null("%s", name));
+	nvp->nvp_data = (uint64_t)(uintptr_t)value;
+	nvp->nvp_nitems = nitems;
+	return (true);
 }
 
-nvpair_t *
-nvpair_create_bool(const char *name, bool value)
+const unsigned char *
+nvpair_unpack_array(bool isbe, nvpair_t *nvp, const unsigned char *ptr,
+    size_t *leftp)
 {
+	size_t nitems;
+	bool swap;
 
-	return (nvpair_createf_bool(value, "%s", name));
-}
+	PJDLOG_ASSERT(nvp->nvp_type == NV_TYPE_BOOL_ARRAY ||
+	    nvp->nvp_type == NV_TYPE_INT64_ARRAY ||
+	    nvp->nvp_type == NV_TYPE_UINT64_ARRAY ||
+	    nvp->nvp_type == NV_TYPE_STRING_ARRAY);
 
-nvpair_t *
-nvpair_create_number_type(const char *name, uint64_t value, int type)
-{
+	if (*leftp < nvp->nvp_datasize ||
+	    !nvpair_array_check(nvp->nvp_type, ptr, nvp->nvp_datasize,
+	    &nitems)) {
+		RESTORE_ERRNO(EINVAL);
+		return (NULL);
+	}
 
-	return (nvpair_createf_number_type(value, type, "%s", name));
-}
+#if BYTE_ORDER == BIG_ENDIAN
+	swap = !isbe;
+#else
+	swap = isbe;
+#endif
 
-nvpair_t *
-nvpair_create_string(const char *name, const char *value)
-{
+	if (!nvpair_array_decode(nvp, ptr, nitems, swap))
+		return (NULL);
+	ptr += nvp->nvp_datasize;
+	*leftp -= nvp->nvp_datasize;
 
-	return (nvpair_createf_string(value, "%s", name));
+	return (ptr);
 }
 
-nvpair_t *
-nvpair_create_stringf(const char *name, const char *valuefmt, ...)
+const unsigned char *
+nvpair_unpack(bool isbe, const unsigned char *ptr, size_t *leftp,
+    nvpair_t **nvpp)
 {
-	va_list valueap;
+	struct nvpair_header nvphdr;
 	nvpair_t *nvp;
+	size_t namesize;
 
-	va_start(valueap, valuefmt);
-	nvp = nvpair_create_stringv(name, valuefmt, valueap);
-	va_end(valueap);
+	/*
+	 * Peek at the name size so the pair can be allocated at its final
+	 * size instead of reserving NV_NAME_MAX bytes for every element.
+	 * nvpair_unpack_header() does the real validation.
+	 */
+	if (*leftp < sizeof(nvphdr)) {
+		RESTORE_ERRNO(EINVAL);
+		return (NULL);
+	}
+	memcpy(&nvphdr, ptr, sizeof(nvphdr));
+#if BYTE_ORDER == BIG_ENDIAN
+	namesize = isbe ? nvphdr.nvph_namesize : le16toh(nvphdr.nvph_namesize);
+#else
+	namesize = isbe ? be16toh(nvphdr.nvph_namesize) : nvphdr.nvph_namesize;
+#endif
+	if (namesize > NV_NAME_MAX) {
+		RESTORE_ERRNO(EINVAL);
+		return (NULL);
+	}
 
-	return (nvp);
+	nvp = nv_calloc(1, sizeof(*nvp) + namesize + 1);
+	if (nvp == NULL)
+		return (NULL);
+	nvp->nvp_name = (char *)(nvp + 1);
+
+	ptr = nvpair_unpack_header(isbe, nvp, ptr, leftp);
+	if (ptr == NULL)
+		goto failed;
+
+	nvp->nvp_data = 0x00;
+	nvp->nvp_magic = NVPAIR_MAGIC;
+	*nvpp = nvp;
+	return (ptr);
+failed:
+	nv_free(nvp);
+	return (NULL);
 }
 
-nvpair_t *
-nvpair_create_stringv(const char *name, const char *valuefmt, va_list valueap)
+/*
+ * Decode the pair at ptr from a buffer in host byte order that
+ * nvlist_view_init() has already accepted, so the header, name and value
+ * are known to be well formed and nothing but allocation can fail.  A
+ * nested list is unpacked up to its header and returned in *child.
+ */
+const unsigned char *
+nvpair_unpack_native(const unsigned char *ptr, size_t *leftp,
+    nvpair_t **nvpp, nvlist_t **child)
 {
+	struct nvpair_header nvphdr;
 	nvpair_t *nvp;
-	char *str;
-	int len;
+	void *value;
+	size_t nitems;
+
+	memcpy(&nvphdr, ptr, sizeof(nvphdr));
+	ptr += sizeof(nvphdr);
+	*leftp -= sizeof(nvphdr);
+
+	nvp = nv_calloc(1, sizeof(*nvp) + nvphdr.nvph_namesize);
+	if (nvp == NULL)
+		return (NULL);
+	nvp->nvp_name = (char *)(nvp + 1);
+	memcpy(nvp->nvp_name, ptr, nvphdr.nvph_namesize);
+	ptr += nvphdr.nvph_namesize;
+	*leftp -= nvphdr.nvph_namesize;
+
+	nvp->nvp_type = nvphdr.nvph_type;
+	nvp->nvp_datasize = nvphdr.nvph_datasize;
+	nvp->nvp_magic = NVPAIR_MAGIC;
+
+	switch (nvp->nvp_type) {
+	case NV_TYPE_NULL:
+	case NV_TYPE_NVLIST_UP:
+		break;
+	case NV_TYPE_BOOL:
+		nvp->nvp_data = *ptr;
+		break;
+	case NV_TYPE_NUMBER:
+	case NV_TYPE_PTR:
+	case NV_TYPE_UINT64:
+	case NV_TYPE_INT64:
+	case NV_TYPE_ENDPOINT:
+	case NV_TYPE_DATE:
+		memcpy(&nvp->nvp_data, ptr, sizeof(uint64_t));
+		break;
+	case NV_TYPE_STRING:
+	case NV_TYPE_BINARY:
+	case NV_TYPE_UUID:
+		value = nv_malloc(nvp->nvp_datasize);
+		if (value == NULL)
+			goto failed;
+		memcpy(value, ptr, nvp->nvp_datasize);
+		nvp->nvp_data = (uint64_t)(uintptr_t)value;
+		break;
+	case NV_TYPE_NVLIST:
+	case NV_TYPE_NVLIST_ARRAY:
+	case NV_TYPE_NVLIST_DICTIONARY:
+		ptr = nvpair_unpack_nvlist(false, nvp, ptr, leftp, 0, child);
+		if (ptr == NULL)
+			goto failed;
+		*nvpp = nvp;
+		return (ptr);
+	case NV_TYPE_BOOL_ARRAY:
+	case NV_TYPE_INT64_ARRAY:
+	case NV_TYPE_UINT64_ARRAY:
+	case NV_TYPE_STRING_ARRAY:
+		if (nvp->nvp_type == NV_TYPE_STRING_ARRAY)
+			nitems = nvpair_nulcount(ptr, nvp->nvp_datasize);
+		else if (nvp->nvp_type == NV_TYPE_BOOL_ARRAY)
+			nitems = nvp->nvp_datasize;
+		else
+			nitems = nvp->nvp_datasize / sizeof(uint64_t);
+		if (!nvpair_array_decode(nvp, ptr, nitems, false))
+			goto failed;
+		break;
+	default:
+		PJDLOG_ABORT("Invalid type (%d).", nvp->nvp_type);
+	}
+	ptr += nvp->nvp_datasize;
+	*leftp -= nvp->nvp_datasize;
+
+	*nvpp = nvp;
+	return (ptr);
+failed:
+	nv_free(nvp);
+	return (NULL);
+}
+
+/*
+ * Validate the pair at ptr for nvlist_view_t and describe it in nvpv.
+ * Nothing is copied; the returned pointer is just past the pair's data.
+ * Nested nvlists are only bounds checked here, the caller walks them.
+ */
+const unsigned char *
+nvpair_view_unpack(bool isbe, const unsigned char *ptr, size_t *leftp,
+    nvpair_view_t *nvpv)
+{
+	struct nvpair_header nvphdr;
+	size_t nitems;
+
+	if (*leftp < sizeof(nvphdr))
+		goto failed;
+
+	memcpy(&nvphdr, ptr, sizeof(nvphdr));
+	ptr += sizeof(nvphdr);
+	*leftp -= sizeof(nvphdr);
+
+#if BYTE_ORDER == BIG_ENDIAN
+	if (!isbe) {
+		nvphdr.nvph_namesize = le16toh(nvphdr.nvph_namesize);
+		nvphdr.nvph_datasize = le64toh(nvphdr.nvph_datasize);
+	}
+#else
+	if (isbe) {
+		nvphdr.nvph_namesize = be16toh(nvphdr.nvph_namesize);
+		nvphdr.nvph_datasize = be64toh(nvphdr.nvph_datasize);
+	}
+#endif
+
+	if (nvphdr.nvph_namesize > NV_NAME_MAX)
+		goto failed;
+	if (*leftp < nvphdr.nvph_namesize)
+		goto failed;
+	if (nvphdr.nvph_namesize < 1)
+		goto failed;
+	if (nvpair_strnlen(ptr, nvphdr.nvph_namesize) !=
+	    (size_t)(nvphdr.nvph_namesize - 1)) {
+		goto failed;
+	}
+
+	nvpv->nvpv_name = (const char *)ptr;
+	ptr += nvphdr.nvph_namesize;
+	*leftp -= nvphdr.nvph_namesize;
+
+	if (*leftp < nvphdr.nvph_datasize)
+		goto failed;
+
+	switch (nvphdr.nvph_type) {
+	case NV_TYPE_NULL:
+	case NV_TYPE_NVLIST_UP:
+		if (nvphdr.nvph_datasize != 0)
+			goto failed;
+		break;
+	case NV_TYPE_BOOL:
+		if (nvphdr.nvph_datasize != sizeof(uint8_t))
+			goto failed;
+		if (*ptr != 0 && *ptr != 1)
+			goto failed;
+		break;
+	case NV_TYPE_NUMBER:
+	case NV_TYPE_PTR:
+	case NV_TYPE_UINT64:
+	case NV_TYPE_INT64:
+	case NV_TYPE_ENDPOINT:
+	case NV_TYPE_DATE:
+		if (nvphdr.nvph_datasize != sizeof(uint64_t))
+			goto failed;
+		break;
+	case NV_TYPE_STRING:
+		if (nvphdr.nvph_datasize == 0)
+			goto failed;
+		if (nvpair_strnlen(ptr, nvphdr.nvph_datasize) !=
+		    nvphdr.nvph_datasize - 1) {
+			goto failed;
+		}
+		break;
+	case NV_TYPE_BINARY:
+	case NV_TYPE_NVLIST:
+	case NV_TYPE_NVLIST_ARRAY:
+	case NV_TYPE_NVLIST_DICTIONARY:
+		if (nvphdr.nvph_datasize == 0)
+			goto failed;
+		break;
+	case NV_TYPE_UUID:
+		if (nvphdr.nvph_datasize != sizeof(uuid_t))
+			goto failed;
+		break;
+	case NV_TYPE_BOOL_ARRAY:
+	case NV_TYPE_INT64_ARRAY:
+	case NV_TYPE_UINT64_ARRAY:
+	case NV_TYPE_STRING_ARRAY:
+		if (!nvpair_array_check(nvphdr.nvph_type, ptr,
+		    nvphdr.nvph_datasize, &nitems)) {
+			goto failed;
+		}
+		break;
+	default:
+		/* Descriptors can't be viewed, there are no fds to map. */
+		goto failed;
+	}
+
+	nvpv->nvpv_type = nvphdr.nvph_type;
+	nvpv->nvpv_flags = isbe ? NV_FLAG_BIG_ENDIAN : 0;
+	nvpv->nvpv_data = ptr;
+	nvpv->nvpv_datasize = nvphdr.nvph_datasize;
+
+	ptr += nvphdr.nvph_datasize;
+	*leftp -= nvphdr.nvph_datasize;
+
+	return (ptr);
+failed:
+	RESTORE_ERRNO(EINVAL);
+	return (NULL);
+}
+
+/*
+ * Decode the pair header at ptr without validating it.
+ */
+void
+nvpair_peek_header(bool isbe, const unsigned char *ptr, int *typep,
+    size_t *namesizep, uint64_t *datasizep)
+{
+	struct nvpair_header nvphdr;
+
+	memcpy(&nvphdr, ptr, sizeof(nvphdr));
+
+#if BYTE_ORDER == BIG_ENDIAN
+	if (!isbe) {
+		nvphdr.nvph_namesize = le16toh(nvphdr.nvph_namesize);
+		nvphdr.nvph_datasize = le64toh(nvphdr.nvph_datasize);
+	}
+#else
+	if (isbe) {
+		nvphdr.nvph_namesize = be16toh(nvphdr.nvph_namesize);
+		nvphdr.nvph_datasize = be64toh(nvphdr.nvph_datasize);
+	}
+#endif
+
+	*typep = nvphdr.nvph_type;
+	*namesizep = nvphdr.nvph_namesize;
+	*datasizep = nvphdr.nvph_datasize;
+}
+
+/*
+ * Describe a pair of an already validated view; no checks are done.
+ */
+const unsigned char *
+nvpair_view_header(bool isbe, const unsigned char *ptr, nvpair_view_t *nvpv)
+{
+	size_t namesize;
+	uint64_t datasize;
+	int type;
+
+	nvpair_peek_header(isbe, ptr, &type, &namesize, &datasize);
+	ptr += sizeof(struct nvpair_header);
+
+	nvpv->nvpv_name = (const char *)ptr;
+	nvpv->nvpv_type = type;
+	nvpv->nvpv_flags = isbe ? NV_FLAG_BIG_ENDIAN : 0;
+	nvpv->nvpv_data = ptr + namesize;
+	nvpv->nvpv_datasize = datasize;
+
+	return (nvpv->nvpv_data + nvpv->nvpv_datasize);
+}
+
+bool
+nvpair_view_get_bool(const nvpair_view_t *nvpv)
+{
+
+	PJDLOG_ASSERT(nvpv->nvpv_type == NV_TYPE_BOOL);
+
+	return (*nvpv->nvpv_data != 0);
+}
+
+uint64_t
+nvpair_view_get_number(const nvpair_view_t *nvpv)
+{
+
+	PJDLOG_ASSERT(
+	    nvpv->nvpv_type == NV_TYPE_NUMBER ||
+	    nvpv->nvpv_type == NV_TYPE_PTR ||
+	    nvpv->nvpv_type == NV_TYPE_UINT64 ||
+	    nvpv->nvpv_type == NV_TYPE_INT64 ||
+	    nvpv->nvpv_type == NV_TYPE_ENDPOINT ||
+	    nvpv->nvpv_type == NV_TYPE_DATE
+	);
+
+	if ((nvpv->nvpv_flags & NV_FLAG_BIG_ENDIAN) != 0)
+		return (be64dec(nvpv->nvpv_data));
+	else
+		return (le64dec(nvpv->nvpv_data));
+}
+
+const char *
+nvpair_view_get_string(const nvpair_view_t *nvpv)
+{
+
+	PJDLOG_ASSERT(nvpv->nvpv_type == NV_TYPE_STRING);
+
+	return ((const char *)nvpv->nvpv_data);
+}
+
+const void *
+nvpair_view_get_binary(const nvpair_view_t *nvpv, size_t *sizep)
+{
+
+	PJDLOG_ASSERT(nvpv->nvpv_type == NV_TYPE_BINARY);
+
+	if (sizep != NULL)
+		*sizep = nvpv->nvpv_datasize;
+	return (nvpv->nvpv_data);
+}
+
+const uuid_t *
+nvpair_view_get_uuid(const nvpair_view_t *nvpv)
+{
+
+	PJDLOG_ASSERT(nvpv->nvpv_type == NV_TYPE_UUID);
+
+	return ((const uuid_t *)nvpv->nvpv_data);
+}
+
+size_t
+nvpair_view_get_nitems(const nvpair_view_t *nvpv)
+{
+	size_t nitems;
+
+	PJDLOG_ASSERT(
+	    nvpv->nvpv_type == NV_TYPE_BOOL_ARRAY ||
+	    nvpv->nvpv_type == NV_TYPE_INT64_ARRAY ||
+	    nvpv->nvpv_type == NV_TYPE_UINT64_ARRAY ||
+	    nvpv->nvpv_type == NV_TYPE_STRING_ARRAY
+	);
+
+	if (!nvpair_array_check(nvpv->nvpv_type, nvpv->nvpv_data,
+	    nvpv->nvpv_datasize, &nitems)) {
+		PJDLOG_ABORT("Malformed array in view.");
+	}
+	return (nitems);
+}
+
+void
+nvpair_view_get_bool_array(const nvpair_view_t *nvpv, bool *values)
+{
+	size_t ii;
+
+	PJDLOG_ASSERT(nvpv->nvpv_type == NV_TYPE_BOOL_ARRAY);
+
+	for (ii = 0; ii < nvpv->nvpv_datasize; ii++)
+		values[ii] = nvpv->nvpv_data[ii] != 0;
+}
+
+void
+nvpair_view_get_number_array(const nvpair_view_t *nvpv, uint64_t *values)
+{
+	bool isbe;
+
+	PJDLOG_ASSERT(nvpv->nvpv_type == NV_TYPE_INT64_ARRAY ||
+	    nvpv->nvpv_type == NV_TYPE_UINT64_ARRAY);
+
+	isbe = (nvpv->nvpv_flags & NV_FLAG_BIG_ENDIAN) != 0;
+	memcpy(values, nvpv->nvpv_data, nvpv->nvpv_datasize);
+#if BYTE_ORDER == BIG_ENDIAN
+	if (!isbe)
+#else
+	if (isbe)
+#endif
+		nvpair_array_swap(values, nvpv->nvpv_datasize / sizeof(uint64_t));
+}
+
+void
+nvpair_view_get_string_array(const nvpair_view_t *nvpv, const char **values)
+{
+	const char *str, *end;
+	size_t ii;
+
+	PJDLOG_ASSERT(nvpv->nvpv_type == NV_TYPE_STRING_ARRAY);
+
+	str = (const char *)nvpv->nvpv_data;
+	end = str + nvpv->nvpv_datasize;
+	for (ii = 0; str < end; ii++) {
+		values[ii] = str;
+		str += strlen(str) + 1;
+	}
+}
+
+int
+nvpair_type(const nvpair_t *nvp)
+{
+
+	NVPAIR_ASSERT(nvp);
+
+	return (nvp->nvp_type);
+}
+
+const char *
+nvpair_name(const nvpair_t *nvp)
+{
+
+	NVPAIR_ASSERT(nvp);
+
+	return (nvp->nvp_name);
+}
+
+/*
+ * Allocate a pair, from the arena if one is given.  Arena pairs may carry a
+ * copy of their payload in the same allocation, right after the name.
+ */
+static nvpair_t *
+nvpair_alloc(struct nvlist_arena *arena, int type, uint64_t data,
+    size_t datasize, const char *name, const void *payload)
+{
+	nvpair_t *nvp;
+	size_t namelen, size;
+
+	PJDLOG_ASSERT(type >= NV_TYPE_FIRST && type <= NV_TYPE_LAST);
+	PJDLOG_ASSERT(payload == NULL || arena != NULL);
+
+	namelen = strlen(name);
+	if (namelen >= NV_NAME_MAX) {
+		RESTORE_ERRNO(ENAMETOOLONG);
+		return (NULL);
+	}
+
+	size = sizeof(*nvp) + namelen + 1;
+	if (arena == NULL) {
+		nvp = nv_calloc(1, size);
+	} else {
+		size = roundup(size, sizeof(uint64_t));
+		nvp = nvlist_arena_alloc(arena,
+		    size + (payload != NULL ? datasize : 0));
+		if (nvp != NULL)
+			memset(nvp, 0, sizeof(*nvp));
+	}
+	if (nvp != NULL) {
+		nvp->nvp_name = (char *)(nvp + 1);
+		memcpy(nvp->nvp_name, name, namelen + 1);
+		if (payload != NULL) {
+			memcpy((char *)nvp + size, payload, datasize);
+			data = (uint64_t)(uintptr_t)((char *)nvp + size);
+		}
+		nvp->nvp_type = type;
+		nvp->nvp_data = data;
+		nvp->nvp_datasize = datasize;
+		nvp->nvp_arena = arena;
+		nvp->nvp_magic = NVPAIR_MAGIC;
+	}
+
+	return (nvp);
+}
+
+/*
+ * Allocate a pair for an element of a compact (version 1) list, whose name
+ * and data size don't come from a pair header.  The value is then read with
+ * the nvpair_unpack functions like for version 0.  A datasize of 0 stands
+ * for the fixed size of the type.
+ */
+nvpair_t *
+nvpair_unpack_compact(int type, const char *name, uint64_t datasize)
+{
+
+	if (type < NV_TYPE_FIRST || type > NV_TYPE_LAST) {
+		RESTORE_ERRNO(EINVAL);
+		return (NULL);
+	}
+
+	switch (type) {
+	case NV_TYPE_NULL:
+		break;
+	case NV_TYPE_BOOL:
+		datasize = sizeof(uint8_t);
+		break;
+	case NV_TYPE_UUID:
+		datasize = sizeof(uuid_t);
+		break;
+	case NV_TYPE_NUMBER:
+	case NV_TYPE_PTR:
+	case NV_TYPE_UINT64:
+	case NV_TYPE_INT64:
+	case NV_TYPE_ENDPOINT:
+	case NV_TYPE_DATE:
+		datasize = sizeof(uint64_t);
+		break;
+	}
+
+	return (nvpair_alloc(NULL, type, 0, datasize, name, NULL));
+}
+
+struct nvlist_arena *
+nvpair_arena(const nvpair_t *nvp)
+{
+
+	NVPAIR_ASSERT(nvp);
+
+	return (nvp->nvp_arena);
+}
+
+nvpair_t *
+nvpair_create_null(const char *name)
+{
+
+	return (nvpair_create_null_in(NULL, name));
+}
+
+nvpair_t *
+nvpair_create_null_in(struct nvlist_arena *arena, const char *name)
+{
+
+	return (nvpair_alloc(arena, NV_TYPE_NULL, 0, 0, name, NULL));
+}
+
+nvpair_t *
+nvpair_create_bool(const char *name, bool value)
+{
+
+	return (nvpair_create_bool_in(NULL, name, value));
+}
+
+nvpair_t *
+nvpair_create_bool_in(struct nvlist_arena *arena, const char *name,
+    bool value)
+{
+
+	return (nvpair_alloc(arena, NV_TYPE_BOOL, value ? 1 : 0,
+	    sizeof(uint8_t), name, NULL));
+}
+
+nvpair_t *
+nvpair_create_number_type(const char *name, uint64_t value, int type)
+{
+
+	return (nvpair_create_number_type_in(NULL, name, value, type));
+}
+
+nvpair_t *
+nvpair_create_number_type_in(struct nvlist_arena *arena, const char *name,
+    uint64_t value, int type)
+{
+	if (type > NV_TYPE_NUMBER_MAX || type < NV_TYPE_NUMBER_MIN)
+		return (NULL);
+
+	return (nvpair_alloc(arena, type, value, sizeof(value), name, NULL));
+}
+
+nvpair_t *
+nvpair_create_string(const char *name, const char *value)
+{
+
+	return (nvpair_create_string_in(NULL, name, value));
+}
+
+nvpair_t *
+nvpair_create_string_in(struct nvlist_arena *arena, const char *name,
+    const char *value)
+{
+	nvpair_t *nvp;
+	size_t size;
+	char *data;
+
+	if (value == NULL) {
+		RESTORE_ERRNO(EINVAL);
+		return (NULL);
+	}
+
+	size = strlen(value) + 1;
+	if (arena != NULL) {
+		return (nvpair_alloc(arena, NV_TYPE_STRING, 0, size, name,
+		    value));
+	}
+
+	data = nv_strdup(value);
+	if (data == NULL)
+		return (NULL);
+
+	nvp = nvpair_alloc(NULL, NV_TYPE_STRING, (uint64_t)(uintptr_t)data,
+	    size, name, NULL);
+	if (nvp == NULL)
+		nv_free(data);
+
+	return (nvp);
+}
+
+nvpair_t *
+nvpair_create_stringf(const char *name, const char *valuefmt, ...)
+{
+	va_list valueap;
+	nvpair_t *nvp;
+
+	va_start(valueap, valuefmt);
+	nvp = nvpair_create_stringv(name, valuefmt, valueap);
+	va_end(valueap);
+
+	return (nvp);
+}
+
+nvpair_t *
+nvpair_create_stringv(const char *name, const char *valuefmt, va_list valueap)
+{
+	nvpair_t *nvp;
+	char *str;
+	int len;
 
 	len = nv_vasprintf(&str, valuefmt, valueap);
 	if (len < 0)
@@ -841,18 +1705,62 @@ nvpair_create_stringv(const char *name, const char *valuefmt, va_list valueap)
 }
 
 nvpair_t *
-nvpair_create_nvlist_type(const char *name, const nvlist_t *value, int type)
+nvpair_create_nvlist_type(const char *name, const nvlist_t *value, int type)
+{
+	nvlist_t *nvl;
+	nvpair_t *nvp;
+
+	if (value == NULL) {
+		RESTORE_ERRNO(EINVAL);
+		return (NULL);
+	}
+
+	/* A frozen list can be shared instead of copied. */
+	if (nvlist_frozen(value) && nvlist_get_nvpair_parent(value) == NULL)
+		nvl = nvlist_retain(value);
+	else
+		nvl = nvlist_clone(value);
+	if (nvl == NULL)
+		return (NULL);
+
+	nvp = nvpair_alloc(NULL, type, (uint64_t)(uintptr_t)nvl, 0, name, NULL);
+	if (nvp == NULL)
+		nvlist_destroy(nvl);
+	else if (!nvlist_frozen(nvl))
+		nvlist_set_parent(nvl, nvp);
+
+	return (nvp);
+}
+
+#ifndef _KERNEL
+nvpair_t *
+nvpair_create_descriptor(const char *name, int value)
 {
 
-	return (nvpair_createf_nvlist_type(value, type, "%s", name));
+	return (nvpair_create_descriptor_in(NULL, name, value));
 }
 
-#ifndef _KERNEL
 nvpair_t *
-nvpair_create_descriptor(const char *name, int value)
+nvpair_create_descriptor_in(struct nvlist_arena *arena, const char *name,
+    int value)
 {
+	nvpair_t *nvp;
+
+	if (value < 0) {
+		errno = EBADF;
+		return (NULL);
+	}
+
+	value = fcntl(value, F_DUPFD_CLOEXEC, 0);
+	if (value < 0)
+		return (NULL);
+
+	nvp = nvpair_alloc(arena, NV_TYPE_DESCRIPTOR, (uint64_t)value,
+	    sizeof(int64_t), name, NULL);
+	if (nvp == NULL)
+		close(value);
 
-	return (nvpair_createf_descriptor(value, "%s", name));
+	return (nvp);
 }
 #endif
 
@@ -860,14 +1768,263 @@ nvpair_t *
 nvpair_create_binary(const char *name, const void *value, size_t size)
 {
 
-	return (nvpair_createf_binary(value, size, "%s", name));
+	return (nvpair_create_binary_in(NULL, name, value, size));
+}
+
+nvpair_t *
+nvpair_create_binary_in(struct nvlist_arena *arena, const char *name,
+    const void *value, size_t size)
+{
+	nvpair_t *nvp;
+	void *data;
+
+	if (value == NULL || size == 0) {
+		RESTORE_ERRNO(EINVAL);
+		return (NULL);
+	}
+
+	if (arena != NULL) {
+		return (nvpair_alloc(arena, NV_TYPE_BINARY, 0, size, name,
+		    value));
+	}
+
+	data = nv_malloc(size);
+	if (data == NULL)
+		return (NULL);
+	memcpy(data, value, size);
+
+	nvp = nvpair_alloc(NULL, NV_TYPE_BINARY, (uint64_t)(uintptr_t)data,
+	    size, name, NULL);
+	if (nvp == NULL)
+		nv_free(data);
+
+	return (nvp);
+}
+
+/*
+ * Create a binary pair that references value instead of copying it.  The
+ * pair owns value from here on, even on failure: destructor is called with
+ * ctx once the pair no longer needs it.
+ */
+nvpair_t *
+nvpair_create_binary_external(const char *name, const void *value,
+    size_t size, nv_destructor_t destructor, void *ctx)
+{
+	struct nvpair_external *external;
+	nvpair_t *nvp;
+	int serrno;
+
+	if (value == NULL || size == 0) {
+		RESTORE_ERRNO(EINVAL);
+		nvp = NULL;
+		goto failed;
+	}
+
+	external = nv_malloc(sizeof(*external));
+	if (external == NULL) {
+		nvp = NULL;
+		goto failed;
+	}
+	external->nve_destructor = destructor;
+	external->nve_ctx = ctx;
+
+	nvp = nvpair_alloc(NULL, NV_TYPE_BINARY, (uint64_t)(uintptr_t)value,
+	    size, name, NULL);
+	if (nvp == NULL) {
+		nv_free(external);
+		goto failed;
+	}
+	nvp->nvp_external = external;
+
+	return (nvp);
+failed:
+	if (destructor != NULL) {
+		SAVE_ERRNO(serrno);
+		destructor(ctx, value, size);
+		RESTORE_ERRNO(serrno);
+	}
+	return (NULL);
 }
 
 nvpair_t *
 nvpair_create_uuid(const char *name, const uuid_t *value)
 {
 
-	return (nvpair_createf_uuid(value, "%s", name));
+	return (nvpair_create_uuid_in(NULL, name, value));
+}
+
+nvpair_t *
+nvpair_create_uuid_in(struct nvlist_arena *arena, const char *name,
+    const uuid_t *value)
+{
+	nvpair_t *nvp;
+	void *data;
+	size_t size;
+
+	size = sizeof(uuid_t);
+
+	if (value == NULL) {
+		RESTORE_ERRNO(EINVAL);
+		return (NULL);
+	}
+
+	if (arena != NULL) {
+		return (nvpair_alloc(arena, NV_TYPE_UUID, 0, size, name,
+		    value));
+	}
+
+	data = nv_malloc(size);
+	if (data == NULL)
+		return (NULL);
+	memcpy(data, value, size);
+
+	nvp = nvpair_alloc(NULL, NV_TYPE_UUID, (uint64_t)(uintptr_t)data,
+	    size, name, NULL);
+	if (nvp == NULL)
+		nv_free(data);
+
+	return (nvp);
+}
+
+/*
+ * Allocate the data of a typed array pair, from the arena when there is one.
+ */
+static void *
+nvpair_array_alloc(struct nvlist_arena *arena, size_t size)
+{
+
+	if (arena != NULL)
+		return (nvlist_arena_alloc(arena, size));
+	return (nv_malloc(size));
+}
+
+/*
+ * Create a typed array pair around data, an allocation from
+ * nvpair_array_alloc() that the pair takes over.
+ */
+static nvpair_t *
+nvpair_create_array(struct nvlist_arena *arena, int type, const char *name,
+    void *data, size_t datasize, size_t nitems)
+{
+	nvpair_t *nvp;
+
+	nvp = nvpair_alloc(arena, type, (uint64_t)(uintptr_t)data, datasize,
+	    name, NULL);
+	if (nvp == NULL) {
+		if (arena == NULL)
+			nv_free(data);
+		return (NULL);
+	}
+	nvp->nvp_nitems = nitems;
+
+	return (nvp);
+}
+
+nvpair_t *
+nvpair_create_bool_array(const char *name, const bool *value, size_t nitems)
+{
+
+	return (nvpair_create_bool_array_in(NULL, name, value, nitems));
+}
+
+nvpair_t *
+nvpair_create_bool_array_in(struct nvlist_arena *arena, const char *name,
+    const bool *value, size_t nitems)
+{
+	bool *data;
+
+	if (value == NULL || nitems == 0 || nitems > SIZE_MAX / sizeof(bool)) {
+		RESTORE_ERRNO(EINVAL);
+		return (NULL);
+	}
+
+	data = nvpair_array_alloc(arena, nitems * sizeof(bool));
+	if (data == NULL)
+		return (NULL);
+	memcpy(data, value, nitems * sizeof(bool));
+
+	/* Packed as one byte per item. */
+	return (nvpair_create_array(arena, NV_TYPE_BOOL_ARRAY, name, data,
+	    nitems, nitems));
+}
+
+nvpair_t *
+nvpair_create_number_array_type(const char *name, const uint64_t *value,
+    size_t nitems, int type)
+{
+
+	return (nvpair_create_number_array_type_in(NULL, name, value, nitems,
+	    type));
+}
+
+nvpair_t *
+nvpair_create_number_array_type_in(struct nvlist_arena *arena,
+    const char *name, const uint64_t *value, size_t nitems, int type)
+{
+	uint64_t *data;
+	size_t size;
+
+	PJDLOG_ASSERT(type == NV_TYPE_INT64_ARRAY ||
+	    type == NV_TYPE_UINT64_ARRAY);
+
+	if (value == NULL || nitems == 0 ||
+	    nitems > SIZE_MAX / sizeof(uint64_t)) {
+		RESTORE_ERRNO(EINVAL);
+		return (NULL);
+	}
+
+	size = nitems * sizeof(uint64_t);
+	data = nvpair_array_alloc(arena, size);
+	if (data == NULL)
+		return (NULL);
+	memcpy(data, value, size);
+
+	return (nvpair_create_array(arena, type, name, data, size, nitems));
+}
+
+nvpair_t *
+nvpair_create_string_array(const char *name, const char * const *value,
+    size_t nitems)
+{
+
+	return (nvpair_create_string_array_in(NULL, name, value, nitems));
+}
+
+nvpair_t *
+nvpair_create_string_array_in(struct nvlist_arena *arena, const char *name,
+    const char * const *value, size_t nitems)
+{
+	const char **data;
+	char *str;
+	size_t ii, len, size;
+
+	if (value == NULL || nitems == 0 || nitems > SIZE_MAX / sizeof(char *)) {
+		RESTORE_ERRNO(EINVAL);
+		return (NULL);
+	}
+
+	size = 0;
+	for (ii = 0; ii < nitems; ii++) {
+		if (value[ii] == NULL) {
+			RESTORE_ERRNO(EINVAL);
+			return (NULL);
+		}
+		size += strlen(value[ii]) + 1;
+	}
+
+	data = nvpair_array_alloc(arena, nitems * sizeof(char *) + size);
+	if (data == NULL)
+		return (NULL);
+	str = (char *)(data + nitems);
+	for (ii = 0; ii < nitems; ii++) {
+		len = strlen(value[ii]) + 1;
+		memcpy(str, value[ii], len);
+		data[ii] = str;
+		str += len;
+	}
+
+	return (nvpair_create_array(arena, NV_TYPE_STRING_ARRAY, name, data,
+	    size, nitems));
 }
 
 nvpair_t *
@@ -979,191 +2136,311 @@ nvpair_createf_uuid(const uuid_t *value, const char *namefmt, ...)
 nvpair_t *
 nvpair_createv_null(const char *namefmt, va_list nameap)
 {
+	nvpair_t *nvp;
+	char *name;
+
+	nv_vasprintf(&name, namefmt, nameap);
+	if (name == NULL)
+		return (NULL);
+	nvp = nvpair_create_null(name);
+	nv_free(name);
 
-	return (nvpair_allocv(NV_TYPE_NULL, 0, 0, namefmt, nameap));
+	return (nvp);
 }
 
 nvpair_t *
 nvpair_createv_bool(bool value, const char *namefmt, va_list nameap)
 {
+	nvpair_t *nvp;
+	char *name;
+
+	nv_vasprintf(&name, namefmt, nameap);
+	if (name == NULL)
+		return (NULL);
+	nvp = nvpair_create_bool(name, value);
+	nv_free(name);
+
+	return (nvp);
+}
+
+nvpair_t *
+nvpair_createv_number_type(uint64_t value, int type, const char *namefmt, va_list nameap)
+{
+	nvpair_t *nvp;
+	char *name;
+
+	nv_vasprintf(&name, namefmt, nameap);
+	if (name == NULL)
+		return (NULL);
+	nvp = nvpair_create_number_type(name, value, type);
+	nv_free(name);
+
+	return (nvp);
+}
+
+nvpair_t *
+nvpair_createv_string(const char *value, const char *namefmt, va_list nameap)
+{
+	nvpair_t *nvp;
+	char *name;
+
+	nv_vasprintf(&name, namefmt, nameap);
+	if (name == NULL)
+		return (NULL);
+	nvp = nvpair_create_string(name, value);
+	nv_free(name);
+
+	return (nvp);
+}
+
+nvpair_t *
+nvpair_createv_nvlist_type(const nvlist_t *value, int type, const char *namefmt,
+    va_list nameap)
+{
+	nvpair_t *nvp;
+	char *name;
+
+	nv_vasprintf(&name, namefmt, nameap);
+	if (name == NULL)
+		return (NULL);
+	nvp = nvpair_create_nvlist_type(name, value, type);
+	nv_free(name);
+
+	return (nvp);
+}
+
+#ifndef _KERNEL
+nvpair_t *
+nvpair_createv_descriptor(int value, const char *namefmt, va_list nameap)
+{
+	nvpair_t *nvp;
+	char *name;
+
+	nv_vasprintf(&name, namefmt, nameap);
+	if (name == NULL)
+		return (NULL);
+	nvp = nvpair_create_descriptor(name, value);
+	nv_free(name);
+
+	return (nvp);
+}
+#endif
+
+nvpair_t *
+nvpair_createv_binary(const void *value, size_t size, const char *namefmt,
+    va_list nameap)
+{
+	nvpair_t *nvp;
+	char *name;
+
+	nv_vasprintf(&name, namefmt, nameap);
+	if (name == NULL)
+		return (NULL);
+	nvp = nvpair_create_binary(name, value, size);
+	nv_free(name);
+
+	return (nvp);
+}
+
+nvpair_t *
+nvpair_createv_uuid(const uuid_t *value,  const char *namefmt,
+    va_list nameap)
+{
+	nvpair_t *nvp;
+	char *name;
+
+	nv_vasprintf(&name, namefmt, nameap);
+	if (name == NULL)
+		return (NULL);
+	nvp = nvpair_create_uuid(name, value);
+	nv_free(name);
 
-	return (nvpair_allocv(NV_TYPE_BOOL, value ? 1 : 0, sizeof(uint8_t),
-	    namefmt, nameap));
+	return (nvp);
 }
 
 nvpair_t *
-nvpair_createv_number_type(uint64_t value, int type, const char *namefmt, va_list nameap)
+nvpair_move_string(const char *name, char *value)
 {
-	if (type > NV_TYPE_NUMBER_MAX || type < NV_TYPE_NUMBER_MIN)
-		return (NULL);
 
-	return (nvpair_allocv(type, value, sizeof(value), namefmt,
-	    nameap));
+	return (nvpair_move_string_in(NULL, name, value));
 }
 
+/*
+ * Arena pairs don't reference payloads they can't release with the arena,
+ * so moving into an arena copies the value and frees it right away.
+ */
 nvpair_t *
-nvpair_createv_string(const char *value, const char *namefmt, va_list nameap)
+nvpair_move_string_in(struct nvlist_arena *arena, const char *name,
+    char *value)
 {
 	nvpair_t *nvp;
-	size_t size;
-	char *data;
+	int serrno;
 
 	if (value == NULL) {
 		RESTORE_ERRNO(EINVAL);
 		return (NULL);
 	}
 
-	data = nv_strdup(value);
-	if (data == NULL)
-		return (NULL);
-	size = strlen(value) + 1;
+	if (arena != NULL) {
+		nvp = nvpair_create_string_in(arena, name, value);
+		SAVE_ERRNO(serrno);
+		nv_free(value);
+		RESTORE_ERRNO(serrno);
+		return (nvp);
+	}
 
-	nvp = nvpair_allocv(NV_TYPE_STRING, (uint64_t)(uintptr_t)data, size,
-	    namefmt, nameap);
-	if (nvp == NULL)
-		nv_free(data);
+	nvp = nvpair_alloc(NULL, NV_TYPE_STRING, (uint64_t)(uintptr_t)value,
+	    strlen(value) + 1, name, NULL);
+	if (nvp == NULL) {
+		SAVE_ERRNO(serrno);
+		nv_free(value);
+		RESTORE_ERRNO(serrno);
+	}
 
 	return (nvp);
 }
 
 nvpair_t *
-nvpair_createv_nvlist_type(const nvlist_t *value, int type, const char *namefmt,
-    va_list nameap)
+nvpair_move_nvlist(const char *name, nvlist_t *value)
+{
+
+	return (nvpair_move_nvlist_type(name, value, NV_TYPE_NVLIST));
+}
+
+nvpair_t *
+nvpair_move_nvlist_type(const char *name, nvlist_t *value, int type)
+{
+
+	return (nvpair_move_nvlist_type_in(NULL, name, value, type));
+}
+
+nvpair_t *
+nvpair_move_nvlist_type_in(struct nvlist_arena *arena, const char *name,
+    nvlist_t *value, int type)
 {
-	nvlist_t *nvl;
 	nvpair_t *nvp;
 
-	if (value == NULL) {
+	if (value == NULL || nvlist_get_nvpair_parent(value) != NULL) {
 		RESTORE_ERRNO(EINVAL);
 		return (NULL);
 	}
 
-	nvl = nvlist_clone(value);
-	if (nvl == NULL)
+	if (nvlist_error(value) != 0) {
+		RESTORE_ERRNO(nvlist_error(value));
+		nvlist_destroy(value);
 		return (NULL);
+	}
 
-	nvp = nvpair_allocv(type, (uint64_t)(uintptr_t)nvl, 0,
-	    namefmt, nameap);
+	nvp = nvpair_alloc(arena, type, (uint64_t)(uintptr_t)value, 0, name,
+	    NULL);
 	if (nvp == NULL)
-		nvlist_destroy(nvl);
-	else
-		nvlist_set_parent(nvl, nvp);
+		nvlist_destroy(value);
+	else if (!nvlist_frozen(value))
+		nvlist_set_parent(value, nvp);
 
 	return (nvp);
 }
 
 #ifndef _KERNEL
 nvpair_t *
-nvpair_createv_descriptor(int value, const char *namefmt, va_list nameap)
+nvpair_move_descriptor(const char *name, int value)
+{
+
+	return (nvpair_move_descriptor_in(NULL, name, value));
+}
+
+nvpair_t *
+nvpair_move_descriptor_in(struct nvlist_arena *arena, const char *name,
+    int value)
 {
 	nvpair_t *nvp;
+	int serrno;
 
 	if (value < 0) {
 		errno = EBADF;
 		return (NULL);
 	}
 
-	value = fcntl(value, F_DUPFD_CLOEXEC, 0);
-	if (value < 0)
-		return (NULL);
-
-	nvp = nvpair_allocv(NV_TYPE_DESCRIPTOR, (uint64_t)value,
-	    sizeof(int64_t), namefmt, nameap);
-	if (nvp == NULL)
+	nvp = nvpair_alloc(arena, NV_TYPE_DESCRIPTOR, (uint64_t)value,
+	    sizeof(int64_t), name, NULL);
+	if (nvp == NULL) {
+		serrno = errno;
 		close(value);
+		errno = serrno;
+	}
 
 	return (nvp);
 }
 #endif
 
 nvpair_t *
-nvpair_createv_binary(const void *value, size_t size, const char *namefmt,
-    va_list nameap)
+nvpair_move_binary(const char *name, void *value, size_t size)
 {
-	nvpair_t *nvp;
-	void *data;
-
-	if (value == NULL || size == 0) {
-		RESTORE_ERRNO(EINVAL);
-		return (NULL);
-	}
-
-	data = nv_malloc(size);
-	if (data == NULL)
-		return (NULL);
-	memcpy(data, value, size);
-
-	nvp = nvpair_allocv(NV_TYPE_BINARY, (uint64_t)(uintptr_t)data, size,
-	    namefmt, nameap);
-	if (nvp == NULL)
-		nv_free(data);
 
-	return (nvp);
+	return (nvpair_move_binary_in(NULL, name, value, size));
 }
 
 nvpair_t *
-nvpair_createv_uuid(const uuid_t *value,  const char *namefmt,
-    va_list nameap)
+nvpair_move_binary_in(struct nvlist_arena *arena, const char *name,
+    void *value, size_t size)
 {
 	nvpair_t *nvp;
-	void *data;
-	size_t size;
-
-	size = sizeof(uuid_t);
+	int serrno;
 
-	if (value == NULL) {
+	if (value == NULL || size == 0) {
 		RESTORE_ERRNO(EINVAL);
 		return (NULL);
 	}
 
-	data = nv_malloc(size);
-	if (data == NULL)
-		return (NULL);
-	memcpy(data, value, size);
-
-	nvp = nvpair_allocv(NV_TYPE_UUID, (uint64_t)(uintptr_t)data, size,
-	    namefmt, nameap);
-	if (nvp == NULL)
-		nv_free(data);
-
-	return (nvp);	
-}
-
-nvpair_t *
-nvpair_move_string(const char *name, char *value)
-{
-
-	return (nvpair_movef_string(value, "%s", name));
-}
+	if (arena != NULL) {
+		nvp = nvpair_create_binary_in(arena, name, value, size);
+		SAVE_ERRNO(serrno);
+		nv_free(value);
+		RESTORE_ERRNO(serrno);
+		return (nvp);
+	}
 
-nvpair_t *
-nvpair_move_nvlist(const char *name, nvlist_t *value)
-{
+	nvp = nvpair_alloc(NULL, NV_TYPE_BINARY, (uint64_t)(uintptr_t)value,
+	    size, name, NULL);
+	if (nvp == NULL) {
+		SAVE_ERRNO(serrno);
+		nv_free(value);
+		RESTORE_ERRNO(serrno);
+	}
 
-	return (nvpair_movef_nvlist_type(value, NV_TYPE_NVLIST, "%s", name));
+	return (nvp);
 }
 
 nvpair_t *
-nvpair_move_nvlist_type(const char *name, nvlist_t *value, int type)
+nvpair_move_uuid(const char *name, uuid_t *value)
 {
 
-	return (nvpair_movef_nvlist_type(value, type, "%s", name));
+	return (nvpair_move_uuid_in(NULL, name, value));
 }
 
-#ifndef _KERNEL
 nvpair_t *
-nvpair_move_descriptor(const char *name, int value)
+nvpair_move_uuid_in(struct nvlist_arena *arena, const char *name,
+    uuid_t *value)
 {
+	nvpair_t *nvp;
+	int serrno;
 
-	return (nvpair_movef_descriptor(value, "%s", name));
-}
-#endif
+	if (value == NULL) {
+		RESTORE_ERRNO(EINVAL);
+		return (NULL);
+	}
 
-nvpair_t *
-nvpair_move_binary(const char *name, void *value, size_t size)
-{
+	if (arena != NULL) {
+		nvp = nvpair_create_uuid_in(arena, name,
+		    (const uuid_t *)value);
+		SAVE_ERRNO(serrno);
+		nv_free(value);
+		RESTORE_ERRNO(serrno);
+		return (nvp);
+	}
 
-	return (nvpair_movef_binary(value, size, "%s", name));
+	return (nvpair_alloc(NULL, NV_TYPE_UUID, (uint64_t)(uintptr_t)value,
+	    sizeof(uuid_t), name, NULL));
 }
 
 nvpair_t *
@@ -1237,20 +2514,15 @@ nvpair_t *
 nvpair_movev_string(char *value, const char *namefmt, va_list nameap)
 {
 	nvpair_t *nvp;
-	int serrno;
-
-	if (value == NULL) {
-		RESTORE_ERRNO(EINVAL);
-		return (NULL);
-	}
+	char *name;
 
-	nvp = nvpair_allocv(NV_TYPE_STRING, (uint64_t)(uintptr_t)value,
-	    strlen(value) + 1, namefmt, nameap);
-	if (nvp == NULL) {
-		SAVE_ERRNO(serrno);
+	nv_vasprintf(&name, namefmt, nameap);
+	if (name == NULL) {
 		nv_free(value);
-		RESTORE_ERRNO(serrno);
+		return (NULL);
 	}
+	nvp = nvpair_move_string(name, value);
+	nv_free(name);
 
 	return (nvp);
 }
@@ -1259,24 +2531,13 @@ nvpair_t *
 nvpair_movev_nvlist_type(nvlist_t *value, int type, const char *namefmt, va_list nameap)
 {
 	nvpair_t *nvp;
+	char *name;
 
-	if (value == NULL || nvlist_get_nvpair_parent(value) != NULL) {
-		RESTORE_ERRNO(EINVAL);
-		return (NULL);
-	}
-
-	if (nvlist_error(value) != 0) {
-		RESTORE_ERRNO(nvlist_error(value));
-		nvlist_destroy(value);
+	nv_vasprintf(&name, namefmt, nameap);
+	if (name == NULL)
 		return (NULL);
-	}
-
-	nvp = nvpair_allocv(type, (uint64_t)(uintptr_t)value, 0,
-	    namefmt, nameap);
-	if (nvp == NULL)
-		nvlist_destroy(value);
-	else
-		nvlist_set_parent(value, nvp);
+	nvp = nvpair_move_nvlist_type(name, value, type);
+	nv_free(name);
 
 	return (nvp);
 }
@@ -1286,20 +2547,13 @@ nvpair_t *
 nvpair_movev_descriptor(int value, const char *namefmt, va_list nameap)
 {
 	nvpair_t *nvp;
-	int serrno;
+	char *name;
 
-	if (value < 0) {
-		errno = EBADF;
+	nv_vasprintf(&name, namefmt, nameap);
+	if (name == NULL)
 		return (NULL);
-	}
-
-	nvp = nvpair_allocv(NV_TYPE_DESCRIPTOR, (uint64_t)value,
-	    sizeof(int64_t), namefmt, nameap);
-	if (nvp == NULL) {
-		serrno = errno;
-		close(value);
-		errno = serrno;
-	}
+	nvp = nvpair_move_descriptor(name, value);
+	nv_free(name);
 
 	return (nvp);
 }
@@ -1310,20 +2564,15 @@ nvpair_movev_binary(void *value, size_t size, const char *namefmt,
     va_list nameap)
 {
 	nvpair_t *nvp;
-	int serrno;
-
-	if (value == NULL || size == 0) {
-		RESTORE_ERRNO(EINVAL);
-		return (NULL);
-	}
+	char *name;
 
-	nvp = nvpair_allocv(NV_TYPE_BINARY, (uint64_t)(uintptr_t)value, size,
-	    namefmt, nameap);
-	if (nvp == NULL) {
-		SAVE_ERRNO(serrno);
+	nv_vasprintf(&name, namefmt, nameap);
+	if (name == NULL) {
 		nv_free(value);
-		RESTORE_ERRNO(serrno);
+		return (NULL);
 	}
+	nvp = nvpair_move_binary(name, value, size);
+	nv_free(name);
 
 	return (nvp);
 }
@@ -1332,14 +2581,16 @@ nvpair_t *
 nvpair_movev_uuid(uuid_t *value, const char *namefmt,
     va_list nameap)
 {
+	nvpair_t *nvp;
+	char *name;
 
-	if (value == NULL) {
-		RESTORE_ERRNO(EINVAL);
+	nv_vasprintf(&name, namefmt, nameap);
+	if (name == NULL)
 		return (NULL);
-	}
+	nvp = nvpair_move_uuid(name, value);
+	nv_free(name);
 
-	return (nvpair_allocv(NV_TYPE_UUID, (uint64_t)(uintptr_t)value,
-	    sizeof(uuid_t), namefmt, nameap));
+	return (nvp);
 }
 
 bool
@@ -1416,6 +2667,60 @@ nvpair_get_uuid(const nvpair_t *nvp)
 	return ((const uuid_t *)(intptr_t)nvp->nvp_data);
 }
 
+const bool *
+nvpair_get_bool_array(const nvpair_t *nvp, size_t *nitemsp)
+{
+
+	NVPAIR_ASSERT(nvp);
+	PJDLOG_ASSERT(nvp->nvp_type == NV_TYPE_BOOL_ARRAY);
+
+	if (nitemsp != NULL)
+		*nitemsp = nvp->nvp_nitems;
+	return ((const bool *)(intptr_t)nvp->nvp_data);
+}
+
+const uint64_t *
+nvpair_get_number_array(const nvpair_t *nvp, size_t *nitemsp)
+{
+
+	NVPAIR_ASSERT(nvp);
+	PJDLOG_ASSERT(nvp->nvp_type == NV_TYPE_INT64_ARRAY ||
+	    nvp->nvp_type == NV_TYPE_UINT64_ARRAY);
+
+	if (nitemsp != NULL)
+		*nitemsp = nvp->nvp_nitems;
+	return ((const uint64_t *)(intptr_t)nvp->nvp_data);
+}
+
+const char * const *
+nvpair_get_string_array(const nvpair_t *nvp, size_t *nitemsp)
+{
+
+	NVPAIR_ASSERT(nvp);
+	PJDLOG_ASSERT(nvp->nvp_type == NV_TYPE_STRING_ARRAY);
+
+	if (nitemsp != NULL)
+		*nitemsp = nvp->nvp_nitems;
+	return ((const char * const *)(intptr_t)nvp->nvp_data);
+}
+
+/*
+ * Hand an external binary value back to its owner.
+ */
+static void
+nvpair_release_external(nvpair_t *nvp)
+{
+	struct nvpair_external *external;
+
+	external = nvp->nvp_external;
+	nvp->nvp_external = NULL;
+	if (external->nve_destructor != NULL) {
+		external->nve_destructor(external->nve_ctx,
+		    (const void *)(uintptr_t)nvp->nvp_data, nvp->nvp_datasize);
+	}
+	nv_free(external);
+}
+
 void
 nvpair_free(nvpair_t *nvp)
 {
@@ -1436,16 +2741,27 @@ nvpair_free(nvpair_t *nvp)
 		nvlist_destroy((nvlist_t *)(intptr_t)nvp->nvp_data);
 		break;
 	case NV_TYPE_STRING:
-		nv_free((char *)(intptr_t)nvp->nvp_data);
+		if (nvp->nvp_arena == NULL)
+			nv_free((char *)(intptr_t)nvp->nvp_data);
 		break;
 	case NV_TYPE_BINARY:
-		nv_free((void *)(intptr_t)nvp->nvp_data);
-		break;
+		if (nvp->nvp_external != NULL) {
+			nvpair_release_external(nvp);
+			break;
+		}
+		/* FALLTHROUGH */
 	case NV_TYPE_UUID:
-		nv_free((void *)(intptr_t)nvp->nvp_data);
-		break;	
+	case NV_TYPE_BOOL_ARRAY:
+	case NV_TYPE_INT64_ARRAY:
+	case NV_TYPE_UINT64_ARRAY:
+	case NV_TYPE_STRING_ARRAY:
+		if (nvp->nvp_arena == NULL)
+			nv_free((void *)(intptr_t)nvp->nvp_data);
+		break;
 	}
-	nv_free(nvp);
+	/* Arena pairs go away with their arena. */
+	if (nvp->nvp_arena == NULL)
+		nv_free(nvp);
 }
 
 void
@@ -1456,7 +2772,48 @@ nvpair_free_structure(nvpair_t *nvp)
 	PJDLOG_ASSERT(nvp->nvp_list == NULL);
 
 	nvp->nvp_magic = 0;
-	nv_free(nvp);
+	nv_free(nvp->nvp_external);
+	if (nvp->nvp_arena == NULL)
+		nv_free(nvp);
+}
+
+/*
+ * Give the payload of an arena pair or of an external binary pair an
+ * allocation of its own, so that the nvlist_take functions can hand it
+ * over to the caller.
+ */
+void
+nvpair_detach_payload(nvpair_t *nvp)
+{
+	void *data;
+
+	NVPAIR_ASSERT(nvp);
+
+	if (nvp->nvp_external != NULL) {
+		data = nv_malloc(nvp->nvp_datasize);
+		if (data != NULL) {
+			memcpy(data, (void *)(uintptr_t)nvp->nvp_data,
+			    nvp->nvp_datasize);
+		}
+		nvpair_release_external(nvp);
+		nvp->nvp_data = (uint64_t)(uintptr_t)data;
+		return;
+	}
+	if (nvp->nvp_arena == NULL)
+		return;
+
+	switch (nvp->nvp_type) {
+	case NV_TYPE_STRING:
+	case NV_TYPE_BINARY:
+	case NV_TYPE_UUID:
+		data = nv_malloc(nvp->nvp_datasize);
+		if (data != NULL) {
+			memcpy(data, (void *)(uintptr_t)nvp->nvp_data,
+			    nvp->nvp_datasize);
+		}
+		nvp->nvp_data = (uint64_t)(uintptr_t)data;
+		break;
+	}
 }
 
 const char *
@@ -1490,8 +2847,18 @@ nvpair_type_string(int type)
 		return ("INT64");
 	case NV_TYPE_ENDPOINT:
 		return ("ENDPOINT");
+	case NV_TYPE_DATE:
+		return ("DATE");
 	case NV_TYPE_UUID:
 		return ("UUID");
+	case NV_TYPE_BOOL_ARRAY:
+		return ("BOOL_ARRAY");
+	case NV_TYPE_INT64_ARRAY:
+		return ("INT64_ARRAY");
+	case NV_TYPE_UINT64_ARRAY:
+		return ("UINT64_ARRAY");
+	case NV_TYPE_STRING_ARRAY:
+		return ("STRING_ARRAY");
 	default:
 		return ("<UNKNOWN>");
 	}
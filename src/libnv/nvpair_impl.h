@@ -47,16 +47,23 @@ nvlist_t *nvpair_nvlist(const nvpair_t *nvp);
 nvpair_t *nvpair_next(const nvpair_t *nvp);
 nvpair_t *nvpair_prev(const nvpair_t *nvp);
 void nvpair_insert(struct nvl_head *head, nvpair_t *nvp, nvlist_t *nvl);
+void nvpair_insert_unique(struct nvl_head *head, nvpair_t *nvp,
+    nvlist_t *nvl);
 void nvpair_remove(struct nvl_head *head, nvpair_t *nvp, const nvlist_t *nvl);
 size_t nvpair_header_size(void);
 size_t nvpair_size(const nvpair_t *nvp);
 const unsigned char *nvpair_unpack(bool isbe, const unsigned char *ptr,
     size_t *leftp, nvpair_t **nvpp);
 void nvpair_free_structure(nvpair_t *nvp);
+void nvpair_detach_payload(nvpair_t *nvp);
+struct nvlist_arena *nvpair_arena(const nvpair_t *nvp);
 void nvpair_init_datasize(nvpair_t *nvp);
 const char *nvpair_type_string(int type);
 
 /* Pack functions. */
+unsigned char *nvpair_pack_raw_header(int type, const char *name,
+    size_t namesize, uint64_t datasize, unsigned char *ptr, size_t *leftp);
+void nvpair_pack_datasize(unsigned char *ptr, uint64_t datasize);
 unsigned char *nvpair_pack_header(const nvpair_t *nvp, unsigned char *ptr,
     size_t *leftp);
 unsigned char *nvpair_pack_null(const nvpair_t *nvp, unsigned char *ptr,
@@ -71,7 +78,12 @@ unsigned char *nvpair_pack_descriptor(const nvpair_t *nvp, unsigned char *ptr,
     int64_t *fdidxp, size_t *leftp);
 unsigned char *nvpair_pack_binary(const nvpair_t *nvp, unsigned char *ptr,
     size_t *leftp);
+unsigned char *nvpair_pack_array(const nvpair_t *nvp, unsigned char *ptr,
+    size_t *leftp);
 unsigned char *nvpair_pack_nvlist_up(unsigned char *ptr, size_t *leftp);
+const void *nvpair_payload(const nvpair_t *nvp, size_t *sizep);
+void nvpair_peek_header(bool isbe, const unsigned char *ptr, int *typep,
+    size_t *namesizep, uint64_t *datasizep);
 
 /* Unpack data functions. */
 const unsigned char *nvpair_unpack_header(bool isbe, nvpair_t *nvp,
@@ -90,5 +102,47 @@ const unsigned char *nvpair_unpack_descriptor(bool isbe, nvpair_t *nvp,
     const unsigned char *ptr, size_t *leftp, const int *fds, size_t nfds);
 const unsigned char *nvpair_unpack_binary(bool isbe, nvpair_t *nvp,
     const unsigned char *ptr, size_t *leftp);
+const unsigned char *nvpair_unpack_array(bool isbe, nvpair_t *nvp,
+    const unsigned char *ptr, size_t *leftp);
+nvpair_t *nvpair_unpack_compact(int type, const char *name, uint64_t datasize);
+const unsigned char *nvpair_unpack_native(const unsigned char *ptr,
+    size_t *leftp, nvpair_t **nvpp, nvlist_t **child);
+
+/* Arena functions; a NULL arena allocates from the heap. */
+nvpair_t *nvpair_create_null_in(struct nvlist_arena *arena, const char *name);
+nvpair_t *nvpair_create_bool_in(struct nvlist_arena *arena, const char *name,
+    bool value);
+nvpair_t *nvpair_create_number_type_in(struct nvlist_arena *arena,
+    const char *name, uint64_t value, int type);
+nvpair_t *nvpair_create_string_in(struct nvlist_arena *arena,
+    const char *name, const char *value);
+nvpair_t *nvpair_create_descriptor_in(struct nvlist_arena *arena,
+    const char *name, int value);
+nvpair_t *nvpair_create_binary_in(struct nvlist_arena *arena,
+    const char *name, const void *value, size_t size);
+nvpair_t *nvpair_create_uuid_in(struct nvlist_arena *arena, const char *name,
+    const uuid_t *value);
+nvpair_t *nvpair_create_bool_array_in(struct nvlist_arena *arena,
+    const char *name, const bool *value, size_t nitems);
+nvpair_t *nvpair_create_number_array_type_in(struct nvlist_arena *arena,
+    const char *name, const uint64_t *value, size_t nitems, int type);
+nvpair_t *nvpair_create_string_array_in(struct nvlist_arena *arena,
+    const char *name, const char * const *value, size_t nitems);
+nvpair_t *nvpair_move_string_in(struct nvlist_arena *arena, const char *name,
+    char *value);
+nvpair_t *nvpair_move_nvlist_type_in(struct nvlist_arena *arena,
+    const char *name, nvlist_t *value, int type);
+nvpair_t *nvpair_move_descriptor_in(struct nvlist_arena *arena,
+    const char *name, int value);
+nvpair_t *nvpair_move_binary_in(struct nvlist_arena *arena, const char *name,
+    void *value, size_t size);
+nvpair_t *nvpair_move_uuid_in(struct nvlist_arena *arena, const char *name,
+    uuid_t *value);
+
+/* View functions. */
+const unsigned char *nvpair_view_unpack(bool isbe, const unsigned char *ptr,
+    size_t *leftp, nvpair_view_t *nvpv);
+const unsigned char *nvpair_view_header(bool isbe, const unsigned char *ptr,
+    nvpair_view_t *nvpv);
 
 #endif	/* !_NVPAIR_IMPL_H_ */
@@ -33,10 +33,13 @@
 
 @implementation OS_OBJECT_CLASS(xpc_object)
 
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wobjc-missing-super-calls"
 - (void)dealloc {
+	// Objects live in xpc_slab_alloc() memory, xpc_object_destroy() frees it.
 	xpc_object_destroy((__bridge struct xpc_object *)(self));
-	[super dealloc];
 }
+#pragma clang diagnostic pop
 
 @end
 
@@ -46,7 +49,6 @@
 @implementation OS_OBJECT_CLASS(xpc_connection)
 
 - (void)dealloc {
-	xpc_object_destroy((__bridge struct xpc_object *)(self));
 	[super dealloc];
 }
 
@@ -31,6 +31,7 @@
 #include <mach/mach.h>
 #include <libkern/OSByteOrder.h>
 #include <sys/types.h>
+#include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/fcntl.h>
 #include <sys/un.h>
@@ -42,6 +43,7 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 #include <pwd.h>
 #include <assert.h>
 #include <uuid/uuid.h>
@@ -161,11 +163,13 @@ enum {
 struct _launch {
 	void	*sendbuf;
 	int	*sendfds;
-	void	*recvbuf;
+	nvlist_parser_t *parser;
 	int	*recvfds;
 	size_t	sendlen;
 	size_t	sendfdcnt;
-	size_t	recvlen;
+	struct launch_msg_header recvhdr;
+	size_t	recvhdrlen;
+	uint64_t recvleft;
 	size_t	recvfdcnt;
 	int which;
 	int cifd;
@@ -373,7 +377,12 @@ launch_data_dict_iterate(launch_data_t dict, void (*cb)(launch_data_t, const cha
 bool
 launch_data_array_set_index(launch_data_t where, launch_data_t what, size_t ind)
 {
-	xpc_array_set_value(where, ind, what);
+	if (ind > xpc_array_get_count(where))
+		return false;
+	if (ind == xpc_array_get_count(where))
+		xpc_array_append_value(where, what);
+	else
+		xpc_array_set_value(where, ind, what);
 	return true;
 }
 
@@ -383,26 +392,12 @@ launch_data_array_get_index(launch_data_t where, size_t ind)
 	return xpc_array_get_value(where, ind);
 }
 
+extern xpc_object_t xpc_array_take_value(xpc_object_t xarray, size_t index);
+
 launch_data_t
 launch_data_array_pop_first(launch_data_t where)
 {
-	xpc_object_t copy = xpc_array_create(NULL, 0);
-
-	__block bool first = true;
-	xpc_array_apply(where, ^bool(size_t index, xpc_object_t value) {
-		if (first) {
-			first = false;
-		} else {
-			xpc_array_append_value(copy, value);
-		}
-
-		return true;
-	});
-
-	xpc_release(where);
-	xpc_retain(copy);
-
-	return copy;
+	return xpc_array_take_value(where, 0);
 }
 
 size_t
@@ -561,7 +556,7 @@ launchd_fdopen(int fd, int cifd)
 		goto out_bad;
 	if ((c->sendfds = malloc(0)) == NULL)
 		goto out_bad;
-	if ((c->recvbuf = malloc(0)) == NULL)
+	if ((c->parser = nvlist_parser_create(0)) == NULL)
 		goto out_bad;
 	if ((c->recvfds = malloc(0)) == NULL)
 		goto out_bad;
@@ -573,8 +568,7 @@ out_bad:
 		free(c->sendbuf);
 	if (c->sendfds)
 		free(c->sendfds);
-	if (c->recvbuf)
-		free(c->recvbuf);
+	nvlist_parser_destroy(c->parser);
 	if (c->recvfds)
 		free(c->recvfds);
 	free(c);
@@ -594,8 +588,7 @@ launchd_close(launch_t lh, typeof(close) closefunc)
 		free(lh->sendbuf);
 	if (lh->sendfds)
 		free(lh->sendfds);
-	if (lh->recvbuf)
-		free(lh->recvbuf);
+	nvlist_parser_destroy(lh->parser);
 	if (lh->recvfds)
 		free(lh->recvfds);
 	closefunc(lh->fd);
@@ -606,23 +599,23 @@ launchd_close(launch_t lh, typeof(close) closefunc)
 #define ROUND_TO_64BIT_WORD_SIZE(x)	((x + 7) & ~7)
 
 extern nvlist_t *xpc2nv(xpc_object_t xo, int64_t (^port_serializer)(mach_port_t port));
+extern size_t xpc2wire_size(xpc_object_t xo);
+extern int xpc2wire(xpc_object_t xo, void *buf, size_t size, int64_t (^port_serializer)(mach_port_t port));
 extern xpc_object_t nv2xpc(const nvlist_t *nv, mach_port_t (^port_deserializer)(int64_t port_id));
+extern xpc_object_t nv2xpc_view(const nvlist_view_t *view, mach_port_t (^port_deserializer)(int64_t port_id));
 
 size_t
 launch_data_pack(launch_data_t d, void *where, size_t len, int *fd_where, size_t *fd_cnt)
 {
-	nvlist_t *nvl = xpc2nv(d, ^int64_t(mach_port_t port) {
+	/*
+	 * Encode straight into the caller's buffer.  Like the original
+	 * liblaunch, 0 means the message did not fit.
+	 */
+	size_t size = xpc2wire_size(d);
+	if (size > len || xpc2wire(d, where, size, ^int64_t(mach_port_t port) {
 		xpc_api_misuse("Cannot currently serialize mach ports in launch_data_pack()");
-	});
-
-	size_t size;
-	void *data = nvlist_pack(nvl, &size);
-	if (size >= len) {
-		memcpy(where, data, size);
-	}
-
-	free(data);
-	nvlist_destroy(nvl);
+	}) != 0)
+		size = 0;
 
 	return size;
 }
@@ -630,12 +623,52 @@ launch_data_pack(launch_data_t d, void *where, size_t len, int *fd_where, size_t
 launch_data_t
 launch_data_unpack(void *data, size_t data_size, int *fds, size_t fd_cnt, size_t *data_offset, size_t *fdoffset)
 {
-	nvlist_t *nvl = nvlist_unpack(data, data_size);
-	xpc_object_t xo = nv2xpc(nvl, ^mach_port_t(int64_t port_id) {
+	nvlist_view_t view;
+	if (!nvlist_view_init(&view, data, data_size))
+		return NULL;
+
+	return nv2xpc_view(&view, ^mach_port_t(int64_t port_id) {
 		xpc_api_misuse("Should not be called");
 	});
-	nvlist_destroy(nvl);
-	return xo;
+}
+
+/*
+ * Keep the part of iov past the first skip bytes in lh->sendbuf, where the
+ * next launchd_msg_send(lh, NULL) picks it up.
+ */
+static int
+launchd_msg_stash(launch_t lh, const struct iovec *iov, size_t niov, size_t skip)
+{
+	size_t i, len, total = 0;
+	char *p;
+
+	for (i = 0; i < niov; i++)
+		total += iov[i].iov_len;
+	lh->sendlen = 0;
+	if (total <= skip)
+		return 0;
+
+	free(lh->sendbuf);
+	if ((lh->sendbuf = malloc(total - skip)) == NULL) {
+		lh->sendbuf = malloc(0);
+		errno = ENOMEM;
+		return -1;
+	}
+	lh->sendlen = total - skip;
+
+	p = lh->sendbuf;
+	for (i = 0; i < niov; i++) {
+		len = iov[i].iov_len;
+		if (skip >= len) {
+			skip -= len;
+			continue;
+		}
+		memcpy(p, (char *)iov[i].iov_base + skip, len - skip);
+		p += len - skip;
+		skip = 0;
+	}
+
+	return 0;
 }
 
 int
@@ -644,9 +677,10 @@ launchd_msg_send(launch_t lh, launch_data_t d)
 	struct launch_msg_header lmh;
 	struct cmsghdr *cm = NULL;
 	struct msghdr mh;
-	struct iovec iov[2];
-	size_t sentctrllen = 0;
-	int r;
+	struct iovec iov, *msgiov = NULL, *packed = NULL;
+	nvlist_t *nvl = NULL;
+	size_t sentctrllen = 0, niov = 0, size;
+	int r, serrno;
 
 	int fd2use = launchd_getfd(lh);
 	if (fd2use == -1) {
@@ -660,53 +694,51 @@ launchd_msg_send(launch_t lh, launch_data_t d)
 	assert((d && lh->sendlen == 0) || (!d && lh->sendlen));
 
 	if (d) {
-		size_t fd_slots_used = 0;
-		size_t good_enough_size = 10 * 1024 * 1024;
 		uint64_t msglen;
 
-		/* hack, see the above assert to verify "correctness" */
-		free(lh->sendbuf);
-		lh->sendbuf = malloc(good_enough_size);
-		if (!lh->sendbuf) {
+		/*
+		 * Send straight out of the nvlist: large strings and data are
+		 * handed to sendmsg() where they live, and only what the socket
+		 * does not take right away is copied to lh->sendbuf.
+		 */
+		nvl = xpc2nv(d, ^int64_t(mach_port_t port) {
+			xpc_api_misuse("Cannot currently serialize mach ports in launchd_msg_send()");
+		});
+		packed = nvlist_pack_iov(nvl, &niov, &size);
+		if (packed == NULL) {
+			nvlist_destroy(nvl);
 			errno = ENOMEM;
 			return -1;
 		}
 
-		free(lh->sendfds);
-		lh->sendfds = malloc(4 * 1024);
-		if (!lh->sendfds) {
-			free(lh->sendbuf);
-			lh->sendbuf = NULL;
-			errno = ENOMEM;
-			return -1;
-		}
-
-		lh->sendlen = launch_data_pack(d, lh->sendbuf, good_enough_size, lh->sendfds, &fd_slots_used);
-
-		if (lh->sendlen == 0) {
+		if ((msgiov = malloc((niov + 1) * sizeof(*msgiov))) == NULL) {
+			free(packed);
+			nvlist_destroy(nvl);
 			errno = ENOMEM;
 			return -1;
 		}
 
-		lh->sendfdcnt = fd_slots_used;
+		lh->sendfdcnt = 0;
 
-		msglen = lh->sendlen + sizeof(struct launch_msg_header); /* type promotion to make the host2wire() macro work right */
+		msglen = size + sizeof(struct launch_msg_header); /* type promotion to make the host2wire() macro work right */
 		lmh.len = host2wire(msglen);
 		lmh.magic = host2wire(LAUNCH_MSG_HEADER_MAGIC);
 
-		iov[0].iov_base = &lmh;
-		iov[0].iov_len = sizeof(lmh);
-		mh.msg_iov = iov;
-		mh.msg_iovlen = 2;
+		msgiov[0].iov_base = &lmh;
+		msgiov[0].iov_len = sizeof(lmh);
+		memcpy(msgiov + 1, packed, niov * sizeof(*msgiov));
+		niov++;
+
+		/* Anything past IOV_MAX is left over and stashed below. */
+		mh.msg_iov = msgiov;
+		mh.msg_iovlen = niov > IOV_MAX ? IOV_MAX : niov;
 	} else {
-		mh.msg_iov = iov + 1;
+		iov.iov_base = lh->sendbuf;
+		iov.iov_len = lh->sendlen;
+		mh.msg_iov = &iov;
 		mh.msg_iovlen = 1;
 	}
 
-	iov[1].iov_base = lh->sendbuf;
-	iov[1].iov_len = lh->sendlen;
-
-
 	if (lh->sendfdcnt > 0) {
 		sentctrllen = mh.msg_controllen = CMSG_SPACE(lh->sendfdcnt * sizeof(int));
 		cm = alloca(mh.msg_controllen);
@@ -721,7 +753,20 @@ launchd_msg_send(launch_t lh, launch_data_t d)
 		memcpy(CMSG_DATA(cm), lh->sendfds, lh->sendfdcnt * sizeof(int));
 	}
 
-	if ((r = sendmsg(fd2use, &mh, 0)) == -1) {
+	r = sendmsg(fd2use, &mh, 0);
+
+	if (d) {
+		serrno = errno;
+		if (launchd_msg_stash(lh, msgiov, niov, r > 0 ? r : 0) == -1)
+			r = -1;
+		else
+			errno = serrno;
+		free(msgiov);
+		free(packed);
+		nvlist_destroy(nvl);
+	}
+
+	if (r == -1) {
 		return -1;
 	} else if (r == 0) {
 		errno = ECONNRESET;
@@ -731,16 +776,14 @@ launchd_msg_send(launch_t lh, launch_data_t d)
 		return -1;
 	}
 
-	if (d) {
-		r -= sizeof(struct launch_msg_header);
-	}
-
-	lh->sendlen -= r;
-	if (lh->sendlen > 0) {
-		memmove(lh->sendbuf, lh->sendbuf + r, lh->sendlen);
-	} else {
-		free(lh->sendbuf);
-		lh->sendbuf = malloc(0);
+	if (!d) {
+		lh->sendlen -= r;
+		if (lh->sendlen > 0) {
+			memmove(lh->sendbuf, lh->sendbuf + r, lh->sendlen);
+		} else {
+			free(lh->sendbuf);
+			lh->sendbuf = malloc(0);
+		}
 	}
 
 	lh->sendfdcnt = 0;
@@ -987,9 +1030,11 @@ launchd_msg_recv(launch_t lh, void (*cb)(launch_data_t, void *), void *context)
 {
 	struct cmsghdr *cm = alloca(4096); 
 	launch_data_t rmsg = NULL;
-	size_t data_offset, fd_offset;
+	unsigned char buf[8*1024], *ptr;
 	struct msghdr mh;
 	struct iovec iov;
+	nvlist_t *nvl;
+	size_t left, n;
 	int r;
 
 	int fd2use = launchd_getfd(lh);
@@ -1002,10 +1047,8 @@ launchd_msg_recv(launch_t lh, void (*cb)(launch_data_t, void *), void *context)
 	mh.msg_iov = &iov;
 	mh.msg_iovlen = 1;
 
-	lh->recvbuf = reallocf(lh->recvbuf, lh->recvlen + 8*1024);
-
-	iov.iov_base = lh->recvbuf + lh->recvlen;
-	iov.iov_len = 8*1024;
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
 	mh.msg_control = cm;
 	mh.msg_controllen = 4096;
 
@@ -1019,69 +1062,89 @@ launchd_msg_recv(launch_t lh, void (*cb)(launch_data_t, void *), void *context)
 		errno = ECONNABORTED;
 		return -1;
 	}
-	lh->recvlen += r;
 	if (mh.msg_controllen > 0) {
 		lh->recvfds = reallocf(lh->recvfds, lh->recvfdcnt * sizeof(int) + mh.msg_controllen - sizeof(struct cmsghdr));
 		memcpy(lh->recvfds + lh->recvfdcnt, CMSG_DATA(cm), mh.msg_controllen - sizeof(struct cmsghdr));
 		lh->recvfdcnt += (mh.msg_controllen - sizeof(struct cmsghdr)) / sizeof(int);
 	}
 
+	ptr = buf;
+	left = r;
 	r = 0;
 
-	while (lh->recvlen > 0) {
-		struct launch_msg_header *lmhp = lh->recvbuf;
-		uint64_t tmplen;
-		data_offset = sizeof(struct launch_msg_header);
-		fd_offset = 0;
-
-		if (lh->recvlen < sizeof(struct launch_msg_header))
-			goto need_more_data;
-
-		tmplen = big2wire(lmhp->len);
+	/*
+	 * Messages are decoded as they stream in: the framing header is
+	 * collected in lh->recvhdr and the payload goes straight to the
+	 * parser, which keeps its state across calls.
+	 */
+	while (left > 0) {
+		if (lh->recvhdrlen < sizeof(lh->recvhdr)) {
+			n = MIN(sizeof(lh->recvhdr) - lh->recvhdrlen, left);
+			memcpy((char *)&lh->recvhdr + lh->recvhdrlen, ptr, n);
+			lh->recvhdrlen += n;
+			ptr += n;
+			left -= n;
+			if (lh->recvhdrlen < sizeof(lh->recvhdr))
+				break;
+
+			lh->recvleft = big2wire(lh->recvhdr.len);
+			if (big2wire(lh->recvhdr.magic) != LAUNCH_MSG_HEADER_MAGIC || lh->recvleft <= sizeof(struct launch_msg_header)) {
+				errno = EBADRPC;
+				goto out_bad;
+			}
+			lh->recvleft -= sizeof(struct launch_msg_header);
+			continue;
+		}
 
-		if (big2wire(lmhp->magic) != LAUNCH_MSG_HEADER_MAGIC || tmplen <= sizeof(struct launch_msg_header)) {
+		n = nvlist_parser_feed(lh->parser, ptr, MIN(left, lh->recvleft));
+		if (nvlist_parser_error(lh->parser) != 0) {
 			errno = EBADRPC;
 			goto out_bad;
 		}
-
-		if (lh->recvlen < tmplen) {
-			goto need_more_data;
+		ptr += n;
+		left -= n;
+		lh->recvleft -= n;
+
+		if ((nvl = nvlist_parser_take(lh->parser)) == NULL) {
+			if (lh->recvleft == 0) {
+				/* The frame ended before the list did. */
+				errno = EBADRPC;
+				goto out_bad;
+			}
+			continue;
 		}
-
-		if ((rmsg = launch_data_unpack(lh->recvbuf, lh->recvlen, lh->recvfds, lh->recvfdcnt, &data_offset, &fd_offset)) == NULL) {
+		if (lh->recvleft != 0) {
+			nvlist_destroy(nvl);
 			errno = EBADRPC;
 			goto out_bad;
 		}
+		lh->recvhdrlen = 0;
+
+		rmsg = nv2xpc(nvl, ^mach_port_t(int64_t port_id) {
+			xpc_api_misuse("Should not be called");
+		});
+		nvlist_destroy(nvl);
+		if (rmsg == NULL) {
+			errno = EBADMSG;
+			goto out_bad;
+		}
 
 		launch_globals_t globals = _launch_globals();
 
 		globals->in_flight_msg_recv_client = lh;
 
 		cb(rmsg, context);
+		launch_data_free(rmsg);
 
 		/* launchd and only launchd can call launchd_close() as a part of the callback */
-		if (globals->in_flight_msg_recv_client == NULL) {
-			r = 0;
-			break;
-		}
-
-		lh->recvlen -= data_offset;
-		if (lh->recvlen > 0) {
-			memmove(lh->recvbuf, lh->recvbuf + data_offset, lh->recvlen);
-		} else {
-			free(lh->recvbuf);
-			lh->recvbuf = malloc(0);
-		}
-
-		lh->recvfdcnt -= fd_offset;
-		if (lh->recvfdcnt > 0) {
-			memmove(lh->recvfds, lh->recvfds + fd_offset, lh->recvfdcnt * sizeof(int));
-		} else {
-			free(lh->recvfds);
-			lh->recvfds = malloc(0);
-		}
+		if (globals->in_flight_msg_recv_client == NULL)
+			return 0;
 	}
 
+	/* Part of a message is still outstanding. */
+	if (lh->recvhdrlen > 0)
+		goto need_more_data;
+
 	return r;
 
 need_more_data:
@@ -1090,10 +1153,16 @@ out_bad:
 	return -1;
 }
 
+/*
+ * Only containers are copied.  The leaves in them are shared with the
+ * copy, so launch_data_set_integer(), launch_data_set_bool() and the like
+ * on a leaf looked up in either change it in both.  This used to return o
+ * itself, so callers never had more than that.
+ */
 launch_data_t
 launch_data_copy(launch_data_t o)
 {
-	return xpc_retain(o);
+	return xpc_copy(o);
 }
 
 int
@@ -26,18 +26,198 @@
  */
 
 #include <sys/types.h>
+#include <sys/param.h>
+#include <string.h>
 #include <mach/mach.h>
+#include <pthread.h>
 #include <xpc/launchd.h>
+#include <xpc/private.h>
 #include "xpc_internal.h"
 
+#define	XPC_ARRAY_MIN_CAPACITY	4
+
+/*
+ * Make room for at least count elements, doubling the vector so that
+ * appends are amortized O(1).
+ */
+static bool
+xpc_array_reserve(struct xpc_object *xo, size_t count)
+{
+	struct xpc_object **items;
+	size_t capacity;
+
+	if (count <= xo->xo_array_capacity)
+		return (true);
+
+	capacity = MAX(xo->xo_array_capacity, XPC_ARRAY_MIN_CAPACITY);
+	while (capacity < count)
+		capacity *= 2;
+	items = realloc(xo->xo_array, capacity * sizeof(items[0]));
+	if (items == NULL)
+		return (false);
+	xo->xo_array = items;
+	xo->xo_array_capacity = capacity;
+	return (true);
+}
+
+/*
+ * Fill the empty array xo with a copy of the elements of from, one level
+ * deep, as xpc_dictionary_fill() does for dictionaries.  Returns false if
+ * memory runs out, with xo holding part of the elements.
+ */
+static bool
+xpc_array_fill(struct xpc_object *xo, struct xpc_object *from)
+{
+	struct xpc_object *value;
+	size_t i;
+
+	if (!xpc_array_reserve(xo, from->xo_size))
+		return (false);
+	for (i = 0; i < from->xo_size; i++) {
+		value = from->xo_array[i];
+		value = XPC_IS_CONTAINER(value) ? xpc_copy(value) :
+		    xpc_retain(value);
+		if (value == NULL)
+			return (false);
+		xo->xo_array[xo->xo_size++] = value;
+	}
+
+	return (true);
+}
+
+/*
+ * Serializes deciding to share the store of an array with deciding to
+ * lend a container from it, as for dictionaries.
+ */
+static pthread_mutex_t xpc_array_share_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline struct xpc_object *
+xpc_array_node(struct xpc_object *xo)
+{
+
+	return (__atomic_load_n(&xo->xo_u.array.store, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * xpc_copy() of an array: the copy shares a node array with the original,
+ * unless the array lent out containers.  An array that holds its elements
+ * itself hands the vector to a new node, leaving its own pointer to it in
+ * place for readers that are still using it.
+ */
+__private_extern__ struct xpc_object *
+xpc_array_copy(struct xpc_object *xo)
+{
+	struct xpc_object *node, *copy;
+	xpc_u val;
+
+	bzero(&val, sizeof(val));
+	pthread_mutex_lock(&xpc_array_share_lock);
+	node = xo->xo_u.array.store;
+	if (node->xo_flags & _XPC_CONTAINER_LENT) {
+		pthread_mutex_unlock(&xpc_array_share_lock);
+		copy = _xpc_prim_create(XPC_TYPE_ARRAY, val, 0);
+		if (copy == NULL)
+			return (NULL);
+		if (!xpc_array_fill(copy, node)) {
+			xpc_release(copy);
+			return (NULL);
+		}
+		return (copy);
+	}
+
+	if (node == xo) {
+		node = _xpc_prim_create(XPC_TYPE_ARRAY, val, xo->xo_size);
+		if (node == NULL) {
+			pthread_mutex_unlock(&xpc_array_share_lock);
+			return (NULL);
+		}
+		node->xo_u.array.items = xo->xo_u.array.items;
+		node->xo_u.array.capacity = xo->xo_u.array.capacity;
+		__atomic_store_n(&xo->xo_u.array.store, node,
+		    __ATOMIC_RELEASE);
+	}
+	__atomic_or_fetch(&node->xo_flags, _XPC_CONTAINER_SHARED,
+	    __ATOMIC_RELAXED);
+	xpc_retain(node);
+	pthread_mutex_unlock(&xpc_array_share_lock);
+
+	copy = _xpc_prim_create(XPC_TYPE_ARRAY, val, xo->xo_size);
+	if (copy == NULL) {
+		xpc_release(node);
+		return (NULL);
+	}
+	copy->xo_u.array.store = node;
+	return (copy);
+}
+
+/*
+ * Give an array that shares its elements a node of its own and return its
+ * store, as xpc_dictionary_unshare() does for dictionaries.
+ */
+static struct xpc_object *
+xpc_array_unshare(struct xpc_object *xo, bool lend)
+{
+	struct xpc_object *node, *tmp;
+	xpc_u val;
+
+	node = xpc_array_node(xo);
+	if (!lend && !(node->xo_flags & _XPC_CONTAINER_SHARED))
+		return (node);
+
+	bzero(&val, sizeof(val));
+	pthread_mutex_lock(&xpc_array_share_lock);
+	while ((node = xo->xo_u.array.store)->xo_flags &
+	    _XPC_CONTAINER_SHARED) {
+		pthread_mutex_unlock(&xpc_array_share_lock);
+		tmp = _xpc_prim_create(XPC_TYPE_ARRAY, val, 0);
+		if (tmp == NULL)
+			return (NULL);
+		if (!xpc_array_fill(tmp, node)) {
+			xpc_release(tmp);
+			return (NULL);
+		}
+
+		pthread_mutex_lock(&xpc_array_share_lock);
+		if (xo->xo_u.array.store != node) {
+			pthread_mutex_unlock(&xpc_array_share_lock);
+			xpc_release(tmp);
+			pthread_mutex_lock(&xpc_array_share_lock);
+			continue;
+		}
+		/* xo's reference to node goes with it. */
+		tmp->xo_u.array.retired = node;
+		__atomic_store_n(&xo->xo_u.array.store, tmp, __ATOMIC_RELEASE);
+	}
+	if (lend)
+		__atomic_or_fetch(&node->xo_flags, _XPC_CONTAINER_LENT,
+		    __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&xpc_array_share_lock);
+
+	return (node);
+}
+
 xpc_object_t
-xpc_array_create(const xpc_object_t *objects, size_t count)
+xpc_array_create_with_capacity(size_t capacity)
 {
 	struct xpc_object *xo;
-	size_t i;
 	xpc_u val; bzero(&val, sizeof(val));
 
 	xo = _xpc_prim_create(XPC_TYPE_ARRAY, val, 0);
+	if (xo == NULL)
+		return (NULL);
+
+	/* Only a hint, appending grows the vector anyway. */
+	(void)xpc_array_reserve(xo, capacity);
+	return (xo);
+}
+
+xpc_object_t
+xpc_array_create(const xpc_object_t *objects, size_t count)
+{
+	struct xpc_object *xo;
+	size_t i;
+
+	xo = xpc_array_create_with_capacity(count);
 	
 	for (i = 0; i < count; i++)
 		xpc_array_append_value(xo, objects[i]);
@@ -48,72 +228,93 @@ xpc_array_create(const xpc_object_t *objects, size_t count)
 void
 xpc_array_set_value(xpc_object_t xarray, size_t index, xpc_object_t value)
 {
-	struct xpc_object *xo, *xotmp, *xotmp2;
-	struct xpc_array_head *arr;
-	size_t i;
+	struct xpc_object *xo, *xotmp;
 
 	xo = xarray;
 	xpc_assert_nonnull(xo);
 	xpc_assert_type(xo, XPC_TYPE_ARRAY);
-	arr = &xo->xo_array;
-	i = 0;
+	xpc_assert_nonnull(value);
 
 	if (index == XPC_ARRAY_APPEND)
 		return xpc_array_append_value(xarray, value);
 
-	if (index >= (size_t)xo->xo_size)
+	if (index >= xo->xo_size)
 		return;
 
-	TAILQ_FOREACH_SAFE(xotmp, arr, xo_link, xotmp2) {
-		if (i++ == index) {
-			TAILQ_INSERT_AFTER(arr, (struct xpc_object *)value,
-			    xotmp, xo_link);
-			TAILQ_REMOVE(arr, xotmp, xo_link);
-			xpc_retain(value);
-			free(xotmp);
-			break;
-		}
-	}
+	if (xpc_array_unshare(xo, false) == NULL)
+		return;
+	xotmp = xo->xo_array[index];
+	xo->xo_array[index] = xpc_retain(value);
+	xpc_release(xotmp);
+	XPC_CONTAINER_LEND(xo, value);
 }
 	
 void
 xpc_array_append_value(xpc_object_t xarray, xpc_object_t value)
 {
 	struct xpc_object *xo;
-	struct xpc_array_head *arr;
 	
 	xo = xarray;
 	xpc_assert_nonnull(xo);
 	xpc_assert_type(xo, XPC_TYPE_ARRAY);
-	arr = &xo->xo_array;
+	xpc_assert_nonnull(value);
 
-	TAILQ_INSERT_TAIL(arr, (struct xpc_object *)value, xo_link);
-	xpc_retain(value);
+	if (xpc_array_unshare(xo, false) == NULL)
+		return;
+	if (!xpc_array_reserve(xo, xo->xo_size + 1))
+		xpc_api_misuse("Cannot grow array to %zu elements", xo->xo_size + 1);
+	xo->xo_array[xo->xo_size++] = xpc_retain(value);
+	xo->xo_u.array.store->xo_size = xo->xo_size;
+	XPC_CONTAINER_LEND(xo, value);
 }
 
+/*
+ * Remove the element at index and hand the array's reference to it over
+ * to the caller.
+ */
+__private_extern__ xpc_object_t
+xpc_array_take_value(xpc_object_t xarray, size_t index)
+{
+	struct xpc_object *xo, *xotmp;
+
+	xo = xarray;
+	xpc_assert_nonnull(xo);
+	xpc_assert_type(xo, XPC_TYPE_ARRAY);
+
+	if (index >= xo->xo_size)
+		return (NULL);
+
+	if (xpc_array_unshare(xo, false) == NULL)
+		return (NULL);
+	xotmp = xo->xo_array[index];
+	xo->xo_size--;
+	xo->xo_u.array.store->xo_size = xo->xo_size;
+	memmove(&xo->xo_array[index], &xo->xo_array[index + 1],
+	    (xo->xo_size - index) * sizeof(xo->xo_array[0]));
+	return (xotmp);
+}
 
 xpc_object_t
 xpc_array_get_value(xpc_object_t xarray, size_t index)
 {
-	struct xpc_object *xo, *xotmp;
-	struct xpc_array_head *arr;
-	size_t i;
+	struct xpc_object *xo, *node;
 
 	xo = xarray;
 	xpc_assert_nonnull(xo);
 	xpc_assert_type(xo, XPC_TYPE_ARRAY);
-	arr = &xo->xo_array;
-	i = 0;
 
-	if (index > xo->xo_size)
+	node = xpc_array_node(xo);
+	if (index >= node->xo_size)
 		return (NULL);
-	
-	TAILQ_FOREACH(xotmp, arr, xo_link) {
-		if (i++ == index)
-			return (xotmp);
-	}
 
-	return (NULL);
+	if (!XPC_IS_CONTAINER(node->xo_u.array.items[index]))
+		return (node->xo_u.array.items[index]);
+
+	/* The caller may change a container, so it can't be a shared one. */
+	node = xpc_array_unshare(xo, true);
+	if (node == NULL)
+		return (NULL);
+	return (node->xo_u.array.items[index]);
 }
 
 size_t
@@ -321,16 +522,31 @@ xpc_array_get_connection(xpc_object_t array, size_t index)
 bool
 xpc_array_apply(xpc_object_t xarray, xpc_array_applier_t applier)
 {
-	struct xpc_object *xo, *xotmp;
-	struct xpc_array_head *arr;
-	size_t i;
+	struct xpc_object *xo;
 
-	i = 0;
 	xo = xarray;
-	arr = &xo->xo_array;
+	xpc_assert_nonnull(xo);
+	xpc_assert_type(xo, XPC_TYPE_ARRAY);
+
+	/* The applier may change the elements it is given. */
+	if (xpc_array_unshare(xo, true) == NULL)
+		return (false);
+	return (xpc_array_apply_nocopy(xo, applier));
+}
+
+/*
+ * xpc_array_apply() for appliers that don't change the elements.
+ */
+__private_extern__ bool
+xpc_array_apply_nocopy(xpc_object_t xarray, xpc_array_applier_t applier)
+{
+	struct xpc_object *node;
+	size_t i;
+
+	node = xpc_array_node(xarray);
 
-	TAILQ_FOREACH(xotmp, arr, xo_link) {
-		if (!applier(i++, xotmp))
+	for (i = 0; i < node->xo_size; i++) {
+		if (!applier(i, node->xo_u.array.items[i]))
 			return (false);
 	}
 
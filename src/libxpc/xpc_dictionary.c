@@ -26,15 +26,33 @@
  */
 
 #include <sys/types.h>
+#include <sys/errno.h>
 #include <mach/mach.h>
+#include <pthread.h>
+#include <launch.h>
 #include <xpc/launchd.h>
+#include <xpc/private.h>
 #include "xpc_internal.h"
 #include <assert.h>
 
 #define NVLIST_XPC_TYPE         XPC_RESERVED_KEY_PREFIX "object type"
 #define NVLIST_PORT_INDEX		XPC_RESERVED_KEY_PREFIX "port index"
 
+#define	XPC_DICT_SLOT_DELETED	((struct xpc_dict_pair *)(uintptr_t)-1)
+
+static void xpc_dictionary_set_wire_value(struct xpc_object *xo,
+    const char *key, struct xpc_object *value);
+
+static inline struct xpc_object *xpc_dictionary_node(struct xpc_object *xo);
+static struct xpc_object *xpc_dictionary_pair_value(struct xpc_object *node,
+    struct xpc_dict_pair *pair);
+static struct xpc_object *xpc_dictionary_pair_decode(struct xpc_object *node,
+    struct xpc_dict_pair *pair);
+static bool xpc_dictionary_store_packed(struct xpc_object *xo,
+    const char *key, const void *packed);
+
 static void xpc2nv_primitive(nvlist_t *nv, const char *key, xpc_object_t value, int64_t (^port_serializer)(mach_port_t port));
+static nvlist_t *xpc2nv_in(nvlist_t *owner, struct xpc_object *xo, int64_t (^port_serializer)(mach_port_t port));
 
 __private_extern__ void
 nv_release_entry(nvlist_t *nv, const char *key)
@@ -47,6 +65,94 @@ nv_release_entry(nvlist_t *nv, const char *key)
 	}
 }
 
+/*
+ * Expand the items of a typed array pair back into an xpc array.
+ */
+static struct xpc_object *
+nv2xpc_typed_array(int type, const void *items, size_t nitems)
+{
+	struct xpc_object *xo, *xotmp;
+	size_t i;
+
+	xo = xpc_array_create_with_capacity(nitems);
+	for (i = 0; i < nitems; i++) {
+		switch (type) {
+		case NV_TYPE_BOOL_ARRAY:
+			xotmp = xpc_bool_create(((const bool *)items)[i]);
+			break;
+		case NV_TYPE_INT64_ARRAY:
+			xotmp = xpc_int64_create(((const int64_t *)items)[i]);
+			break;
+		case NV_TYPE_UINT64_ARRAY:
+			xotmp = xpc_uint64_create(((const uint64_t *)items)[i]);
+			break;
+		default:
+			xotmp = xpc_string_create(((const char * const *)items)[i]);
+			break;
+		}
+		xpc_array_append_value(xo, xotmp);
+		xpc_release(xotmp);
+	}
+
+	return (xo);
+}
+
+/*
+ * The type of object a dictionary marked with NVLIST_XPC_TYPE xtype stands
+ * for, when that is a port right; NULL otherwise.
+ */
+static xpc_type_t
+nv2xpc_marked_port_type(const char *xtype)
+{
+
+	if (strcmp(xtype, "connection") == 0)
+		return (XPC_TYPE_CONNECTION);
+	if (strcmp(xtype, "endpoint") == 0)
+		return (XPC_TYPE_ENDPOINT);
+	if (strcmp(xtype, "fileport") == 0)
+		return (XPC_TYPE_FD);
+	return (NULL);
+}
+
+/*
+ * Decode a dictionary that xpc2nv() marked with NVLIST_XPC_TYPE xtype.  The
+ * marker and the value next to it come from the peer, so an unknown marker
+ * or a missing value returns NULL and sets errno to EBADMSG.
+ */
+static struct xpc_object *
+nv2xpc_marked(const nvlist_t *nv, const char *xtype,
+    mach_port_t (^port_deserializer)(int64_t port_id))
+{
+	xpc_type_t type;
+	const void *value;
+	size_t value_size;
+	xpc_u val;
+
+	if ((type = nv2xpc_marked_port_type(xtype)) != NULL) {
+		if (!nvlist_exists_int64(nv, NVLIST_PORT_INDEX))
+			goto bad;
+		val.port = port_deserializer(nvlist_get_int64(nv,
+		    NVLIST_PORT_INDEX));
+		return (_xpc_prim_create(type, val, 0));
+	} else if (strcmp(xtype, "date") == 0) {
+		if (!nvlist_exists_int64(nv, "date"))
+			goto bad;
+		return (xpc_date_create(nvlist_get_int64(nv, "date")));
+	} else if (strcmp(xtype, "double") == 0) {
+		if (!nvlist_exists_binary(nv, "double"))
+			goto bad;
+		value = nvlist_get_binary(nv, "double", &value_size);
+		if (value_size != sizeof(double))
+			goto bad;
+		memcpy(&val.d, value, sizeof(double));
+		return (xpc_double_create(val.d));
+	}
+
+bad:
+	errno = EBADMSG;
+	return (NULL);
+}
+
 struct xpc_object *
 nv2xpc(const nvlist_t *nv, mach_port_t (^port_deserializer)(int64_t port_id))
 {
@@ -61,32 +167,10 @@ nv2xpc(const nvlist_t *nv, mach_port_t (^port_deserializer)(int64_t port_id))
 	xpc_assert(nvlist_type(nv) == NV_TYPE_NVLIST_DICTIONARY || nvlist_type(nv) == NV_TYPE_NVLIST_ARRAY, "nvlist_t %p is not dictionary or array", nv);
 
 	if (nvlist_type(nv) == NV_TYPE_NVLIST_DICTIONARY) {
-		if (nvlist_contains_key(nv, NVLIST_XPC_TYPE)) {
-			const char *type = nvlist_get_string(nv, NVLIST_XPC_TYPE);
-
-			if (strcmp(type, "connection") == 0) {
-				int64_t port_id = nvlist_get_int64(nv, NVLIST_PORT_INDEX);
-				val.port = port_deserializer(port_id);
-				return _xpc_prim_create(XPC_TYPE_CONNECTION, val, 0);
-			} else if (strcmp(type, "endpoint") == 0) {
-				int64_t port_id = nvlist_get_int64(nv, NVLIST_PORT_INDEX);
-				val.port = port_deserializer(port_id);
-				return _xpc_prim_create(XPC_TYPE_ENDPOINT, val, 0);
-			} else if (strcmp(type, "fileport") == 0) {
-				int64_t port_id = nvlist_get_int64(nv, NVLIST_PORT_INDEX);
-				val.port = port_deserializer(port_id);
-				return _xpc_prim_create(XPC_TYPE_FD, val, 0);
-			} else if (strcmp(type, "date") == 0) {
-				return xpc_date_create(nvlist_get_int64(nv, "date"));
-			} else if (strcmp(type, "double") == 0) {
-				size_t value_size;
-				double *value = (double *)nvlist_get_binary(nv, "date", &value_size);
-				xpc_assert(value_size == sizeof(double), "nvlist data of type date has incorrect size (expected %lu, got %zu)", sizeof(double), value_size);
-				return xpc_double_create(*value);
-			} else {
-				xpc_api_misuse("Unexpected NVLIST_XPC_TYPE in dictionary: %s", type);
-			}
-		}
+		if (nvlist_exists_string(nv, NVLIST_XPC_TYPE))
+			return (nv2xpc_marked(nv,
+			    nvlist_get_string(nv, NVLIST_XPC_TYPE),
+			    port_deserializer));
 
 		xo = xpc_dictionary_create(NULL, NULL, 0);
 	}
@@ -126,13 +210,25 @@ nv2xpc(const nvlist_t *nv, mach_port_t (^port_deserializer)(int64_t port_id))
 		case NV_TYPE_PTR:
 			break;
 
-		case NV_TYPE_BINARY:
+		case NV_TYPE_BINARY: {
+			const void *bytes;
+			size_t size;
+
+			bytes = nvlist_get_binary(nv, key, &size);
+			xotmp = xpc_data_create(bytes, size);
 			break;
+		}
 
 		case NV_TYPE_UUID:
 			memcpy(&val.uuid, nvlist_get_uuid(nv, key),
 			    sizeof(uuid_t));
 			xotmp = _xpc_prim_create(XPC_TYPE_UUID, val, 0);
+			break;
+
+		case NV_TYPE_NVLIST:
+			nvtmp = nvlist_get_nvlist(nv, key);
+			xotmp = nv2xpc(nvtmp, port_deserializer);
+			break;
 
 		case NV_TYPE_NVLIST_ARRAY:
 			nvtmp = nvlist_get_nvlist_array(nv, key);
@@ -143,20 +239,511 @@ nv2xpc(const nvlist_t *nv, mach_port_t (^port_deserializer)(int64_t port_id))
 			nvtmp = nvlist_get_nvlist_dictionary(nv, key);
 			xotmp = nv2xpc(nvtmp, port_deserializer);
 			break;
+
+		case NV_TYPE_BOOL_ARRAY: {
+			const bool *items;
+			size_t nitems;
+
+			items = nvlist_get_bool_array(nv, key, &nitems);
+			xotmp = nv2xpc_typed_array(type, items, nitems);
+			break;
+		}
+
+		case NV_TYPE_INT64_ARRAY: {
+			const int64_t *items;
+			size_t nitems;
+
+			items = nvlist_get_int64_array(nv, key, &nitems);
+			xotmp = nv2xpc_typed_array(type, items, nitems);
+			break;
+		}
+
+		case NV_TYPE_UINT64_ARRAY: {
+			const uint64_t *items;
+			size_t nitems;
+
+			items = nvlist_get_uint64_array(nv, key, &nitems);
+			xotmp = nv2xpc_typed_array(type, items, nitems);
+			break;
+		}
+
+		case NV_TYPE_STRING_ARRAY: {
+			const char * const *items;
+			size_t nitems;
+
+			items = nvlist_get_string_array(nv, key, &nitems);
+			xotmp = nv2xpc_typed_array(type, items, nitems);
+			break;
+		}
 		}
 
 		if (xotmp) {
 			if (nvlist_type(nv) == NV_TYPE_NVLIST_DICTIONARY)
-				xpc_dictionary_set_value(xo, key, xotmp);
+				xpc_dictionary_set_wire_value(xo, key, xotmp);
 
 			if (nvlist_type(nv) == NV_TYPE_NVLIST_ARRAY)
 				xpc_array_append_value(xo, xotmp);
+			xpc_release(xotmp);
+		}
+	}
+
+	return (xo);
+}
+
+/*
+ * A received message, shared by the lazy dictionaries decoded from it.  The
+ * payload and port array came out of line and are deallocated with the
+ * last reference.
+ */
+struct xpc_wire {
+	unsigned int		refs;
+	void *			data;
+	size_t			size;
+	mach_port_t *		ports;
+	size_t			nports;
+};
+
+static struct xpc_wire *
+xpc_wire_retain(struct xpc_wire *wire)
+{
+
+	__atomic_add_fetch(&wire->refs, 1, __ATOMIC_RELAXED);
+	return (wire);
+}
+
+__private_extern__ void
+xpc_wire_release(struct xpc_wire *wire)
+{
+
+	if (wire == NULL ||
+	    __atomic_sub_fetch(&wire->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	mig_deallocate((vm_address_t)wire->data, wire->size);
+	mig_deallocate((vm_address_t)wire->ports,
+	    wire->nports * sizeof(mach_port_t));
+	free(wire);
+}
+
+static mach_port_t
+xpc_wire_port(struct xpc_wire *wire, int64_t port_index)
+{
+
+	xpc_assert(port_index >= 0 && (uint64_t)port_index < wire->nports,
+	    "Port index greater than number of ports in buffer");
+	return (wire->ports[port_index]);
+}
+
+/*
+ * Data of received messages is handed out in place when it is large
+ * enough for the copy to matter; it then keeps the whole message around.
+ */
+#define	XPC_WIRE_DATA_MIN	4096
+
+static struct xpc_object *
+nv2xpc_wire_data(struct xpc_wire *wire, const void *bytes, size_t size)
+{
+	struct xpc_object *xo;
+	dispatch_data_t ddata;
+
+	xpc_wire_retain(wire);
+	ddata = dispatch_data_create(bytes, size, NULL, ^{
+		xpc_wire_release(wire);
+	});
+	if (ddata == NULL) {
+		xpc_wire_release(wire);
+		return (NULL);
+	}
+
+	xo = xpc_data_create_with_dispatch_data(ddata);
+	dispatch_release(ddata);
+	return (xo);
+}
+
+static struct xpc_object *nv2xpc_view_in(const nvlist_view_t *view,
+    struct xpc_wire *wire, mach_port_t (^port_deserializer)(int64_t port_id));
+
+/*
+ * Whether nv2xpc_view_value() decodes pairs of type.  Pairs of the other
+ * types are left out of the objects decoded from a message.
+ */
+static bool
+nv2xpc_view_decodes(int type)
+{
+
+	switch (type) {
+	case NV_TYPE_BOOL:
+	case NV_TYPE_STRING:
+	case NV_TYPE_INT64:
+	case NV_TYPE_UINT64:
+	case NV_TYPE_BINARY:
+	case NV_TYPE_UUID:
+	case NV_TYPE_NVLIST:
+	case NV_TYPE_NVLIST_ARRAY:
+	case NV_TYPE_NVLIST_DICTIONARY:
+	case NV_TYPE_BOOL_ARRAY:
+	case NV_TYPE_INT64_ARRAY:
+	case NV_TYPE_UINT64_ARRAY:
+	case NV_TYPE_STRING_ARRAY:
+		return (true);
+	default:
+		return (false);
+	}
+}
+
+/*
+ * Decode the value of a single pair of a view.
+ */
+static struct xpc_object *
+nv2xpc_view_value(const nvpair_view_t *nvpv, struct xpc_wire *wire,
+    mach_port_t (^port_deserializer)(int64_t port_id))
+{
+	struct xpc_object *xotmp = NULL;
+	nvlist_view_t child;
+	xpc_u val;
+
+	switch (nvpv->nvpv_type) {
+	case NV_TYPE_BOOL:
+		xotmp = xpc_bool_create(nvpair_view_get_bool(nvpv));
+		break;
+
+	case NV_TYPE_STRING:
+		xotmp = xpc_string_create(nvpair_view_get_string(nvpv));
+		break;
+
+	case NV_TYPE_INT64:
+		xotmp = xpc_int64_create((int64_t)nvpair_view_get_number(nvpv));
+		break;
+
+	case NV_TYPE_UINT64:
+		xotmp = xpc_uint64_create(nvpair_view_get_number(nvpv));
+		break;
+
+	case NV_TYPE_BINARY: {
+		const void *bytes;
+		size_t size;
+
+		bytes = nvpair_view_get_binary(nvpv, &size);
+		if (wire != NULL && size >= XPC_WIRE_DATA_MIN)
+			xotmp = nv2xpc_wire_data(wire, bytes, size);
+		else
+			xotmp = xpc_data_create(bytes, size);
+		break;
+	}
+
+	case NV_TYPE_UUID:
+		memcpy(&val.uuid, nvpair_view_get_uuid(nvpv),
+		    sizeof(uuid_t));
+		xotmp = _xpc_prim_create(XPC_TYPE_UUID, val, 0);
+		break;
+
+	case NV_TYPE_NVLIST:
+	case NV_TYPE_NVLIST_ARRAY:
+	case NV_TYPE_NVLIST_DICTIONARY:
+		nvpair_view_get_nvlist(nvpv, &child);
+		xotmp = nv2xpc_view_in(&child, wire, port_deserializer);
+		break;
+
+	case NV_TYPE_BOOL_ARRAY:
+	case NV_TYPE_INT64_ARRAY:
+	case NV_TYPE_UINT64_ARRAY:
+	case NV_TYPE_STRING_ARRAY: {
+		void *items;
+		size_t nitems;
+
+		/* One slot is large enough for every item type. */
+		nitems = nvpair_view_get_nitems(nvpv);
+		items = malloc(nitems * sizeof(uint64_t));
+		if (items == NULL)
+			break;
+		if (nvpv->nvpv_type == NV_TYPE_BOOL_ARRAY)
+			nvpair_view_get_bool_array(nvpv, items);
+		else if (nvpv->nvpv_type == NV_TYPE_STRING_ARRAY)
+			nvpair_view_get_string_array(nvpv, items);
+		else
+			nvpair_view_get_number_array(nvpv, items);
+		xotmp = nv2xpc_typed_array(nvpv->nvpv_type, items, nitems);
+		free(items);
+		break;
+	}
+	}
+
+	return (xotmp);
+}
+
+/*
+ * Build a lazy dictionary over a view into wire.  Only the keys are read
+ * here; see xpc_dictionary_pair_value().  Pairs that would not decode are
+ * skipped now, as the eager decoder skips them, so that the count of the
+ * dictionary is the number of values it can hand out.  Returns NULL and
+ * sets errno if a key can't be added.
+ */
+static struct xpc_object *
+nv2xpc_lazy(const nvlist_view_t *view, struct xpc_wire *wire)
+{
+	struct xpc_object *xo;
+	nvpair_view_t nvpv;
+	void *cookiep, *packed;
+	xpc_u val = {0};
+	int error;
+
+	xo = _xpc_prim_create_flags(XPC_TYPE_DICTIONARY, val, 0,
+	    _XPC_DICT_LAZY);
+	if (xo == NULL)
+		return (NULL);
+	xo->xo_u.dict.wire = xpc_wire_retain(wire);
+	xo->xo_u.dict.view = *view;
+
+	cookiep = NULL;
+	for (;;) {
+		packed = cookiep != NULL ? cookiep :
+		    (void *)(uintptr_t)view->nvv_ptr;
+		if (!nvlist_view_next(view, &nvpv, &cookiep))
+			break;
+		if (!nv2xpc_view_decodes(nvpv.nvpv_type))
+			continue;
+		if (!xpc_dictionary_store_packed(xo, nvpv.nvpv_name, packed)) {
+			error = errno;
+			xpc_release(xo);
+			errno = error;
+			return (NULL);
+		}
+	}
+
+	return (xo);
+}
+
+/*
+ * Same as nv2xpc_marked(), for a view.
+ */
+static struct xpc_object *
+nv2xpc_view_marked(const nvlist_view_t *view, const char *xtype,
+    mach_port_t (^port_deserializer)(int64_t port_id))
+{
+	nvpair_view_t nvpv;
+	xpc_type_t type;
+	const void *value;
+	size_t value_size;
+	xpc_u val;
+
+	if ((type = nv2xpc_marked_port_type(xtype)) != NULL) {
+		if (!nvlist_view_find(view, NVLIST_PORT_INDEX, NV_TYPE_INT64,
+		    &nvpv))
+			goto bad;
+		val.port = port_deserializer(
+		    (int64_t)nvpair_view_get_number(&nvpv));
+		return (_xpc_prim_create(type, val, 0));
+	} else if (strcmp(xtype, "date") == 0) {
+		if (!nvlist_view_find(view, "date", NV_TYPE_INT64, &nvpv))
+			goto bad;
+		return (xpc_date_create((int64_t)nvpair_view_get_number(&nvpv)));
+	} else if (strcmp(xtype, "double") == 0) {
+		if (!nvlist_view_find(view, "double", NV_TYPE_BINARY, &nvpv))
+			goto bad;
+		value = nvpair_view_get_binary(&nvpv, &value_size);
+		if (value_size != sizeof(double))
+			goto bad;
+		/* The buffer gives no alignment guarantee. */
+		memcpy(&val.d, value, sizeof(double));
+		return (xpc_double_create(val.d));
+	}
+
+bad:
+	errno = EBADMSG;
+	return (NULL);
+}
+
+static struct xpc_object *
+nv2xpc_view_in(const nvlist_view_t *view, struct xpc_wire *wire,
+    mach_port_t (^port_deserializer)(int64_t port_id))
+{
+	struct xpc_object *xo = NULL, *xotmp = NULL;
+	nvpair_view_t nvpv;
+	void *cookiep;
+	int type;
+
+	xpc_assert(view != NULL, "%s: nvlist_view_t is NULL", __FUNCTION__);
+	type = nvlist_view_type(view);
+	xpc_assert(type == NV_TYPE_NVLIST_DICTIONARY || type == NV_TYPE_NVLIST_ARRAY, "nvlist_view_t %p is not dictionary or array", view);
+
+	if (type == NV_TYPE_NVLIST_DICTIONARY) {
+		if (nvlist_view_find(view, NVLIST_XPC_TYPE, NV_TYPE_STRING,
+		    &nvpv)) {
+			return (nv2xpc_view_marked(view,
+			    nvpair_view_get_string(&nvpv), port_deserializer));
+		}
+
+		if (wire != NULL)
+			return (nv2xpc_lazy(view, wire));
+		xo = xpc_dictionary_create(NULL, NULL, 0);
+	} else
+		xo = xpc_array_create(NULL, 0);
+
+	cookiep = NULL;
+	while (nvlist_view_next(view, &nvpv, &cookiep)) {
+		xotmp = nv2xpc_view_value(&nvpv, wire, port_deserializer);
+		if (xotmp) {
+			if (type == NV_TYPE_NVLIST_DICTIONARY)
+				xpc_dictionary_set_wire_value(xo, nvpv.nvpv_name, xotmp);
+			else
+				xpc_array_append_value(xo, xotmp);
+			xpc_release(xotmp);
 		}
 	}
 
 	return (xo);
 }
 
+/*
+ * Same as nv2xpc(), but reads a packed nvlist in place instead of a fully
+ * unpacked copy of it.  Keys and values are copied into the new objects, so
+ * the buffer behind the view may go away as soon as this returns.  Returns
+ * NULL and sets errno to EBADMSG if the buffer holds a malformed object.
+ */
+struct xpc_object *
+nv2xpc_view(const nvlist_view_t *view, mach_port_t (^port_deserializer)(int64_t port_id))
+{
+
+	return (nv2xpc_view_in(view, NULL, port_deserializer));
+}
+
+/*
+ * Decode a received message, taking over its out of line payload and
+ * ports.  Dictionaries come back lazy and keep the payload until the last
+ * of them is gone; anything else is decoded right away.  Returns NULL and
+ * sets errno if the payload is malformed.
+ */
+__private_extern__ struct xpc_object *
+nv2xpc_wire(void *data, size_t size, mach_port_t *ports, size_t nports)
+{
+	struct xpc_object *xo;
+	struct xpc_wire *wire;
+	nvlist_view_t view;
+	int error;
+
+	wire = malloc(sizeof(*wire));
+	if (wire == NULL) {
+		mig_deallocate((vm_address_t)data, size);
+		mig_deallocate((vm_address_t)ports,
+		    nports * sizeof(mach_port_t));
+		errno = ENOMEM;
+		return (NULL);
+	}
+	wire->refs = 1;
+	wire->data = data;
+	wire->size = size;
+	wire->ports = ports;
+	wire->nports = nports;
+
+	xo = NULL;
+	error = 0;
+	if (nvlist_view_init(&view, data, size)) {
+		xo = nv2xpc_view_in(&view, wire, ^(int64_t port_index) {
+			return (xpc_wire_port(wire, port_index));
+		});
+	}
+	if (xo == NULL)
+		error = errno;
+
+	xpc_wire_release(wire);
+	if (error != 0)
+		errno = error;
+	return (xo);
+}
+
+static nvlist_t *
+xpc2nv_special(nvlist_t *nv, const char *type)
+{
+	nvlist_t *inner_nv;
+
+	inner_nv = nvlist_create_in(nv, NV_TYPE_NVLIST_DICTIONARY, 0);
+	nvlist_add_string(inner_nv, NVLIST_XPC_TYPE, type);
+	return (inner_nv);
+}
+
+/*
+ * Destructor for data objects referenced by an nvlist: the bytes stay in
+ * the object, which was retained when the pair was added.
+ */
+static void
+xpc2nv_release_data(void *ctx, const void *value __unused, size_t size __unused)
+{
+
+	xpc_release(ctx);
+}
+
+/*
+ * Return the element type shared by a non-empty array that can be sent as
+ * a typed array pair, or NULL if xo does not qualify.
+ */
+static xpc_type_t
+xpc2nv_array_type(struct xpc_object *xo)
+{
+	xpc_type_t type;
+	size_t i;
+
+	if (xo->xo_size == 0)
+		return (NULL);
+	type = xo->xo_array[0]->xo_xpc_type;
+	if (type != XPC_TYPE_BOOL && type != XPC_TYPE_INT64 &&
+	    type != XPC_TYPE_UINT64 && type != XPC_TYPE_STRING)
+		return (NULL);
+
+	for (i = 1; i < xo->xo_size; i++) {
+		if (xo->xo_array[i]->xo_xpc_type != type)
+			return (NULL);
+	}
+
+	return (type);
+}
+
+/*
+ * Add a non-empty array whose elements are all booleans, all signed or
+ * unsigned integers, or all strings as one typed array pair instead of a
+ * nested list with a pair per element.  Returns false if xo does not
+ * qualify.
+ */
+static bool
+xpc2nv_typed_array(nvlist_t *nv, const char *key, struct xpc_object *xo)
+{
+	struct xpc_object *xotmp;
+	xpc_type_t type;
+	uint64_t *items;
+	size_t count, i;
+
+	type = xpc2nv_array_type(xo);
+	if (type == NULL)
+		return (false);
+	count = xo->xo_size;
+
+	/* One slot is large enough for every item type. */
+	items = malloc(count * sizeof(uint64_t));
+	if (items == NULL)
+		return (false);
+
+	for (i = 0; i < count; i++) {
+		xotmp = xo->xo_array[i];
+		if (type == XPC_TYPE_BOOL)
+			((bool *)items)[i] = xpc_bool_get_value(xotmp);
+		else if (type == XPC_TYPE_STRING)
+			((const char **)items)[i] = xpc_string_get_string_ptr(xotmp);
+		else
+			items[i] = xotmp->xo_uint;
+	}
+
+	if (type == XPC_TYPE_BOOL)
+		nvlist_add_bool_array(nv, key, (const bool *)items, count);
+	else if (type == XPC_TYPE_INT64)
+		nvlist_add_int64_array(nv, key, (const int64_t *)items, count);
+	else if (type == XPC_TYPE_UINT64)
+		nvlist_add_uint64_array(nv, key, items, count);
+	else
+		nvlist_add_string_array(nv, key, (const char * const *)items, count);
+	free(items);
+
+	return (true);
+}
+
 static void
 xpc2nv_primitive(nvlist_t *nv, const char *key, xpc_object_t value, int64_t (^port_serializer)(mach_port_t port))
 {
@@ -164,92 +751,367 @@ xpc2nv_primitive(nvlist_t *nv, const char *key, xpc_object_t value, int64_t (^po
 	nvlist_t *inner_nv;
 
 	if (xotmp->xo_xpc_type == XPC_TYPE_DICTIONARY) {
-		nvlist_add_nvlist_dictionary(nv, key, xpc2nv(xotmp, port_serializer));
+		nvlist_move_nvlist_dictionary(nv, key, xpc2nv_in(nv, xotmp, port_serializer));
 	} else if (xotmp->xo_xpc_type == XPC_TYPE_ARRAY) {
-		nvlist_add_nvlist_array(nv, key, xpc2nv(xotmp, port_serializer));
+		if (!xpc2nv_typed_array(nv, key, xotmp))
+			nvlist_move_nvlist_array(nv, key, xpc2nv_in(nv, xotmp, port_serializer));
 	} else if (xotmp->xo_xpc_type == XPC_TYPE_BOOL) {
 		nvlist_add_bool(nv, key, xpc_bool_get_value(xotmp));
 	} else if (xotmp->xo_xpc_type == XPC_TYPE_CONNECTION) {
-		inner_nv = nvlist_create_dictionary(0);
-		nvlist_add_string(inner_nv, NVLIST_XPC_TYPE, "connection");
+		inner_nv = xpc2nv_special(nv, "connection");
 		nvlist_add_int64(inner_nv, NVLIST_PORT_INDEX, port_serializer(xotmp->xo_port));
-		nvlist_add_nvlist(nv, key, inner_nv);
-		nvlist_destroy(inner_nv);
+		nvlist_move_nvlist(nv, key, inner_nv);
 	} else if (xotmp->xo_xpc_type == XPC_TYPE_ENDPOINT) {
-		inner_nv = nvlist_create_dictionary(0);
-		nvlist_add_string(inner_nv, NVLIST_XPC_TYPE, "endpoint");
+		inner_nv = xpc2nv_special(nv, "endpoint");
 		nvlist_add_int64(inner_nv, NVLIST_PORT_INDEX, port_serializer(xotmp->xo_port));
-		nvlist_add_nvlist(nv, key, inner_nv);
-		nvlist_destroy(inner_nv);
+		nvlist_move_nvlist(nv, key, inner_nv);
 	} else if (xotmp->xo_xpc_type == XPC_TYPE_INT64) {
 		nvlist_add_int64(nv, key, xpc_int64_get_value(xotmp));
 	} else if (xotmp->xo_xpc_type == XPC_TYPE_UINT64) {
 		nvlist_add_uint64(nv, key,  xpc_uint64_get_value(xotmp));
 	} else if (xotmp->xo_xpc_type == XPC_TYPE_DATE) {
-		inner_nv = nvlist_create_dictionary(0);
-		nvlist_add_string(inner_nv, NVLIST_XPC_TYPE, "date");
+		inner_nv = xpc2nv_special(nv, "date");
 		nvlist_add_int64(inner_nv, "date", xotmp->xo_u.i);
-		nvlist_add_nvlist(nv, key, inner_nv);
-		nvlist_destroy(inner_nv);
+		nvlist_move_nvlist(nv, key, inner_nv);
 	} else if (xotmp->xo_xpc_type == XPC_TYPE_DATA) {
-		nvlist_add_binary(nv, key, xpc_data_get_bytes_ptr(xotmp), xpc_data_get_length(xotmp));
+		nvlist_add_binary_external(nv, key, xpc_data_get_bytes_ptr(xotmp),
+		    xpc_data_get_length(xotmp), xpc2nv_release_data, xpc_retain(xotmp));
 	} else if (xotmp->xo_xpc_type == XPC_TYPE_STRING) {
 		nvlist_add_string(nv, key, xpc_string_get_string_ptr(xotmp));
 	} else if (xotmp->xo_xpc_type == XPC_TYPE_UUID) {
 		nvlist_add_uuid(nv, key, (uuid_t*)xpc_uuid_get_bytes(xotmp));
 	} else if (xotmp->xo_xpc_type == XPC_TYPE_FD) {
-		inner_nv = nvlist_create_dictionary(0);
-		nvlist_add_string(inner_nv, NVLIST_XPC_TYPE, "fileport");
+		inner_nv = xpc2nv_special(nv, "fileport");
 		nvlist_add_int64(inner_nv, NVLIST_PORT_INDEX, port_serializer(xotmp->xo_port));
-		nvlist_add_nvlist(nv, key, inner_nv);
-		nvlist_destroy(inner_nv);
+		nvlist_move_nvlist(nv, key, inner_nv);
 	} else if (xotmp->xo_xpc_type == XPC_TYPE_SHMEM) {
 		xpc_api_misuse("Cannot serialize object of type shared memory");
 	} else if (xotmp->xo_xpc_type == XPC_TYPE_ERROR) {
 		xpc_api_misuse("Cannot serialize object of type error");
 	} else if (xotmp->xo_xpc_type == XPC_TYPE_DOUBLE) {
-		inner_nv = nvlist_create_dictionary(0);
-		nvlist_add_string(inner_nv, NVLIST_XPC_TYPE, "double");
+		inner_nv = xpc2nv_special(nv, "double");
 		nvlist_add_binary(inner_nv, "double", &xotmp->xo_u.d, sizeof(double));
-		nvlist_add_nvlist(nv, key, inner_nv);
-		nvlist_destroy(inner_nv);
+		nvlist_move_nvlist(nv, key, inner_nv);
 	} else {
 		xpc_api_misuse("Unknown XPC type for object");
 	}
 }
 
-nvlist_t *
-xpc2nv(struct xpc_object *xo, int64_t (^port_serializer)(mach_port_t port))
+/*
+ * Convert xo into a list allocated from the arena of owner, or into the
+ * root of a new arena if owner is NULL.  Nested lists are built in place
+ * and moved into their parent, so the whole tree lives in one arena and
+ * goes away with a single nvlist_destroy() of the root.
+ */
+static nvlist_t *
+xpc2nv_in(nvlist_t *owner, struct xpc_object *xo, int64_t (^port_serializer)(mach_port_t port))
 {
 	nvlist_t *nv;
-	struct xpc_object *xotmp;
+	int type;
 
-	if (xo->xo_xpc_type == XPC_TYPE_DICTIONARY) {
-		nv = nvlist_create_dictionary(0);
-		debugf("nv = %p\n", nv);
-		xpc_dictionary_apply(xo, ^(const char *k, xpc_object_t v) {
+	if (xo->xo_xpc_type == XPC_TYPE_DICTIONARY)
+		type = NV_TYPE_NVLIST_DICTIONARY;
+	else if (xo->xo_xpc_type == XPC_TYPE_ARRAY)
+		type = NV_TYPE_NVLIST_ARRAY;
+	else {
+		xpc_assert(0, "xpc_object not of %s type", "array or dictionary");
+		return NULL;
+	}
+
+	if (owner == NULL)
+		nv = nvlist_create_arena(type, 0);
+	else
+		nv = nvlist_create_in(owner, type, 0);
+	debugf("nv = %p\n", nv);
+
+	if (type == NV_TYPE_NVLIST_DICTIONARY) {
+		xpc_dictionary_apply_nocopy(xo, ^(const char *k,
+		    xpc_object_t v) {
 			xpc2nv_primitive(nv, k, v, port_serializer);
 			return ((bool)true);
 		});
+	} else {
+		xpc_array_apply_nocopy(xo, ^(size_t index, xpc_object_t v) {
+			char key[24];
 
-		return nv;
-	}
-
-	if (xo->xo_xpc_type == XPC_TYPE_ARRAY) {
-		char *key = NULL;
-		nv = nvlist_create_array(0);
-		xpc_array_apply(xo, ^(size_t index, xpc_object_t v) {
-			asprintf(&key, "%ld", index);
+			snprintf(key, sizeof(key), "%zu", index);
 			xpc2nv_primitive(nv, key, v, port_serializer);
-			free(key);
 			return ((bool)true);
 		});
+	}
+
+	return nv;
+}
+
+nvlist_t *
+xpc2nv(struct xpc_object *xo, int64_t (^port_serializer)(mach_port_t port))
+{
+
+	return (xpc2nv_in(NULL, xo, port_serializer));
+}
+
+/*
+ * xpc2wire() writes the bytes nvlist_pack() makes of xpc2nv(xo) straight
+ * from the objects, into a buffer of xpc2wire_size(xo) bytes.  The two
+ * walks below must agree with xpc2nv_primitive() pair for pair.  Ports
+ * are serialized while writing, in the same order as by xpc2nv().
+ */
+static size_t xpc2wire_size_list(struct xpc_object *xo);
+static void xpc2wire_list(nvlist_encoder_t *nve, struct xpc_object *xo,
+    int64_t (^port_serializer)(mach_port_t port));
+
+static const char *
+xpc2wire_special(xpc_type_t type)
+{
+
+	if (type == XPC_TYPE_CONNECTION)
+		return ("connection");
+	if (type == XPC_TYPE_ENDPOINT)
+		return ("endpoint");
+	if (type == XPC_TYPE_FD)
+		return ("fileport");
+	if (type == XPC_TYPE_DATE)
+		return ("date");
+	if (type == XPC_TYPE_DOUBLE)
+		return ("double");
+	return (NULL);
+}
+
+/*
+ * Size of the data of a typed array pair made of the elements of xo, which
+ * are all of the given type.
+ */
+static size_t
+xpc2wire_array_size(struct xpc_object *xo, xpc_type_t type)
+{
+	size_t size, i;
+
+	if (type == XPC_TYPE_BOOL)
+		return (xo->xo_size * sizeof(bool));
+	if (type != XPC_TYPE_STRING)
+		return (xo->xo_size * sizeof(uint64_t));
+
+	size = 0;
+	for (i = 0; i < xo->xo_size; i++)
+		size += xo->xo_array[i]->xo_size + 1;
+	return (size);
+}
+
+static size_t
+xpc2wire_size_value(const char *key, struct xpc_object *xo)
+{
+	xpc_type_t type, atype;
+	const char *special;
+	size_t size;
+
+	type = xo->xo_xpc_type;
+	if (type == XPC_TYPE_DICTIONARY) {
+		return (nvlist_encode_nvlist_size(key) + xpc2wire_size_list(xo));
+	} else if (type == XPC_TYPE_ARRAY) {
+		atype = xpc2nv_array_type(xo);
+		if (atype == NULL) {
+			return (nvlist_encode_nvlist_size(key) +
+			    xpc2wire_size_list(xo));
+		}
+		return (nvlist_encode_size(key, xpc2wire_array_size(xo, atype)));
+	} else if (type == XPC_TYPE_BOOL) {
+		return (nvlist_encode_size(key, sizeof(uint8_t)));
+	} else if (type == XPC_TYPE_INT64 || type == XPC_TYPE_UINT64) {
+		return (nvlist_encode_size(key, sizeof(uint64_t)));
+	} else if (type == XPC_TYPE_DATA) {
+		return (nvlist_encode_size(key, xpc_data_get_length(xo)));
+	} else if (type == XPC_TYPE_STRING) {
+		return (nvlist_encode_size(key, xo->xo_size + 1));
+	} else if (type == XPC_TYPE_UUID) {
+		return (nvlist_encode_size(key, sizeof(uuid_t)));
+	} else if (type == XPC_TYPE_SHMEM) {
+		xpc_api_misuse("Cannot serialize object of type shared memory");
+	} else if (type == XPC_TYPE_ERROR) {
+		xpc_api_misuse("Cannot serialize object of type error");
+	}
+
+	special = xpc2wire_special(type);
+	if (special == NULL)
+		xpc_api_misuse("Unknown XPC type for object");
+
+	size = nvlist_encode_nvlist_size(key) +
+	    nvlist_encode_size(NVLIST_XPC_TYPE, strlen(special) + 1);
+	if (type == XPC_TYPE_DATE)
+		size += nvlist_encode_size("date", sizeof(int64_t));
+	else if (type == XPC_TYPE_DOUBLE)
+		size += nvlist_encode_size("double", sizeof(double));
+	else
+		size += nvlist_encode_size(NVLIST_PORT_INDEX, sizeof(int64_t));
+	return (size);
+}
+
+static size_t
+xpc2wire_size_list(struct xpc_object *xo)
+{
+	struct xpc_object *node, *value;
+	struct xpc_dict_pair *pair;
+	char key[24];
+	size_t size, i;
+
+	size = 0;
+	if (xo->xo_xpc_type == XPC_TYPE_DICTIONARY) {
+		node = xpc_dictionary_node(xo);
+		TAILQ_FOREACH(pair, &node->xo_u.dict.head, xo_link) {
+			value = xpc_dictionary_pair_value(node, pair);
+			if (value != NULL)
+				size += xpc2wire_size_value(pair->key, value);
+		}
+	} else {
+		for (i = 0; i < xo->xo_size; i++) {
+			snprintf(key, sizeof(key), "%zu", i);
+			size += xpc2wire_size_value(key, xo->xo_array[i]);
+		}
+	}
+
+	return (size);
+}
+
+static void
+xpc2wire_typed_array(nvlist_encoder_t *nve, const char *key,
+    struct xpc_object *xo, xpc_type_t type)
+{
+	struct xpc_object *xotmp;
+	unsigned char *data;
+	size_t i;
+	int nvtype;
+
+	if (type == XPC_TYPE_BOOL)
+		nvtype = NV_TYPE_BOOL_ARRAY;
+	else if (type == XPC_TYPE_INT64)
+		nvtype = NV_TYPE_INT64_ARRAY;
+	else if (type == XPC_TYPE_UINT64)
+		nvtype = NV_TYPE_UINT64_ARRAY;
+	else
+		nvtype = NV_TYPE_STRING_ARRAY;
+
+	data = nvlist_encode_pair(nve, nvtype, key,
+	    xpc2wire_array_size(xo, type));
+	if (data == NULL)
+		return;
+
+	for (i = 0; i < xo->xo_size; i++) {
+		xotmp = xo->xo_array[i];
+		if (type == XPC_TYPE_BOOL) {
+			*(bool *)data = xotmp->xo_bool;
+			data += sizeof(bool);
+		} else if (type == XPC_TYPE_STRING) {
+			memcpy(data, xpc_string_get_string_ptr(xotmp),
+			    xotmp->xo_size + 1);
+			data += xotmp->xo_size + 1;
+		} else {
+			memcpy(data, &xotmp->xo_uint, sizeof(uint64_t));
+			data += sizeof(uint64_t);
+		}
+	}
+}
+
+static void
+xpc2wire_value(nvlist_encoder_t *nve, const char *key, struct xpc_object *xo,
+    int64_t (^port_serializer)(mach_port_t port))
+{
+	xpc_type_t type, atype;
+	const char *special;
+	int nvtype;
+
+	type = xo->xo_xpc_type;
+	if (type == XPC_TYPE_ARRAY && (atype = xpc2nv_array_type(xo)) != NULL) {
+		xpc2wire_typed_array(nve, key, xo, atype);
+	} else if (type == XPC_TYPE_DICTIONARY || type == XPC_TYPE_ARRAY) {
+		nvtype = type == XPC_TYPE_DICTIONARY ?
+		    NV_TYPE_NVLIST_DICTIONARY : NV_TYPE_NVLIST_ARRAY;
+		nvlist_encode_begin(nve, nvtype, key, nvtype);
+		xpc2wire_list(nve, xo, port_serializer);
+		nvlist_encode_end(nve);
+	} else if (type == XPC_TYPE_BOOL) {
+		nvlist_encode_bool(nve, key, xo->xo_bool);
+	} else if (type == XPC_TYPE_INT64) {
+		nvlist_encode_number(nve, NV_TYPE_INT64, key, xo->xo_uint);
+	} else if (type == XPC_TYPE_UINT64) {
+		nvlist_encode_number(nve, NV_TYPE_UINT64, key, xo->xo_uint);
+	} else if (type == XPC_TYPE_DATA) {
+		nvlist_encode_binary(nve, NV_TYPE_BINARY, key,
+		    xpc_data_get_bytes_ptr(xo), xpc_data_get_length(xo));
+	} else if (type == XPC_TYPE_STRING) {
+		nvlist_encode_binary(nve, NV_TYPE_STRING, key,
+		    xpc_string_get_string_ptr(xo), xo->xo_size + 1);
+	} else if (type == XPC_TYPE_UUID) {
+		nvlist_encode_binary(nve, NV_TYPE_UUID, key,
+		    xpc_uuid_get_bytes(xo), sizeof(uuid_t));
+	} else {
+		/* xpc2wire_size() has turned away everything else. */
+		special = xpc2wire_special(type);
+		nvlist_encode_begin(nve, NV_TYPE_NVLIST, key,
+		    NV_TYPE_NVLIST_DICTIONARY);
+		nvlist_encode_string(nve, NVLIST_XPC_TYPE, special);
+		if (type == XPC_TYPE_DATE) {
+			nvlist_encode_number(nve, NV_TYPE_INT64, "date",
+			    (uint64_t)xo->xo_u.i);
+		} else if (type == XPC_TYPE_DOUBLE) {
+			nvlist_encode_binary(nve, NV_TYPE_BINARY, "double",
+			    &xo->xo_u.d, sizeof(double));
+		} else {
+			nvlist_encode_number(nve, NV_TYPE_INT64,
+			    NVLIST_PORT_INDEX,
+			    (uint64_t)port_serializer(xo->xo_port));
+		}
+		nvlist_encode_end(nve);
+	}
+}
+
+static void
+xpc2wire_list(nvlist_encoder_t *nve, struct xpc_object *xo,
+    int64_t (^port_serializer)(mach_port_t port))
+{
+	struct xpc_object *node, *value;
+	struct xpc_dict_pair *pair;
+	char key[24];
+	size_t i;
+
+	if (xo->xo_xpc_type == XPC_TYPE_DICTIONARY) {
+		node = xpc_dictionary_node(xo);
+		TAILQ_FOREACH(pair, &node->xo_u.dict.head, xo_link) {
+			value = xpc_dictionary_pair_value(node, pair);
+			if (value != NULL)
+				xpc2wire_value(nve, pair->key, value,
+				    port_serializer);
+		}
+	} else {
+		for (i = 0; i < xo->xo_size; i++) {
+			snprintf(key, sizeof(key), "%zu", i);
+			xpc2wire_value(nve, key, xo->xo_array[i], port_serializer);
+		}
+	}
+}
+
+size_t
+xpc2wire_size(struct xpc_object *xo)
+{
 
-		return nv;
-	}
+	xpc_assert(xo->xo_xpc_type == XPC_TYPE_DICTIONARY ||
+	    xo->xo_xpc_type == XPC_TYPE_ARRAY,
+	    "xpc_object not of %s type", "array or dictionary");
+
+	return (nvlist_encode_nvlist_size(NULL) + xpc2wire_size_list(xo));
+}
+
+/*
+ * Returns 0, or an errno value if a key is too long for the format.
+ */
+int
+xpc2wire(struct xpc_object *xo, void *buf, size_t size,
+    int64_t (^port_serializer)(mach_port_t port))
+{
+	nvlist_encoder_t nve;
 
-	xpc_assert(0, "xpc_object not of %s type", "array or dictionary");
-	return NULL;
+	nvlist_encode_init(&nve, xo->xo_xpc_type == XPC_TYPE_DICTIONARY ?
+	    NV_TYPE_NVLIST_DICTIONARY : NV_TYPE_NVLIST_ARRAY, buf, size);
+	xpc2wire_list(&nve, xo, port_serializer);
+	return (nvlist_encode_finish(&nve));
 }
 
 xpc_object_t
@@ -260,7 +1122,7 @@ xpc_dictionary_create(const char * const *keys, const xpc_object_t *values,
 	size_t i;
 	xpc_u val = {0};
 
-	xo = _xpc_prim_create(XPC_TYPE_DICTIONARY, val, count);
+	xo = _xpc_prim_create(XPC_TYPE_DICTIONARY, val, 0);
 	
 	for (i = 0; i < count; i++)
 		xpc_dictionary_set_value(xo, keys[i], values[i]);
@@ -296,6 +1158,7 @@ xpc_dictionary_get_audit_token(xpc_object_t xdict, audit_token_t *token)
 	xpc_assert_nonnull(xdict);
 
 	xo = xdict;
+	xpc_assert_type(xo, XPC_TYPE_DICTIONARY);
 	if (xo->xo_audit_token != NULL)
 		memcpy(token, xo->xo_audit_token, sizeof(*token));
 }
@@ -344,39 +1207,714 @@ xpc_dictionary_copy_mach_send(xpc_object_t xdict, const char *key)
 	return xovalue->xo_port;
 }
 
-void
-xpc_dictionary_set_value_nokeycheck(xpc_object_t xdict, const char *key, xpc_object_t value)
+static uint32_t
+xpc_dictionary_hash(const char *key)
 {
-	struct xpc_object *xo = xdict, *xotmp;
-	struct xpc_dict_head *head;
+	uint32_t hash;
+
+	/* FNV-1a */
+	hash = 2166136261U;
+	while (*key != '\0') {
+		hash ^= (unsigned char)*key++;
+		hash *= 16777619U;
+	}
+
+	return (hash);
+}
+
+/*
+ * Process-wide table of interned dictionary keys.  It starts out with the
+ * keys libxpc and launchd put in nearly every message, and keys received
+ * off the wire are added as they come in, whether the dictionary is
+ * decoded right away or lazily, so dictionaries holding the same
+ * key share one copy and lookups passing that pointer skip the string
+ * compare.  A second table indexes the entries by the address of their
+ * string, so that such lookups also take the hash from the entry instead
+ * of hashing the key again.  Entries are never removed; once
+ * XPC_KEY_INTERN_MAX keys are in, new keys are copied into their pairs as
+ * before.  Lookups don't take the lock, inserts publish an entry only once
+ * it is complete.
+ */
+#define	XPC_KEY_INTERN_MAX	4096
+#define	XPC_KEY_INTERN_SIZE	(2 * XPC_KEY_INTERN_MAX)
+#define	XPC_KEY_INTERN_LEN	64
+
+struct xpc_key {
+	const char *	str;
+	uint32_t	hash;
+};
+
+static const char *xpc_key_builtin[] = {
+	XPC_SEQID, XPC_RPORT,
+	LAUNCH_KEY_SUBMITJOB, LAUNCH_KEY_REMOVEJOB, LAUNCH_KEY_STARTJOB,
+	LAUNCH_KEY_STOPJOB, LAUNCH_KEY_GETJOB, LAUNCH_KEY_GETJOBS,
+	LAUNCH_KEY_CHECKIN,
+	LAUNCH_JOBKEY_LABEL, LAUNCH_JOBKEY_DISABLED, LAUNCH_JOBKEY_USERNAME,
+	LAUNCH_JOBKEY_GROUPNAME, LAUNCH_JOBKEY_TIMEOUT,
+	LAUNCH_JOBKEY_EXITTIMEOUT, LAUNCH_JOBKEY_INITGROUPS,
+	LAUNCH_JOBKEY_SOCKETS, LAUNCH_JOBKEY_MACHSERVICES,
+	LAUNCH_JOBKEY_INETDCOMPATIBILITY, LAUNCH_JOBKEY_PROGRAMARGUMENTS,
+	LAUNCH_JOBKEY_PROGRAM, LAUNCH_JOBKEY_ONDEMAND, LAUNCH_JOBKEY_KEEPALIVE,
+	LAUNCH_JOBKEY_RUNATLOAD, LAUNCH_JOBKEY_ROOTDIRECTORY,
+	LAUNCH_JOBKEY_WORKINGDIRECTORY, LAUNCH_JOBKEY_ENVIRONMENTVARIABLES,
+	LAUNCH_JOBKEY_USERENVIRONMENTVARIABLES, LAUNCH_JOBKEY_UMASK,
+	LAUNCH_JOBKEY_NICE, LAUNCH_JOBKEY_LOWPRIORITYIO,
+	LAUNCH_JOBKEY_SESSIONCREATE, LAUNCH_JOBKEY_SOFTRESOURCELIMITS,
+	LAUNCH_JOBKEY_HARDRESOURCELIMITS, LAUNCH_JOBKEY_STANDARDINPATH,
+	LAUNCH_JOBKEY_STANDARDOUTPATH, LAUNCH_JOBKEY_STANDARDERRORPATH,
+	LAUNCH_JOBKEY_DEBUG, LAUNCH_JOBKEY_WAITFORDEBUGGER,
+	LAUNCH_JOBKEY_QUEUEDIRECTORIES, LAUNCH_JOBKEY_WATCHPATHS,
+	LAUNCH_JOBKEY_STARTINTERVAL, LAUNCH_JOBKEY_STARTCALENDARINTERVAL,
+	LAUNCH_JOBKEY_LASTEXITSTATUS, LAUNCH_JOBKEY_PID,
+	LAUNCH_JOBKEY_THROTTLEINTERVAL, LAUNCH_JOBKEY_LAUNCHONLYONCE,
+	LAUNCH_JOBKEY_ABANDONPROCESSGROUP, LAUNCH_JOBKEY_ENABLETRANSACTIONS,
+	LAUNCH_JOBKEY_PROCESSTYPE, LAUNCH_JOBKEY_LAUNCHEVENTS,
+};
+
+#define	XPC_KEY_NBUILTIN	(sizeof(xpc_key_builtin) / sizeof(xpc_key_builtin[0]))
+
+static struct xpc_key xpc_key_static[XPC_KEY_NBUILTIN];
+static struct xpc_key *xpc_keys[XPC_KEY_INTERN_SIZE];
+static struct xpc_key *xpc_keys_by_addr[XPC_KEY_INTERN_SIZE];
+static size_t xpc_nkeys;
+static pthread_mutex_t xpc_keys_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t xpc_keys_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Find the slot of key in the table, or the free slot where it goes.
+ */
+static struct xpc_key **
+xpc_key_slot(const char *key, uint32_t hash)
+{
+	struct xpc_key *entry;
+	size_t idx;
+
+	for (idx = hash % XPC_KEY_INTERN_SIZE;;
+	    idx = (idx + 1) % XPC_KEY_INTERN_SIZE) {
+		entry = __atomic_load_n(&xpc_keys[idx], __ATOMIC_ACQUIRE);
+		if (entry == NULL || (entry->hash == hash &&
+		    (entry->str == key || !strcmp(entry->str, key))))
+			return (&xpc_keys[idx]);
+	}
+}
+
+static size_t
+xpc_key_addr_idx(const char *str)
+{
+	uint64_t addr;
+
+	/* Fibonacci hashing; the low bits of the address are mostly zero. */
+	addr = (uint64_t)(uintptr_t)str * 0x9e3779b97f4a7c15ULL;
+	return ((size_t)(addr >> 32) % XPC_KEY_INTERN_SIZE);
+}
+
+/*
+ * Make entry, which was just added to xpc_keys, findable by address.
+ */
+static void
+xpc_key_publish_addr(struct xpc_key *entry)
+{
+	size_t idx;
+
+	for (idx = xpc_key_addr_idx(entry->str); xpc_keys_by_addr[idx] != NULL;
+	    idx = (idx + 1) % XPC_KEY_INTERN_SIZE)
+		;
+	__atomic_store_n(&xpc_keys_by_addr[idx], entry, __ATOMIC_RELEASE);
+}
+
+static void
+xpc_key_init(void)
+{
+	struct xpc_key *entry, **slot;
+	size_t i;
+
+	for (i = 0; i < XPC_KEY_NBUILTIN; i++) {
+		entry = &xpc_key_static[i];
+		entry->str = xpc_key_builtin[i];
+		entry->hash = xpc_dictionary_hash(entry->str);
+		slot = xpc_key_slot(entry->str, entry->hash);
+		if (*slot == NULL) {
+			*slot = entry;
+			xpc_key_publish_addr(entry);
+			xpc_nkeys++;
+		}
+	}
+}
+
+/*
+ * The hash of key.  When key is the string of an interned entry, which is
+ * what lookups with the keys of received messages and with libxpc's own
+ * keys pass, it is the hash the entry was interned with.
+ */
+static uint32_t
+xpc_key_hash(const char *key)
+{
+	struct xpc_key *entry;
+	size_t idx;
+
+	pthread_once(&xpc_keys_once, xpc_key_init);
+	for (idx = xpc_key_addr_idx(key);;
+	    idx = (idx + 1) % XPC_KEY_INTERN_SIZE) {
+		entry = __atomic_load_n(&xpc_keys_by_addr[idx],
+		    __ATOMIC_ACQUIRE);
+		if (entry == NULL)
+			return (xpc_dictionary_hash(key));
+		if (entry->str == key)
+			return (entry->hash);
+	}
+}
+
+/*
+ * Return the interned copy of key, or NULL if it isn't interned.
+ */
+static const char *
+xpc_key_find(const char *key, uint32_t hash)
+{
+	struct xpc_key *entry;
+
+	pthread_once(&xpc_keys_once, xpc_key_init);
+	entry = __atomic_load_n(xpc_key_slot(key, hash), __ATOMIC_ACQUIRE);
+	return (entry != NULL ? entry->str : NULL);
+}
+
+/*
+ * Like xpc_key_find(), but add key to the table if there is room for it.
+ */
+static const char *
+xpc_key_intern(const char *key, uint32_t hash)
+{
+	struct xpc_key *entry, **slot;
+	const char *str;
+	size_t len;
+
+	str = xpc_key_find(key, hash);
+	if (str != NULL)
+		return (str);
+
+	len = strlen(key);
+	if (len > XPC_KEY_INTERN_LEN)
+		return (NULL);
+
+	pthread_mutex_lock(&xpc_keys_lock);
+	/* Another thread may have added it meanwhile. */
+	slot = xpc_key_slot(key, hash);
+	if (*slot != NULL) {
+		str = (*slot)->str;
+	} else if (xpc_nkeys < XPC_KEY_INTERN_MAX &&
+	    (entry = malloc(sizeof(*entry) + len + 1)) != NULL) {
+		memcpy(entry + 1, key, len + 1);
+		entry->str = (const char *)(entry + 1);
+		entry->hash = hash;
+		__atomic_store_n(slot, entry, __ATOMIC_RELEASE);
+		xpc_key_publish_addr(entry);
+		xpc_nkeys++;
+		str = entry->str;
+	}
+	pthread_mutex_unlock(&xpc_keys_lock);
+
+	return (str);
+}
+
+static void
+xpc_dictionary_index_link(struct xpc_dict_index *index,
+    struct xpc_dict_pair *pair)
+{
+	struct xpc_dict_slot *slot;
+	size_t idx, mask;
+
+	mask = index->size - 1;
+	for (idx = pair->hash & mask;; idx = (idx + 1) & mask) {
+		slot = &index->slots[idx];
+		if (slot->pair == NULL) {
+			index->used++;
+			break;
+		}
+		if (slot->pair == XPC_DICT_SLOT_DELETED)
+			break;
+	}
+	slot->hash = pair->hash;
+	slot->pair = pair;
+}
+
+/*
+ * (Re)build the index so that at most half of its slots are in use.  If
+ * that fails the dictionary goes without one and lookups walk the list.
+ */
+static void
+xpc_dictionary_reindex(struct xpc_object *xo)
+{
+	struct xpc_dict_index *index;
 	struct xpc_dict_pair *pair;
+	size_t size;
 
-	xpc_assert_nonnull(xdict);
-	xpc_assert_type(xo, XPC_TYPE_DICTIONARY);
+	size = 16;
+	while (size < xo->xo_size * 3)
+		size <<= 1;
 
-	xo = xdict;
-	head = &xo->xo_dict;
+	free(xo->xo_dict_index);
+	index = calloc(1, sizeof(*index) + size * sizeof(index->slots[0]));
+	xo->xo_dict_index = index;
+	if (index == NULL)
+		return;
 
-	TAILQ_FOREACH(pair, head, xo_link) {
-		if (!strcmp(pair->key, key)) {
-			if (value != NULL) {
-				pair->value = value;
-			} else {
-				TAILQ_REMOVE(head, pair, xo_link);
-			}
-
-			return;
+	index->size = size;
+	TAILQ_FOREACH(pair, &xo->xo_dict, xo_link)
+		xpc_dictionary_index_link(index, pair);
+}
+
+static struct xpc_dict_pair *
+xpc_dictionary_lookup(struct xpc_object *xo, const char *key)
+{
+	struct xpc_dict_index *index;
+	struct xpc_dict_slot *slot;
+	struct xpc_dict_pair *pair;
+	size_t idx, mask;
+	uint32_t hash;
+
+	index = xo->xo_dict_index;
+	if (index == NULL) {
+		/* Interned keys usually match by address. */
+		TAILQ_FOREACH(pair, &xo->xo_dict, xo_link) {
+			if (pair->key == key)
+				return (pair);
 		}
+		TAILQ_FOREACH(pair, &xo->xo_dict, xo_link) {
+			if (!strcmp(pair->key, key))
+				return (pair);
+		}
+		return (NULL);
+	}
+
+	hash = xpc_key_hash(key);
+	mask = index->size - 1;
+	for (idx = hash & mask;; idx = (idx + 1) & mask) {
+		slot = &index->slots[idx];
+		if (slot->pair == NULL)
+			return (NULL);
+		if (slot->pair != XPC_DICT_SLOT_DELETED &&
+		    slot->hash == hash && (slot->pair->key == key ||
+		    !strcmp(slot->pair->key, key)))
+			return (slot->pair);
 	}
+}
+
+static void
+xpc_dictionary_insert(struct xpc_object *xo, struct xpc_dict_pair *pair)
+{
+	struct xpc_dict_index *index;
 
+	TAILQ_INSERT_TAIL(&xo->xo_dict, pair, xo_link);
 	xo->xo_size++;
+	xo->xo_u.dict.store->xo_size = xo->xo_size;
+
+	index = xo->xo_dict_index;
+	if (index == NULL) {
+		if (xo->xo_size > XPC_DICT_HASH_THRESHOLD)
+			xpc_dictionary_reindex(xo);
+	} else if ((index->used + 1) * 2 > index->size) {
+		xpc_dictionary_reindex(xo);
+	} else {
+		xpc_dictionary_index_link(index, pair);
+	}
+}
+
+static void
+xpc_dictionary_remove(struct xpc_object *xo, struct xpc_dict_pair *pair)
+{
+	struct xpc_dict_index *index;
+	struct xpc_dict_slot *slot;
+	size_t idx, mask;
+
+	TAILQ_REMOVE(&xo->xo_dict, pair, xo_link);
+	xo->xo_size--;
+	xo->xo_u.dict.store->xo_size = xo->xo_size;
+
+	index = xo->xo_dict_index;
+	if (index == NULL)
+		return;
+
+	mask = index->size - 1;
+	for (idx = pair->hash & mask;; idx = (idx + 1) & mask) {
+		slot = &index->slots[idx];
+		xpc_assert(slot->pair != NULL, "dictionary index lost a key");
+		if (slot->pair == pair) {
+			slot->pair = XPC_DICT_SLOT_DELETED;
+			break;
+		}
+	}
+}
+
+/*
+ * Fill the empty dictionary xo with a copy of the pairs of from, one
+ * level deep: values are retained, and dictionaries and arrays among them
+ * are copied with xpc_copy() in turn.  Values still packed in a message
+ * are decoded for xo alone, so that from, which may be shared, is only
+ * read.  Returns false if memory runs out, with xo holding part of the
+ * pairs.
+ */
+static bool
+xpc_dictionary_fill(struct xpc_object *xo, struct xpc_object *from)
+{
+	struct xpc_object *value;
+	struct xpc_dict_pair *pair, *copy;
+
+	TAILQ_FOREACH(pair, &from->xo_dict, xo_link) {
+		value = __atomic_load_n(&pair->value, __ATOMIC_ACQUIRE);
+		if (value == NULL && pair->packed != NULL) {
+			value = xpc_dictionary_pair_decode(from, pair);
+			if (value == NULL)
+				continue;
+		} else if (value == NULL)
+			continue;
+		else if (XPC_IS_CONTAINER(value)) {
+			value = xpc_copy(value);
+			if (value == NULL)
+				return (false);
+		} else
+			xpc_retain(value);
+
+		copy = malloc(sizeof(struct xpc_dict_pair));
+		if (copy == NULL) {
+			xpc_release(value);
+			return (false);
+		}
+		/* Keys of a message go away with it. */
+		copy->key = pair->interned ?
+		    xpc_key_find(pair->key, pair->hash) : NULL;
+		copy->interned = copy->key != NULL;
+		if (!copy->interned)
+			copy->key = strdup(pair->key);
+		if (copy->key == NULL) {
+			xpc_release(value);
+			free(copy);
+			return (false);
+		}
+		copy->hash = pair->hash;
+		copy->value = value;
+		copy->packed = NULL;
+		xpc_dictionary_insert(xo, copy);
+	}
+
+	return (true);
+}
+
+/*
+ * Serializes deciding to share the store of a dictionary with deciding to
+ * lend a container from it; see XPC_IS_CONTAINER().
+ */
+static pthread_mutex_t xpc_dictionary_share_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The store of xo, as a reader racing with xpc_dictionary_unshare() can
+ * use it: its pairs stay valid until xo goes away.
+ */
+static inline struct xpc_object *
+xpc_dictionary_node(struct xpc_object *xo)
+{
+
+	return (__atomic_load_n(&xo->xo_u.dict.store, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Hand the pairs of xo, which holds them itself, to a new node dictionary
+ * that copies can share, along with the message of a lazy one, and make
+ * that the store of xo.  Readers may still be walking the pairs from xo,
+ * so nothing of xo but its store changes; its head and index are just no
+ * longer used.  Called with the share lock held.
+ */
+static struct xpc_object *
+xpc_dictionary_detach(struct xpc_object *xo)
+{
+	struct xpc_object *node;
+	struct xpc_dict_pair *first;
+	xpc_u val;
+
+	bzero(&val, sizeof(val));
+	node = _xpc_prim_create_flags(XPC_TYPE_DICTIONARY, val, xo->xo_size,
+	    xo->xo_flags & _XPC_DICT_LAZY);
+	if (node == NULL)
+		return (NULL);
+
+	first = TAILQ_FIRST(&xo->xo_u.dict.head);
+	if (first != NULL) {
+		node->xo_u.dict.head.tqh_first = first;
+		node->xo_u.dict.head.tqh_last = xo->xo_u.dict.head.tqh_last;
+		first->xo_link.tqe_prev = &node->xo_u.dict.head.tqh_first;
+	}
+	node->xo_u.dict.index = xo->xo_u.dict.index;
+	if (xo->xo_flags & _XPC_DICT_LAZY) {
+		node->xo_u.dict.wire = xpc_wire_retain(xo->xo_u.dict.wire);
+		node->xo_u.dict.view = xo->xo_u.dict.view;
+	}
+
+	__atomic_store_n(&xo->xo_u.dict.store, node, __ATOMIC_RELEASE);
+	return (node);
+}
+
+/*
+ * xpc_copy() of a dictionary: the copy shares the node holding the pairs
+ * of the original, whatever their number.  A dictionary that lent out
+ * containers is copied a level at once instead; see XPC_IS_CONTAINER().
+ * So are the statically allocated XPC_ERROR_* dictionaries, which can't
+ * be changed at all.  xo is only read, but for its store being switched to
+ * a node.
+ */
+__private_extern__ struct xpc_object *
+xpc_dictionary_copy(struct xpc_object *xo)
+{
+	struct xpc_object *node, *copy;
+	xpc_u val;
+
+	bzero(&val, sizeof(val));
+	pthread_mutex_lock(&xpc_dictionary_share_lock);
+	node = xo->xo_u.dict.store;
+	if ((node->xo_flags & _XPC_CONTAINER_LENT) ||
+	    node->header.ref_cnt == _OS_OBJECT_GLOBAL_REFCNT) {
+		pthread_mutex_unlock(&xpc_dictionary_share_lock);
+		copy = _xpc_prim_create(XPC_TYPE_DICTIONARY, val, 0);
+		if (copy == NULL)
+			return (NULL);
+		if (!xpc_dictionary_fill(copy, node)) {
+			xpc_release(copy);
+			return (NULL);
+		}
+		return (copy);
+	}
+
+	if (node == xo && (node = xpc_dictionary_detach(xo)) == NULL) {
+		pthread_mutex_unlock(&xpc_dictionary_share_lock);
+		return (NULL);
+	}
+	__atomic_or_fetch(&node->xo_flags, _XPC_CONTAINER_SHARED,
+	    __ATOMIC_RELAXED);
+	xpc_retain(node);
+	pthread_mutex_unlock(&xpc_dictionary_share_lock);
+
+	copy = _xpc_prim_create(XPC_TYPE_DICTIONARY, val, xo->xo_size);
+	if (copy == NULL) {
+		xpc_release(node);
+		return (NULL);
+	}
+	copy->xo_u.dict.store = node;
+	return (copy);
+}
+
+/*
+ * Give a dictionary that shares its pairs a node of its own, before it
+ * changes or hands out a container that could be changed, and return its
+ * store.  Only this level is copied, so that changing one value deep down
+ * costs the containers on the way to it and not the whole tree.  The new
+ * node is filled on the side and then published in one go; another reader
+ * may get there first, and then its node is used.  With lend, the store is
+ * also flagged _XPC_CONTAINER_LENT before a copy can share it.  If memory
+ * runs out, xo is left sharing and NULL is returned.
+ */
+static struct xpc_object *
+xpc_dictionary_unshare(struct xpc_object *xo, bool lend)
+{
+	struct xpc_object *node, *tmp;
+	xpc_u val;
+
+	/*
+	 * Changing xo while it is being copied is the caller's bug.  Static
+	 * dictionaries are never shared, so lending from them needn't be
+	 * recorded, and couldn't be.
+	 */
+	node = xpc_dictionary_node(xo);
+	if ((!lend || node->header.ref_cnt == _OS_OBJECT_GLOBAL_REFCNT) &&
+	    !(node->xo_flags & _XPC_CONTAINER_SHARED))
+		return (node);
+
+	bzero(&val, sizeof(val));
+	pthread_mutex_lock(&xpc_dictionary_share_lock);
+	while ((node = xo->xo_u.dict.store)->xo_flags & _XPC_CONTAINER_SHARED) {
+		pthread_mutex_unlock(&xpc_dictionary_share_lock);
+		tmp = _xpc_prim_create(XPC_TYPE_DICTIONARY, val, 0);
+		if (tmp == NULL)
+			return (NULL);
+		if (!xpc_dictionary_fill(tmp, node)) {
+			xpc_release(tmp);
+			return (NULL);
+		}
+
+		pthread_mutex_lock(&xpc_dictionary_share_lock);
+		if (xo->xo_u.dict.store != node) {
+			pthread_mutex_unlock(&xpc_dictionary_share_lock);
+			xpc_release(tmp);
+			pthread_mutex_lock(&xpc_dictionary_share_lock);
+			continue;
+		}
+		/* xo's reference to node goes with it. */
+		tmp->xo_u.dict.retired = node;
+		if (xo->xo_size != tmp->xo_size)
+			xo->xo_size = tmp->xo_size;
+		__atomic_store_n(&xo->xo_u.dict.store, tmp, __ATOMIC_RELEASE);
+	}
+	if (lend)
+		__atomic_or_fetch(&node->xo_flags, _XPC_CONTAINER_LENT,
+		    __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&xpc_dictionary_share_lock);
+
+	return (node);
+}
+
+/*
+ * Set or remove a value.  Keys of new pairs are shared with the interned
+ * key table when it has them; intern adds them to the table first.
+ */
+static void
+xpc_dictionary_store(struct xpc_object *xo, const char *key,
+    struct xpc_object *value, bool intern)
+{
+	struct xpc_dict_pair *pair;
+	uint32_t hash;
+
+	if (xpc_dictionary_unshare(xo, false) == NULL)
+		return;
+	pair = xpc_dictionary_lookup(xo, key);
+	if (pair != NULL) {
+		if (value != NULL) {
+			xpc_retain(value);
+			if (pair->value != NULL)
+				xpc_release(pair->value);
+			pair->value = value;
+			pair->packed = NULL;
+		} else {
+			xpc_dictionary_remove(xo, pair);
+			if (pair->value != NULL)
+				xpc_release(pair->value);
+			if (!pair->interned)
+				free((char *)pair->key);
+			free(pair);
+		}
+		return;
+	}
+
+	if (value == NULL)
+		return;
+
+	hash = xpc_key_hash(key);
 	pair = malloc(sizeof(struct xpc_dict_pair));
-	pair->key = key;
+	pair->key = intern ? xpc_key_intern(key, hash) : xpc_key_find(key, hash);
+	pair->interned = pair->key != NULL;
+	if (!pair->interned)
+		pair->key = strdup(key);
+	pair->hash = hash;
 	pair->value = value;
-	TAILQ_INSERT_TAIL(&xo->xo_dict, pair, xo_link);
+	pair->packed = NULL;
+	xpc_dictionary_insert(xo, pair);
 	xpc_retain(value);
 }
 
+/*
+ * Add a pair of a lazy dictionary, whose value is still packed in the
+ * message at packed.  Keys are interned as by
+ * xpc_dictionary_set_wire_value(); those the table has no room for point
+ * into the message, which outlives the dictionary.  The key comes from the
+ * peer, so a reserved one makes the message bad rather than the caller:
+ * returns false and sets errno to EBADMSG then, or to ENOMEM.
+ */
+static bool
+xpc_dictionary_store_packed(struct xpc_object *xo, const char *key,
+    const void *packed)
+{
+	struct xpc_dict_pair *pair;
+	uint32_t hash;
+
+	if (strncmp(key, NVLIST_XPC_TYPE, strlen(NVLIST_XPC_TYPE)) == 0) {
+		errno = EBADMSG;
+		return (false);
+	}
+
+	pair = xpc_dictionary_lookup(xo, key);
+	if (pair != NULL) {
+		/* The last of duplicate keys wins, as with set_value. */
+		if (pair->value != NULL)
+			xpc_release(pair->value);
+		pair->value = NULL;
+		pair->packed = packed;
+		return (true);
+	}
+
+	hash = xpc_key_hash(key);
+	pair = malloc(sizeof(struct xpc_dict_pair));
+	if (pair == NULL) {
+		errno = ENOMEM;
+		return (false);
+	}
+	pair->key = xpc_key_intern(key, hash);
+	if (pair->key == NULL)
+		pair->key = key;
+	pair->interned = true;
+	pair->hash = hash;
+	pair->value = NULL;
+	pair->packed = packed;
+	xpc_dictionary_insert(xo, pair);
+	return (true);
+}
+
+/*
+ * Decode the packed value of a pair of a lazy dictionary into a new
+ * object, without publishing it in the pair.  node is the store the pair
+ * was found in, which holds the message.
+ */
+static struct xpc_object *
+xpc_dictionary_pair_decode(struct xpc_object *node,
+    struct xpc_dict_pair *pair)
+{
+	struct xpc_wire *wire;
+	nvpair_view_t nvpv;
+	void *cookie;
+
+	wire = node->xo_u.dict.wire;
+	cookie = (void *)(uintptr_t)pair->packed;
+	nvlist_view_next(&node->xo_u.dict.view, &nvpv, &cookie);
+	return (nv2xpc_view_value(&nvpv, wire, ^(int64_t port_index) {
+		return (xpc_wire_port(wire, port_index));
+	}));
+}
+
+/*
+ * Value of a pair of node, which lazy dictionaries decode on first use.
+ * Readers may race to decode the same pair; the first value published is
+ * kept and the others are thrown away.
+ */
+static struct xpc_object *
+xpc_dictionary_pair_value(struct xpc_object *node, struct xpc_dict_pair *pair)
+{
+	struct xpc_object *value, *expected;
+
+	value = __atomic_load_n(&pair->value, __ATOMIC_ACQUIRE);
+	if (value != NULL || pair->packed == NULL)
+		return (value);
+
+	value = xpc_dictionary_pair_decode(node, pair);
+	if (value == NULL)
+		return (NULL);
+
+	expected = NULL;
+	if (!__atomic_compare_exchange_n(&pair->value, &expected, value, false,
+	    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		xpc_release(value);
+		value = expected;
+	}
+
+	return (value);
+}
+
+void
+xpc_dictionary_set_value_nokeycheck(xpc_object_t xdict, const char *key, xpc_object_t value)
+{
+	struct xpc_object *xo = xdict;
+
+	xpc_assert_nonnull(xdict);
+	xpc_assert_type(xo, XPC_TYPE_DICTIONARY);
+
+	xpc_dictionary_store(xo, key, value, false);
+	if (value != NULL)
+		XPC_CONTAINER_LEND(xo, value);
+}
+
 void
 xpc_dictionary_set_value(xpc_object_t xdict, const char *key, xpc_object_t value) {
 	bool is_reserved_key = strncmp(key, NVLIST_XPC_TYPE, strlen(NVLIST_XPC_TYPE)) == 0;
@@ -385,25 +1923,67 @@ xpc_dictionary_set_value(xpc_object_t xdict, const char *key, xpc_object_t value
 
 }
 
+/*
+ * xpc_dictionary_set_value() for keys of received messages, which are
+ * interned.
+ */
+static void
+xpc_dictionary_set_wire_value(struct xpc_object *xo, const char *key,
+    struct xpc_object *value)
+{
+	bool is_reserved_key = strncmp(key, NVLIST_XPC_TYPE, strlen(NVLIST_XPC_TYPE)) == 0;
+	xpc_precondition(!is_reserved_key, "Cannot add key %s to dictionary, as it is reserved for internal use", key);
+
+	xpc_dictionary_store(xo, key, value, true);
+}
+
 xpc_object_t
 xpc_dictionary_get_value(xpc_object_t xdict, const char *key)
 {
 	xpc_assert_nonnull(xdict);
 
-	struct xpc_object *xo;
-	struct xpc_dict_head *head;
+	struct xpc_object *xo, *node, *value;
 	struct xpc_dict_pair *pair;
 
 	xo = xdict;
 	xpc_assert_type(xo, XPC_TYPE_DICTIONARY);
-	head = &xo->xo_dict;
 
-	TAILQ_FOREACH(pair, head, xo_link) {
-		if (!strcmp(pair->key, key))
-			return (pair->value);
-	}
+	node = xpc_dictionary_node(xo);
+	pair = xpc_dictionary_lookup(node, key);
+	if (pair == NULL)
+		return (NULL);
 
-	return (NULL);
+	value = xpc_dictionary_pair_value(node, pair);
+	if (value == NULL || !XPC_IS_CONTAINER(value))
+		return (value);
+
+	/* The caller may change it, so it can't be a shared one. */
+	if (xpc_dictionary_unshare(xo, true) == node)
+		return (value);
+	node = xpc_dictionary_node(xo);
+	pair = xpc_dictionary_lookup(node, key);
+	if (pair == NULL)
+		return (NULL);
+
+	return (xpc_dictionary_pair_value(node, pair));
+}
+
+/*
+ * xpc_dictionary_get_value() for readers that don't change what they get,
+ * which can then come straight from shared pairs.
+ */
+__private_extern__ xpc_object_t
+xpc_dictionary_get_value_nocopy(xpc_object_t xdict, const char *key)
+{
+	struct xpc_object *node;
+	struct xpc_dict_pair *pair;
+
+	node = xpc_dictionary_node(xdict);
+	pair = xpc_dictionary_lookup(node, key);
+	if (pair == NULL)
+		return (NULL);
+
+	return (xpc_dictionary_pair_value(node, pair));
 }
 
 size_t
@@ -535,17 +2115,35 @@ xpc_dictionary_get_data(xpc_object_t xdict, const char *key, size_t *length)
 bool
 xpc_dictionary_apply(xpc_object_t xdict, xpc_dictionary_applier_t applier)
 {
-	struct xpc_object *xo = xdict, *xotmp;
-	struct xpc_dict_head *head;
-	struct xpc_dict_pair *pair;
+	struct xpc_object *xo = xdict;
 
 	xpc_assert_nonnull(xdict);
 	xpc_assert_type(xo, XPC_TYPE_DICTIONARY);
 
-	head = &xo->xo_dict;
+	/* The applier may change the values it is given. */
+	if (xpc_dictionary_unshare(xo, true) == NULL)
+		return (false);
+	return (xpc_dictionary_apply_nocopy(xo, applier));
+}
+
+/*
+ * xpc_dictionary_apply() for appliers that don't change the values.
+ */
+__private_extern__ bool
+xpc_dictionary_apply_nocopy(xpc_object_t xdict,
+    xpc_dictionary_applier_t applier)
+{
+	struct xpc_object *node, *value;
+	struct xpc_dict_head *head;
+	struct xpc_dict_pair *pair;
+
+	node = xpc_dictionary_node(xdict);
+	head = &node->xo_u.dict.head;
 
 	TAILQ_FOREACH(pair, head, xo_link) {
-		if (!applier(pair->key, pair->value))
+		/* A packed value that failed to decode has nothing to show. */
+		value = xpc_dictionary_pair_value(node, pair);
+		if (value != NULL && !applier(pair->key, value))
 			return (false);
 	}
 
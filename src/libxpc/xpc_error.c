@@ -25,6 +25,8 @@ OS_OBJECT_OBJC_CLASS_DECL(xpc_object);
 /* The only key for XPC_ERROR_* dictionaries */
 #define _XPC_ERROR_KEY_DESCRIPTION_STR "XPCErrorDescription"
 const char *const _xpc_error_key_description = _XPC_ERROR_KEY_DESCRIPTION_STR;
+/* FNV-1a of the key, as xpc_dictionary_hash() computes it */
+#define _XPC_ERROR_KEY_DESCRIPTION_HASH 0xf16d556eU
 
 /*
 * XPC_ERROR_* constants are declared to be of type `struct _xpc_dictionary_s`
@@ -64,9 +66,10 @@ static const struct xpc_object _xpc_error_connection_interrupted_val = {
 static const struct xpc_dict_pair _xpc_error_connection_interrupted_pair = {
 	.key = _XPC_ERROR_KEY_DESCRIPTION_STR,
 	.value = &_xpc_error_connection_interrupted_val,
+	.hash = _XPC_ERROR_KEY_DESCRIPTION_HASH,
 	.xo_link = {
 		.tqe_next = NULL,
-		.tqe_prev = &_xpc_error_connection_interrupted.inner.xo_u.dict.tqh_first
+		.tqe_prev = &_xpc_error_connection_interrupted.inner.xo_u.dict.head.tqh_first
 	}
 };
 
@@ -81,8 +84,11 @@ const struct _xpc_dictionary_s _xpc_error_connection_interrupted = {
 		.xo_size = 1,
 		.xo_u = {
 			.dict = {
-				.tqh_first = &_xpc_error_connection_interrupted_pair,
-				.tqh_last = &_xpc_error_connection_interrupted_pair.xo_link.tqe_next
+				.head = {
+					.tqh_first = &_xpc_error_connection_interrupted_pair,
+					.tqh_last = &_xpc_error_connection_interrupted_pair.xo_link.tqe_next
+				},
+				.store = (struct xpc_object *)&_xpc_error_connection_interrupted.inner
 			}
 		}
 	}
@@ -108,9 +114,10 @@ static const struct xpc_object _xpc_error_connection_invalid_val = {
 static const struct xpc_dict_pair _xpc_error_connection_invalid_pair = {
 	.key = _XPC_ERROR_KEY_DESCRIPTION_STR,
 	.value = &_xpc_error_connection_invalid_val,
+	.hash = _XPC_ERROR_KEY_DESCRIPTION_HASH,
 	.xo_link = {
 		.tqe_next = NULL,
-		.tqe_prev = &_xpc_error_connection_invalid.inner.xo_u.dict.tqh_first
+		.tqe_prev = &_xpc_error_connection_invalid.inner.xo_u.dict.head.tqh_first
 	}
 };
 
@@ -125,8 +132,11 @@ const struct _xpc_dictionary_s _xpc_error_connection_invalid = {
 		.xo_size = 1,
 		.xo_u = {
 			.dict = {
-				.tqh_first = &_xpc_error_connection_invalid_pair,
-				.tqh_last = &_xpc_error_connection_invalid_pair.xo_link.tqe_next
+				.head = {
+					.tqh_first = &_xpc_error_connection_invalid_pair,
+					.tqh_last = &_xpc_error_connection_invalid_pair.xo_link.tqe_next
+				},
+				.store = (struct xpc_object *)&_xpc_error_connection_invalid.inner
 			}
 		}
 	}
@@ -152,9 +162,10 @@ static const struct xpc_object _xpc_error_termination_imminent_val = {
 static const struct xpc_dict_pair _xpc_error_termination_imminent_pair = {
 	.key = _XPC_ERROR_KEY_DESCRIPTION_STR,
 	.value = &_xpc_error_termination_imminent_val,
+	.hash = _XPC_ERROR_KEY_DESCRIPTION_HASH,
 	.xo_link = {
 		.tqe_next = NULL,
-		.tqe_prev = &_xpc_error_termination_imminent.inner.xo_u.dict.tqh_first
+		.tqe_prev = &_xpc_error_termination_imminent.inner.xo_u.dict.head.tqh_first
 	}
 };
 
@@ -169,8 +180,11 @@ const struct _xpc_dictionary_s _xpc_error_termination_imminent = {
 		.xo_size = 1,
 		.xo_u = {
 			.dict = {
-				.tqh_first = &_xpc_error_termination_imminent_pair,
-				.tqh_last = &_xpc_error_termination_imminent_pair.xo_link.tqe_next
+				.head = {
+					.tqh_first = &_xpc_error_termination_imminent_pair,
+					.tqh_last = &_xpc_error_termination_imminent_pair.xo_link.tqe_next
+				},
+				.store = (struct xpc_object *)&_xpc_error_termination_imminent.inner
 			}
 		}
 	}
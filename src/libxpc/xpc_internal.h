@@ -52,13 +52,131 @@ __XNU_PRIVATE_EXTERN extern XPC_TYPE(_xpc_type_invalid);
 
 struct xpc_object;
 struct xpc_dict_pair;
+struct xpc_wire;
 
 TAILQ_HEAD(xpc_dict_head, xpc_dict_pair);
-TAILQ_HEAD(xpc_array_head, xpc_object);
+
+/*
+ * Dictionaries keep their pairs on a list in insertion order, which is the
+ * order of xpc_dictionary_apply() and of serialization.  Once they hold
+ * more than XPC_DICT_HASH_THRESHOLD pairs, an open addressing index keyed
+ * by the hash cached in each pair is kept alongside for lookups.
+ */
+#define	XPC_DICT_HASH_THRESHOLD	8
+
+struct xpc_dict_slot {
+	uint32_t		hash;
+	struct xpc_dict_pair *	pair;
+};
+
+struct xpc_dict_index {
+	size_t			size;
+	size_t			used;
+	struct xpc_dict_slot	slots[];
+};
+
+/*
+ * Dictionaries of received messages are lazy: their pairs start out with
+ * only a key and the position of the packed pair in the message, and the
+ * value is decoded the first time it is looked up.  Such dictionaries are
+ * flagged _XPC_DICT_LAZY and hold a reference on the message, which they
+ * also need for the ports it carries; the trailing members exist only in
+ * them.  The audit token is only kept here: xpc_pipe_receive() and
+ * xpc_pipe_try_receive() drop messages that are not dictionaries, so no
+ * other type ever carries one.
+ */
+struct xpc_dict {
+	struct xpc_dict_head	head;
+	struct xpc_dict_index *	index;
+	audit_token_t *		audit;	/* sender of a received message */
+	struct xpc_object *	store;	/* holder of head and index */
+	struct xpc_object *	retired; /* store replaced by this one */
+	struct xpc_wire *	wire;
+	nvlist_view_t		view;
+};
+
+/*
+ * Arrays hold their elements in a vector that doubles as it fills up; the
+ * number of elements is the xo_size of the array.
+ */
+struct xpc_array {
+	struct xpc_object **	items;
+	size_t			capacity;
+	struct xpc_object *	store;	/* holder of items */
+	struct xpc_object *	retired; /* store replaced by this one */
+};
+
+/*
+ * xpc_copy() of a dictionary or an array doesn't copy anything: the
+ * contents go to a hidden node container, flagged _XPC_CONTAINER_SHARED,
+ * which the original and all its copies then share read-only through
+ * their store.  store points back at the container itself otherwise, and
+ * the xo_dict and xo_array macros always go through it.  The first time
+ * one of the sharers changes, or hands out a container it holds, it gets
+ * a node of its own with a copy of the contents.  A node's xo_size is kept
+ * equal to that of the containers it stores for.
+ *
+ * Readers don't take a lock, so the store of a container is only ever
+ * switched by publishing a complete new one; nothing is taken out of the
+ * old store.  The container keeps the old one alive through the new one's
+ * retired, for readers that may still be in it, until it goes away.
+ *
+ * A store whose container has handed out a container it holds, or was
+ * given one, is flagged _XPC_CONTAINER_LENT: the caller may still change
+ * that one in place, which must not show through in a copy.  xpc_copy()
+ * of such a container copies its own level right away instead, and copies
+ * the containers in it with xpc_copy() in turn.  Deciding to share a store
+ * and lending from it happen under a lock, so that they can't cross.
+ *
+ * Values other than containers are shared by retain.  The setters that
+ * change such a value in place, which only liblaunch uses, change it in
+ * every copy holding it.
+ */
+#define	XPC_IS_CONTAINER(xo)						\
+    ((xo)->xo_xpc_type == XPC_TYPE_DICTIONARY ||			\
+    (xo)->xo_xpc_type == XPC_TYPE_ARRAY)
+#define	XPC_CONTAINER_STORE(xo)						\
+    ((xo)->xo_xpc_type == XPC_TYPE_DICTIONARY ?				\
+    (xo)->xo_u.dict.store : (xo)->xo_u.array.store)
+#define	XPC_CONTAINER_LEND(xo, value)				\
+	do {								\
+		if (XPC_IS_CONTAINER((struct xpc_object *)(value)))	\
+			__atomic_or_fetch(				\
+			    &XPC_CONTAINER_STORE(xo)->xo_flags,		\
+			    _XPC_CONTAINER_LENT, __ATOMIC_RELAXED);	\
+	} while (0)
+
+/*
+ * Strings of up to XPC_STRING_INLINE_MAX bytes are kept in the object
+ * itself, with ptr pointing at buf; longer ones are allocated separately.
+ * ptr overlays xo_str, so readers don't need to care.  hash caches
+ * xpc_hash() of the string, 0 until it is first asked for.
+ */
+#define	XPC_STRING_INLINE_MAX	23
+
+struct xpc_string {
+	const char *		ptr;
+	uint64_t		hash;
+	char			buf[XPC_STRING_INLINE_MAX + 1];
+};
+
+/*
+ * Data objects own a malloc()ed copy of their bytes, unless they are
+ * flagged _XPC_DATA_DISPATCH: then ddata is a single region dispatch_data_t
+ * whose buffer ptr points at, and releasing it gives the bytes back.  ptr
+ * overlays xo_ptr.  hash is cached as for strings.
+ */
+struct xpc_data {
+	const void *		ptr;
+	uint64_t		hash;
+	dispatch_data_t		ddata;
+};
 
 typedef union {
-	struct xpc_dict_head dict;
-	struct xpc_array_head array;
+	struct xpc_dict dict;
+	struct xpc_array array;
+	struct xpc_string string;
+	struct xpc_data data;
 	uint64_t ui;
 	int64_t i;
 	const char *str;
@@ -72,24 +190,36 @@ typedef union {
 
 
 #define _XPC_FROM_WIRE 0x1
+#define _XPC_STRING_INLINE 0x2
+#define _XPC_DICT_LAZY 0x4
+#define _XPC_DATA_DISPATCH 0x8
+#define _XPC_CONTAINER_LENT 0x10
+#define _XPC_CONTAINER_SHARED 0x20
 
 struct xpc_object_header {
 	_OS_OBJECT_HEADER(const void *isa, ref_cnt, xref_cnt);
 };
 
+/*
+ * Only statically allocated objects are sizeof(struct xpc_object) bytes.
+ * Everything else is allocated as _xpc_object_size() bytes, which ends
+ * xo_u right after the member used by the object's type; an int64 doesn't
+ * pay for a dictionary.
+ */
 struct xpc_object {
 	struct xpc_object_header header;
 	xpc_type_t		xo_xpc_type;
 	uint16_t		xo_flags;
 	size_t			xo_size;
 	xpc_u			xo_u;
-	audit_token_t *		xo_audit_token;
-	TAILQ_ENTRY(xpc_object) xo_link;
 };
 
 struct xpc_dict_pair {
 	const char *		key;
 	struct xpc_object *	value;
+	const void *		packed;	/* undecoded value in the message */
+	uint32_t		hash;
+	bool			interned;	/* key is shared or in the message, don't free */
 	TAILQ_ENTRY(xpc_dict_pair) xo_link;
 };
 
@@ -141,22 +271,38 @@ struct xpc_service {
 #define xo_fd xo_u.fd
 #define xo_uuid xo_u.uuid
 #define xo_port xo_u.port
-#define xo_array xo_u.array
-#define xo_dict xo_u.dict
+#define xo_array xo_u.array.store->xo_u.array.items
+#define xo_array_capacity xo_u.array.store->xo_u.array.capacity
+#define xo_dict xo_u.dict.store->xo_u.dict.head
+#define xo_dict_index xo_u.dict.store->xo_u.dict.index
+#define xo_audit_token xo_u.dict.audit
 
 __private_extern__ struct xpc_object *_xpc_prim_create(xpc_type_t type, xpc_u value,
     size_t size);
 __private_extern__ struct xpc_object *_xpc_prim_create_flags(xpc_type_t type,
     xpc_u value, size_t size, uint16_t flags);
+__private_extern__ size_t _xpc_object_size(xpc_type_t type, uint16_t flags);
 __private_extern__ void xpc_object_destroy(struct xpc_object *xo);
+__private_extern__ void *xpc_slab_alloc(size_t size);
+__private_extern__ void xpc_slab_free(void *ptr, size_t size);
 __private_extern__ const char *_xpc_get_type_name(xpc_object_t obj);
 __private_extern__ nvlist_t *xpc2nv(struct xpc_object *xo, int64_t (^port_serializer)(mach_port_t port));
+__private_extern__ size_t xpc2wire_size(struct xpc_object *xo);
+__private_extern__ int xpc2wire(struct xpc_object *xo, void *buf, size_t size, int64_t (^port_serializer)(mach_port_t port));
 __private_extern__ struct xpc_object *nv2xpc(const nvlist_t *nv, mach_port_t (^port_deserializer)(int64_t port_id));
-__private_extern__ void xpc_object_destroy(struct xpc_object *xo);
+__private_extern__ struct xpc_object *nv2xpc_view(const nvlist_view_t *view, mach_port_t (^port_deserializer)(int64_t port_id));
+__private_extern__ struct xpc_object *nv2xpc_wire(void *data, size_t size, mach_port_t *ports, size_t nports);
+__private_extern__ void xpc_wire_release(struct xpc_wire *wire);
 __private_extern__ int xpc_pipe_send(xpc_object_t obj, mach_port_t dst,
     mach_port_t local, uint64_t id);
 __private_extern__ int xpc_pipe_receive(mach_port_t local, mach_port_t *remote,
     xpc_object_t *result, uint64_t *id);
+__private_extern__ xpc_object_t xpc_array_take_value(xpc_object_t xarray, size_t index);
+__private_extern__ struct xpc_object *xpc_array_copy(struct xpc_object *xo);
+__private_extern__ bool xpc_array_apply_nocopy(xpc_object_t xarray, xpc_array_applier_t applier);
+__private_extern__ struct xpc_object *xpc_dictionary_copy(struct xpc_object *xo);
+__private_extern__ xpc_object_t xpc_dictionary_get_value_nocopy(xpc_object_t xdict, const char *key);
+__private_extern__ bool xpc_dictionary_apply_nocopy(xpc_object_t xdict, xpc_dictionary_applier_t applier);
 __private_extern__ void xpc_dictionary_set_value_nokeycheck(xpc_object_t xdict, const char *key, xpc_object_t value);
 __private_extern__ void xpc_api_misuse(const char *info, ...) __attribute__((noreturn, format(printf, 1, 2)));
 
@@ -31,11 +31,13 @@
 #include <mach/mach.h>
 #include <mach/message.h>
 #include <xpc/launchd.h>
+#include <xpc/private.h>
 #include <assert.h>
 #include <syslog.h>
 #include <stdarg.h>
 #include <uuid/uuid.h>
 #include <stdatomic.h>
+#include <objc/runtime.h>
 
 #include "xpc_internal.h"
 
@@ -62,7 +64,8 @@ struct xpc_port_set {
 	int64_t port_count;
 };
 
-static void xpc_copy_description_level(xpc_object_t obj, struct sbuf *sbuf, int level);
+static void xpc_copy_description_level(xpc_object_t obj, struct sbuf *sbuf,
+    int level, xpc_description_writer_t writer);
 
 static void
 xpc_dictionary_destroy(struct xpc_object *dict)
@@ -70,29 +73,53 @@ xpc_dictionary_destroy(struct xpc_object *dict)
 	struct xpc_dict_head *head;
 	struct xpc_dict_pair *p, *ptmp;
 
-	head = &dict->xo_dict;
-
-	TAILQ_FOREACH_SAFE(p, head, xo_link, ptmp) {
-		TAILQ_REMOVE(head, p, xo_link);
-		xpc_release(p->value);
-		free(p);
+	/*
+	 * The pairs are in a node, only drop our reference to it.  Our own
+	 * head and index, if they ever held anything, went to the node too.
+	 */
+	if (dict->xo_u.dict.store != dict) {
+		xpc_release(dict->xo_u.dict.store);
+	} else {
+		head = &dict->xo_dict;
+
+		TAILQ_FOREACH_SAFE(p, head, xo_link, ptmp) {
+			TAILQ_REMOVE(head, p, xo_link);
+			if (p->value != NULL)
+				xpc_release(p->value);
+			if (!p->interned)
+				free((char *)p->key);
+			free(p);
+		}
+		free(dict->xo_dict_index);
 	}
+	if (dict->xo_u.dict.retired != NULL)
+		xpc_release(dict->xo_u.dict.retired);
+	free(dict->xo_audit_token);
+	if (dict->xo_flags & _XPC_DICT_LAZY)
+		xpc_wire_release(dict->xo_u.dict.wire);
 }
 
 static void
-xpc_array_destroy(struct xpc_object *dict)
+xpc_array_destroy(struct xpc_object *array)
 {
-	struct xpc_object *p, *ptmp;
-	struct xpc_array_head *head;
-
-	head = &dict->xo_array;
+	size_t i;
 
-	TAILQ_FOREACH_SAFE(p, head, xo_link, ptmp) {
-		TAILQ_REMOVE(head, p, xo_link);
-		xpc_release(p);
+	if (array->xo_u.array.store != array) {
+		xpc_release(array->xo_u.array.store);
+	} else {
+		for (i = 0; i < array->xo_size; i++)
+			xpc_release(array->xo_array[i]);
+		free(array->xo_array);
 	}
+	if (array->xo_u.array.retired != NULL)
+		xpc_release(array->xo_u.array.retired);
 }
 
+/*
+ * Release whatever the object owns and give its storage back to the slab
+ * it was carved from.  This takes the place of NSObject's -dealloc, which
+ * would free() the object.
+ */
 void
 xpc_object_destroy(struct xpc_object *xo)
 {
@@ -102,14 +129,19 @@ xpc_object_destroy(struct xpc_object *xo)
 	if (xo->xo_xpc_type == XPC_TYPE_ARRAY)
 		xpc_array_destroy(xo);
 
-	if (xo->xo_xpc_type == XPC_TYPE_STRING)
-		free(xo->xo_u.str);
+	if (xo->xo_xpc_type == XPC_TYPE_STRING &&
+	    (!(xo->xo_flags & _XPC_STRING_INLINE) ||
+	    xo->xo_str != xo->xo_u.string.buf))
+		free((char *)xo->xo_str);
 
-	if (xo->xo_xpc_type == XPC_TYPE_DATA)
+	if (xo->xo_xpc_type == XPC_TYPE_DATA &&
+	    (xo->xo_flags & _XPC_DATA_DISPATCH) && xo->xo_u.data.ddata != NULL)
+		dispatch_release(xo->xo_u.data.ddata);
+	else if (xo->xo_xpc_type == XPC_TYPE_DATA)
 		free((void *)xo->xo_u.ptr);
 
-	if (xo->xo_audit_token != NULL)
-		free(xo->xo_audit_token);
+	objc_destructInstance((id)xo);
+	xpc_slab_free(xo, _xpc_object_size(xo->xo_xpc_type, xo->xo_flags));
 }
 
 xpc_object_t
@@ -141,11 +173,22 @@ xpc_strerror(int error)
 	return (xpc_errors[error]);
 }
 
+/*
+ * Descriptions are streamed to writers once this much has piled up.
+ */
+#define	XPC_DESCRIPTION_CHUNK	4096
+
 static void
-xpc_copy_description_level(xpc_object_t obj, struct sbuf *sbuf, int level)
+xpc_copy_description_level(xpc_object_t obj, struct sbuf *sbuf, int level,
+    xpc_description_writer_t writer)
 {
 	struct xpc_object *xo = obj;
 
+	if (writer != NULL && sbuf_len(sbuf) >= XPC_DESCRIPTION_CHUNK) {
+		writer(sbuf_data(sbuf), sbuf_len(sbuf));
+		sbuf_clear(sbuf);
+	}
+
 	if (obj == NULL) {
 		sbuf_printf(sbuf, "<null value>\n");
 		return;
@@ -155,16 +198,17 @@ xpc_copy_description_level(xpc_object_t obj, struct sbuf *sbuf, int level)
 
 	if (xo->xo_xpc_type == XPC_TYPE_DICTIONARY) {
 		sbuf_printf(sbuf, "\n");
-		xpc_dictionary_apply(xo, ^(const char *k, xpc_object_t v) {
+		xpc_dictionary_apply_nocopy(xo, ^(const char *k,
+		    xpc_object_t v) {
 			sbuf_printf(sbuf, "%*s\"%s\": ", level * 4, " ", k);
-			xpc_copy_description_level(v, sbuf, level + 1);
+			xpc_copy_description_level(v, sbuf, level + 1, writer);
 			return ((bool)true);
 		});
 	} else if (xo->xo_xpc_type == XPC_TYPE_ARRAY) {
 		sbuf_printf(sbuf, "\n");
-		xpc_array_apply(xo, ^(size_t idx, xpc_object_t v) {
-			sbuf_printf(sbuf, "%*s%ld: ", level * 4, " ", idx);
-			xpc_copy_description_level(v, sbuf, level + 1);
+		xpc_array_apply_nocopy(xo, ^(size_t idx, xpc_object_t v) {
+			sbuf_printf(sbuf, "%*s%zu: ", level * 4, " ", idx);
+			xpc_copy_description_level(v, sbuf, level + 1, writer);
 			return ((bool)true);
 		});
 	} else if (xo->xo_xpc_type == XPC_TYPE_BOOL) {
@@ -183,7 +227,6 @@ xpc_copy_description_level(xpc_object_t obj, struct sbuf *sbuf, int level)
 		memcpy(id, xpc_uuid_get_bytes(obj), sizeof(uuid_t));
 		uuid_unparse_upper(id, uuid_str);
 		sbuf_printf(sbuf, "%s\n", uuid_str);
-		free(uuid_str);
 	} else if (xo->xo_xpc_type == XPC_TYPE_ENDPOINT) {
 		sbuf_printf(sbuf, "<%lld>\n", xo->xo_int);
 	} else if (xo->xo_xpc_type == XPC_TYPE_NULL) {
@@ -202,7 +245,7 @@ xpc_copy_description(xpc_object_t obj)
 	struct sbuf *sbuf;
 
 	sbuf = sbuf_new_auto();
-	xpc_copy_description_level(obj, sbuf, 0);
+	xpc_copy_description_level(obj, sbuf, 0, NULL);
 	sbuf_finish(sbuf);
 	result = strdup(sbuf_data(sbuf));
 	sbuf_delete(sbuf);
@@ -210,6 +253,36 @@ xpc_copy_description(xpc_object_t obj)
 	return (result);
 }
 
+/*
+ * Same output as xpc_copy_description(), but only a chunk of it is held in
+ * memory at a time.
+ */
+void
+xpc_write_description(xpc_object_t obj, xpc_description_writer_t writer)
+{
+	struct sbuf sbuf;
+
+	xpc_assert_nonnull(writer);
+
+	if (sbuf_new(&sbuf, NULL, 2 * XPC_DESCRIPTION_CHUNK,
+	    SBUF_AUTOEXTEND) == NULL)
+		return;
+	xpc_copy_description_level(obj, &sbuf, 0, writer);
+	sbuf_finish(&sbuf);
+	if (sbuf_len(&sbuf) > 0)
+		writer(sbuf_data(&sbuf), sbuf_len(&sbuf));
+	sbuf_delete(&sbuf);
+}
+
+void
+xpc_fwrite_description(xpc_object_t obj, FILE *fp)
+{
+
+	xpc_write_description(obj, ^(const char *buf, size_t len) {
+		fwrite(buf, 1, len, fp);
+	});
+}
+
 xpc_object_t
 xpc_copy_entitlement_for_token(const char *key __unused, audit_token_t *token __unused)
 {
@@ -241,30 +314,27 @@ xpc_pipe_routine_reply(xpc_object_t xobj)
 	xo = xobj;
 	xpc_assert(xo->xo_xpc_type == XPC_TYPE_DICTIONARY, "xpc_object_t not of %s type", "dictionary");
 
-	nvlist_t *nvlist = xpc2nv(xobj, ^(mach_port_t port) {
+	size = xpc2wire_size(xo);
+	msg_size = __DARWIN_ALIGN(sizeof(struct xpc_message));
+	if ((message = calloc(msg_size, 1)) == NULL)
+		return (ENOMEM);
+
+	void *packed = malloc(size);
+	if (packed == NULL || xpc2wire(xo, packed, size, ^(mach_port_t port) {
 		int64_t port_index = port_set.port_count++;
 
-		if (port_index > port_set.buffer_size) {
+		if (port_index >= port_set.buffer_size) {
 			port_set.buffer_size *= 2;
 			port_set.buffer = realloc(port_set.buffer, port_set.buffer_size * sizeof(mach_port_t));
 		}
 
 		port_set.buffer[port_index] = port;
 		return port_index;
-	});
-
-	if (nvlist == NULL)
-		return (EINVAL);
-	size = nvlist_size(nvlist);
-	msg_size = __DARWIN_ALIGN(sizeof(struct xpc_message));
-	if ((message = calloc(msg_size, 1)) == NULL)
-		return (ENOMEM);
-
-	void *packed = nvlist_pack_buffer(nvlist, NULL, &size);
-	if (packed == NULL) {
+	}) != 0) {
 		debugf("Could not pack XPC message for transport");
+		free(packed);
 		free(message);
-		nvlist_destroy(nvlist);
+		free(port_set.buffer);
 		return EINVAL;
 	}
 
@@ -306,7 +376,6 @@ xpc_pipe_routine_reply(xpc_object_t xobj)
 	free(message);
 	free(packed);
 	free(port_set.buffer);
-	nvlist_destroy(nvlist);
 	return (err);
 }
 
@@ -328,10 +397,17 @@ xpc_pipe_send(xpc_object_t xobj, mach_port_t dst, mach_port_t local,
 	xo = xobj;
 	xpc_assert(xo->xo_xpc_type == XPC_TYPE_DICTIONARY, "xpc_object_t not of %s type", "dictionary");
 
-	nvlist_t *nvl = xpc2nv(xobj, ^(mach_port_t port) {
+	size = xpc2wire_size(xo);
+
+	msg_size = __DARWIN_ALIGN(sizeof(struct xpc_message));
+	if ((message = calloc(msg_size, 1)) == NULL)
+		return (ENOMEM);
+
+	void *packed = malloc(size);
+	if (packed == NULL || xpc2wire(xo, packed, size, ^(mach_port_t port) {
 		int64_t port_index = port_set.port_count++;
 
-		if (port_index > port_set.buffer_size) {
+		if (port_index >= port_set.buffer_size) {
 			port_set.buffer_size *= 2;
 			port_set.buffer = realloc(port_set.buffer, port_set.buffer_size * sizeof(mach_port_t));
 		}
@@ -341,19 +417,11 @@ xpc_pipe_send(xpc_object_t xobj, mach_port_t dst, mach_port_t local,
 
 		port_set.buffer[port_index] = port;
 		return port_index;
-	});
-
-	size = nvlist_size(nvl);
-
-	msg_size = __DARWIN_ALIGN(sizeof(struct xpc_message));
-	if ((message = calloc(msg_size, 1)) == NULL)
-		return (ENOMEM);
-
-	void *packed = nvlist_pack_buffer(nvl, NULL, &size);
-	if (packed == NULL) {
+	}) != 0) {
 		debugf("Could not pack XPC message for transport");
+		free(packed);
 		free(message);
-		nvlist_destroy(nvl);
+		free(port_set.buffer);
 		return (EINVAL);
 	}
 
@@ -395,7 +463,6 @@ xpc_pipe_send(xpc_object_t xobj, mach_port_t dst, mach_port_t local,
 	free(packed);
 	free(message);
 	free(port_set.buffer);
-	nvlist_destroy(nvl);
 	return (err);
 }
 
@@ -428,22 +495,26 @@ xpc_pipe_receive(mach_port_t local, mach_port_t *remote, xpc_object_t *result,
 	data_size = message.ool_data.size;
 	debugf("unpacking data_size=%zu", data_size);
 
-	nvlist_t *nv = nvlist_unpack(&message.ool_data.address, data_size);
-	xo = nv2xpc(nv, ^(int64_t port_index) {
-		xpc_assert(port_index <= message.ool_ports.count / sizeof(mach_port_t), "Port index greater than number of ports in buffer");
-		mach_port_t *ports = message.ool_ports.address;
-		return ports[port_index];
-	});
-	nvlist_destroy(nv);
-
-	mig_deallocate((vm_address_t)message.ool_data.address, message.ool_data.size);
+	/*
+	 * The payload is decoded as the values are looked up, and belongs to
+	 * the result from here on; a malformed one drops the message.
+	 */
+	xo = nv2xpc_wire(message.ool_data.address, data_size,
+	    message.ool_ports.address, message.ool_ports.count);
 	message.ool_data.address = NULL;
 	message.ool_data.size = 0;
-
-	mig_deallocate((vm_address_t)message.ool_ports.address, message.ool_ports.count * sizeof(mach_port_t));
 	message.ool_ports.address = NULL;
 	message.ool_ports.count = 0;
 
+	if (xo == NULL) {
+		debugf("dropping malformed message, error %d", errno);
+		return (EBADMSG);
+	}
+	if (xo->xo_xpc_type != XPC_TYPE_DICTIONARY) {
+		xpc_release(xo);
+		return (EBADMSG);
+	}
+
 	tr = (mach_msg_trailer_t *)(((char *)&message) + request->msgh_size);
 	auditp = &((mach_msg_audit_trailer_t *)tr)->msgh_audit;
 
@@ -510,22 +581,26 @@ xpc_pipe_try_receive(mach_port_t portset, xpc_object_t *requestobj, mach_port_t
 	data_size = message.ool_data.size;
 	debugf("unpacking data_size=%d", data_size);
 
-	nvlist_t *nvlist = nvlist_unpack(&message.ool_data.address, data_size);
-	xo = nv2xpc(nvlist, ^(int64_t port_index) {
-		xpc_assert(port_index <= message.ool_ports.count / sizeof(mach_port_t), "Port index greater than number of ports in buffer");
-		mach_port_t *ports = message.ool_ports.address;
-		return ports[port_index];
-	});
-	nvlist_destroy(nvlist);
-
-	mig_deallocate((vm_address_t)message.ool_data.address, message.ool_data.size);
+	/*
+	 * The payload is decoded as the values are looked up, and belongs to
+	 * the result from here on; a malformed one drops the message.
+	 */
+	xo = nv2xpc_wire(message.ool_data.address, data_size,
+	    message.ool_ports.address, message.ool_ports.count);
 	message.ool_data.address = NULL;
 	message.ool_data.size = 0;
-
-	mig_deallocate((vm_address_t)message.ool_ports.address, message.ool_ports.count * sizeof(mach_port_t));
 	message.ool_ports.address = NULL;
 	message.ool_ports.count = 0;
 
+	if (xo == NULL) {
+		debugf("dropping malformed message, error %d", errno);
+		return (EBADMSG);
+	}
+	if (xo->xo_xpc_type != XPC_TYPE_DICTIONARY) {
+		xpc_release(xo);
+		return (EBADMSG);
+	}
+
 	/* is padding for alignment enforced in the kernel?*/
 	tr = (mach_msg_trailer_t *)(((char *)&message) + request->msgh_size);
 	auditp = &((mach_msg_audit_trailer_t *)tr)->msgh_audit;
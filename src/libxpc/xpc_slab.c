@@ -0,0 +1,316 @@
+/*
+ * Copyright 2020 PureDarwin Project
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xpc/private.h>
+#include "xpc_internal.h"
+
+/*
+ * Objects are carved out of XPC_SLAB_SIZE slabs, in size classes that are
+ * XPC_SLAB_QUANTUM bytes apart.  Every thread keeps a short free list per
+ * class and exchanges XPC_SLAB_BATCH objects at a time with a depot shared
+ * by all threads, so the lock is only taken once per batch.  Slabs are
+ * never given back to the system; freed objects stay in the depot for the
+ * next burst of allocations.
+ */
+#define	XPC_SLAB_SIZE		(16 * 1024)
+#define	XPC_SLAB_QUANTUM	16
+#define	XPC_SLAB_NCLASSES	8
+#define	XPC_SLAB_MAX		(XPC_SLAB_QUANTUM * XPC_SLAB_NCLASSES)
+#define	XPC_SLAB_BATCH		32
+#define	XPC_SLAB_CACHE_MAX	(2 * XPC_SLAB_BATCH)
+
+struct xpc_slab_free {
+	struct xpc_slab_free *	next;
+};
+
+/* Per-thread free list of a class. */
+struct xpc_slab_cache {
+	struct xpc_slab_free *	free;
+	size_t			count;
+	uint64_t		allocs;
+	uint64_t		frees;
+};
+
+/* Shared depot of a class, protected by xpc_slab_lock. */
+struct xpc_slab_depot {
+	struct xpc_slab_free *	free;
+	size_t			count;
+	size_t			slabs;
+	uint64_t		allocs;
+	uint64_t		frees;
+};
+
+static pthread_mutex_t xpc_slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct xpc_slab_depot xpc_slab_depots[XPC_SLAB_NCLASSES];
+static pthread_once_t xpc_slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t xpc_slab_key;
+
+/* Value of xpc_slab_key once the thread's caches are gone. */
+#define	XPC_SLAB_EXITING	((struct xpc_slab_cache *)-1)
+
+static inline size_t
+xpc_slab_class(size_t size)
+{
+
+	return ((size + XPC_SLAB_QUANTUM - 1) / XPC_SLAB_QUANTUM - 1);
+}
+
+/*
+ * Add the counters of a thread cache to the depot's.  Called with
+ * xpc_slab_lock held.
+ */
+static void
+xpc_slab_fold(struct xpc_slab_cache *cache, struct xpc_slab_depot *depot)
+{
+
+	depot->allocs += cache->allocs;
+	depot->frees += cache->frees;
+	cache->allocs = cache->frees = 0;
+}
+
+/*
+ * Move up to count objects from a thread cache to the depot, along with the
+ * cache's counters.  Called with xpc_slab_lock held.
+ */
+static void
+xpc_slab_drain(struct xpc_slab_cache *cache, struct xpc_slab_depot *depot,
+    size_t count)
+{
+	struct xpc_slab_free *obj;
+
+	while (count-- > 0 && (obj = cache->free) != NULL) {
+		cache->free = obj->next;
+		cache->count--;
+		obj->next = depot->free;
+		depot->free = obj;
+		depot->count++;
+	}
+
+	xpc_slab_fold(cache, depot);
+}
+
+/*
+ * Fill an empty thread cache from the depot, carving a new slab when the
+ * depot has run dry, and pass the cache's counters on as xpc_slab_drain()
+ * does.  Called with xpc_slab_lock held.
+ */
+static bool
+xpc_slab_refill(struct xpc_slab_cache *cache, struct xpc_slab_depot *depot,
+    size_t size)
+{
+	struct xpc_slab_free *obj;
+	char *slab;
+	size_t i;
+
+	xpc_slab_fold(cache, depot);
+	if (depot->free == NULL) {
+		slab = malloc(XPC_SLAB_SIZE);
+		if (slab == NULL)
+			return (false);
+		for (i = 0; i + size <= XPC_SLAB_SIZE; i += size) {
+			obj = (struct xpc_slab_free *)(slab + i);
+			obj->next = cache->free;
+			cache->free = obj;
+			cache->count++;
+		}
+		depot->slabs++;
+		return (true);
+	}
+
+	for (i = 0; i < XPC_SLAB_BATCH && depot->free != NULL; i++) {
+		obj = depot->free;
+		depot->free = obj->next;
+		depot->count--;
+		obj->next = cache->free;
+		cache->free = obj;
+		cache->count++;
+	}
+	return (true);
+}
+
+static void
+xpc_slab_thread_exit(void *arg)
+{
+	struct xpc_slab_cache *caches;
+	size_t i;
+
+	caches = arg;
+	if (caches != XPC_SLAB_EXITING) {
+		pthread_mutex_lock(&xpc_slab_lock);
+		for (i = 0; i < XPC_SLAB_NCLASSES; i++)
+			xpc_slab_drain(&caches[i], &xpc_slab_depots[i],
+			    caches[i].count);
+		pthread_mutex_unlock(&xpc_slab_lock);
+		free(caches);
+	}
+
+	/*
+	 * Destructors of other keys, such as an autorelease pool's, may still
+	 * release objects.  Leave a marker so that they go through the depot
+	 * rather than set up caches that nothing would free.  This runs the
+	 * destructor again until the system stops iterating, to no effect.
+	 */
+	(void)pthread_setspecific(xpc_slab_key, XPC_SLAB_EXITING);
+}
+
+static void
+xpc_slab_init(void)
+{
+
+	(void)pthread_key_create(&xpc_slab_key, xpc_slab_thread_exit);
+}
+
+static struct xpc_slab_cache *
+xpc_slab_thread_cache(void)
+{
+	struct xpc_slab_cache *caches;
+
+	pthread_once(&xpc_slab_once, xpc_slab_init);
+	caches = pthread_getspecific(xpc_slab_key);
+	if (caches == XPC_SLAB_EXITING)
+		return (NULL);
+	if (caches == NULL) {
+		caches = calloc(XPC_SLAB_NCLASSES, sizeof(*caches));
+		if (caches == NULL)
+			return (NULL);
+		if (pthread_setspecific(xpc_slab_key, caches) != 0) {
+			free(caches);
+			return (NULL);
+		}
+	}
+
+	return (caches);
+}
+
+/*
+ * Allocate size bytes of zeroed memory.  Sizes above XPC_SLAB_MAX go to
+ * malloc; the same size must be handed back to xpc_slab_free().
+ */
+__private_extern__ void *
+xpc_slab_alloc(size_t size)
+{
+	struct xpc_slab_cache *caches, *cache, local;
+	struct xpc_slab_free *obj;
+	size_t class;
+	bool ok;
+
+	if (size == 0 || size > XPC_SLAB_MAX)
+		return (calloc(1, size));
+
+	class = xpc_slab_class(size);
+	caches = xpc_slab_thread_cache();
+	if (caches == NULL) {
+		/* No cache for this thread, go through the depot. */
+		memset(&local, 0, sizeof(local));
+		cache = &local;
+	} else
+		cache = &caches[class];
+
+	if (cache->free == NULL) {
+		pthread_mutex_lock(&xpc_slab_lock);
+		ok = xpc_slab_refill(cache, &xpc_slab_depots[class],
+		    (class + 1) * XPC_SLAB_QUANTUM);
+		pthread_mutex_unlock(&xpc_slab_lock);
+		if (!ok)
+			return (NULL);
+	}
+
+	obj = cache->free;
+	cache->free = obj->next;
+	cache->count--;
+	cache->allocs++;
+
+	if (cache == &local) {
+		pthread_mutex_lock(&xpc_slab_lock);
+		xpc_slab_drain(cache, &xpc_slab_depots[class], cache->count);
+		pthread_mutex_unlock(&xpc_slab_lock);
+	}
+	memset(obj, 0, size);
+	return (obj);
+}
+
+__private_extern__ void
+xpc_slab_free(void *ptr, size_t size)
+{
+	struct xpc_slab_cache *caches, *cache, local;
+	struct xpc_slab_free *obj;
+	size_t class;
+
+	if (ptr == NULL)
+		return;
+
+	if (size == 0 || size > XPC_SLAB_MAX) {
+		free(ptr);
+		return;
+	}
+
+	class = xpc_slab_class(size);
+	obj = ptr;
+	caches = xpc_slab_thread_cache();
+	if (caches == NULL) {
+		/* No cache for this thread, go straight to the depot. */
+		memset(&local, 0, sizeof(local));
+		cache = &local;
+	} else
+		cache = &caches[class];
+
+	obj->next = cache->free;
+	cache->free = obj;
+	cache->count++;
+	cache->frees++;
+
+	if (cache == &local || cache->count > XPC_SLAB_CACHE_MAX) {
+		pthread_mutex_lock(&xpc_slab_lock);
+		xpc_slab_drain(cache, &xpc_slab_depots[class],
+		    cache == &local ? 1 : XPC_SLAB_BATCH);
+		pthread_mutex_unlock(&xpc_slab_lock);
+	}
+}
+
+size_t
+xpc_slab_get_stats(struct xpc_slab_stats *stats, size_t count)
+{
+	struct xpc_slab_depot *depot;
+	size_t i;
+
+	pthread_mutex_lock(&xpc_slab_lock);
+	for (i = 0; i < count && i < XPC_SLAB_NCLASSES; i++) {
+		depot = &xpc_slab_depots[i];
+		stats[i].xss_size = (i + 1) * XPC_SLAB_QUANTUM;
+		stats[i].xss_slabs = depot->slabs;
+		stats[i].xss_depot = depot->count;
+		stats[i].xss_allocs = depot->allocs;
+		stats[i].xss_frees = depot->frees;
+	}
+	pthread_mutex_unlock(&xpc_slab_lock);
+
+	return (XPC_SLAB_NCLASSES);
+}
@@ -29,33 +29,88 @@
 #include <mach/mach.h>
 #include <xpc/launchd.h>
 #include <sys/fileport.h>
+#include <stddef.h>
 #include <time.h>
+#include <objc/runtime.h>
 #include "xpc_internal.h"
 
 OS_OBJECT_OBJC_CLASS_DECL(xpc_object);
 
+/*
+ * Every type carries its own xpc_hash(), xpc_equal() and xpc_copy(), so
+ * none of them has to walk a chain of type comparisons.
+ */
+typedef uint64_t (*xpc_hash_func_t)(struct xpc_object *);
+typedef bool (*xpc_equal_func_t)(struct xpc_object *, struct xpc_object *);
+typedef struct xpc_object *(*xpc_copy_func_t)(struct xpc_object *);
+
 struct _xpc_type_s {
 	const char *description;
+	xpc_hash_func_t hash;
+	xpc_equal_func_t equal;
+	xpc_copy_func_t copy;
 };
 
+static struct xpc_object *xpc_object_copy(struct xpc_object *xo);
+static struct xpc_object *xpc_value_copy(struct xpc_object *xo);
+static struct xpc_object *xpc_bool_copy(struct xpc_object *xo);
+static struct xpc_object *xpc_data_copy(struct xpc_object *xo);
+static struct xpc_object *xpc_string_copy(struct xpc_object *xo);
+static uint64_t xpc_object_hash(struct xpc_object *xo);
+static bool xpc_object_equal(struct xpc_object *xo1, struct xpc_object *xo2);
+static uint64_t xpc_array_hash(struct xpc_object *xo);
+static bool xpc_array_equal(struct xpc_object *xo1, struct xpc_object *xo2);
+static uint64_t xpc_bool_hash(struct xpc_object *xo);
+static bool xpc_bool_equal(struct xpc_object *xo1, struct xpc_object *xo2);
+static uint64_t xpc_port_hash(struct xpc_object *xo);
+static bool xpc_port_equal(struct xpc_object *xo1, struct xpc_object *xo2);
+static uint64_t xpc_data_hash(struct xpc_object *xo);
+static bool xpc_data_equal(struct xpc_object *xo1, struct xpc_object *xo2);
+static uint64_t xpc_int_hash(struct xpc_object *xo);
+static bool xpc_int_equal(struct xpc_object *xo1, struct xpc_object *xo2);
+static uint64_t xpc_dictionary_hash(struct xpc_object *xo);
+static bool xpc_dictionary_equal(struct xpc_object *xo1, struct xpc_object *xo2);
+static uint64_t xpc_null_hash(struct xpc_object *xo);
+static bool xpc_null_equal(struct xpc_object *xo1, struct xpc_object *xo2);
+static uint64_t xpc_string_hash(struct xpc_object *xo);
+static bool xpc_string_equal(struct xpc_object *xo1, struct xpc_object *xo2);
+static uint64_t xpc_uuid_hash(struct xpc_object *xo);
+static bool xpc_uuid_equal(struct xpc_object *xo1, struct xpc_object *xo2);
+static uint64_t xpc_double_hash(struct xpc_object *xo);
+static bool xpc_double_equal(struct xpc_object *xo1, struct xpc_object *xo2);
+
 typedef const struct _xpc_type_s xt;
-xt _xpc_type_invalid = { "<invalid>" };
-xt _xpc_type_array = { "array" };
-xt _xpc_type_bool = { "bool" };
-xt _xpc_type_connection = { "connection" };
-xt _xpc_type_data = { "data" };
-xt _xpc_type_date = { "date" };
-xt _xpc_type_dictionary = { "dictionary" };
-xt _xpc_type_endpoint = { "endpoint" };
-xt _xpc_type_null = { "null" };
-xt _xpc_type_error = { "error" };
-xt _xpc_type_fd = { "file descriptor" };
-xt _xpc_type_int64 = { "int64" };
-xt _xpc_type_uint64 = { "uint64" };
-xt _xpc_type_shmem = { "shared memory" };
-xt _xpc_type_string = { "string" };
-xt _xpc_type_uuid = { "UUID" };
-xt _xpc_type_double = { "double" };
+xt _xpc_type_invalid = { "<invalid>", xpc_object_hash, xpc_object_equal,
+    xpc_object_copy };
+xt _xpc_type_array = { "array", xpc_array_hash, xpc_array_equal,
+    xpc_array_copy };
+xt _xpc_type_bool = { "bool", xpc_bool_hash, xpc_bool_equal, xpc_bool_copy };
+xt _xpc_type_connection = { "connection", xpc_port_hash, xpc_port_equal,
+    xpc_object_copy };
+xt _xpc_type_data = { "data", xpc_data_hash, xpc_data_equal, xpc_data_copy };
+xt _xpc_type_date = { "date", xpc_int_hash, xpc_int_equal, xpc_value_copy };
+xt _xpc_type_dictionary = { "dictionary", xpc_dictionary_hash,
+    xpc_dictionary_equal, xpc_dictionary_copy };
+xt _xpc_type_endpoint = { "endpoint", xpc_port_hash, xpc_port_equal,
+    xpc_object_copy };
+xt _xpc_type_null = { "null", xpc_null_hash, xpc_null_equal,
+    xpc_object_copy };
+xt _xpc_type_error = { "error", xpc_object_hash, xpc_object_equal,
+    xpc_object_copy };
+xt _xpc_type_fd = { "file descriptor", xpc_port_hash, xpc_port_equal,
+    xpc_object_copy };
+xt _xpc_type_int64 = { "int64", xpc_int_hash, xpc_int_equal,
+    xpc_value_copy };
+xt _xpc_type_uint64 = { "uint64", xpc_int_hash, xpc_int_equal,
+    xpc_value_copy };
+xt _xpc_type_shmem = { "shared memory", xpc_object_hash, xpc_object_equal,
+    xpc_object_copy };
+xt _xpc_type_string = { "string", xpc_string_hash, xpc_string_equal,
+    xpc_string_copy };
+xt _xpc_type_uuid = { "UUID", xpc_uuid_hash, xpc_uuid_equal,
+    xpc_value_copy };
+xt _xpc_type_double = { "double", xpc_double_hash, xpc_double_equal,
+    xpc_value_copy };
 
 
 struct _xpc_bool_s {
@@ -96,8 +151,6 @@ static const struct xpc_object _xpc_null_instance = {
 	.xo_size = 0
 };
 
-static size_t xpc_data_hash(const uint8_t *data, size_t length);
-
 static xpc_type_t xpc_typemap[] = {
 	NULL,
 	XPC_TYPE_DICTIONARY,
@@ -147,25 +200,71 @@ _xpc_prim_create(xpc_type_t type, xpc_u value, size_t size)
 	return (_xpc_prim_create_flags(type, value, size, 0));
 }
 
+__private_extern__ size_t
+_xpc_object_size(xpc_type_t type, uint16_t flags)
+{
+	size_t size;
+
+	if (type == XPC_TYPE_DICTIONARY && (flags & _XPC_DICT_LAZY))
+		size = sizeof(struct xpc_dict);
+	else if (type == XPC_TYPE_DICTIONARY)
+		size = offsetof(struct xpc_dict, wire);
+	else if (type == XPC_TYPE_ARRAY)
+		size = sizeof(struct xpc_array);
+	else if (type == XPC_TYPE_UUID)
+		size = sizeof(uuid_t);
+	else if (type == XPC_TYPE_STRING && (flags & _XPC_STRING_INLINE))
+		size = sizeof(struct xpc_string);
+	else if (type == XPC_TYPE_STRING)
+		size = offsetof(struct xpc_string, buf);
+	else if (type == XPC_TYPE_DATA && (flags & _XPC_DATA_DISPATCH))
+		size = sizeof(struct xpc_data);
+	else if (type == XPC_TYPE_DATA)
+		size = offsetof(struct xpc_data, ddata);
+	else
+		size = sizeof(uint64_t);
+
+	return (offsetof(struct xpc_object, xo_u) + size);
+}
+
 __private_extern__ struct xpc_object *
 _xpc_prim_create_flags(xpc_type_t type, xpc_u value, size_t size, uint16_t flags)
 {
 	struct xpc_object *xo;
-	xo = _os_object_alloc(&OS_xpc_object_class, sizeof(struct xpc_object) - sizeof(struct xpc_object_header));
+	size_t objsize;
+
+	objsize = _xpc_object_size(type, flags);
+	xo = xpc_slab_alloc(objsize);
 	if (xo == NULL)
 		return (NULL);
+	objc_constructInstance((Class)&OS_xpc_object_class, xo);
 
 	xo->xo_size = size;
 	xo->xo_xpc_type = type;
 	xo->xo_flags = flags;
-	xo->xo_u = value;
-	xo->xo_audit_token = NULL;
+	memcpy(&xo->xo_u, &value, objsize - offsetof(struct xpc_object, xo_u));
 
-	if (type == XPC_TYPE_DICTIONARY)
+	if (type == XPC_TYPE_DICTIONARY) {
+		xo->xo_u.dict.store = xo;
+		xo->xo_u.dict.retired = NULL;
 		TAILQ_INIT(&xo->xo_dict);
+		xo->xo_dict_index = NULL;
+		xo->xo_audit_token = NULL;
+		if (flags & _XPC_DICT_LAZY)
+			xo->xo_u.dict.wire = NULL;
+	}
 
-	if (type == XPC_TYPE_ARRAY)
-		TAILQ_INIT(&xo->xo_array);
+	if (type == XPC_TYPE_ARRAY) {
+		xo->xo_u.array.store = xo;
+		xo->xo_u.array.retired = NULL;
+		xo->xo_array = NULL;
+		xo->xo_array_capacity = 0;
+	}
+
+	if (type == XPC_TYPE_STRING)
+		xo->xo_u.string.hash = 0;
+	else if (type == XPC_TYPE_DATA)
+		xo->xo_u.data.hash = 0;
 
 	return (xo);
 }
@@ -329,10 +428,34 @@ xpc_data_create(const void *bytes, size_t length)
 	return _xpc_prim_create(XPC_TYPE_DATA, val, length);
 }
 
+/*
+ * The object keeps a reference on the data instead of copying it.  Data
+ * made of several regions has to be made contiguous for
+ * xpc_data_get_bytes_ptr(); dispatch_data_create_map() only copies in
+ * that case.
+ */
 xpc_object_t
 xpc_data_create_with_dispatch_data(dispatch_data_t ddata)
 {
-	xpc_api_misuse("%s: function unimplemented", __PRETTY_FUNCTION__);
+	struct xpc_object *xo;
+	dispatch_data_t map;
+	const void *ptr;
+	size_t size;
+	xpc_u val;
+
+	xpc_assert_nonnull(ddata);
+
+	map = dispatch_data_create_map(ddata, &ptr, &size);
+	if (map == NULL)
+		return (NULL);
+
+	val.data.ptr = ptr;
+	val.data.ddata = map;
+	xo = _xpc_prim_create_flags(XPC_TYPE_DATA, val, size,
+	    _XPC_DATA_DISPATCH);
+	if (xo == NULL)
+		dispatch_release(map);
+	return (xo);
 }
 
 size_t
@@ -365,12 +488,13 @@ xpc_data_get_bytes(xpc_object_t xdata, void *buffer, size_t off, size_t length)
 	xpc_assert_nonnull(xo);
 	xpc_assert_type(xo, XPC_TYPE_DATA);
 
+	/* off is into the data, not the buffer. */
+	if (off >= xo->xo_size)
+		return (0);
 	size_t length_to_copy = length;
-	if (length_to_copy > xo->xo_size) length_to_copy = xo->xo_size;
+	if (length_to_copy > xo->xo_size - off) length_to_copy = xo->xo_size - off;
 
-	uint8_t *byte_buffer = (uint8_t *)buffer;
-	byte_buffer += off;
-	memcpy(byte_buffer, (void *)xo->xo_u.ptr, length_to_copy);
+	memcpy(buffer, (const uint8_t *)xo->xo_u.ptr + off, length_to_copy);
 
 	return length_to_copy;
 }
@@ -383,9 +507,16 @@ xpc_data_set_bytes(xpc_object_t xdata, void *buffer, size_t length)
 	xpc_assert_nonnull(xo);
 	xpc_assert_type(xo, XPC_TYPE_DATA);
 
-	free(xo->xo_u.ptr);
-	xo->xo_u.ptr = malloc(length);
-	memcpy(xo->xo_u.ptr, buffer, length);
+	if ((xo->xo_flags & _XPC_DATA_DISPATCH) && xo->xo_u.data.ddata != NULL) {
+		/* From here on the bytes are the object's own. */
+		dispatch_release(xo->xo_u.data.ddata);
+		xo->xo_u.data.ddata = NULL;
+	} else
+		free((void *)xo->xo_u.ptr);
+	xo->xo_u.ptr = (uintptr_t)malloc(length);
+	memcpy((void *)xo->xo_u.ptr, buffer, length);
+	xo->xo_size = length;
+	xo->xo_u.data.hash = 0;
 }
 
 xpc_object_t
@@ -407,34 +538,96 @@ xpc_fd_dup(xpc_object_t xfd)
 	return fileport_makefd(xo->xo_u.port);
 }
 
+/*
+ * Create a string object from the first len bytes of string, inline if it
+ * is short enough.
+ */
+static struct xpc_object *
+xpc_string_create_len(const char *string, size_t len)
+{
+	struct xpc_object *xo;
+	xpc_u val;
+	char *str;
+
+	bzero(&val, sizeof(val));
+	if (len > XPC_STRING_INLINE_MAX) {
+		str = malloc(len + 1);
+		if (str == NULL)
+			return (NULL);
+		memcpy(str, string, len);
+		str[len] = '\0';
+		val.str = str;
+		xo = _xpc_prim_create(XPC_TYPE_STRING, val, len);
+		if (xo == NULL)
+			free(str);
+		return (xo);
+	}
+
+	xo = _xpc_prim_create_flags(XPC_TYPE_STRING, val, len,
+	    _XPC_STRING_INLINE);
+	if (xo == NULL)
+		return (NULL);
+	memcpy(xo->xo_u.string.buf, string, len);
+	xo->xo_u.string.buf[len] = '\0';
+	xo->xo_str = xo->xo_u.string.buf;
+	return (xo);
+}
+
+/*
+ * Create a string object from a malloc()ed string, which is consumed.
+ */
+static struct xpc_object *
+xpc_string_create_owned(char *str)
+{
+	struct xpc_object *xo;
+	xpc_u val;
+	size_t len;
+
+	len = strlen(str);
+	if (len <= XPC_STRING_INLINE_MAX) {
+		xo = xpc_string_create_len(str, len);
+		free(str);
+		return (xo);
+	}
+
+	bzero(&val, sizeof(val));
+	val.str = str;
+	xo = _xpc_prim_create(XPC_TYPE_STRING, val, len);
+	if (xo == NULL)
+		free(str);
+	return (xo);
+}
+
 xpc_object_t
 xpc_string_create(const char *string)
 {
-	xpc_u val;
 
-	val.str = strdup(string);
-	return _xpc_prim_create(XPC_TYPE_STRING, val, strlen(string));
+	return (xpc_string_create_len(string, strlen(string)));
 }
 
 xpc_object_t
 xpc_string_create_with_format(const char *fmt, ...)
 {
 	va_list ap;
-	xpc_u val;
+	char *str;
+	int ret;
 
 	va_start(ap, fmt);
-	vasprintf((char **)&val.str, fmt, ap);
+	ret = vasprintf(&str, fmt, ap);
 	va_end(ap);
-	return _xpc_prim_create(XPC_TYPE_STRING, val, strlen(val.str));
+	if (ret < 0)
+		return (NULL);
+	return (xpc_string_create_owned(str));
 }
 
 xpc_object_t
 xpc_string_create_with_format_and_arguments(const char *fmt, va_list ap)
 {
-	xpc_u val;
+	char *str;
 
-	vasprintf((char **)&val.str, fmt, ap);
-	return _xpc_prim_create(XPC_TYPE_STRING, val, strlen(val.str));
+	if (vasprintf(&str, fmt, ap) < 0)
+		return (NULL);
+	return (xpc_string_create_owned(str));
 }
 
 size_t
@@ -462,12 +655,28 @@ xpc_string_get_string_ptr(xpc_object_t xstring)
 void
 xpc_string_set_value(xpc_object_t xstring, const char *value) {
 	struct xpc_object *xo = xstring;
+	size_t len;
+	char *str;
 
 	xpc_assert_nonnull(xo);
 	xpc_assert_type(xo, XPC_TYPE_STRING);
 
-	free(xo->xo_u.str);
-	xo->xo_u.str = strdup(value);
+	len = strlen(value);
+	if ((xo->xo_flags & _XPC_STRING_INLINE) && len <= XPC_STRING_INLINE_MAX) {
+		memmove(xo->xo_u.string.buf, value, len + 1);
+		str = NULL;
+	} else {
+		str = strdup(value);
+		if (str == NULL)
+			return;
+	}
+
+	if (!(xo->xo_flags & _XPC_STRING_INLINE) ||
+	    xo->xo_str != xo->xo_u.string.buf)
+		free((char *)xo->xo_str);
+	xo->xo_str = str != NULL ? str : xo->xo_u.string.buf;
+	xo->xo_size = len;
+	xo->xo_u.string.hash = 0;
 }
 
 xpc_object_t
@@ -499,6 +708,359 @@ xpc_get_type(xpc_object_t obj)
 	return xo->xo_xpc_type;
 }
 
+/*
+ * A 64-bit hash in the manner of wyhash: input is consumed 16 bytes at a
+ * time (48 for long inputs, in three independent lanes) and folded in with
+ * 64x64->128 bit multiplies.  Hashes are not stable across processes and
+ * must never go on the wire.
+ */
+#define	XPC_HASH_P0	0x2d358dccaa6c78a5ULL
+#define	XPC_HASH_P1	0x8bb84b93962eacc9ULL
+#define	XPC_HASH_P2	0x4b33a62ed433d4a3ULL
+#define	XPC_HASH_P3	0x4d5a2da51de1aa47ULL
+
+static inline uint64_t
+xpc_hash_mix(uint64_t a, uint64_t b)
+{
+	__uint128_t r;
+
+	r = (__uint128_t)a * b;
+	return ((uint64_t)r ^ (uint64_t)(r >> 64));
+}
+
+static inline uint64_t
+xpc_hash_read8(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return (v);
+}
+
+static inline uint64_t
+xpc_hash_read4(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return (v);
+}
+
+static uint64_t
+xpc_hash_bytes(const void *data, size_t len)
+{
+	const uint8_t *p;
+	uint64_t seed, seed1, seed2, a, b;
+	__uint128_t r;
+	size_t i;
+
+	p = data;
+	seed = xpc_hash_mix(XPC_HASH_P0, XPC_HASH_P1);
+	if (len <= 16) {
+		if (len >= 4) {
+			a = (xpc_hash_read4(p) << 32) |
+			    xpc_hash_read4(p + ((len >> 3) << 2));
+			b = (xpc_hash_read4(p + len - 4) << 32) |
+			    xpc_hash_read4(p + len - 4 - ((len >> 3) << 2));
+		} else if (len > 0) {
+			a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) |
+			    p[len - 1];
+			b = 0;
+		} else
+			a = b = 0;
+	} else {
+		i = len;
+		if (i >= 48) {
+			seed1 = seed2 = seed;
+			do {
+				seed = xpc_hash_mix(xpc_hash_read8(p) ^ XPC_HASH_P1,
+				    xpc_hash_read8(p + 8) ^ seed);
+				seed1 = xpc_hash_mix(xpc_hash_read8(p + 16) ^
+				    XPC_HASH_P2, xpc_hash_read8(p + 24) ^ seed1);
+				seed2 = xpc_hash_mix(xpc_hash_read8(p + 32) ^
+				    XPC_HASH_P3, xpc_hash_read8(p + 40) ^ seed2);
+				p += 48;
+				i -= 48;
+			} while (i >= 48);
+			seed ^= seed1 ^ seed2;
+		}
+		while (i > 16) {
+			seed = xpc_hash_mix(xpc_hash_read8(p) ^ XPC_HASH_P1,
+			    xpc_hash_read8(p + 8) ^ seed);
+			p += 16;
+			i -= 16;
+		}
+		/* The last 16 bytes, which may overlap those already read. */
+		a = xpc_hash_read8(p + i - 16);
+		b = xpc_hash_read8(p + i - 8);
+	}
+
+	r = (__uint128_t)(a ^ XPC_HASH_P1) * (b ^ seed);
+	return (xpc_hash_mix((uint64_t)r ^ XPC_HASH_P0 ^ len,
+	    (uint64_t)(r >> 64) ^ XPC_HASH_P1));
+}
+
+static inline uint64_t
+xpc_hash_u64(uint64_t v)
+{
+
+	return (xpc_hash_mix(v ^ XPC_HASH_P0, XPC_HASH_P1));
+}
+
+/*
+ * Strings and data can be hashed over and over, as keys of a set for
+ * instance, so their hash is computed once and kept in the object until
+ * it is modified.  0 means not computed yet; a hash that happens to be 0
+ * is stored as 1.  Statically allocated objects, such as the descriptions
+ * of the XPC_ERROR_* dictionaries, may be in read-only memory and are
+ * hashed on every call instead.
+ */
+static inline uint64_t
+xpc_hash_cached(struct xpc_object *xo, uint64_t *cache, const void *data,
+    size_t len)
+{
+	uint64_t hash;
+
+	hash = __atomic_load_n(cache, __ATOMIC_RELAXED);
+	if (hash == 0) {
+		hash = xpc_hash_bytes(data, len);
+		if (hash == 0)
+			hash = 1;
+		if (xo->header.ref_cnt != _OS_OBJECT_GLOBAL_REFCNT)
+			__atomic_store_n(cache, hash, __ATOMIC_RELAXED);
+	}
+	return (hash);
+}
+
+/*
+ * Two objects whose hashes are both cached and differ can't be equal.
+ */
+static inline bool
+xpc_hash_differ(uint64_t *cache1, uint64_t *cache2)
+{
+	uint64_t h1, h2;
+
+	h1 = __atomic_load_n(cache1, __ATOMIC_RELAXED);
+	h2 = __atomic_load_n(cache2, __ATOMIC_RELAXED);
+	return (h1 != 0 && h2 != 0 && h1 != h2);
+}
+
+/* Objects without a notion of value are only equal to themselves. */
+static uint64_t
+xpc_object_hash(struct xpc_object *xo)
+{
+
+	return (xpc_hash_u64((uintptr_t)xo));
+}
+
+static bool
+xpc_object_equal(struct xpc_object *xo1, struct xpc_object *xo2)
+{
+
+	return (xo1 == xo2);
+}
+
+static uint64_t
+xpc_null_hash(struct xpc_object *xo __unused)
+{
+
+	return (XPC_HASH_P3);
+}
+
+static bool
+xpc_null_equal(struct xpc_object *xo1 __unused, struct xpc_object *xo2 __unused)
+{
+
+	return (true);
+}
+
+static uint64_t
+xpc_bool_hash(struct xpc_object *xo)
+{
+
+	return (xpc_hash_u64(xo->xo_bool));
+}
+
+static bool
+xpc_bool_equal(struct xpc_object *xo1, struct xpc_object *xo2)
+{
+
+	return (xo1->xo_bool == xo2->xo_bool);
+}
+
+/* int64, uint64 and date */
+static uint64_t
+xpc_int_hash(struct xpc_object *xo)
+{
+
+	return (xpc_hash_u64(xo->xo_uint));
+}
+
+static bool
+xpc_int_equal(struct xpc_object *xo1, struct xpc_object *xo2)
+{
+
+	return (xo1->xo_uint == xo2->xo_uint);
+}
+
+static uint64_t
+xpc_double_hash(struct xpc_object *xo)
+{
+	double d;
+	uint64_t v;
+
+	/* 0.0 == -0.0, so they must hash alike. */
+	d = xo->xo_d == 0.0 ? 0.0 : xo->xo_d;
+	memcpy(&v, &d, sizeof(v));
+	return (xpc_hash_u64(v));
+}
+
+static bool
+xpc_double_equal(struct xpc_object *xo1, struct xpc_object *xo2)
+{
+
+	return (xo1->xo_d == xo2->xo_d);
+}
+
+/* connection, endpoint and fd */
+static uint64_t
+xpc_port_hash(struct xpc_object *xo)
+{
+
+	return (xpc_hash_u64(xo->xo_port));
+}
+
+static bool
+xpc_port_equal(struct xpc_object *xo1, struct xpc_object *xo2)
+{
+
+	return (xo1->xo_port == xo2->xo_port);
+}
+
+static uint64_t
+xpc_uuid_hash(struct xpc_object *xo)
+{
+
+	return (xpc_hash_bytes(xo->xo_uuid, sizeof(uuid_t)));
+}
+
+static bool
+xpc_uuid_equal(struct xpc_object *xo1, struct xpc_object *xo2)
+{
+
+	return (memcmp(xo1->xo_uuid, xo2->xo_uuid, sizeof(uuid_t)) == 0);
+}
+
+static uint64_t
+xpc_string_hash(struct xpc_object *xo)
+{
+
+	return (xpc_hash_cached(xo, &xo->xo_u.string.hash, xo->xo_str,
+	    xo->xo_size));
+}
+
+static bool
+xpc_string_equal(struct xpc_object *xo1, struct xpc_object *xo2)
+{
+
+	if (xo1->xo_size != xo2->xo_size)
+		return (false);
+	if (xpc_hash_differ(&xo1->xo_u.string.hash, &xo2->xo_u.string.hash))
+		return (false);
+	return (memcmp(xo1->xo_str, xo2->xo_str, xo1->xo_size) == 0);
+}
+
+static uint64_t
+xpc_data_hash(struct xpc_object *xo)
+{
+
+	return (xpc_hash_cached(xo, &xo->xo_u.data.hash, xo->xo_u.data.ptr,
+	    xo->xo_size));
+}
+
+static bool
+xpc_data_equal(struct xpc_object *xo1, struct xpc_object *xo2)
+{
+
+	if (xo1->xo_size != xo2->xo_size)
+		return (false);
+	if (xpc_hash_differ(&xo1->xo_u.data.hash, &xo2->xo_u.data.hash))
+		return (false);
+	return (memcmp(xo1->xo_u.data.ptr, xo2->xo_u.data.ptr,
+	    xo1->xo_size) == 0);
+}
+
+/*
+ * Containers can change at any time, so their hash is recomputed on every
+ * call.  The pairs of a dictionary are summed so that the order of the
+ * keys doesn't matter; arrays fold their elements in order.
+ */
+static uint64_t
+xpc_dictionary_hash(struct xpc_object *xo)
+{
+	__block uint64_t hash = 0;
+
+	xpc_dictionary_apply_nocopy(xo, ^bool(const char *k, xpc_object_t v) {
+		hash += xpc_hash_mix(xpc_hash_bytes(k, strlen(k)) ^ XPC_HASH_P1,
+		    (uint64_t)xpc_hash(v) ^ XPC_HASH_P2);
+		return (true);
+	});
+	return (xpc_hash_mix(hash ^ XPC_HASH_P0, xo->xo_size ^ XPC_HASH_P3));
+}
+
+/*
+ * Keys are unique, so once the counts match it is enough to find each key
+ * of the first dictionary in the second.
+ */
+static bool
+xpc_dictionary_equal(struct xpc_object *xo1, struct xpc_object *xo2)
+{
+
+	if (xo1->xo_size != xo2->xo_size)
+		return (false);
+	/* Copies that haven't changed yet share their pairs. */
+	if (xo1->xo_u.dict.store == xo2->xo_u.dict.store)
+		return (true);
+
+	return (xpc_dictionary_apply_nocopy(xo1, ^bool(const char *k,
+	    xpc_object_t v) {
+		xpc_object_t v2;
+
+		v2 = xpc_dictionary_get_value_nocopy(xo2, k);
+		return (v2 != NULL && xpc_equal(v, v2));
+	}));
+}
+
+static uint64_t
+xpc_array_hash(struct xpc_object *xo)
+{
+	uint64_t hash;
+	size_t i;
+
+	hash = XPC_HASH_P0 ^ xo->xo_size;
+	for (i = 0; i < xo->xo_size; i++)
+		hash = xpc_hash_mix(hash ^ (uint64_t)xpc_hash(xo->xo_array[i]),
+		    XPC_HASH_P1);
+	return (hash);
+}
+
+static bool
+xpc_array_equal(struct xpc_object *xo1, struct xpc_object *xo2)
+{
+	size_t i;
+
+	if (xo1->xo_size != xo2->xo_size)
+		return (false);
+	if (xo1->xo_u.array.store == xo2->xo_u.array.store)
+		return (true);
+
+	for (i = 0; i < xo1->xo_size; i++) {
+		if (!xpc_equal(xo1->xo_array[i], xo2->xo_array[i]))
+			return (false);
+	}
+	return (true);
+}
+
 bool
 xpc_equal(xpc_object_t x1, xpc_object_t x2)
 {
@@ -510,99 +1072,86 @@ xpc_equal(xpc_object_t x1, xpc_object_t x2)
 	xpc_assert_nonnull(xo1);
 	xpc_assert_nonnull(xo2);
 
-	if (xo1->xo_xpc_type != xo2->xo_xpc_type) return false;
-
-	if (xo1->xo_xpc_type == XPC_TYPE_BOOL) {
-		return xo1->xo_u.b == xo2->xo_u.b;
-	} else if (xo1->xo_xpc_type == XPC_TYPE_INT64 || xo1->xo_xpc_type == XPC_TYPE_DATE) {
-		return xo1->xo_u.i == xo2->xo_u.i;
-	} else if (xo1->xo_xpc_type == XPC_TYPE_UINT64) {
-		return xo1->xo_u.ui == xo2->xo_u.ui;
-	} else if (xo1->xo_xpc_type == XPC_TYPE_ENDPOINT) {
-		return xo1->xo_u.port == xo2->xo_u.port;
-	} else if (xo1->xo_xpc_type == XPC_TYPE_STRING) {
-		return strcmp(xo1->xo_u.str, xo1->xo_u.str) == 0;
-	} else if (xo1->xo_xpc_type == XPC_TYPE_DATA) {
-		if (xo1->xo_size != xo2->xo_size) return false;
-		return memcmp((void *)xo1->xo_u.ptr, (void *)xo2->xo_u.ptr, xo1->xo_size) == 0;
-	} else if (xo1->xo_xpc_type == XPC_TYPE_DICTIONARY) {
-		struct xpc_dict_pair *pair;
-		size_t count1 = 0, count2 = 0;
-		TAILQ_FOREACH(pair, &xo1->xo_u.dict, xo_link) {
-			count1++;
-		}
-		TAILQ_FOREACH(pair, &xo2->xo_u.dict, xo_link) {
-			count2++;
-		}
+	if (xo1 == xo2)
+		return (true);
+	if (xo1->xo_xpc_type != xo2->xo_xpc_type)
+		return (false);
+	return (xo1->xo_xpc_type->equal(xo1, xo2));
+}
+
+/*
+ * Copies of values that can't be shared.  Within dictionaries and arrays
+ * values are treated as immutable and shared with the copy instead.
+ */
+static struct xpc_object *
+xpc_object_copy(struct xpc_object *xo)
+{
 
-		if (count1 != count2) return false;
+	return (xpc_retain(xo));
+}
 
-		TAILQ_FOREACH(pair, &xo1->xo_u.dict, xo_link) {
-			struct xpc_object *value1 = pair->value;
-			struct xpc_object *value2 = xpc_dictionary_get_value(xo2, pair->key);
-			if (value2 == NULL) return false;
-			if (!xpc_equal(value1, value2)) return false;
-		}
+static struct xpc_object *
+xpc_value_copy(struct xpc_object *xo)
+{
+	xpc_u val;
 
-		TAILQ_FOREACH(pair, &xo2->xo_u.dict, xo_link) {
-			if (xpc_dictionary_get_value(xo1, pair->key) == NULL) return false;
-		}
+	/* Only the start of xo_u is allocated. */
+	memcpy(&val, &xo->xo_u, _xpc_object_size(xo->xo_xpc_type, 0) -
+	    offsetof(struct xpc_object, xo_u));
+	return (_xpc_prim_create(xo->xo_xpc_type, val, xo->xo_size));
+}
 
-		return true;
-	} else if (xo1->xo_xpc_type == XPC_TYPE_ARRAY) {
-		if (xpc_array_get_count(xo1) != xpc_array_get_count(xo2)) return false;
+/*
+ * Distinct bools, as launch_data_alloc() makes them, can be changed with
+ * xpc_bool_set_value(), so their copies must be distinct too.
+ */
+static struct xpc_object *
+xpc_bool_copy(struct xpc_object *xo)
+{
 
-		return xpc_array_apply(xo1, ^bool(size_t index, xpc_object_t value) {
-			return xpc_equal(value, xpc_array_get_value(xo2, index));
-		});
-	} else {
-		xpc_api_misuse("xpc_equal() is not implemented for this object type");
-	}
+	if (xo->header.ref_cnt != _OS_OBJECT_GLOBAL_REFCNT)
+		return (xpc_bool_create_distinct(xo->xo_bool));
+	return (xpc_bool_create(xo->xo_bool));
 }
 
-static size_t
-xpc_data_hash(const uint8_t *data, size_t length)
+static struct xpc_object *
+xpc_string_copy(struct xpc_object *xo)
 {
-    size_t hash = 5381;
 
-    while (length--)
-        hash = ((hash << 5) + hash) + data[length];
+	return (xpc_string_create_len(xo->xo_str, xo->xo_size));
+}
 
-    return (hash);
+static struct xpc_object *
+xpc_data_copy(struct xpc_object *xo)
+{
+
+	/* dispatch data is immutable, the copy can refer to it as well. */
+	if ((xo->xo_flags & _XPC_DATA_DISPATCH) && xo->xo_u.data.ddata != NULL)
+		return (xpc_data_create_with_dispatch_data(
+		    xo->xo_u.data.ddata));
+	return (xpc_data_create(xo->xo_u.data.ptr, xo->xo_size));
+}
+
+xpc_object_t
+xpc_copy(xpc_object_t obj)
+{
+	struct xpc_object *xo;
+
+	xo = obj;
+	xpc_assert_nonnull(xo);
+
+	return (xo->xo_xpc_type->copy(xo));
 }
 
 size_t
 xpc_hash(xpc_object_t obj)
 {
 	struct xpc_object *xo;
-	__block size_t hash = 0;
 
 	xo = obj;
-	if (xo->xo_xpc_type == XPC_TYPE_BOOL || xo->xo_xpc_type == XPC_TYPE_INT64 ||
-		xo->xo_xpc_type == XPC_TYPE_UINT64 || xo->xo_xpc_type == XPC_TYPE_DATE ||
-		xo->xo_xpc_type == XPC_TYPE_ENDPOINT) {
-		return ((size_t)xo->xo_u.port);
-	} else if (xo->xo_xpc_type == XPC_TYPE_STRING) {
-		return (xpc_data_hash((const uint8_t *)xpc_string_get_string_ptr(obj), xpc_string_get_length(obj)));
-	} else if (xo->xo_xpc_type == XPC_TYPE_DATA) {
-		return (xpc_data_hash(xpc_data_get_bytes_ptr(obj), xpc_data_get_length(obj)));
-	} else if (xo->xo_xpc_type == XPC_TYPE_DICTIONARY) {
-		xpc_dictionary_apply(obj, ^bool(const char *k, xpc_object_t v) {
-			hash ^= xpc_data_hash((const uint8_t *)k, strlen(k));
-			hash ^= xpc_hash(v);
-			return true;
-		});
-		return (hash);
-	} else if (xo->xo_xpc_type == XPC_TYPE_ARRAY) {
-		xpc_array_apply(obj, ^bool(size_t idx, xpc_object_t v) {
-			hash ^= xpc_hash(v);
-			return true;
-		});
-		return (hash);
-	}
+	xpc_assert_nonnull(xo);
 
-    printf("end of unimplmented xpc_hash()\n");
-    return 1; // _sjc_ nothing here, returned this now
+	return ((size_t)xo->xo_xpc_type->hash(xo));
 }
 
 mach_port_t
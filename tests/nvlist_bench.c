@@ -0,0 +1,742 @@
+//
+//  nvlist_bench.c
+//  libnv micro-benchmarks
+//
+//  Copyright © 2018 PureDarwin. All rights reserved.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/param.h>
+#include <sys/uio.h>
+
+#include "nv.h"
+#include "nv_impl.h"
+#include "nvlist_impl.h"
+
+#ifndef NVLIST_TESTING
+#error "libnv and the bench must be built with -DNVLIST_TESTING"
+#endif
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static char **
+make_names(size_t nkeys)
+{
+	char **names;
+	size_t i;
+
+	names = malloc(nkeys * sizeof(names[0]));
+	for (i = 0; i < nkeys; i++)
+		asprintf(&names[i], "Key%zu", i);
+
+	return (names);
+}
+
+static void
+free_names(char **names, size_t nkeys)
+{
+	size_t i;
+
+	for (i = 0; i < nkeys; i++)
+		free(names[i]);
+	free(names);
+}
+
+static nvlist_t *
+build_list(char **names, size_t nkeys)
+{
+	nvlist_t *nvl;
+	size_t i;
+
+	nvl = nvlist_create(0);
+	for (i = 0; i < nkeys; i++)
+		nvlist_add_number(nvl, names[i], i);
+
+	return (nvl);
+}
+
+static uint64_t
+time_lookups(char **names, size_t nkeys, size_t rounds)
+{
+	nvlist_t *nvl;
+	uint64_t start, elapsed;
+	size_t i, j;
+
+	nvl = build_list(names, nkeys);
+	start = now_ns();
+	for (i = 0; i < rounds; i++) {
+		for (j = 0; j < nkeys; j++) {
+			if (!nvlist_exists_number(nvl, names[j]))
+				abort();
+		}
+	}
+	elapsed = now_ns() - start;
+	nvlist_destroy(nvl);
+
+	return (elapsed);
+}
+
+/*
+ * Time lookups of every key in lists of growing size, once with the name
+ * index disabled and once with it forced on, to show where the index
+ * starts paying for itself.
+ */
+static void
+bench_lookup(void)
+{
+	size_t sizes[] = { 2, 4, 8, 12, 16, 24, 32, 64, 256, 1024 };
+	size_t saved, i, n, rounds;
+	uint64_t linear, hashed;
+	char **names;
+
+	saved = nvlist_set_hash_threshold(NVLIST_HASH_THRESHOLD);
+	printf("lookup: keys  linear ns/op  indexed ns/op\n");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		n = sizes[i];
+		rounds = 4000000 / n + 1;
+		names = make_names(n);
+
+		(void)nvlist_set_hash_threshold(SIZE_MAX);
+		linear = time_lookups(names, n, rounds);
+		(void)nvlist_set_hash_threshold(0);
+		hashed = time_lookups(names, n, rounds);
+
+		printf("        %4zu  %12.1f  %13.1f\n", n,
+		    (double)linear / (rounds * n), (double)hashed / (rounds * n));
+		free_names(names, n);
+	}
+	(void)nvlist_set_hash_threshold(saved);
+}
+
+/*
+ * Time unpacking of flat payloads of growing size: without the name index
+ * (every insert scans the list for duplicates), with it, and in trusted
+ * mode where the duplicate check is skipped altogether.
+ */
+static void
+bench_unpack(void)
+{
+	size_t sizes[] = { 10, 100, 10000 };
+	size_t saved, i, j, k, n, rounds, size;
+	uint64_t start, times[3];
+	char **names;
+	nvlist_t *nvl;
+	void *buf;
+
+	saved = nvlist_set_hash_threshold(NVLIST_HASH_THRESHOLD);
+	printf("unpack: keys  unindexed us  indexed us  trusted us\n");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		n = sizes[i];
+		rounds = 20000 / n + 1;
+		names = make_names(n);
+		nvl = nvlist_create(0);
+		for (j = 0; j < n; j++)
+			nvlist_add_string(nvl, names[j], names[j]);
+		buf = nvlist_pack(nvl, &size);
+		nvlist_destroy(nvl);
+
+		for (k = 0; k < 3; k++) {
+			(void)nvlist_set_hash_threshold((k == 0) ? SIZE_MAX :
+			    saved);
+			start = now_ns();
+			for (j = 0; j < rounds; j++) {
+				nvl = nvlist_unpack_flags(buf, size,
+				    (k == 2) ? NV_UNPACK_TRUSTED : 0);
+				if (nvl == NULL)
+					abort();
+				nvlist_destroy(nvl);
+			}
+			times[k] = now_ns() - start;
+		}
+
+		printf("        %5zu  %12.1f  %10.1f  %10.1f\n", n,
+		    times[0] / 1000.0 / rounds, times[1] / 1000.0 / rounds,
+		    times[2] / 1000.0 / rounds);
+		free(buf);
+		free_names(names, n);
+	}
+	(void)nvlist_set_hash_threshold(saved);
+}
+
+/*
+ * Compare unpacking a payload with reading it through a view, both for a
+ * receiver that walks every element and for one that only reads one key.
+ */
+static void
+bench_view(void)
+{
+	size_t sizes[] = { 10, 100, 10000 };
+	size_t i, j, n, rounds, size;
+	uint64_t start, times[4];
+	nvpair_view_t nvpv;
+	nvlist_view_t view;
+	char **names;
+	nvlist_t *nvl;
+	void *buf, *cookie;
+	const char *name;
+	int type;
+
+	printf("view:  keys  unpack+walk us  view+walk us  unpack+get us  view+get us\n");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		n = sizes[i];
+		rounds = 20000 / n + 1;
+		names = make_names(n);
+		nvl = nvlist_create_dictionary(0);
+		for (j = 0; j < n; j++)
+			nvlist_add_string(nvl, names[j], names[j]);
+		buf = nvlist_pack(nvl, &size);
+		nvlist_destroy(nvl);
+
+		start = now_ns();
+		for (j = 0; j < rounds; j++) {
+			nvl = nvlist_unpack(buf, size);
+			cookie = NULL;
+			while ((name = nvlist_next(nvl, &type, &cookie)) != NULL)
+				(void)nvlist_get_string(nvl, name);
+			nvlist_destroy(nvl);
+		}
+		times[0] = now_ns() - start;
+
+		start = now_ns();
+		for (j = 0; j < rounds; j++) {
+			if (!nvlist_view_init(&view, buf, size))
+				abort();
+			cookie = NULL;
+			while (nvlist_view_next(&view, &nvpv, &cookie))
+				(void)nvpair_view_get_string(&nvpv);
+		}
+		times[1] = now_ns() - start;
+
+		start = now_ns();
+		for (j = 0; j < rounds; j++) {
+			nvl = nvlist_unpack(buf, size);
+			(void)nvlist_get_string(nvl, names[0]);
+			nvlist_destroy(nvl);
+		}
+		times[2] = now_ns() - start;
+
+		start = now_ns();
+		for (j = 0; j < rounds; j++) {
+			if (!nvlist_view_init(&view, buf, size))
+				abort();
+			(void)nvlist_view_get_string(&view, names[0]);
+		}
+		times[3] = now_ns() - start;
+
+		printf("        %5zu  %13.1f  %12.1f  %13.1f  %11.1f\n", n,
+		    times[0] / 1000.0 / rounds, times[1] / 1000.0 / rounds,
+		    times[2] / 1000.0 / rounds, times[3] / 1000.0 / rounds);
+		free(buf);
+		free_names(names, n);
+	}
+}
+
+static nvlist_t *
+build_nested(char **names, size_t nkeys, size_t depth)
+{
+	nvlist_t *nvl, *child;
+	size_t i;
+
+	nvl = nvlist_create_dictionary(0);
+	for (i = 0; i < nkeys; i++)
+		nvlist_add_string(nvl, names[i], names[i]);
+	if (depth > 1) {
+		child = build_nested(names, nkeys, depth - 1);
+		nvlist_move_nvlist_dictionary(nvl, "child", child);
+	}
+
+	return (nvl);
+}
+
+/*
+ * Time packing of job-dictionary-like trees of growing depth.  Packing
+ * should stay linear in the number of elements however deep the tree is.
+ */
+static void
+bench_pack(void)
+{
+	size_t depths[] = { 1, 4, 16, 64, 256 };
+	size_t i, j, n, rounds, size;
+	uint64_t start, elapsed;
+	char **names;
+	nvlist_t *nvl;
+	void *buf;
+
+	n = 8;
+	names = make_names(n);
+	printf("pack:  depth  elements  us/pack  ns/element\n");
+	for (i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+		rounds = 20000 / depths[i] + 1;
+		nvl = build_nested(names, n, depths[i]);
+		start = now_ns();
+		for (j = 0; j < rounds; j++) {
+			buf = nvlist_pack(nvl, &size);
+			if (buf == NULL)
+				abort();
+			free(buf);
+			/* Touch the top level, as a typical update would. */
+			nvlist_add_null(nvl, "dirty");
+			nvlist_free_null(nvl, "dirty");
+		}
+		elapsed = now_ns() - start;
+		nvlist_destroy(nvl);
+
+		printf("        %4zu  %8zu  %7.1f  %10.1f\n", depths[i],
+		    depths[i] * (n + 1), elapsed / 1000.0 / rounds,
+		    (double)elapsed / rounds / (depths[i] * (n + 1)));
+	}
+	free_names(names, n);
+}
+
+static nvlist_t *
+build_message(nvlist_t *owner, char **names, size_t nkeys, size_t depth)
+{
+	nvlist_t *nvl, *child;
+	size_t i;
+
+	if (owner == NULL)
+		nvl = nvlist_create_dictionary(0);
+	else
+		nvl = nvlist_create_in(owner, NV_TYPE_NVLIST_DICTIONARY, 0);
+	for (i = 0; i < nkeys; i++) {
+		nvlist_add_string(nvl, names[i], names[i]);
+		nvlist_add_uint64(nvl, names[i] + 1, i);
+	}
+	if (depth > 1) {
+		child = build_message(owner, names, nkeys, depth - 1);
+		nvlist_move_nvlist_dictionary(nvl, "child", child);
+	}
+
+	return (nvl);
+}
+
+/*
+ * Time building, packing and destroying a message tree, as xpc2nv() and
+ * xpc_pipe_send() do for every message, with the tree on the heap and in
+ * an arena.
+ */
+static void
+bench_arena(void)
+{
+	size_t depths[] = { 1, 4, 16 };
+	size_t i, j, k, n, rounds, size;
+	uint64_t start, times[2];
+	char **names;
+	nvlist_t *nvl, *root;
+	void *buf;
+
+	n = 16;
+	names = make_names(n);
+	printf("arena: depth  heap us/msg  arena us/msg\n");
+	for (i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+		rounds = 20000 / depths[i] + 1;
+		for (k = 0; k < 2; k++) {
+			start = now_ns();
+			for (j = 0; j < rounds; j++) {
+				if (k == 0)
+					nvl = build_message(NULL, names, n, depths[i]);
+				else {
+					root = nvlist_create_arena(
+					    NV_TYPE_NVLIST_DICTIONARY, 0);
+					nvl = build_message(root, names, n,
+					    depths[i]);
+					nvlist_move_nvlist_dictionary(root, "msg", nvl);
+					nvl = root;
+				}
+				buf = nvlist_pack(nvl, &size);
+				if (buf == NULL)
+					abort();
+				free(buf);
+				nvlist_destroy(nvl);
+			}
+			times[k] = now_ns() - start;
+		}
+
+		printf("        %4zu  %11.2f  %12.2f\n", depths[i],
+		    times[0] / 1000.0 / rounds, times[1] / 1000.0 / rounds);
+	}
+	free_names(names, n);
+}
+
+/*
+ * Compare packing a message carrying a large opaque value into one buffer
+ * with packing it into an iovec that references the value in place.
+ */
+static void
+bench_iov(void)
+{
+	size_t sizes[] = { 64, 4096, 65536, 1048576 };
+	size_t i, j, rounds, size, niov;
+	uint64_t start, times[2];
+	struct iovec *iov;
+	nvlist_t *nvl;
+	void *blob, *buf;
+
+	printf("iov:   bytes  pack us  pack_iov us\n");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		rounds = 200000000 / (sizes[i] + 10000) + 1;
+		blob = calloc(1, sizes[i]);
+		nvl = nvlist_create_dictionary(0);
+		nvlist_add_string(nvl, "Label", "com.example.job");
+		nvlist_add_binary(nvl, "EnvironmentVariables", blob, sizes[i]);
+
+		start = now_ns();
+		for (j = 0; j < rounds; j++) {
+			buf = nvlist_pack(nvl, &size);
+			if (buf == NULL)
+				abort();
+			free(buf);
+		}
+		times[0] = now_ns() - start;
+
+		start = now_ns();
+		for (j = 0; j < rounds; j++) {
+			iov = nvlist_pack_iov(nvl, &niov, &size);
+			if (iov == NULL)
+				abort();
+			free(iov);
+		}
+		times[1] = now_ns() - start;
+
+		printf("       %7zu  %7.2f  %11.2f\n", sizes[i],
+		    times[0] / 1000.0 / rounds, times[1] / 1000.0 / rounds);
+		nvlist_destroy(nvl);
+		free(blob);
+	}
+}
+
+/*
+ * Compare receiving a large reply in 8 KB reads by accumulating it and
+ * unpacking it at the end with feeding each read to a parser.
+ */
+static void
+bench_parser(void)
+{
+	size_t sizes[] = { 100, 1000, 10000 };
+	size_t i, j, k, n, rounds, size, off, chunk, len;
+	uint64_t start, times[2];
+	nvlist_parser_t *parser;
+	char **names;
+	nvlist_t *nvl, *job;
+	unsigned char *buf, *acc;
+
+	printf("parser: jobs  accumulate us  stream us\n");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		n = sizes[i];
+		rounds = 2000 / n + 1;
+		names = make_names(n);
+		nvl = nvlist_create_dictionary(0);
+		for (j = 0; j < n; j++) {
+			job = nvlist_create_dictionary(0);
+			nvlist_add_string(job, "Label", names[j]);
+			nvlist_add_string(job, "Program", "/usr/libexec/job");
+			nvlist_add_int64(job, "PID", j);
+			nvlist_move_nvlist_dictionary(nvl, names[j], job);
+		}
+		buf = nvlist_pack(nvl, &size);
+		nvlist_destroy(nvl);
+		chunk = 8 * 1024;
+
+		start = now_ns();
+		for (j = 0; j < rounds; j++) {
+			acc = NULL;
+			for (off = 0; off < size; off += len) {
+				len = MIN(chunk, size - off);
+				acc = realloc(acc, off + chunk);
+				memcpy(acc + off, buf + off, len);
+			}
+			nvl = nvlist_unpack(acc, size);
+			if (nvl == NULL)
+				abort();
+			nvlist_destroy(nvl);
+			free(acc);
+		}
+		times[0] = now_ns() - start;
+
+		parser = nvlist_parser_create(0);
+		start = now_ns();
+		for (j = 0; j < rounds; j++) {
+			for (off = 0; off < size; off += len) {
+				len = MIN(chunk, size - off);
+				k = nvlist_parser_feed(parser, buf + off, len);
+				if (k != len)
+					abort();
+			}
+			nvl = nvlist_parser_take(parser);
+			if (nvl == NULL)
+				abort();
+			nvlist_destroy(nvl);
+		}
+		times[1] = now_ns() - start;
+		nvlist_parser_destroy(parser);
+
+		printf("        %5zu  %13.1f  %9.1f\n", n,
+		    times[0] / 1000.0 / rounds, times[1] / 1000.0 / rounds);
+		free(buf);
+		free_names(names, n);
+	}
+}
+
+/*
+ * Compare an integer list sent as a nested list with a pair per element
+ * with the same list sent as one typed array.
+ */
+static void
+bench_array(void)
+{
+	size_t sizes[] = { 10, 1000, 10000 };
+	size_t i, j, n, rounds, size[2];
+	uint64_t start, times[2][2];
+	nvlist_t *nvl, *arr;
+	int64_t *pids;
+	char key[24];
+	void *buf;
+	int t;
+
+	printf("array: items  nvlist B  typed B  nvlist pack/unpack us  "
+	    "typed pack/unpack us\n");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		n = sizes[i];
+		rounds = 20000 / n + 1;
+		pids = malloc(n * sizeof(*pids));
+		for (j = 0; j < n; j++)
+			pids[j] = 100 + j;
+
+		for (t = 0; t < 2; t++) {
+			nvl = nvlist_create_dictionary(0);
+			if (t == 0) {
+				arr = nvlist_create_array(0);
+				for (j = 0; j < n; j++) {
+					snprintf(key, sizeof(key), "%zu", j);
+					nvlist_add_int64(arr, key, pids[j]);
+				}
+				nvlist_move_nvlist_array(nvl, "pids", arr);
+			} else
+				nvlist_add_int64_array(nvl, "pids", pids, n);
+
+			start = now_ns();
+			for (j = 0; j < rounds; j++) {
+				buf = nvlist_pack(nvl, &size[t]);
+				free(buf);
+			}
+			times[t][0] = now_ns() - start;
+
+			buf = nvlist_pack(nvl, &size[t]);
+			nvlist_destroy(nvl);
+			start = now_ns();
+			for (j = 0; j < rounds; j++) {
+				nvl = nvlist_unpack(buf, size[t]);
+				if (nvl == NULL)
+					abort();
+				nvlist_destroy(nvl);
+			}
+			times[t][1] = now_ns() - start;
+			free(buf);
+		}
+
+		printf("       %5zu  %8zu  %7zu  %10.1f/%-10.1f  %9.1f/%-9.1f\n",
+		    n, size[0], size[1],
+		    times[0][0] / 1000.0 / rounds, times[0][1] / 1000.0 / rounds,
+		    times[1][0] / 1000.0 / rounds, times[1][1] / 1000.0 / rounds);
+		free(pids);
+	}
+}
+
+/*
+ * Build a launchd style message: a dictionary of jobs that all repeat the
+ * same keys and carry their arguments as a nested array.
+ */
+static nvlist_t *
+build_jobs(size_t njobs)
+{
+	nvlist_t *nvl, *job, *args;
+	char label[48], key[24];
+	size_t i, j;
+
+	nvl = nvlist_create_dictionary(0);
+	for (i = 0; i < njobs; i++) {
+		snprintf(label, sizeof(label), "com.example.job%zu", i);
+		job = nvlist_create_dictionary(0);
+		nvlist_add_string(job, "Label", label);
+		nvlist_add_string(job, "Program", "/usr/libexec/exampled");
+		nvlist_add_int64(job, "PID", 100 + i);
+		nvlist_add_bool(job, "OnDemand", (i & 1) != 0);
+		nvlist_add_uint64(job, "ThrottleInterval", 10);
+		args = nvlist_create_array(0);
+		for (j = 0; j < 4; j++) {
+			snprintf(key, sizeof(key), "%zu", j);
+			nvlist_add_string(args, key, "-v");
+		}
+		nvlist_move_nvlist_array(job, "ProgramArguments", args);
+		nvlist_move_nvlist_dictionary(nvl, label, job);
+	}
+	return (nvl);
+}
+
+/*
+ * Compare the default version 0 encoding with the compact version 1
+ * encoding: packed size and pack/unpack throughput of the same message.
+ */
+static void
+bench_compact(void)
+{
+	size_t sizes[] = { 1, 100, 1000 };
+	size_t i, j, rounds, size[2];
+	uint64_t start, times[2][2];
+	nvlist_t *nvl, *tmp;
+	void *buf;
+	int t;
+
+	printf("compact: jobs      v0 B      v1 B  v0 pack/unpack MB/s  "
+	    "v1 pack/unpack MB/s\n");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		rounds = 20000 / sizes[i] + 1;
+		nvl = build_jobs(sizes[i]);
+
+		for (t = 0; t < 2; t++) {
+			start = now_ns();
+			for (j = 0; j < rounds; j++) {
+				buf = nvlist_pack_flags(nvl, &size[t],
+				    t == 0 ? 0 : NV_PACK_COMPACT);
+				free(buf);
+			}
+			times[t][0] = now_ns() - start;
+
+			buf = nvlist_pack_flags(nvl, &size[t],
+			    t == 0 ? 0 : NV_PACK_COMPACT);
+			start = now_ns();
+			for (j = 0; j < rounds; j++) {
+				tmp = nvlist_unpack(buf, size[t]);
+				if (tmp == NULL)
+					abort();
+				nvlist_destroy(tmp);
+			}
+			times[t][1] = now_ns() - start;
+			free(buf);
+		}
+
+		/* Throughput is measured against the bytes of each encoding. */
+		printf("         %4zu  %8zu  %8zu  %8.1f/%-10.1f  %8.1f/%-10.1f\n",
+		    sizes[i], size[0], size[1],
+		    size[0] * rounds * 1000.0 / times[0][0],
+		    size[0] * rounds * 1000.0 / times[0][1],
+		    size[1] * rounds * 1000.0 / times[1][0],
+		    size[1] * rounds * 1000.0 / times[1][1]);
+		nvlist_destroy(nvl);
+	}
+}
+
+/*
+ * Time adding a blob to a list and destroying the list again, copying the
+ * blob with nvlist_add_binary() and referencing it with
+ * nvlist_add_binary_external().
+ */
+static void
+bench_external(void)
+{
+	size_t sizes[] = { 4096, 65536, 1048576 };
+	size_t i, j, rounds;
+	uint64_t start, times[2];
+	nvlist_t *nvl;
+	void *blob;
+
+	printf("external: bytes  copied us  external us\n");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		rounds = 1000;
+		blob = malloc(sizes[i]);
+		memset(blob, 0x5a, sizes[i]);
+
+		start = now_ns();
+		for (j = 0; j < rounds; j++) {
+			nvl = nvlist_create(0);
+			nvlist_add_binary(nvl, "blob", blob, sizes[i]);
+			nvlist_destroy(nvl);
+		}
+		times[0] = now_ns() - start;
+
+		start = now_ns();
+		for (j = 0; j < rounds; j++) {
+			nvl = nvlist_create(0);
+			nvlist_add_binary_external(nvl, "blob", blob, sizes[i],
+			    NULL, NULL);
+			nvlist_destroy(nvl);
+		}
+		times[1] = now_ns() - start;
+
+		printf("       %8zu  %9.2f  %11.2f\n", sizes[i],
+		    times[0] / 1000.0 / rounds, times[1] / 1000.0 / rounds);
+		free(blob);
+	}
+}
+
+/*
+ * Time embedding a cached export of jobs into a new reply and packing it,
+ * once with the export copied into the reply and once frozen, so that the
+ * reply shares it.
+ */
+static void
+bench_frozen(void)
+{
+	size_t sizes[] = { 1, 100, 1000 };
+	size_t i, j, rounds, size;
+	uint64_t start, times[2];
+	nvlist_t *export, *reply;
+	void *buf;
+	int t;
+
+	printf("frozen: jobs  copied us  frozen us\n");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		rounds = 20000 / sizes[i] + 1;
+		export = build_jobs(sizes[i]);
+
+		for (t = 0; t < 2; t++) {
+			if (t == 1 && !nvlist_freeze(export))
+				abort();
+			start = now_ns();
+			for (j = 0; j < rounds; j++) {
+				reply = nvlist_create_dictionary(0);
+				nvlist_add_int64(reply, "Error", 0);
+				nvlist_add_nvlist_dictionary(reply, "Jobs", export);
+				buf = nvlist_pack(reply, &size);
+				if (buf == NULL)
+					abort();
+				free(buf);
+				nvlist_destroy(reply);
+			}
+			times[t] = now_ns() - start;
+		}
+
+		printf("        %4zu  %9.2f  %9.2f\n", sizes[i],
+		    times[0] / 1000.0 / rounds, times[1] / 1000.0 / rounds);
+		nvlist_destroy(export);
+	}
+}
+
+int
+main(int argc, const char *argv[])
+{
+
+	bench_lookup();
+	bench_unpack();
+	bench_view();
+	bench_pack();
+	bench_arena();
+	bench_iov();
+	bench_parser();
+	bench_array();
+	bench_compact();
+	bench_external();
+	bench_frozen();
+	return (0);
+}
@@ -0,0 +1,627 @@
+//
+//  xpc_bench.c
+//  libxpc micro-benchmarks
+//
+//  Copyright © 2018 PureDarwin. All rights reserved.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <malloc/malloc.h>
+#include <mach/mach.h>
+#include <xpc/xpc.h>
+#include <xpc/private.h>
+#include <launch.h>
+
+#define	BUF_SIZE	(1024 * 1024)
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*
+ * Allocation counting: the default zone's entry points are wrapped so that
+ * every malloc, calloc and realloc made by the libraries is counted.  The
+ * layout and protection of malloc_zone_t are private to libmalloc, so the
+ * hook is best effort: when the zone cannot be made writable it is not
+ * installed, the counts stay at zero and main() says so.  Set
+ * XPC_BENCH_NO_ALLOC_COUNT to leave the zone alone altogether.
+ */
+static size_t nallocs;
+static void *(*zone_malloc)(struct _malloc_zone_t *, size_t);
+static void *(*zone_calloc)(struct _malloc_zone_t *, size_t, size_t);
+static void *(*zone_realloc)(struct _malloc_zone_t *, void *, size_t);
+
+static void *
+counting_malloc(struct _malloc_zone_t *zone, size_t size)
+{
+
+	nallocs++;
+	return (zone_malloc(zone, size));
+}
+
+static void *
+counting_calloc(struct _malloc_zone_t *zone, size_t n, size_t size)
+{
+
+	nallocs++;
+	return (zone_calloc(zone, n, size));
+}
+
+static void *
+counting_realloc(struct _malloc_zone_t *zone, void *ptr, size_t size)
+{
+
+	nallocs++;
+	return (zone_realloc(zone, ptr, size));
+}
+
+static bool
+count_allocations(void)
+{
+	malloc_zone_t *zone;
+
+	if (getenv("XPC_BENCH_NO_ALLOC_COUNT") != NULL)
+		return (false);
+
+	zone = malloc_default_zone();
+	if (zone == NULL || zone->malloc == NULL || zone->calloc == NULL ||
+	    zone->realloc == NULL)
+		return (false);
+
+	/* The zone structure is read-only once the process is up. */
+	if (vm_protect(mach_task_self(), (vm_address_t)zone, sizeof(*zone), 0,
+	    VM_PROT_READ | VM_PROT_WRITE) != KERN_SUCCESS)
+		return (false);
+	zone_malloc = zone->malloc;
+	zone_calloc = zone->calloc;
+	zone_realloc = zone->realloc;
+	zone->malloc = counting_malloc;
+	zone->calloc = counting_calloc;
+	zone->realloc = counting_realloc;
+	(void)vm_protect(mach_task_self(), (vm_address_t)zone, sizeof(*zone), 0,
+	    VM_PROT_READ);
+
+	return (true);
+}
+
+/*
+ * Build a chain of depth dictionaries, each holding a few leaves and the
+ * next level under "child".
+ */
+static xpc_object_t
+build_nested(size_t depth)
+{
+	xpc_object_t dict, child;
+
+	dict = xpc_dictionary_create(NULL, NULL, 0);
+	xpc_dictionary_set_string(dict, "Label", "com.example.nested");
+	xpc_dictionary_set_int64(dict, "Depth", (int64_t)depth);
+	xpc_dictionary_set_data(dict, "Blob", "0123456789abcdef", 16);
+	if (depth > 1) {
+		child = build_nested(depth - 1);
+		xpc_dictionary_set_value(dict, "child", child);
+		xpc_release(child);
+	}
+
+	return (dict);
+}
+
+/*
+ * Serialize nested dictionaries through xpc2nv() and nvlist packing, and
+ * report the allocations and time per message.  Every level is built in
+ * place and moved into its parent, so the allocations grow linearly with
+ * the depth; a builder that clones children grows quadratically.
+ */
+static void
+bench_nested(void)
+{
+	size_t depths[] = { 1, 4, 16, 64 };
+	size_t i, j, rounds, size, allocs;
+	uint64_t start, elapsed;
+	xpc_object_t msg;
+	void *buf;
+
+	printf("nested: depth  bytes  allocs/msg  us/msg\n");
+	for (i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+		rounds = 10000 / depths[i] + 1;
+		msg = build_nested(depths[i]);
+		buf = malloc(BUF_SIZE);
+		size = launch_data_pack((launch_data_t)msg, buf, BUF_SIZE, NULL,
+		    NULL);
+
+		allocs = nallocs;
+		start = now_ns();
+		for (j = 0; j < rounds; j++) {
+			if (launch_data_pack((launch_data_t)msg, buf, size, NULL,
+			    NULL) != size)
+				abort();
+		}
+		elapsed = now_ns() - start;
+		allocs = nallocs - allocs;
+
+		printf("        %5zu  %5zu  %10.1f  %6.2f\n", depths[i], size,
+		    (double)allocs / rounds, elapsed / 1000.0 / rounds);
+		free(buf);
+		xpc_release(msg);
+	}
+}
+
+/*
+ * Time filling dictionaries of various sizes and looking up each of their
+ * keys, per operation.
+ */
+static void
+bench_dictionary(void)
+{
+	size_t sizes[] = { 4, 64, 4096 };
+	size_t i, j, k, rounds;
+	uint64_t start, elapsed[2];
+	xpc_object_t dict;
+	char **keys;
+
+	printf("dictionary: keys  set ns/key  get ns/key\n");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		rounds = 100000 / sizes[i] + 1;
+		keys = malloc(sizes[i] * sizeof(keys[0]));
+		for (j = 0; j < sizes[i]; j++)
+			asprintf(&keys[j], "com.example.key%zu", j);
+
+		elapsed[0] = elapsed[1] = 0;
+		for (k = 0; k < rounds; k++) {
+			start = now_ns();
+			dict = xpc_dictionary_create(NULL, NULL, 0);
+			for (j = 0; j < sizes[i]; j++)
+				xpc_dictionary_set_int64(dict, keys[j], j);
+			elapsed[0] += now_ns() - start;
+
+			start = now_ns();
+			for (j = 0; j < sizes[i]; j++) {
+				if (xpc_dictionary_get_value(dict, keys[j]) == NULL)
+					abort();
+			}
+			elapsed[1] += now_ns() - start;
+			xpc_release(dict);
+		}
+
+		printf("            %4zu  %10.1f  %10.1f\n", sizes[i],
+		    (double)elapsed[0] / rounds / sizes[i],
+		    (double)elapsed[1] / rounds / sizes[i]);
+		for (j = 0; j < sizes[i]; j++)
+			free(keys[j]);
+		free(keys);
+	}
+}
+
+/*
+ * Time appending to arrays of various sizes and reading each element back
+ * by index, per element.
+ */
+static void
+bench_array(void)
+{
+	size_t sizes[] = { 4, 64, 4096 };
+	size_t i, j, k, rounds;
+	uint64_t start, elapsed[2];
+	xpc_object_t array, value;
+
+	value = xpc_int64_create(42);
+	printf("array: elements  append ns/elt  get ns/elt\n");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		rounds = 100000 / sizes[i] + 1;
+		elapsed[0] = elapsed[1] = 0;
+		for (k = 0; k < rounds; k++) {
+			start = now_ns();
+			array = xpc_array_create(NULL, 0);
+			for (j = 0; j < sizes[i]; j++)
+				xpc_array_append_value(array, value);
+			elapsed[0] += now_ns() - start;
+
+			start = now_ns();
+			for (j = 0; j < sizes[i]; j++) {
+				if (xpc_array_get_value(array, j) != value)
+					abort();
+			}
+			elapsed[1] += now_ns() - start;
+			xpc_release(array);
+		}
+
+		printf("       %8zu  %13.1f  %10.1f\n", sizes[i],
+		    (double)elapsed[0] / rounds / sizes[i],
+		    (double)elapsed[1] / rounds / sizes[i]);
+	}
+	xpc_release(value);
+}
+
+/*
+ * Time wrapping blobs of various sizes in data objects, copied by
+ * xpc_data_create() and referenced by xpc_data_create_with_dispatch_data(),
+ * per blob.  Data of a single region must not be copied; data of several
+ * is made contiguous once.
+ */
+static void
+bench_data(void)
+{
+	size_t sizes[] = { 4096, 1024 * 1024, 16 * 1024 * 1024 };
+	size_t i, j, rounds;
+	uint64_t start, elapsed[2];
+	dispatch_data_t ddata, head, tail, concat;
+	xpc_object_t data;
+	const void *ptr;
+	size_t size;
+	char *buf;
+
+	printf("data: bytes  copy us/blob  dispatch us/blob\n");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		rounds = 64 * 1024 * 1024 / sizes[i];
+		buf = malloc(sizes[i]);
+		memset(buf, 'x', sizes[i]);
+		ddata = dispatch_data_create(buf, sizes[i], NULL,
+		    DISPATCH_DATA_DESTRUCTOR_FREE);
+
+		start = now_ns();
+		for (j = 0; j < rounds; j++) {
+			data = xpc_data_create(buf, sizes[i]);
+			xpc_release(data);
+		}
+		elapsed[0] = now_ns() - start;
+
+		start = now_ns();
+		for (j = 0; j < rounds; j++) {
+			data = xpc_data_create_with_dispatch_data(ddata);
+			if (xpc_data_get_bytes_ptr(data) != buf)
+				abort();
+			xpc_release(data);
+		}
+		elapsed[1] = now_ns() - start;
+
+		printf("      %8zu  %12.2f  %16.2f\n", sizes[i],
+		    elapsed[0] / 1000.0 / rounds, elapsed[1] / 1000.0 / rounds);
+
+		head = dispatch_data_create_subrange(ddata, 0, sizes[i] / 2);
+		tail = dispatch_data_create_subrange(ddata, sizes[i] / 2,
+		    sizes[i] - sizes[i] / 2);
+		concat = dispatch_data_create_concat(head, tail);
+		data = xpc_data_create_with_dispatch_data(concat);
+		ptr = xpc_data_get_bytes_ptr(data);
+		size = xpc_data_get_length(data);
+		if (size != sizes[i] || memcmp(ptr, buf, size) != 0)
+			abort();
+		xpc_release(data);
+		dispatch_release(concat);
+		dispatch_release(tail);
+		dispatch_release(head);
+		dispatch_release(ddata);
+	}
+}
+
+/*
+ * An export of njobs launchd jobs, keyed by label.
+ */
+static xpc_object_t
+build_jobs(size_t njobs)
+{
+	xpc_object_t jobs, job, args;
+	char label[64];
+	size_t i;
+
+	jobs = xpc_dictionary_create(NULL, NULL, 0);
+	for (i = 0; i < njobs; i++) {
+		snprintf(label, sizeof(label), "com.example.job%zu", i);
+		job = xpc_dictionary_create(NULL, NULL, 0);
+		xpc_dictionary_set_string(job, LAUNCH_JOBKEY_LABEL, label);
+		xpc_dictionary_set_string(job, LAUNCH_JOBKEY_PROGRAM,
+		    "/usr/libexec/example");
+		args = xpc_array_create(NULL, 0);
+		xpc_array_set_string(args, XPC_ARRAY_APPEND,
+		    "/usr/libexec/example");
+		xpc_array_set_string(args, XPC_ARRAY_APPEND, "-d");
+		xpc_array_set_string(args, XPC_ARRAY_APPEND, label);
+		xpc_dictionary_set_value(job, LAUNCH_JOBKEY_PROGRAMARGUMENTS,
+		    args);
+		xpc_release(args);
+		xpc_dictionary_set_int64(job, LAUNCH_JOBKEY_PID, 100 + i);
+		xpc_dictionary_set_bool(job, LAUNCH_JOBKEY_RUNATLOAD, true);
+		xpc_dictionary_set_value(jobs, label, job);
+		xpc_release(job);
+	}
+
+	return (jobs);
+}
+
+/*
+ * Describe a job export into one string and streamed to /dev/null, and
+ * report the allocations and time of each.  The streamed description must
+ * match the string byte for byte.
+ */
+static void
+bench_description(void)
+{
+	__block size_t streamed;
+	__block char *copy;
+	size_t allocs[2];
+	uint64_t start, elapsed[2];
+	xpc_object_t jobs;
+	char *desc;
+	FILE *fp;
+
+	jobs = build_jobs(100);
+	desc = xpc_copy_description(jobs);
+	copy = desc;
+	streamed = 0;
+	xpc_write_description(jobs, ^(const char *buf, size_t len) {
+		if (strncmp(copy + streamed, buf, len) != 0)
+			abort();
+		streamed += len;
+	});
+	if (streamed != strlen(desc))
+		abort();
+	free(desc);
+	xpc_release(jobs);
+
+	jobs = build_jobs(10000);
+	fp = fopen("/dev/null", "w");
+
+	allocs[0] = nallocs;
+	start = now_ns();
+	desc = xpc_copy_description(jobs);
+	fputs(desc, fp);
+	elapsed[0] = now_ns() - start;
+	allocs[0] = nallocs - allocs[0];
+
+	allocs[1] = nallocs;
+	start = now_ns();
+	xpc_fwrite_description(jobs, fp);
+	elapsed[1] = now_ns() - start;
+	allocs[1] = nallocs - allocs[1];
+
+	printf("description: 10000 jobs, %zu bytes\n", strlen(desc));
+	printf("             copy    allocs %6zu  ms %8.2f\n", allocs[0],
+	    elapsed[0] / 1000000.0);
+	printf("             stream  allocs %6zu  ms %8.2f\n", allocs[1],
+	    elapsed[1] / 1000000.0);
+	free(desc);
+	fclose(fp);
+	xpc_release(jobs);
+}
+
+/*
+ * Time hashing and comparing a job export, and comparing long strings that
+ * only differ at the end: once their hashes are cached that takes no byte
+ * comparison at all.
+ */
+static void
+bench_hash(void)
+{
+	xpc_object_t jobs, jobs2, a, b;
+	uint64_t start, elapsed[4];
+	char str[256];
+	size_t i, rounds;
+
+	jobs = build_jobs(10000);
+	jobs2 = build_jobs(10000);
+
+	start = now_ns();
+	(void)xpc_hash(jobs);
+	elapsed[0] = now_ns() - start;
+	start = now_ns();
+	(void)xpc_hash(jobs);
+	elapsed[1] = now_ns() - start;
+	start = now_ns();
+	if (!xpc_equal(jobs, jobs2))
+		abort();
+	elapsed[2] = now_ns() - start;
+
+	printf("hash: 10000 jobs  hash ms %6.2f  cached ms %6.2f  "
+	    "equal ms %6.2f\n", elapsed[0] / 1000000.0, elapsed[1] / 1000000.0,
+	    elapsed[2] / 1000000.0);
+	xpc_release(jobs2);
+	xpc_release(jobs);
+
+	memset(str, 'x', sizeof(str) - 1);
+	str[sizeof(str) - 1] = '\0';
+	a = xpc_string_create(str);
+	str[sizeof(str) - 2] = 'y';
+	b = xpc_string_create(str);
+	rounds = 1000000;
+
+	start = now_ns();
+	for (i = 0; i < rounds; i++) {
+		if (xpc_equal(a, b))
+			abort();
+	}
+	elapsed[0] = now_ns() - start;
+	(void)xpc_hash(a);
+	(void)xpc_hash(b);
+	start = now_ns();
+	for (i = 0; i < rounds; i++) {
+		if (xpc_equal(a, b))
+			abort();
+	}
+	elapsed[1] = now_ns() - start;
+
+	printf("      255 byte strings  equal ns %5.1f  cached ns %5.1f\n",
+	    (double)elapsed[0] / rounds, (double)elapsed[1] / rounds);
+	xpc_release(a);
+	xpc_release(b);
+}
+
+/*
+ * Copy the way callers had to before xpc_copy(): rebuild every container.
+ */
+static xpc_object_t
+deep_copy(xpc_object_t obj)
+{
+	__block xpc_object_t copy;
+
+	if (xpc_get_type(obj) == XPC_TYPE_DICTIONARY) {
+		copy = xpc_dictionary_create(NULL, NULL, 0);
+		xpc_dictionary_apply(obj, ^bool(const char *k, xpc_object_t v) {
+			xpc_object_t c;
+
+			c = deep_copy(v);
+			xpc_dictionary_set_value(copy, k, c);
+			xpc_release(c);
+			return (true);
+		});
+	} else if (xpc_get_type(obj) == XPC_TYPE_ARRAY) {
+		copy = xpc_array_create(NULL, 0);
+		xpc_array_apply(obj, ^bool(size_t idx, xpc_object_t v) {
+			xpc_object_t c;
+
+			c = deep_copy(v);
+			xpc_array_append_value(copy, c);
+			xpc_release(c);
+			return (true);
+		});
+	} else
+		copy = xpc_retain(obj);
+
+	return (copy);
+}
+
+/*
+ * Copy a job export by rebuilding it and with xpc_copy(), then change k
+ * jobs of the copy, and report the allocations and time of each.  The
+ * original must not see any of the changes.  The export was given its
+ * containers, so its own first copy takes a level at a time; the copies
+ * after that are taken of that first one, like copies of a received
+ * message.
+ */
+static void
+bench_copy(void)
+{
+	size_t ks[] = { 0, 1, 10, 100, 1000 };
+	size_t i, j, allocs[2];
+	uint64_t start, elapsed[2];
+	xpc_object_t jobs, copy, job;
+	char label[64];
+
+	jobs = build_jobs(10000);
+
+	allocs[0] = nallocs;
+	start = now_ns();
+	copy = deep_copy(jobs);
+	elapsed[0] = now_ns() - start;
+	allocs[0] = nallocs - allocs[0];
+	if (!xpc_equal(copy, jobs))
+		abort();
+	xpc_release(copy);
+	printf("copy: 10000 jobs  rebuild  allocs %6zu  ms %8.3f\n", allocs[0],
+	    elapsed[0] / 1000000.0);
+
+	allocs[0] = nallocs;
+	start = now_ns();
+	copy = xpc_copy(jobs);
+	elapsed[0] = now_ns() - start;
+	allocs[0] = nallocs - allocs[0];
+	if (!xpc_equal(copy, jobs))
+		abort();
+	xpc_release(jobs);
+	jobs = copy;
+	printf("                  first    allocs %6zu  ms %8.3f\n", allocs[0],
+	    elapsed[0] / 1000000.0);
+
+	printf("      changed  copy allocs  us  change allocs  ms\n");
+	for (i = 0; i < sizeof(ks) / sizeof(ks[0]); i++) {
+		allocs[0] = nallocs;
+		start = now_ns();
+		copy = xpc_copy(jobs);
+		elapsed[0] = now_ns() - start;
+		allocs[0] = nallocs - allocs[0];
+
+		allocs[1] = nallocs;
+		start = now_ns();
+		for (j = 0; j < ks[i]; j++) {
+			snprintf(label, sizeof(label), "com.example.job%zu", j);
+			job = xpc_dictionary_get_value(copy, label);
+			xpc_dictionary_set_int64(job, LAUNCH_JOBKEY_PID, 1);
+		}
+		elapsed[1] = now_ns() - start;
+		allocs[1] = nallocs - allocs[1];
+
+		if (xpc_equal(copy, jobs) != (ks[i] == 0))
+			abort();
+		printf("      %7zu  %11zu  %6.1f  %13zu  %6.3f\n", ks[i],
+		    allocs[0], elapsed[0] / 1000.0, allocs[1],
+		    elapsed[1] / 1000000.0);
+		xpc_release(copy);
+	}
+
+	job = xpc_dictionary_get_value(jobs, "com.example.job0");
+	if (xpc_dictionary_get_int64(job, LAUNCH_JOBKEY_PID) != 100)
+		abort();
+	xpc_release(jobs);
+}
+
+/*
+ * Time creating and releasing batches of small objects, the pattern of
+ * decoding a large reply, and dump the allocator's size classes.
+ */
+static void
+bench_objects(void)
+{
+	struct xpc_slab_stats stats[16];
+	xpc_object_t objs[1024];
+	size_t i, j, n, rounds;
+	uint64_t start, elapsed;
+
+	rounds = 1000;
+	start = now_ns();
+	for (i = 0; i < rounds; i++) {
+		for (j = 0; j < 1024; j++)
+			objs[j] = xpc_int64_create(j);
+		for (j = 0; j < 1024; j++)
+			xpc_release(objs[j]);
+	}
+	elapsed = now_ns() - start;
+	printf("objects: int64 create+release ns/obj   %6.1f\n",
+	    (double)elapsed / rounds / 1024);
+
+	start = now_ns();
+	for (i = 0; i < rounds; i++) {
+		for (j = 0; j < 1024; j++)
+			objs[j] = xpc_string_create("com.example.label");
+		for (j = 0; j < 1024; j++)
+			xpc_release(objs[j]);
+	}
+	elapsed = now_ns() - start;
+	printf("         string create+release ns/obj  %6.1f\n",
+	    (double)elapsed / rounds / 1024);
+
+	n = xpc_slab_get_stats(stats, sizeof(stats) / sizeof(stats[0]));
+	printf("slabs: size  slabs  depot  allocs  frees\n");
+	for (i = 0; i < n; i++) {
+		if (stats[i].xss_slabs == 0)
+			continue;
+		printf("       %4zu  %5zu  %5zu  %6llu  %5llu\n",
+		    stats[i].xss_size, stats[i].xss_slabs, stats[i].xss_depot,
+		    (unsigned long long)stats[i].xss_allocs,
+		    (unsigned long long)stats[i].xss_frees);
+	}
+}
+
+int
+main(int argc, const char *argv[])
+{
+
+	if (!count_allocations())
+		printf("allocation counts unavailable, reported as 0\n");
+	bench_nested();
+	bench_dictionary();
+	bench_array();
+	bench_data();
+	bench_description();
+	bench_hash();
+	bench_copy();
+	bench_objects();
+	return (0);
+}
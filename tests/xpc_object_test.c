@@ -0,0 +1,497 @@
+//
+//  xpc_object_test.c
+//  libxpc object behaviour checks
+//
+//  Copyright © 2018 PureDarwin. All rights reserved.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mach/mach.h>
+#include <xpc/xpc.h>
+#include <xpc/connection.h>
+
+#include "nv.h"
+
+/*
+ * The wire encoder and the xpc2nv() path it replaced are private to libxpc,
+ * which is why the test is built from the library's sources.
+ */
+extern nvlist_t *xpc2nv(xpc_object_t xo,
+    int64_t (^port_serializer)(mach_port_t port));
+extern size_t xpc2wire_size(xpc_object_t xo);
+extern int xpc2wire(xpc_object_t xo, void *buf, size_t size,
+    int64_t (^port_serializer)(mach_port_t port));
+extern xpc_object_t nv2xpc_view(const nvlist_view_t *view,
+    mach_port_t (^port_deserializer)(int64_t port_id));
+
+#define	BUF_SIZE	(1024 * 1024)
+#define	WIRE_NPORTS	16
+
+/*
+ * Every check runs, and the failed ones are reported by condition; the
+ * exit status is 1 if any of them failed.
+ */
+static size_t nfailed;
+
+#define	CHECK(cond) do {						\
+	if (!(cond)) {							\
+		printf("%s:%d: %s failed\n", __func__, __LINE__, #cond); \
+		nfailed++;						\
+	}								\
+} while (0)
+
+/*
+ * An export of njobs launchd jobs, keyed by label.
+ */
+static xpc_object_t
+build_jobs(size_t njobs)
+{
+	xpc_object_t jobs, job, args;
+	char label[64];
+	size_t i;
+
+	jobs = xpc_dictionary_create(NULL, NULL, 0);
+	for (i = 0; i < njobs; i++) {
+		snprintf(label, sizeof(label), "com.example.job%zu", i);
+		job = xpc_dictionary_create(NULL, NULL, 0);
+		xpc_dictionary_set_string(job, "Label", label);
+		args = xpc_array_create(NULL, 0);
+		xpc_array_set_string(args, XPC_ARRAY_APPEND,
+		    "/usr/libexec/example");
+		xpc_array_set_string(args, XPC_ARRAY_APPEND, label);
+		xpc_dictionary_set_value(job, "ProgramArguments", args);
+		xpc_release(args);
+		xpc_dictionary_set_int64(job, "PID", 100 + i);
+		xpc_dictionary_set_bool(job, "RunAtLoad", true);
+		xpc_dictionary_set_value(jobs, label, job);
+		xpc_release(job);
+	}
+
+	return (jobs);
+}
+
+/*
+ * The same dictionary with its keys inserted in the opposite order.
+ */
+static xpc_object_t
+reverse_dictionary(xpc_object_t dict)
+{
+	xpc_object_t keys, rev;
+	const char *key;
+	size_t i;
+
+	keys = xpc_array_create(NULL, 0);
+	xpc_dictionary_apply(dict, ^bool(const char *k, xpc_object_t v) {
+		xpc_array_set_string(keys, XPC_ARRAY_APPEND, k);
+		return (true);
+	});
+	rev = xpc_dictionary_create(NULL, NULL, 0);
+	for (i = xpc_array_get_count(keys); i-- > 0;) {
+		key = xpc_array_get_string(keys, i);
+		xpc_dictionary_set_value(rev, key,
+		    xpc_dictionary_get_value(dict, key));
+	}
+	xpc_release(keys);
+
+	return (rev);
+}
+
+/*
+ * xpc_equal() and xpc_hash() must agree: equal objects hash alike, whatever
+ * the order of dictionary keys and whether a hash was cached before the
+ * object changed.
+ */
+static void
+check_equal(void)
+{
+	xpc_object_t a, b, c, jobs, jobs2, rev, job;
+	char world[] = "world";
+	uuid_t uuid;
+
+	a = xpc_string_create("hello");
+	b = xpc_string_create("world");
+	c = xpc_string_create("hello");
+	CHECK(!xpc_equal(a, b));
+	CHECK(xpc_equal(a, c) && xpc_hash(a) == xpc_hash(c));
+	xpc_string_set_value(c, "world");
+	CHECK(!xpc_equal(a, c) && xpc_equal(b, c));
+	CHECK(xpc_hash(b) == xpc_hash(c));
+	xpc_release(c);
+	c = xpc_data_create("hello", 5);
+	CHECK(!xpc_equal(a, c));
+	xpc_release(a);
+	a = xpc_data_create("world", 5);
+	(void)xpc_hash(a);
+	(void)xpc_hash(c);
+	CHECK(!xpc_equal(a, c));
+	xpc_data_set_bytes(c, world, 5);
+	CHECK(xpc_equal(a, c) && xpc_hash(a) == xpc_hash(c));
+	xpc_release(a);
+	xpc_release(b);
+	xpc_release(c);
+
+	a = xpc_double_create(0.0);
+	b = xpc_double_create(-0.0);
+	CHECK(xpc_equal(a, b) && xpc_hash(a) == xpc_hash(b));
+	xpc_release(a);
+	xpc_release(b);
+	memset(uuid, 0x5a, sizeof(uuid));
+	a = xpc_uuid_create(uuid);
+	b = xpc_uuid_create(uuid);
+	CHECK(xpc_equal(a, b) && xpc_hash(a) == xpc_hash(b));
+	xpc_release(a);
+	xpc_release(b);
+
+	a = xpc_array_create(NULL, 0);
+	b = xpc_array_create(NULL, 0);
+	xpc_array_set_string(a, XPC_ARRAY_APPEND, "x");
+	xpc_array_set_string(a, XPC_ARRAY_APPEND, "y");
+	xpc_array_set_string(b, XPC_ARRAY_APPEND, "y");
+	xpc_array_set_string(b, XPC_ARRAY_APPEND, "x");
+	CHECK(!xpc_equal(a, b));
+	xpc_release(a);
+	xpc_release(b);
+
+	jobs = build_jobs(100);
+	jobs2 = build_jobs(100);
+	rev = reverse_dictionary(jobs2);
+	CHECK(xpc_equal(jobs, rev) && xpc_equal(rev, jobs));
+	CHECK(xpc_hash(jobs) == xpc_hash(rev));
+	job = xpc_dictionary_get_value(rev, "com.example.job42");
+	xpc_dictionary_set_int64(job, "PID", 1);
+	CHECK(!xpc_equal(jobs, rev) && xpc_hash(jobs) != xpc_hash(rev));
+	xpc_dictionary_set_int64(job, "PID", 142);
+	CHECK(xpc_equal(jobs, rev));
+	xpc_dictionary_set_value(rev, "extra", job);
+	CHECK(!xpc_equal(jobs, rev));
+	xpc_release(rev);
+	xpc_release(jobs2);
+	xpc_release(jobs);
+}
+
+/*
+ * Build a chain of depth dictionaries, each holding a few leaves and the
+ * next level under "child".
+ */
+static xpc_object_t
+build_nested(size_t depth)
+{
+	xpc_object_t dict, child;
+
+	dict = xpc_dictionary_create(NULL, NULL, 0);
+	xpc_dictionary_set_string(dict, "Label", "com.example.nested");
+	xpc_dictionary_set_int64(dict, "Depth", (int64_t)depth);
+	xpc_dictionary_set_data(dict, "Blob", "0123456789abcdef", 16);
+	if (depth > 1) {
+		child = build_nested(depth - 1);
+		xpc_dictionary_set_value(dict, "child", child);
+		xpc_release(child);
+	}
+
+	return (dict);
+}
+
+/*
+ * A message with one of every type launch_data_pack() can encode, nested
+ * lists, and arrays that do and don't qualify as typed arrays.
+ */
+static xpc_object_t
+build_mixed(void)
+{
+	xpc_object_t msg, array, empty, value;
+	const char *args[] = { "/usr/bin/true", "-v", "" };
+	uuid_t uuid;
+	size_t i;
+
+	msg = build_nested(3);
+	xpc_dictionary_set_bool(msg, "Enabled", true);
+	xpc_dictionary_set_uint64(msg, "Mask", UINT64_MAX - 1);
+	xpc_dictionary_set_string(msg, "Empty", "");
+	value = xpc_double_create(0.25);
+	xpc_dictionary_set_value(msg, "Ratio", value);
+	xpc_release(value);
+	value = xpc_date_create(1234567890123LL);
+	xpc_dictionary_set_value(msg, "When", value);
+	xpc_release(value);
+	for (i = 0; i < sizeof(uuid); i++)
+		uuid[i] = (unsigned char)i;
+	xpc_dictionary_set_uuid(msg, "UUID", uuid);
+
+	array = xpc_array_create(NULL, 0);
+	for (i = 0; i < sizeof(args) / sizeof(args[0]); i++)
+		xpc_array_set_string(array, XPC_ARRAY_APPEND, args[i]);
+	xpc_dictionary_set_value(msg, "ProgramArguments", array);
+	xpc_release(array);
+
+	array = xpc_array_create(NULL, 0);
+	for (i = 0; i < 3; i++)
+		xpc_array_set_bool(array, XPC_ARRAY_APPEND, i != 1);
+	xpc_dictionary_set_value(msg, "Flags", array);
+	xpc_release(array);
+
+	array = xpc_array_create(NULL, 0);
+	xpc_array_set_int64(array, XPC_ARRAY_APPEND, -1);
+	xpc_array_set_string(array, XPC_ARRAY_APPEND, "mixed");
+	empty = xpc_dictionary_create(NULL, NULL, 0);
+	xpc_array_append_value(array, empty);
+	xpc_release(empty);
+	empty = xpc_array_create(NULL, 0);
+	xpc_array_append_value(array, empty);
+	xpc_release(empty);
+	xpc_dictionary_set_value(msg, "Mixed", array);
+	xpc_release(array);
+
+	return (msg);
+}
+
+/*
+ * A message with the pairs build_mixed() has no room for: arrays nested in
+ * arrays, typed arrays of every element type, and ports in dictionaries
+ * and in arrays.  Port names are only numbered by the serializer, so they
+ * need not be real rights.
+ */
+static xpc_object_t
+build_ports(void)
+{
+	xpc_object_t msg, array, inner, value;
+	size_t i;
+
+	msg = build_mixed();
+	xpc_dictionary_set_mach_send(msg, "Service", (mach_port_t)0x1103);
+
+	array = xpc_array_create(NULL, 0);
+	for (i = 0; i < 4; i++) {
+		inner = xpc_array_create(NULL, 0);
+		xpc_array_set_int64(inner, XPC_ARRAY_APPEND, -(int64_t)i);
+		xpc_array_set_int64(inner, XPC_ARRAY_APPEND, INT64_MIN);
+		xpc_array_append_value(array, inner);
+		xpc_release(inner);
+	}
+	inner = xpc_array_create(NULL, 0);
+	xpc_array_set_uint64(inner, XPC_ARRAY_APPEND, 1);
+	xpc_array_set_uint64(inner, XPC_ARRAY_APPEND, UINT64_MAX);
+	xpc_array_append_value(array, inner);
+	xpc_release(inner);
+	inner = xpc_dictionary_create(NULL, NULL, 0);
+	xpc_dictionary_set_mach_send(inner, "Reply", (mach_port_t)0x2207);
+	xpc_array_append_value(array, inner);
+	xpc_release(inner);
+	xpc_dictionary_set_value(msg, "Matrix", array);
+	xpc_release(array);
+
+	array = xpc_array_create(NULL, 0);
+	for (i = 0; i < 3; i++) {
+		value = xpc_array_create(NULL, 0);
+		xpc_array_set_string(value, XPC_ARRAY_APPEND, "port");
+		xpc_array_append_value(array, value);
+		xpc_release(value);
+	}
+	xpc_dictionary_set_value(msg, "Strings", array);
+	xpc_release(array);
+
+	inner = xpc_dictionary_create(NULL, NULL, 0);
+	xpc_dictionary_set_mach_send(inner, "Port", (mach_port_t)0x3303);
+	xpc_dictionary_set_mach_send(inner, "Other", (mach_port_t)0x1103);
+	array = xpc_array_create(NULL, 0);
+	xpc_array_append_value(array, inner);
+	xpc_release(inner);
+	xpc_dictionary_set_value(msg, "Ports", array);
+	xpc_release(array);
+
+	return (msg);
+}
+
+/*
+ * Encode one message both ways, recording the ports each way serializes,
+ * and return the size of the xpc2wire() bytes in buf, or 0 if either way
+ * fails, the bytes are not the nvlist_pack() of xpc2nv() byte for byte or
+ * the ports differ.  The messages have fewer than WIRE_NPORTS ports.
+ */
+static size_t
+check_wire_message(xpc_object_t msg, void *buf, mach_port_t *ports,
+    size_t *nportsp)
+{
+	__block mach_port_t nvports[WIRE_NPORTS];
+	__block size_t nnvports, nwireports;
+	size_t size, nvsize;
+	nvlist_t *nvl;
+	void *nvbuf;
+
+	*nportsp = 0;
+	nnvports = 0;
+	nvl = xpc2nv(msg, ^int64_t(mach_port_t port) {
+		if (nnvports == WIRE_NPORTS)
+			abort();
+		nvports[nnvports] = port;
+		return ((int64_t)nnvports++);
+	});
+	if (nvl == NULL)
+		return (0);
+	nvbuf = nvlist_pack(nvl, &nvsize);
+	nvlist_destroy(nvl);
+	if (nvbuf == NULL)
+		return (0);
+
+	nwireports = 0;
+	size = xpc2wire_size(msg);
+	if (size > BUF_SIZE || xpc2wire(msg, buf, size,
+	    ^int64_t(mach_port_t port) {
+		if (nwireports == WIRE_NPORTS)
+			abort();
+		ports[nwireports] = port;
+		return ((int64_t)nwireports++);
+	}) != 0)
+		size = 0;
+	else if (nvsize != size || memcmp(nvbuf, buf, size) != 0 ||
+	    nnvports != nwireports ||
+	    memcmp(nvports, ports, nnvports * sizeof(ports[0])) != 0)
+		size = 0;
+	free(nvbuf);
+	*nportsp = nwireports;
+
+	return (size);
+}
+
+/*
+ * xpc2wire() encodes straight from the objects.  Check that the result is
+ * byte for byte what nvlist_pack() makes of xpc2nv() for the same object,
+ * with the same ports in the same order, and that decoding it into objects
+ * and encoding those again gives the same bytes.
+ */
+static void
+check_wire(void)
+{
+	xpc_object_t msgs[4], copy;
+	mach_port_t ports[WIRE_NPORTS], ports2[WIRE_NPORTS];
+	__block mach_port_t *portsp;
+	size_t i, size, size2, nports, nports2;
+	nvlist_view_t view;
+	void *buf, *buf2;
+
+	msgs[0] = xpc_dictionary_create(NULL, NULL, 0);
+	msgs[1] = build_nested(16);
+	msgs[2] = build_mixed();
+	msgs[3] = build_ports();
+	buf = malloc(BUF_SIZE);
+	buf2 = malloc(BUF_SIZE);
+
+	for (i = 0; i < sizeof(msgs) / sizeof(msgs[0]); i++) {
+		size = check_wire_message(msgs[i], buf, ports, &nports);
+		if (size == 0 || !nvlist_view_init(&view, buf, size)) {
+			printf("wire: message %zu differs from xpc2nv()\n", i);
+			nfailed++;
+			xpc_release(msgs[i]);
+			continue;
+		}
+
+		portsp = ports;
+		copy = nv2xpc_view(&view, ^mach_port_t(int64_t port_id) {
+			if (port_id < 0 || (size_t)port_id >= nports)
+				return (MACH_PORT_NULL);
+			return (portsp[port_id]);
+		});
+		CHECK(copy != NULL);
+		if (copy != NULL) {
+			size2 = check_wire_message(copy, buf2, ports2,
+			    &nports2);
+			CHECK(size2 == size && memcmp(buf, buf2, size) == 0);
+			CHECK(nports2 == nports && memcmp(ports, ports2,
+			    nports * sizeof(ports[0])) == 0);
+			xpc_release(copy);
+		}
+		xpc_release(msgs[i]);
+	}
+
+	free(buf2);
+	free(buf);
+}
+
+/*
+ * The booleans and XPC_ERROR_* dictionaries are statically allocated,
+ * possibly in read-only memory: hashing, reading and copying them must
+ * work and leave them as they were.
+ */
+static void
+check_static(void)
+{
+	xpc_object_t copy;
+	const char *desc;
+	size_t hash;
+
+	hash = xpc_hash(XPC_BOOL_TRUE);
+	CHECK(xpc_hash(XPC_BOOL_TRUE) == hash);
+	CHECK(!xpc_equal(XPC_BOOL_TRUE, XPC_BOOL_FALSE));
+
+	hash = xpc_hash(XPC_ERROR_CONNECTION_INVALID);
+	CHECK(xpc_hash(XPC_ERROR_CONNECTION_INVALID) == hash);
+	desc = xpc_dictionary_get_string(XPC_ERROR_CONNECTION_INVALID,
+	    XPC_ERROR_KEY_DESCRIPTION);
+	CHECK(desc != NULL && strcmp(desc, "Connection invalid") == 0);
+	CHECK(xpc_dictionary_get_count(XPC_ERROR_CONNECTION_INVALID) == 1);
+	CHECK(!xpc_equal(XPC_ERROR_CONNECTION_INVALID,
+	    XPC_ERROR_CONNECTION_INTERRUPTED));
+
+	copy = xpc_copy(XPC_ERROR_CONNECTION_INVALID);
+	CHECK(xpc_equal(copy, XPC_ERROR_CONNECTION_INVALID));
+	CHECK(xpc_hash(copy) == hash);
+	xpc_dictionary_set_string(copy, XPC_ERROR_KEY_DESCRIPTION, "changed");
+	desc = xpc_dictionary_get_string(XPC_ERROR_CONNECTION_INVALID,
+	    XPC_ERROR_KEY_DESCRIPTION);
+	CHECK(desc != NULL && strcmp(desc, "Connection invalid") == 0);
+	xpc_release(copy);
+}
+
+/*
+ * xpc_copy() is a deep copy: changing the copy or any container read out
+ * of it leaves the original alone, and the other way around.
+ */
+static void
+check_copy(void)
+{
+	xpc_object_t orig, copy, copy2, job, args;
+
+	orig = build_jobs(10);
+	copy = xpc_copy(orig);
+	CHECK(xpc_equal(orig, copy) && xpc_hash(orig) == xpc_hash(copy));
+
+	job = xpc_dictionary_get_value(copy, "com.example.job3");
+	xpc_dictionary_set_int64(job, "PID", 1);
+	args = xpc_dictionary_get_value(job, "ProgramArguments");
+	xpc_array_set_string(args, XPC_ARRAY_APPEND, "-v");
+	job = xpc_dictionary_get_value(orig, "com.example.job3");
+	CHECK(xpc_dictionary_get_int64(job, "PID") == 103);
+	args = xpc_dictionary_get_value(job, "ProgramArguments");
+	CHECK(xpc_array_get_count(args) == 2);
+	CHECK(!xpc_equal(orig, copy));
+
+	copy2 = xpc_copy(copy);
+	xpc_dictionary_set_value(orig, "com.example.job4", NULL);
+	CHECK(xpc_dictionary_get_count(orig) == 9);
+	CHECK(xpc_dictionary_get_count(copy) == 10);
+	CHECK(xpc_dictionary_get_count(copy2) == 10);
+	xpc_release(copy);
+	CHECK(xpc_dictionary_get_value(copy2, "com.example.job4") != NULL);
+	job = xpc_dictionary_get_value(copy2, "com.example.job3");
+	CHECK(xpc_dictionary_get_int64(job, "PID") == 1);
+	xpc_release(copy2);
+	xpc_release(orig);
+}
+
+int
+main(int argc, const char *argv[])
+{
+
+	check_wire();
+	check_equal();
+	check_static();
+	check_copy();
+	if (nfailed != 0) {
+		printf("%zu checks failed\n", nfailed);
+		return (1);
+	}
+	printf("all checks passed\n");
+	return (0);
+}